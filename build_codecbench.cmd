@@ -1,2 +1,2 @@
-i686-w64-mingw32-g++ -Wall codecbench.cpp -o codecbench32.exe -lmsvfw32 -O3 -static -static-libgcc -static-libstdc++ -s
-x86_64-w64-mingw32-g++ -Wall codecbench.cpp -o codecbench64.exe -lmsvfw32 -O3 -static -static-libgcc -static-libstdc++ -s
+i686-w64-mingw32-g++ -Wall codecbench.cpp -o codecbench32.exe -lmsvfw32 -lavifil32 -lwinmm -O3 -static -static-libgcc -static-libstdc++ -s
+x86_64-w64-mingw32-g++ -Wall codecbench.cpp -o codecbench64.exe -lmsvfw32 -lavifil32 -lwinmm -O3 -static -static-libgcc -static-libstdc++ -s
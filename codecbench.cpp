@@ -19,6 +19,10 @@
  * along with codecbench.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600 // condition variables
+#endif
+
 #include <windows.h>
 #include <vfw.h>
 
@@ -27,18 +31,29 @@
 #include <string.h>
 #include <time.h>
 #include <signal.h>
+#include <math.h>
+#include <process.h>
+#include <malloc.h>
+#include <emmintrin.h>
+#include <x86intrin.h>
 
 #include <stdexcept>
 #include <vector>
 #include <fstream>
 #include <map>
+#include <deque>
+#include <algorithm>
+#include <string>
+#include <iterator>
+#include <functional>
 
 struct Timer
 {
 	Timer()
 	{
 		QueryPerformanceFrequency(&freq);
-		sumCounts = numSamples = 0;
+		sumCounts = numSamples = lastCounts = 0;
+		keepSamples = false;
 	}
 
 	void begin()
@@ -46,855 +61,9433 @@ struct Timer
 		QueryPerformanceCounter(&startCount);
 	}
 
-	void end()
+	/// count: add the interval to the measurements, else it is only kept in lastCounts
+	void end(bool count = true)
 	{
 		QueryPerformanceCounter(&endCount);
-		sumCounts += endCount.QuadPart - startCount.QuadPart;
+		lastCounts = endCount.QuadPart - startCount.QuadPart;
+		if (!count)
+			return;
+		sumCounts += lastCounts;
 		++numSamples;
+		if (keepSamples)
+			samples.push_back(lastCounts);
+	}
+
+	/// Keep every begin()/end() interval, with room preallocated for expectedSamples
+	void enableSamples(size_t expectedSamples)
+	{
+		keepSamples = true;
+		samples.reserve(expectedSamples);
 	}
 
-	int64_t sumTimeUs()
+	int64_t sumTimeUs() const
 	{
 		return 1000000 * sumCounts / freq.QuadPart; // freq is counts / sec
 	}
 
+	/// Duration of the last begin()/end() interval
+	double lastMs() const
+	{
+		return 1000.0 * lastCounts / freq.QuadPart;
+	}
+
 	LARGE_INTEGER freq, startCount, endCount;
-	int64_t sumCounts, numSamples;
+	int64_t sumCounts, numSamples, lastCounts;
+	bool keepSamples;
+	std::vector<int64_t> samples;
 };
 
-class ArgvParser
+/// CPU time of the whole process (all threads, including the codecs' own workers) and CPU cycles
+struct CpuTimer
 {
-public:
-	ArgvParser(int argc, char* argv[])
+	CpuTimer()
+		: userTime(0)
+		, kernelTime(0)
+		, cycles(0)
+	{}
+
+	void begin()
 	{
-		char* lastarg = 0;
-		for (int i = 1; i < argc; ++i)
-		{
-			if (argv[i][0] == '-')
-			{
-				lastarg = argv[i];
-				argmap[lastarg] = 0;
-			}
-			else if (lastarg) // param of an arg
-			{
-				argmap[lastarg] = argv[i];
-				lastarg = 0;
-			}
-			else // global (switchless) ordered arg
-			{
-				arglist.push_back(argv[i]);
-			}
-		}
+		sample(startUser, startKernel, startCycles);
 	}
 
-	bool hasArg(const std::string& arg, bool allowParam = false)
+	void end()
 	{
-		ArgMap::const_iterator it = argmap.find(arg);
-		if (it == argmap.end())
-			return false;
-		else if (!allowParam && it->second)
-			throw std::runtime_error("ERROR: '" + arg + "' does not accept arguments");
-		return true;
+		uint64_t user, kernel, cycleCount;
+		sample(user, kernel, cycleCount);
+		userTime += user - startUser;
+		kernelTime += kernel - startKernel;
+		cycles += cycleCount - startCycles;
 	}
 
-	/// Throws an exception if arg was given on the command line but without value
-	/// Returns defVal if arg was not given at all
-	const char* getArg(const std::string& arg, const char* defVal) const
+	/// GetProcessTimes() counts in 100 ns units, but only advances with the scheduler tick (~15.6 ms)
+	double userSeconds() const   { return userTime / 10000000.0; }
+	double kernelSeconds() const { return kernelTime / 10000000.0; }
+	double seconds() const       { return userSeconds() + kernelSeconds(); }
+
+	uint64_t userTime, kernelTime, cycles;
+	uint64_t startUser, startKernel, startCycles;
+
+private:
+	static void sample(uint64_t& user, uint64_t& kernel, uint64_t& cycleCount)
 	{
-		ArgMap::const_iterator it = argmap.find(arg);
-		if (it == argmap.end())
-			return defVal;
-		if (!it->second)
-			throw std::runtime_error("ERROR: Missing argument for option '" + arg + "'");
-		return it->second;
+		FILETIME creationFt, exitFt, kernelFt, userFt;
+		GetProcessTimes(GetCurrentProcess(), &creationFt, &exitFt, &kernelFt, &userFt);
+		user = ((uint64_t)userFt.dwHighDateTime << 32) | userFt.dwLowDateTime;
+		kernel = ((uint64_t)kernelFt.dwHighDateTime << 32) | kernelFt.dwLowDateTime;
+		ULONG64 processCycles = 0;
+		QueryProcessCycleTime(GetCurrentProcess(), &processCycles);
+		cycleCount = processCycles;
 	}
-
-	typedef std::map<std::string, char*> ArgMap;
-	typedef std::vector<char*> ArgList;
-	ArgMap argmap;
-	ArgList arglist;
 };
 
-void printfcc(char* buf, DWORD fcc, int bpp)
+/// Tells when a periodic action is due, costs one QueryPerformanceCounter call per check
+struct IntervalTimer
 {
-	if (isprint(fcc & 0xFF) && isprint((fcc >> 8) & 0xFF) && isprint((fcc >> 16) & 0xFF) && isprint((fcc >> 24) & 0xFF))
+	IntervalTimer(int intervalMs)
 	{
-		*(DWORD*)(buf) = fcc;
-		buf[4] = '\0';
+		QueryPerformanceFrequency(&freq);
+		interval = freq.QuadPart * intervalMs / 1000;
+		next = 0;
 	}
-	else if (fcc == 0)
+
+	bool due()
 	{
-		sprintf(buf, "RGB%d", bpp);
+		LARGE_INTEGER now;
+		QueryPerformanceCounter(&now);
+		if (now.QuadPart < next)
+			return false;
+		next = now.QuadPart + interval;
+		return true;
 	}
-	else
+
+	LARGE_INTEGER freq;
+	int64_t interval, next;
+};
+
+/// Distribution of per-sample times, in milliseconds
+struct LatencyStats
+{
+	double min, p50, p90, p99, p999, max, mean, stddev;
+};
+
+LatencyStats GetLatencyStats(std::vector<int64_t> samples, int64_t freq)
+{
+	LatencyStats stats = {};
+	if (samples.empty())
+		return stats;
+
+	std::sort(samples.begin(), samples.end());
+	double toMs = 1000.0 / freq;
+	size_t n = samples.size();
+
+	double sum = 0.0, sumSq = 0.0;
+	for (size_t i = 0; i < n; ++i)
 	{
-		sprintf(buf, "0x%08lX", fcc);
+		double ms = samples[i] * toMs;
+		sum += ms;
+		sumSq += ms * ms;
 	}
+	stats.mean   = sum / n;
+	stats.stddev = sqrt(std::max(0.0, sumSq / n - stats.mean * stats.mean));
+
+	// Nearest-rank percentiles
+	stats.min  = samples[0] * toMs;
+	stats.p50  = samples[std::min(n - 1, (size_t)ceil(n * 0.50) - 1)] * toMs;
+	stats.p90  = samples[std::min(n - 1, (size_t)ceil(n * 0.90) - 1)] * toMs;
+	stats.p99  = samples[std::min(n - 1, (size_t)ceil(n * 0.99) - 1)] * toMs;
+	stats.p999 = samples[std::min(n - 1, (size_t)ceil(n * 0.999) - 1)] * toMs;
+	stats.max  = samples[n - 1] * toMs;
+	return stats;
 }
 
-void PrintBitmapInfo(BITMAPINFOHEADER* biFormat)
+void PrintLatencyStats(const char* name, const LatencyStats& stats)
 {
-	char fccstr[32];
-	printfcc(fccstr, biFormat->biCompression, biFormat->biBitCount);
-	printf("%ld x %ld [%s] %d bpp", biFormat->biWidth, biFormat->biHeight, fccstr, biFormat->biBitCount);
+	printf("%s latency (ms): min %.3f | p50 %.3f | p90 %.3f | p99 %.3f | p99.9 %.3f | max %.3f | stddev %.3f\n",
+		name, stats.min, stats.p50, stats.p90, stats.p99, stats.p999, stats.max, stats.stddev);
 }
 
-template <int ALIGN, typename T>
-T align_to(T val)
+/// Spread of a per-loop measurement (e.g. fps) over the -loop iterations
+struct RepeatStats
 {
-	return (T)((uintptr_t(val) + ALIGN - 1) / ALIGN * ALIGN);
-}
+	RepeatStats()
+		: n(0), best(0), median(0), mean(0), stddev(0), ciLow(0), ciHigh(0)
+	{}
 
-void GetDecompFormat(const char* format, int width, int height, BITMAPINFOHEADER* biFormatOut)
+	int n;
+	double best, median, mean, stddev; // best: the highest value
+	double ciLow, ciHigh;              // 95% confidence interval of the mean (Student's t)
+	std::vector<int> outliers;         // 0-based loops outside the 1.5 IQR (Tukey) fences
+};
+
+RepeatStats GetRepeatStats(const std::vector<double>& values)
 {
-	memset(biFormatOut, 0, sizeof(BITMAPINFOHEADER));
-	biFormatOut->biSize = sizeof(BITMAPINFOHEADER);
-	biFormatOut->biWidth = width;
-	biFormatOut->biHeight = height;
-	biFormatOut->biPlanes = 1;
+	// Two-sided 95% quantiles of Student's t for 1..30 degrees of freedom
+	static const double t95[] = {
+		12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+		2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+		2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042 };
 
-	if (strcmp(format, "RGB24") == 0 || strcmp(format, "bgr24") == 0) {
-		biFormatOut->biBitCount = 24;
-		biFormatOut->biCompression = BI_RGB;
-		biFormatOut->biSizeImage = align_to<4>(biFormatOut->biWidth * 3) * abs(biFormatOut->biHeight);
-	}
-	else if (strcmp(format, "RGB32") == 0 || strcmp(format, "bgr32") == 0) {
-		biFormatOut->biBitCount = 32;
-		biFormatOut->biCompression = BI_RGB;
-		biFormatOut->biSizeImage = biFormatOut->biWidth * 4 * abs(biFormatOut->biHeight);
-	}
-	else if (strcmp(format, "BGRA") == 0) {
-		biFormatOut->biBitCount = 32;
-		biFormatOut->biCompression = mmioFOURCC('B','G','R','A');
-		biFormatOut->biSizeImage = biFormatOut->biWidth * 4 * abs(biFormatOut->biHeight);
-	}
-	else if (strcmp(format, "AYUV") == 0) {
-		biFormatOut->biBitCount = 32;
-		biFormatOut->biCompression = mmioFOURCC('A','Y','U','V');
-		biFormatOut->biSizeImage = biFormatOut->biWidth * 4 * abs(biFormatOut->biHeight);
-	}
-	else if (strcmp(format, "YUY2") == 0) {
-		biFormatOut->biBitCount = 16;
-		biFormatOut->biCompression = mmioFOURCC('Y','U','Y','2');
-		biFormatOut->biSizeImage = biFormatOut->biWidth * 2 * abs(biFormatOut->biHeight);
-	}
-	else if (strcmp(format, "UYVY") == 0) {
-		biFormatOut->biBitCount = 16;
-		biFormatOut->biCompression = mmioFOURCC('U','Y','V','Y');
-		biFormatOut->biSizeImage = biFormatOut->biWidth * 2 * abs(biFormatOut->biHeight);
-	}
-	else if (strcmp(format, "YV12") == 0) {
-		biFormatOut->biBitCount = 12;
-		biFormatOut->biCompression = mmioFOURCC('Y','V','1','2');
-		biFormatOut->biSizeImage = biFormatOut->biWidth * abs(biFormatOut->biHeight) * 3 / 2;
-	}
-	else if (strcmp(format, "YV24") == 0) {
-		biFormatOut->biBitCount = 24;
-		biFormatOut->biCompression = mmioFOURCC('Y','V','2','4');
-		biFormatOut->biSizeImage = biFormatOut->biWidth * abs(biFormatOut->biHeight) * 3;
-	}
-	else if (strcmp(format, "Y8") == 0) {
-		biFormatOut->biBitCount = 8;
-		biFormatOut->biCompression = mmioFOURCC('Y','8',' ',' ');
-		biFormatOut->biSizeImage = biFormatOut->biWidth * abs(biFormatOut->biHeight);
-	}
-	else if (strcmp(format, "b64a") == 0) {
-		biFormatOut->biBitCount = 64;
-		biFormatOut->biCompression = mmioFOURCC('b','6','4','a');
-		biFormatOut->biSizeImage = biFormatOut->biWidth * 8 * abs(biFormatOut->biHeight);
-	}
-	else if (strcmp(format, "b48r") == 0) {
-		biFormatOut->biBitCount = 48;
-		biFormatOut->biCompression = mmioFOURCC('b','4','8','r');
-		biFormatOut->biSizeImage = biFormatOut->biWidth * 6 * abs(biFormatOut->biHeight);
-	}
-	else if (strcmp(format, "v210") == 0) {
-		biFormatOut->biBitCount = 20;
-		biFormatOut->biCompression = mmioFOURCC('v','2','1','0');
-		biFormatOut->biSizeImage = (biFormatOut->biWidth + 47) / 48 * 128 * abs(biFormatOut->biHeight);
-	}
-	else if (strcmp(format, "r210") == 0) {
-		biFormatOut->biBitCount = 30;
-		biFormatOut->biCompression = mmioFOURCC('r','2','1','0');
-		biFormatOut->biSizeImage = (biFormatOut->biWidth + 63) / 64 * 256 * abs(biFormatOut->biHeight);
+	RepeatStats stats;
+	size_t n = values.size();
+	stats.n = (int)n;
+	if (!n)
+		return stats;
+
+	std::vector<double> sorted(values);
+	std::sort(sorted.begin(), sorted.end());
+	stats.best   = sorted[n - 1];
+	stats.median = n & 1 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2.0;
+
+	double sum = 0.0;
+	for (size_t i = 0; i < n; ++i)
+		sum += values[i];
+	stats.mean = sum / n;
+	stats.ciLow = stats.ciHigh = stats.mean;
+	if (n < 2)
+		return stats;
+
+	double sumSq = 0.0;
+	for (size_t i = 0; i < n; ++i)
+		sumSq += (values[i] - stats.mean) * (values[i] - stats.mean);
+	stats.stddev = sqrt(sumSq / (n - 1)); // sample standard deviation
+	double t = n - 1 <= 30 ? t95[n - 2] : 1.96;
+	stats.ciLow  = stats.mean - t * stats.stddev / sqrt((double)n);
+	stats.ciHigh = stats.mean + t * stats.stddev / sqrt((double)n);
+
+	// Quartiles by linear interpolation, fences need a few values to mean anything
+	if (n >= 4)
+	{
+		double pos1 = (n - 1) * 0.25, pos3 = (n - 1) * 0.75;
+		double q1 = sorted[(size_t)pos1] + (sorted[std::min(n - 1, (size_t)pos1 + 1)] - sorted[(size_t)pos1]) * (pos1 - floor(pos1));
+		double q3 = sorted[(size_t)pos3] + (sorted[std::min(n - 1, (size_t)pos3 + 1)] - sorted[(size_t)pos3]) * (pos3 - floor(pos3));
+		double iqr = q3 - q1;
+		for (size_t i = 0; i < n; ++i)
+		{
+			if (values[i] < q1 - 1.5 * iqr || values[i] > q3 + 1.5 * iqr)
+				stats.outliers.push_back((int)i);
+		}
 	}
-	else {
-		throw std::runtime_error(std::string("Invalid requested decompressed format: ") + format);
+	return stats;
+}
+
+/// 1-based, comma separated loop numbers of the outliers ("" if none)
+std::string RepeatOutlierList(const RepeatStats& stats)
+{
+	std::string list;
+	for (size_t i = 0; i < stats.outliers.size(); ++i)
+	{
+		char num[16];
+		sprintf(num, "%s%d", i ? "," : "", stats.outliers[i] + 1);
+		list += num;
 	}
+	return list;
 }
 
-/////////////////////////////////////
-template <typename T>
-T readVar(std::istream& input)
+void PrintRepeatStats(const char* name, const RepeatStats& stats)
 {
-	T var;
-	input.read((char*) &var, sizeof(var));
-	return var;
+	printf("%s loops (fps, %d): best %.1f | median %.1f | mean %.1f | 95%% CI %.1f..%.1f | stddev %.1f | outliers: %s\n",
+		name, stats.n, stats.best, stats.median, stats.mean, stats.ciLow, stats.ciHigh, stats.stddev,
+		stats.outliers.empty() ? "none" : ("loop " + RepeatOutlierList(stats)).c_str());
 }
 
-template <typename T>
-void writeVar(std::ostream& output, T var)
+/// Geometric mean of the paired ratios b[i] / a[i], with the 95% confidence interval of t over their logarithms
+struct PairedRatio
 {
-	output.write((char*) &var, sizeof(var));
+	int n;
+	double ratio, ciLow, ciHigh;
+	int smaller; // pairs with b[i] < a[i]
+
+	/// Whether the interval excludes 1, i.e. a and b differ at the 5% level
+	bool significant() const
+	{
+		return n >= 2 && (ciHigh < 1.0 || ciLow > 1.0);
+	}
+};
+
+PairedRatio GetPairedRatio(const std::vector<int64_t>& a, const std::vector<int64_t>& b)
+{
+	std::vector<double> logRatios;
+	PairedRatio paired = {};
+	for (size_t i = 0; i < std::min(a.size(), b.size()); ++i)
+	{
+		if (a[i] <= 0 || b[i] <= 0)
+			continue;
+		logRatios.push_back(log((double)b[i] / a[i]));
+		if (b[i] < a[i])
+			++paired.smaller;
+	}
+	RepeatStats stats = GetRepeatStats(logRatios);
+	paired.n = stats.n;
+	paired.ratio = exp(stats.mean);
+	paired.ciLow = exp(stats.ciLow);
+	paired.ciHigh = exp(stats.ciHigh);
+	return paired;
 }
 
 /////////////////////////////////////
-class BitmapInfoHeader
+class Thread
 {
 public:
-	BitmapInfoHeader()
+	Thread()
+		: m_hThread(NULL)
+		, m_failed(false)
+	{}
+
+	virtual ~Thread()
 	{
-		resize(sizeof(BITMAPINFOHEADER));
+		if (m_hThread)
+		{
+			WaitForSingleObject(m_hThread, INFINITE);
+			CloseHandle(m_hThread);
+		}
 	}
 
-	BitmapInfoHeader& operator=(const BITMAPINFOHEADER* bih)
+	/// Starts the thread, pinned to the CPUs in affinityMask unless 0
+	void start(DWORD_PTR affinityMask = 0)
 	{
-		if (!bih)
-			return *this;
-
-		resize(bih->biSize);
-		memcpy(&buf[0], bih, bih->biSize);
-		return *this;
+		m_hThread = (HANDLE)_beginthreadex(NULL, 0, threadProc, this, CREATE_SUSPENDED, NULL);
+		if (!m_hThread)
+		{
+			throw std::runtime_error("ERROR: Failed to create thread\n");
+		}
+		if (affinityMask && !SetThreadAffinityMask(m_hThread, affinityMask))
+		{
+			printf("WARNING: Failed to set thread affinity\n");
+		}
+		ResumeThread(m_hThread);
 	}
 
-	operator BITMAPINFOHEADER*()
+	/// Waits for the thread to finish. Rethrows the error the thread was terminated with.
+	void join()
 	{
-		return (BITMAPINFOHEADER*)&buf[0];
+		if (m_hThread)
+		{
+			WaitForSingleObject(m_hThread, INFINITE);
+			CloseHandle(m_hThread);
+			m_hThread = NULL;
+		}
+		if (m_failed)
+		{
+			m_failed = false;
+			throw std::runtime_error(m_error);
+		}
 	}
 
-	void resize(size_t size)
+protected:
+	virtual void threadMain() = 0;
+
+private:
+	static unsigned __stdcall threadProc(void* param)
 	{
-		buf.resize(size);
+		Thread* thread = (Thread*)param;
+		try
+		{
+			thread->threadMain();
+		}
+		catch (std::exception& e)
+		{
+			thread->m_error = e.what();
+			thread->m_failed = true;
+		}
+		return 0;
 	}
 
-private:
-	std::vector<char> buf;
+	HANDLE m_hThread;
+	bool m_failed;
+	std::string m_error;
 };
 
 /////////////////////////////////////
-class VideoReader
+/// Frame buffer with an aligned start address.
+/// The alignment and the optional large page backing are set once for all buffers with configure().
+class AlignedBuffer
 {
 public:
-	void openRaw(const char* infile, const char* format, int width, int height);
+	explicit AlignedBuffer(size_t size = 0)
+		: m_data(NULL)
+		, m_size(0)
+		, m_minAlignment(0)
+		, m_virtual(false)
+	{
+		resize(size);
+	}
 
-	void open(const char* infile);
+	~AlignedBuffer()
+	{
+		release(m_data, m_virtual);
+	}
 
-	bool readFrame();
+	/// Contents are not preserved
+	void resize(size_t size)
+	{
+		if (size == m_size)
+			return;
+		release(m_data, m_virtual);
+		m_data = NULL;
+		m_size = 0;
+		if (size)
+		{
+			m_data = allocate(size, std::max(s_alignment, m_minAlignment), m_virtual);
+			m_size = size;
+		}
+	}
 
-	void rewind()
+	/// Like resize(), but keeps the contents up to the smaller of the two sizes
+	void reallocate(size_t size)
 	{
-		m_inFile.clear();
-		m_inFile.seekg(m_headerSize, m_inFile.beg);
+		bool isVirtual = false;
+		char* data = size ? allocate(size, std::max(s_alignment, m_minAlignment), isVirtual) : NULL;
+		if (m_size && size)
+			memcpy(data, m_data, std::min(size, m_size));
+		release(m_data, m_virtual);
+		m_data = data;
+		m_size = size;
+		m_virtual = isVirtual;
 	}
 
-	char* frameData()
+	/// Alignment this buffer needs at least, regardless of configure() (e.g. sectors for unbuffered I/O).
+	/// Applies from the next allocation.
+	void setMinAlignment(size_t alignment)
 	{
-		return &m_frameBuf[0];
+		m_minAlignment = alignment;
 	}
 
-	uint32_t frameSize()
+	char* data() const
 	{
-		return m_frameSize;
+		return m_data;
 	}
 
-	BITMAPINFOHEADER* getFormat()
+	size_t size() const
 	{
-		return (BITMAPINFOHEADER*)m_biFormat;
+		return m_size;
 	}
 
-private:
-	std::vector<char> m_frameBuf;
-	uint32_t m_frameSize;
-	std::ifstream m_inFile;
-	BitmapInfoHeader m_biFormat;
-	uint32_t m_headerSize;
-	bool m_raw;
-};
+	/// Sets the alignment (a power of 2) of buffers allocated afterwards, whether they should be
+	/// backed by large pages and the NUMA node to allocate them on (-1: any).
+	/// Returns false if large pages are not available (SeLockMemoryPrivilege missing).
+	static bool configure(size_t alignment, bool largePages, int numaNode = -1)
+	{
+		s_alignment = alignment;
+		s_largePageSize = largePages && EnableLockMemoryPrivilege() ? GetLargePageMinimum() : 0;
+		s_numaNode = numaNode;
+		return !largePages || s_largePageSize;
+	}
 
-void VideoReader::openRaw(const char* infile, const char* format, int width, int height)
-{
-	GetDecompFormat(format, width, height, (BITMAPINFOHEADER*)m_biFormat);
+	static size_t alignment()
+	{
+		return s_alignment;
+	}
 
-	m_inFile.open(infile, std::ios::binary);
-	if (!m_inFile)
+	/// 0 if large pages are not used
+	static size_t largePageSize()
 	{
-		throw std::runtime_error(std::string("ERROR: Failed to open file: ") + infile);
+		return s_largePageSize;
 	}
-	m_raw = true;
-	m_headerSize = 0;
-}
 
-void VideoReader::open(const char* infile)
-{
-	m_inFile.open(infile, std::ios::binary);
-	if (!m_inFile)
+	/// -1 if the buffers are not bound to a NUMA node
+	static int numaNode()
 	{
-		throw std::runtime_error(std::string("ERROR: Failed to open file: ") + infile);
+		return s_numaNode;
 	}
-	m_raw = false;
 
-	// Read magic
-	uint32_t magic = readVar<uint32_t>(m_inFile);
-	if (magic != 0xABCDEF01)
+	/// Number of allocations that could not get large pages and went to the heap instead
+	static LONG largePageFallbacks()
 	{
-		throw std::runtime_error("ERROR: Invalid file magic");
+		return s_largePageFallbacks;
 	}
 
-	// Read format block
-	uint32_t formatSize = readVar<uint32_t>(m_inFile);
-	m_biFormat.resize(formatSize);
-	m_inFile.read((char*)(BITMAPINFOHEADER*)m_biFormat, formatSize);
+	static const char* allocatorName()
+	{
+		return s_largePageSize ? "large_pages" : s_numaNode >= 0 ? "virtual_alloc_numa" : "aligned_malloc";
+	}
 
-	m_headerSize = 8 + formatSize;
-}
+private:
+	AlignedBuffer(const AlignedBuffer&);
+	AlignedBuffer& operator=(const AlignedBuffer&);
 
-bool VideoReader::readFrame()
-{
-	if (m_inFile.eof())
+	/// isVirtual tells whether the buffer came from VirtualAlloc (whose allocations are 64 KiB aligned) or the heap
+	static char* allocate(size_t size, size_t alignment, bool& isVirtual)
 	{
-		return false;
+		isVirtual = true;
+		if (s_largePageSize)
+		{
+			// Large pages are aligned to the page size, which is larger than any frame buffer alignment
+			char* data = virtualAlloc(align_size(size, s_largePageSize), MEM_LARGE_PAGES);
+			if (data)
+				return data;
+			InterlockedIncrement(&s_largePageFallbacks); // no contiguous physical memory left
+		}
+		if (s_numaNode >= 0)
+		{
+			char* data = virtualAlloc(size, 0);
+			if (!data)
+			{
+				throw std::runtime_error("ERROR: Failed to allocate frame buffer on the NUMA node\n");
+			}
+			return data;
+		}
+		isVirtual = false;
+		char* data = (char*)_aligned_malloc(size, alignment);
+		if (!data)
+		{
+			throw std::runtime_error("ERROR: Failed to allocate frame buffer\n");
+		}
+		return data;
 	}
 
-	if (m_raw)
+	static char* virtualAlloc(size_t size, DWORD flags)
 	{
-		m_frameSize = getFormat()->biSizeImage;
+		flags |= MEM_RESERVE | MEM_COMMIT;
+		if (s_numaNode >= 0)
+			return (char*)VirtualAllocExNuma(GetCurrentProcess(), NULL, size, flags, PAGE_READWRITE, s_numaNode);
+		return (char*)VirtualAlloc(NULL, size, flags, PAGE_READWRITE);
 	}
-	else
+
+	static void release(char* data, bool isVirtual)
 	{
-		m_frameSize = readVar<uint32_t>(m_inFile);
+		if (isVirtual)
+			VirtualFree(data, 0, MEM_RELEASE);
+		else
+			_aligned_free(data);
 	}
 
-	if (m_frameBuf.size() < m_frameSize)
+	static size_t align_size(size_t size, size_t alignment)
 	{
-		m_frameBuf.resize(m_frameSize);
+		return (size + alignment - 1) / alignment * alignment;
 	}
-	m_inFile.read(&m_frameBuf[0], m_frameSize);
-	return (bool) m_inFile;
-}
 
-/////////////////////////////////////
-class VideoWriter
-{
-public:
-	/// If biFormat is NULL the file is written as raw
-	void open(const char* outfile, BITMAPINFOHEADER* biFormat = NULL);
+	/// Large page allocations need SeLockMemoryPrivilege enabled in the process token
+	static bool EnableLockMemoryPrivilege()
+	{
+		HANDLE token;
+		if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+			return false;
 
-	void writeFrame(const void* data, uint32_t frameSize);
+		TOKEN_PRIVILEGES privileges = {};
+		privileges.PrivilegeCount = 1;
+		privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+		// AdjustTokenPrivileges() succeeds even if the privilege is not held, that is only told by GetLastError()
+		bool enabled = LookupPrivilegeValueA(NULL, "SeLockMemoryPrivilege", &privileges.Privileges[0].Luid)
+			&& AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL) && GetLastError() == ERROR_SUCCESS;
+		CloseHandle(token);
+		return enabled;
+	}
 
-private:
-	std::ofstream m_outFile;
-	bool m_raw;
+	char* m_data;
+	size_t m_size;
+	size_t m_minAlignment;
+	bool m_virtual;
+
+	static size_t s_alignment;
+	static size_t s_largePageSize;
+	static int s_numaNode;
+	static volatile LONG s_largePageFallbacks;
 };
 
-void VideoWriter::open(const char* outfile, BITMAPINFOHEADER* biFormat)
-{
-	m_outFile.open(outfile, std::ios::binary);
-	if (!m_outFile)
-	{
-		throw std::runtime_error(std::string("ERROR: Failed to open file: ") + outfile);
-	}
+size_t AlignedBuffer::s_alignment = 64;
+size_t AlignedBuffer::s_largePageSize = 0;
+int AlignedBuffer::s_numaNode = -1;
+volatile LONG AlignedBuffer::s_largePageFallbacks = 0;
 
-	if (!biFormat)
-	{
-		m_raw = true;
-	}
-	else
-	{
-		m_raw = false;
+/// Size of the largest cache of the system (the last level cache), 0 if unknown
+size_t GetLastLevelCacheSize()
+{
+	DWORD bytes = 0;
+	GetLogicalProcessorInformation(NULL, &bytes);
+	if (GetLastError() != ERROR_INSUFFICIENT_BUFFER || !bytes)
+		return 0;
 
-		// Write magic
-		writeVar<uint32_t>(m_outFile, 0xABCDEF01);
+	std::vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> info(bytes / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+	if (!GetLogicalProcessorInformation(&info[0], &bytes))
+		return 0;
 
-		// Write format block
-		writeVar<uint32_t>(m_outFile, biFormat->biSize);
-		m_outFile.write((char*)biFormat, biFormat->biSize);
+	size_t size = 0;
+	int level = 0;
+	for (size_t i = 0; i < info.size(); ++i)
+	{
+		if (info[i].Relationship == RelationCache && info[i].Cache.Type != CacheInstruction && info[i].Cache.Level >= level)
+		{
+			size = info[i].Cache.Level > level ? info[i].Cache.Size : std::max<size_t>(size, info[i].Cache.Size);
+			level = info[i].Cache.Level;
+		}
 	}
+	return size;
 }
 
-void VideoWriter::writeFrame(const void* data, uint32_t frameSize)
+/// Writes back and evicts [data, data + size) from all cache levels
+__attribute__((target("sse2")))
+void FlushCache(const void* data, size_t size)
 {
-	if (!m_raw)
+	const char* p = (const char*)((uintptr_t)data & ~(uintptr_t)63);
+	const char* end = (const char*)data + size;
+	for (; p < end; p += 64)
 	{
-		writeVar<uint32_t>(m_outFile, frameSize);
+		_mm_clflush(p);
 	}
-	m_outFile.write((char*)data, frameSize);
+	_mm_mfence();
 }
 
 /////////////////////////////////////
-class Decompressor
+/// Rotates through several frame buffers, so consecutive frames are not written to the same cache hot memory.
+/// The number of buffers is set for all rings with configure().
+class BufferRing
 {
 public:
-	Decompressor()
-		: m_hic(0)
-		, m_decompressing(false)
+	BufferRing()
+		: m_current(0)
 	{}
 
-	~Decompressor()
+	~BufferRing()
 	{
-		if (m_hic)
+		clear();
+	}
+
+	/// Allocates the buffers of size bytes and touches every page, so the first frames through next() do not
+	/// pay for the allocation and the page faults. count: number of buffers, 0: the configure() count.
+	void allocate(size_t size, size_t count = 0)
+	{
+		clear();
+		if (!count)
+			count = s_count ? s_count : autoCount(size);
+		for (size_t i = 0; i < count; ++i)
 		{
-			if (m_decompressing)
-				ICDecompressEnd(m_hic);
-			ICClose(m_hic);
+			m_buffers.push_back(new AlignedBuffer(size));
+			if (size)
+				memset(m_buffers[i]->data(), 0, size);
 		}
-		m_hic = 0;
+		m_current = count - 1;
 	}
 
-	void init(BITMAPINFOHEADER* biFormatIn, BITMAPINFOHEADER* biFormatOut = NULL, int width = 0, int height = 0);
+	/// Moves to the next buffer of allocate(). Contents are not preserved.
+	char* next()
+	{
+		m_current = (m_current + 1) % m_buffers.size();
+		return m_buffers[m_current]->data();
+	}
 
-	void decompressFrame(const void* data, uint32_t dataSize);
+	/// Moves to the next buffer and grows it to at least size bytes, for frames of varying size outside of the
+	/// timed regions (e.g. file reads). Allocates the buffers on first use. Contents are not preserved.
+	char* nextResized(size_t size)
+	{
+		if (m_buffers.empty())
+			allocate(0);
+		char* data = next();
+		AlignedBuffer& buf = *m_buffers[m_current];
+		if (buf.size() < size)
+		{
+			buf.resize(size);
+			data = buf.data();
+		}
+		return data;
+	}
 
-	char* frameData()
+	char* current() const
 	{
-		return &m_frameBuf[0];
+		return m_buffers.empty() ? NULL : m_buffers[m_current]->data();
 	}
 
-	BITMAPINFOHEADER* getOutputFormat()
+	size_t count() const
 	{
-		return (BITMAPINFOHEADER*)m_biFormatOut;
+		return m_buffers.size();
+	}
+
+	void clear()
+	{
+		for (size_t i = 0; i < m_buffers.size(); ++i)
+		{
+			delete m_buffers[i];
+		}
+		m_buffers.clear();
+	}
+
+	/// Number of buffers of rings created afterwards, 0: enough buffers to exceed twice the last level cache
+	static void configure(size_t count)
+	{
+		s_count = count;
+		if (!count && !s_cacheSize)
+		{
+			s_cacheSize = GetLastLevelCacheSize();
+			if (!s_cacheSize)
+				s_cacheSize = 32 * 1024 * 1024;
+		}
+	}
+
+	/// 0 if not queried (fixed -ring count)
+	static size_t cacheSize()
+	{
+		return s_cacheSize;
 	}
 
 private:
-	HIC m_hic;
-	bool m_decompressing;
-	std::vector<char> m_frameBuf;
-	BitmapInfoHeader m_biFormatIn;
-	BitmapInfoHeader m_biFormatOut;
+	BufferRing(const BufferRing&);
+	BufferRing& operator=(const BufferRing&);
+
+	static size_t autoCount(size_t size)
+	{
+		return std::max<size_t>(2, (2 * s_cacheSize + size - 1) / std::max<size_t>(size, 1));
+	}
+
+	std::vector<AlignedBuffer*> m_buffers;
+	size_t m_current;
+
+	static size_t s_count;
+	static size_t s_cacheSize;
 };
 
-void Decompressor::init(BITMAPINFOHEADER* biFormatIn, BITMAPINFOHEADER* biFormatOut, int width, int height)
+size_t BufferRing::s_count = 1;
+size_t BufferRing::s_cacheSize = 0;
+
+/////////////////////////////////////
+/// Frame passed between pipeline stages
+struct PipelineFrame
 {
-	m_decompressing = false;
+	AlignedBuffer buf;
+	char* data;
+	uint32_t dataSize;
+	uint32_t inputSize, rawSize;
+	bool keyFrame;
+	uint64_t encodeTimeNs;
+	bool last;
+};
 
-	// Locate decompressor
-	m_hic = ICLocate(ICTYPE_VIDEO, biFormatIn->biCompression, biFormatIn, NULL, ICMODE_DECOMPRESS);
-	if (!m_hic)
+/// Blocking FIFO of frames, times how long pop() had to wait for a frame
+class FrameQueue
+{
+public:
+	FrameQueue()
+		: m_aborted(false)
 	{
-		throw std::runtime_error("ERROR: Could not find appropriate decompressor!\n");
+		InitializeCriticalSection(&m_lock);
+		InitializeConditionVariable(&m_cond);
 	}
 
-	ICINFO icinfo = {};
-	icinfo.dwSize = sizeof(icinfo);
-	ICGetInfo(m_hic, &icinfo, sizeof(icinfo));
-	wprintf(L"INFO: Decompressor        : '%ls' - '%ls'\n", icinfo.szName, icinfo.szDescription);
+	~FrameQueue()
+	{
+		DeleteCriticalSection(&m_lock);
+	}
 
-	// Determine/request decompressed format
-	if (biFormatOut)
+	void push(PipelineFrame* frame)
 	{
-		// Try to decompress to the requested format
-		LRESULT result = ICDecompressQuery(m_hic, biFormatIn, biFormatOut);
-		if (result != ICERR_OK)
-		{
-			throw std::runtime_error("ERROR: The decompressor cannot decompress to the requested format/size\n");
-		}
-		m_biFormatOut = biFormatOut;
+		EnterCriticalSection(&m_lock);
+		m_frames.push_back(frame);
+		LeaveCriticalSection(&m_lock);
+		WakeConditionVariable(&m_cond);
 	}
-	else
+
+	/// Returns NULL if the queue was aborted
+	PipelineFrame* pop()
 	{
-		// Ask the decompressor about decompressed format
-		DWORD decompFormatSize = ICDecompressGetFormatSize(m_hic, biFormatIn);
-		if (!decompFormatSize || (LONG)decompFormatSize < 0)
+		EnterCriticalSection(&m_lock);
+		if (m_frames.empty() && !m_aborted)
 		{
-			throw std::runtime_error("ICDecompressGetFormatSize() failed\n");
+			m_stallTimer.begin();
+			while (m_frames.empty() && !m_aborted)
+			{
+				SleepConditionVariableCS(&m_cond, &m_lock, INFINITE);
+			}
+			m_stallTimer.end();
 		}
-		m_biFormatOut.resize(decompFormatSize);
-		LRESULT result = ICDecompressGetFormat(m_hic, biFormatIn, (BITMAPINFOHEADER*)m_biFormatOut);
-		if (result != ICERR_OK)
+		PipelineFrame* frame = NULL;
+		if (!m_aborted)
 		{
-			throw std::runtime_error("ICDecompressGetFormat() failed\n");
+			frame = m_frames.front();
+			m_frames.pop_front();
 		}
+		LeaveCriticalSection(&m_lock);
+		return frame;
 	}
 
-	// Determine/request decompressed size
-	// Do separately, as it is for both the above cases
-	if (width || height )
+	/// Wakes up and fails all current and future pop() calls
+	void abort()
 	{
-		if (width)  ((BITMAPINFOHEADER*)m_biFormatOut)->biWidth  = width;
-		if (height) ((BITMAPINFOHEADER*)m_biFormatOut)->biHeight = height;
-		LRESULT result = ICDecompressQuery(m_hic, biFormatIn, (BITMAPINFOHEADER*)m_biFormatOut);
-		if (result != ICERR_OK)
-		{
-			throw std::runtime_error("ERROR: The decompressor cannot decompress to the specified size\n");
-		}
+		EnterCriticalSection(&m_lock);
+		m_aborted = true;
+		LeaveCriticalSection(&m_lock);
+		WakeAllConditionVariable(&m_cond);
 	}
 
-	// Initialize decompressor
-	LRESULT result = ICDecompressBegin(m_hic, biFormatIn, (BITMAPINFOHEADER*)m_biFormatOut);
-	if (result != ICERR_OK)
+	Timer& stallTimer()
 	{
-		throw std::runtime_error("ICDecompressBegin() failed\n");
+		return m_stallTimer;
 	}
-	m_biFormatIn = biFormatIn;
-	m_decompressing = true;
-	m_frameBuf.resize(((BITMAPINFOHEADER*)m_biFormatOut)->biSizeImage);
-}
 
-void Decompressor::decompressFrame(const void* data, uint32_t dataSize)
-{
-	((BITMAPINFOHEADER*)m_biFormatIn)->biSizeImage = dataSize;
-	ICDecompress(m_hic, 0, (BITMAPINFOHEADER*)m_biFormatIn, (LPVOID) data, (BITMAPINFOHEADER*)m_biFormatOut, &m_frameBuf[0]);
-}
+private:
+	CRITICAL_SECTION m_lock;
+	CONDITION_VARIABLE m_cond;
+	std::deque<PipelineFrame*> m_frames;
+	bool m_aborted;
+	Timer m_stallTimer;
+};
 
-/////////////////////////////////////
-class Compressor
+/// Fixed pool of reusable frames between two pipeline stages
+class FrameRing
 {
 public:
-	Compressor()
-		: m_compvars()
-		, m_compressing(false)
-	{}
+	FrameRing(size_t numFrames, size_t bufferSize, size_t minAlignment = 0)
+	{
+		for (size_t i = 0; i < numFrames; ++i)
+		{
+			PipelineFrame* frame = new PipelineFrame();
+			frame->buf.setMinAlignment(minAlignment);
+			frame->buf.resize(bufferSize);
+			if (bufferSize)
+				memset(frame->buf.data(), 0, bufferSize); // touch the pages before the timed run
+			m_frames.push_back(frame);
+			m_free.push(frame);
+		}
+	}
 
-	~Compressor()
+	~FrameRing()
 	{
-		if (m_compvars.hic)
+		for (size_t i = 0; i < m_frames.size(); ++i)
 		{
-			if (m_compressing)
-				ICSeqCompressFrameEnd(&m_compvars);
-			ICClose(m_compvars.hic);
+			delete m_frames[i];
 		}
 	}
 
-	/// Return false means "no-compression" was selected
-	bool init(BITMAPINFOHEADER* biFormatIn);
+	/// Producer: get a free frame, waits while all frames are in use
+	PipelineFrame* acquire()
+	{
+		return m_free.pop();
+	}
 
-	void compressFrame(const void* data);
+	void publish(PipelineFrame* frame)
+	{
+		m_filled.push(frame);
+	}
 
-	char* frameData() const
+	/// Consumer: get the next filled frame, waits while there is none
+	PipelineFrame* consume()
 	{
-		return (char*) m_frameData;
+		return m_filled.pop();
 	}
 
-	uint32_t frameSize() const
+	void release(PipelineFrame* frame)
 	{
-		return m_frameSize;
+		m_free.push(frame);
 	}
 
-	BITMAPINFOHEADER* getOutputFormat()
+	void abort()
 	{
-		return (BITMAPINFOHEADER*)m_biFormatOut;
+		m_free.abort();
+		m_filled.abort();
+	}
+
+	Timer& producerStall()
+	{
+		return m_free.stallTimer();
+	}
+
+	Timer& consumerStall()
+	{
+		return m_filled.stallTimer();
 	}
 
 private:
-	COMPVARS m_compvars;
-	bool m_compressing;
-	LPVOID m_frameData;
-	LONG m_frameSize;
-	BitmapInfoHeader m_biFormatOut;
+	std::vector<PipelineFrame*> m_frames;
+	FrameQueue m_free, m_filled;
 };
 
-bool Compressor::init(BITMAPINFOHEADER* biFormatIn)
+/////////////////////////////////////
+/// Hands out numTasks tasks to any number of worker threads and, with numSlots > 0, returns their results in task order.
+/// Every task owns result slot (task % numSlots) until the consumer releases it, so the workers run at most
+/// numSlots tasks ahead of the consumer.
+class TaskScheduler
 {
-	m_compressing = false;
-	m_compvars.cbSize = sizeof(m_compvars);
+public:
+	/// Result of a task: frames stored back to back at a fixed stride
+	struct Slot
+	{
+		AlignedBuffer buf;
+		std::vector<uint32_t> frameSizes;
+	};
 
-	// Choose compressor
-	if (!ICCompressorChoose(GetDesktopWindow(), 0, biFormatIn, NULL, &m_compvars, NULL))
+	/// The slot buffers are allocated and touched here, outside of any timed region
+	TaskScheduler(size_t numTasks, size_t numSlots, size_t slotSize = 0)
+		: m_numTasks(numTasks)
+		, m_nextTask(0)
+		, m_released(0)
+		, m_aborted(false)
+		, m_slots(numSlots)
+		, m_ready(numSlots, false)
 	{
-		throw std::runtime_error("Compressor selection was canceled!\n");
+		InitializeCriticalSection(&m_lock);
+		InitializeConditionVariable(&m_cond);
+		for (size_t i = 0; i < numSlots; ++i)
+		{
+			m_slots[i] = new Slot();
+			m_slots[i]->buf.resize(slotSize);
+			if (slotSize)
+				memset(m_slots[i]->buf.data(), 0, slotSize);
+		}
 	}
 
-	if (!m_compvars.hic)
+	~TaskScheduler()
 	{
-		return false;
+		for (size_t i = 0; i < m_slots.size(); ++i)
+		{
+			delete m_slots[i];
+		}
+		DeleteCriticalSection(&m_lock);
 	}
-	else
+
+	/// Worker: takes the next task, waits while its slot is still in use. Returns false when there are no more tasks.
+	/// slot is NULL without result slots.
+	bool acquire(size_t& task, Slot*& slot)
+	{
+		EnterCriticalSection(&m_lock);
+		bool ok = !m_aborted && m_nextTask < m_numTasks;
+		if (ok)
+		{
+			task = m_nextTask++;
+			slot = NULL;
+			if (!m_slots.empty())
+			{
+				while (task >= m_released + m_slots.size() && !m_aborted)
+				{
+					SleepConditionVariableCS(&m_cond, &m_lock, INFINITE);
+				}
+				ok = !m_aborted;
+				slot = m_slots[task % m_slots.size()];
+			}
+		}
+		LeaveCriticalSection(&m_lock);
+		return ok;
+	}
+
+	/// Worker: the result of the task is complete
+	void publish(size_t task)
 	{
-		ICINFO icinfo = {};
-		icinfo.dwSize = sizeof(icinfo);
-		ICGetInfo(m_compvars.hic, &icinfo, sizeof(icinfo));
-		wprintf(L"INFO: Compressor          : '%ls' - '%ls'\n", icinfo.szName, icinfo.szDescription);
+		if (m_slots.empty())
+			return;
+		EnterCriticalSection(&m_lock);
+		m_ready[task % m_slots.size()] = true;
+		LeaveCriticalSection(&m_lock);
+		WakeAllConditionVariable(&m_cond);
+	}
 
-		// Initialize compressor
-		BOOL res = ICSeqCompressFrameStart(&m_compvars, (LPBITMAPINFO) biFormatIn);
-		if (!res)
+	/// Consumer: waits for the result of the next task in order, NULL after the last task or if aborted
+	Slot* consume()
+	{
+		EnterCriticalSection(&m_lock);
+		Slot* slot = NULL;
+		if (m_released < m_numTasks && !m_slots.empty())
 		{
-			throw std::runtime_error("ERROR: ICSeqCompressFrameStart() failed\n");
+			size_t index = m_released % m_slots.size();
+			while (!m_ready[index] && !m_aborted)
+			{
+				SleepConditionVariableCS(&m_cond, &m_lock, INFINITE);
+			}
+			if (!m_aborted)
+				slot = m_slots[index];
 		}
+		LeaveCriticalSection(&m_lock);
+		return slot;
+	}
 
-		m_compressing = true;
-		m_biFormatOut = (BITMAPINFOHEADER*) m_compvars.lpbiOut;
+	/// Consumer: done with the result returned by consume(), its slot can take a new task
+	void release()
+	{
+		EnterCriticalSection(&m_lock);
+		m_ready[m_released % m_slots.size()] = false;
+		++m_released;
+		LeaveCriticalSection(&m_lock);
+		WakeAllConditionVariable(&m_cond);
 	}
 
-	return true;
-}
+	/// Wakes up and fails all waiting and future calls
+	void abort()
+	{
+		EnterCriticalSection(&m_lock);
+		m_aborted = true;
+		LeaveCriticalSection(&m_lock);
+		WakeAllConditionVariable(&m_cond);
+	}
 
-void Compressor::compressFrame(const void* data)
-{
-	BOOL fKey = 1;
-	m_frameSize = ((BITMAPINFOHEADER*) m_compvars.lpbiIn)->biSizeImage;
-	m_frameData = ICSeqCompressFrame(&m_compvars, 0, (LPVOID) data, &fKey, &m_frameSize);
-	//printf("Key: %2d, Size: %ld, Size Out: %ld\n", fKey, m_frameSize, ((BITMAPINFOHEADER*) m_compvars.lpbiOut)->biSizeImage);
-}
+private:
+	CRITICAL_SECTION m_lock;
+	CONDITION_VARIABLE m_cond;
+	size_t m_numTasks, m_nextTask, m_released;
+	bool m_aborted;
+	std::vector<Slot*> m_slots;
+	std::vector<bool> m_ready;
+};
 
 /////////////////////////////////////
-class CodecBench
+/// Runs the frames of live channels on a pool of workers. A channel is always in exactly one place: waiting for the
+/// release time of its next frame, due in the deque of a worker, or running on a worker. A worker keeps a channel that
+/// is already due again when its frame is done (it runs late) in its own deque. Due channels are served earliest
+/// deadline first: the deques are FIFO and a worker takes the earliest release of all deque fronts and released
+/// timers, so a late channel cannot starve the others. Taking from another worker's deque counts as a steal.
+class ChannelScheduler
 {
 public:
-	void init(int argc, char* argv[]);
-
-	void run();
+	ChannelScheduler(int numWorkers, size_t numChannels)
+		: m_active((LONG)numChannels)
+		, m_aborted(false)
+		, m_steals(0)
+	{
+		QueryPerformanceFrequency(&m_freq);
+		InitializeCriticalSection(&m_timerLock);
+		for (int i = 0; i < numWorkers; ++i)
+		{
+			m_queues.push_back(new Queue());
+			InitializeCriticalSection(&m_queues[i]->lock);
+		}
+	}
+
+	~ChannelScheduler()
+	{
+		for (size_t i = 0; i < m_queues.size(); ++i)
+		{
+			DeleteCriticalSection(&m_queues[i]->lock);
+			delete m_queues[i];
+		}
+		DeleteCriticalSection(&m_timerLock);
+	}
+
+	/// The next frame of channel is released at releaseCounts (QueryPerformanceCounter), now is the current time
+	void schedule(int worker, size_t channel, int64_t releaseCounts, int64_t now)
+	{
+		if (releaseCounts <= now)
+		{
+			Queue& queue = *m_queues[worker];
+			EnterCriticalSection(&queue.lock);
+			queue.channels.push_back(std::make_pair(releaseCounts, channel));
+			LeaveCriticalSection(&queue.lock);
+			return;
+		}
+		EnterCriticalSection(&m_timerLock);
+		m_timers.push_back(std::make_pair(releaseCounts, channel));
+		std::push_heap(m_timers.begin(), m_timers.end(), std::greater<Entry>());
+		LeaveCriticalSection(&m_timerLock);
+	}
+
+	/// Worker: waits for a due channel. Returns false when all channels finished or after abort().
+	bool next(int worker, size_t& channel)
+	{
+		for (;;)
+		{
+			if (m_aborted || m_active <= 0)
+				return false;
+
+			// Oldest due channel of every deque, the own one wins ties (its frame data is the most likely to be cached)
+			bool found = false;
+			Entry best;
+			size_t bestQueue = 0;
+			for (size_t i = 0; i < m_queues.size(); ++i)
+			{
+				size_t index = (worker + i) % m_queues.size();
+				Entry front;
+				if (peekFront(*m_queues[index], front) && (!found || front.first < best.first))
+				{
+					found = true;
+					best = front;
+					bestQueue = index;
+				}
+			}
+
+			// A released timer with an earlier deadline goes first
+			LARGE_INTEGER now;
+			QueryPerformanceCounter(&now);
+			bool released = false, soon = false;
+			EnterCriticalSection(&m_timerLock);
+			if (!m_timers.empty())
+			{
+				int64_t wait = m_timers.front().first - now.QuadPart;
+				released = wait <= 0 && (!found || m_timers.front().first < best.first);
+				soon = wait < m_freq.QuadPart / 500;
+				if (released)
+				{
+					channel = m_timers.front().second;
+					std::pop_heap(m_timers.begin(), m_timers.end(), std::greater<Entry>());
+					m_timers.pop_back();
+				}
+			}
+			LeaveCriticalSection(&m_timerLock);
+			if (released)
+				return true;
+
+			// Another worker may have taken it in the meantime, then look again
+			if (found)
+			{
+				if (popFront(*m_queues[bestQueue], best, channel))
+				{
+					if (bestQueue != (size_t)worker)
+						InterlockedIncrement(&m_steals);
+					return true;
+				}
+				continue;
+			}
+
+			// Sleep while the next release is more than 2 ms away, spin close to it
+			Sleep(soon ? 0 : 1);
+		}
+	}
+
+	/// Worker: channel has no more frames
+	void finish()
+	{
+		InterlockedDecrement(&m_active);
+	}
+
+	/// Stops all workers
+	void abort()
+	{
+		m_aborted = true;
+	}
+
+	/// Channels a worker took from another worker's deque
+	LONG steals() const
+	{
+		return m_steals;
+	}
 
 private:
-	void initArguments(int argc, char* argv[]);
+	typedef std::pair<int64_t, size_t> Entry; // release time, channel
 
-	void initInput();
+	struct Queue
+	{
+		CRITICAL_SECTION lock;
+		std::deque<Entry> channels; // in release order
+	};
 
-	void initOutput();
+	static bool peekFront(Queue& queue, Entry& entry)
+	{
+		EnterCriticalSection(&queue.lock);
+		bool ok = !queue.channels.empty();
+		if (ok)
+			entry = queue.channels.front();
+		LeaveCriticalSection(&queue.lock);
+		return ok;
+	}
 
-	bool         m_rawin, m_rawout, m_decompress, m_compress;
-	const char  *m_infile, *m_outfile, *m_decompFormat;
-	int          m_decompWidth, m_decompHeight, m_framesToProcess, m_loopCount;
-	VideoReader  m_videoReader;
-	VideoWriter  m_videoWriter;
-	Decompressor m_decompressor;
-	Compressor   m_compressor;
-	BitmapInfoHeader m_formatDecompressed;
-	BitmapInfoHeader m_formatCompressed;
+	/// Pops the front if it is still expected
+	static bool popFront(Queue& queue, const Entry& expected, size_t& channel)
+	{
+		EnterCriticalSection(&queue.lock);
+		bool ok = !queue.channels.empty() && queue.channels.front() == expected;
+		if (ok)
+		{
+			channel = expected.second;
+			queue.channels.pop_front();
+		}
+		LeaveCriticalSection(&queue.lock);
+		return ok;
+	}
 
-	// ---
+	LARGE_INTEGER m_freq;
+	std::vector<Queue*> m_queues;
+	CRITICAL_SECTION m_timerLock;
+	std::vector<Entry> m_timers; // a min-heap
+	volatile LONG m_active;
+	volatile bool m_aborted;
+	volatile LONG m_steals;
+};
+
+/////////////////////////////////////
+class ArgvParser
+{
+public:
+	ArgvParser(int argc, char* argv[])
+	{
+		char* lastarg = 0;
+		for (int i = 1; i < argc; ++i)
+		{
+			if (argv[i][0] == '-')
+			{
+				lastarg = argv[i];
+				argmap[lastarg] = 0;
+			}
+			else if (lastarg) // param of an arg
+			{
+				argmap[lastarg] = argv[i];
+				lastarg = 0;
+			}
+			else // global (switchless) ordered arg
+			{
+				arglist.push_back(argv[i]);
+			}
+		}
+	}
+
+	bool hasArg(const std::string& arg, bool allowParam = false)
+	{
+		ArgMap::const_iterator it = argmap.find(arg);
+		if (it == argmap.end())
+			return false;
+		else if (!allowParam && it->second)
+			throw std::runtime_error("ERROR: '" + arg + "' does not accept arguments");
+		return true;
+	}
+
+	/// Throws an exception if arg was given on the command line but without value
+	/// Returns defVal if arg was not given at all
+	const char* getArg(const std::string& arg, const char* defVal) const
+	{
+		ArgMap::const_iterator it = argmap.find(arg);
+		if (it == argmap.end())
+			return defVal;
+		if (!it->second)
+			throw std::runtime_error("ERROR: Missing argument for option '" + arg + "'");
+		return it->second;
+	}
+
+	typedef std::map<std::string, char*> ArgMap;
+	typedef std::vector<char*> ArgList;
+	ArgMap argmap;
+	ArgList arglist;
+};
+
+void printfcc(char* buf, DWORD fcc, int bpp)
+{
+	if (isprint(fcc & 0xFF) && isprint((fcc >> 8) & 0xFF) && isprint((fcc >> 16) & 0xFF) && isprint((fcc >> 24) & 0xFF))
+	{
+		*(DWORD*)(buf) = fcc;
+		buf[4] = '\0';
+	}
+	else if (fcc == 0)
+	{
+		sprintf(buf, "RGB%d", bpp);
+	}
+	else
+	{
+		sprintf(buf, "0x%08lX", fcc);
+	}
+}
+
+void PrintBitmapInfo(BITMAPINFOHEADER* biFormat)
+{
+	char fccstr[32];
+	printfcc(fccstr, biFormat->biCompression, biFormat->biBitCount);
+	printf("%ld x %ld [%s] %d bpp", biFormat->biWidth, biFormat->biHeight, fccstr, biFormat->biBitCount);
+}
+
+template <int ALIGN, typename T>
+T align_to(T val)
+{
+	return (T)((uintptr_t(val) + ALIGN - 1) / ALIGN * ALIGN);
+}
+
+void GetDecompFormat(const char* format, int width, int height, BITMAPINFOHEADER* biFormatOut)
+{
+	memset(biFormatOut, 0, sizeof(BITMAPINFOHEADER));
+	biFormatOut->biSize = sizeof(BITMAPINFOHEADER);
+	biFormatOut->biWidth = width;
+	biFormatOut->biHeight = height;
+	biFormatOut->biPlanes = 1;
+
+	if (strcmp(format, "RGB24") == 0 || strcmp(format, "bgr24") == 0) {
+		biFormatOut->biBitCount = 24;
+		biFormatOut->biCompression = BI_RGB;
+		biFormatOut->biSizeImage = align_to<4>(biFormatOut->biWidth * 3) * abs(biFormatOut->biHeight);
+	}
+	else if (strcmp(format, "RGB32") == 0 || strcmp(format, "bgr32") == 0) {
+		biFormatOut->biBitCount = 32;
+		biFormatOut->biCompression = BI_RGB;
+		biFormatOut->biSizeImage = biFormatOut->biWidth * 4 * abs(biFormatOut->biHeight);
+	}
+	else if (strcmp(format, "BGRA") == 0) {
+		biFormatOut->biBitCount = 32;
+		biFormatOut->biCompression = mmioFOURCC('B','G','R','A');
+		biFormatOut->biSizeImage = biFormatOut->biWidth * 4 * abs(biFormatOut->biHeight);
+	}
+	else if (strcmp(format, "AYUV") == 0) {
+		biFormatOut->biBitCount = 32;
+		biFormatOut->biCompression = mmioFOURCC('A','Y','U','V');
+		biFormatOut->biSizeImage = biFormatOut->biWidth * 4 * abs(biFormatOut->biHeight);
+	}
+	else if (strcmp(format, "YUY2") == 0) {
+		biFormatOut->biBitCount = 16;
+		biFormatOut->biCompression = mmioFOURCC('Y','U','Y','2');
+		biFormatOut->biSizeImage = biFormatOut->biWidth * 2 * abs(biFormatOut->biHeight);
+	}
+	else if (strcmp(format, "UYVY") == 0) {
+		biFormatOut->biBitCount = 16;
+		biFormatOut->biCompression = mmioFOURCC('U','Y','V','Y');
+		biFormatOut->biSizeImage = biFormatOut->biWidth * 2 * abs(biFormatOut->biHeight);
+	}
+	else if (strcmp(format, "YV12") == 0) {
+		biFormatOut->biBitCount = 12;
+		biFormatOut->biCompression = mmioFOURCC('Y','V','1','2');
+		biFormatOut->biSizeImage = biFormatOut->biWidth * abs(biFormatOut->biHeight) * 3 / 2;
+	}
+	else if (strcmp(format, "YV24") == 0) {
+		biFormatOut->biBitCount = 24;
+		biFormatOut->biCompression = mmioFOURCC('Y','V','2','4');
+		biFormatOut->biSizeImage = biFormatOut->biWidth * abs(biFormatOut->biHeight) * 3;
+	}
+	else if (strcmp(format, "Y8") == 0) {
+		biFormatOut->biBitCount = 8;
+		biFormatOut->biCompression = mmioFOURCC('Y','8',' ',' ');
+		biFormatOut->biSizeImage = biFormatOut->biWidth * abs(biFormatOut->biHeight);
+	}
+	else if (strcmp(format, "b64a") == 0) {
+		biFormatOut->biBitCount = 64;
+		biFormatOut->biCompression = mmioFOURCC('b','6','4','a');
+		biFormatOut->biSizeImage = biFormatOut->biWidth * 8 * abs(biFormatOut->biHeight);
+	}
+	else if (strcmp(format, "b48r") == 0) {
+		biFormatOut->biBitCount = 48;
+		biFormatOut->biCompression = mmioFOURCC('b','4','8','r');
+		biFormatOut->biSizeImage = biFormatOut->biWidth * 6 * abs(biFormatOut->biHeight);
+	}
+	else if (strcmp(format, "v210") == 0) {
+		biFormatOut->biBitCount = 20;
+		biFormatOut->biCompression = mmioFOURCC('v','2','1','0');
+		biFormatOut->biSizeImage = (biFormatOut->biWidth + 47) / 48 * 128 * abs(biFormatOut->biHeight);
+	}
+	else if (strcmp(format, "r210") == 0) {
+		biFormatOut->biBitCount = 30;
+		biFormatOut->biCompression = mmioFOURCC('r','2','1','0');
+		biFormatOut->biSizeImage = (biFormatOut->biWidth + 63) / 64 * 256 * abs(biFormatOut->biHeight);
+	}
+	else {
+		throw std::runtime_error(std::string("Invalid requested decompressed format: ") + format);
+	}
+}
+
+/// Frame size of an uncompressed format at its biWidth x biHeight: DIB rows for BI_RGB, the GetDecompFormat() layouts
+/// for the FOURCC formats (packed rows without padding for the ones it does not know)
+uint32_t GetImageSize(const BITMAPINFOHEADER* format)
+{
+	uint32_t width = format->biWidth, height = abs(format->biHeight);
+	switch (format->biCompression)
+	{
+	case BI_RGB:
+		return align_to<4>((width * format->biBitCount + 7) / 8) * height;
+	case mmioFOURCC('v','2','1','0'):
+		return (width + 47) / 48 * 128 * height;
+	case mmioFOURCC('r','2','1','0'):
+		return (width + 63) / 64 * 256 * height;
+	default:
+		return (uint32_t)((uint64_t)width * height * format->biBitCount / 8);
+	}
+}
+
+/////////////////////////////////////
+/// Format independent picture: 4:4:4 planes of 16-bit samples, component 0..2 are Y, U, V for the YUV formats
+/// and R, G, B for the RGB formats, component 3 is alpha. PackPixels() stores it in any GetDecompFormat() format,
+/// using the top bits of each sample and averaging the chroma of subsampled formats. UnpackPixels() reads it back
+/// (subsampled chroma is repeated) and sets the format's number of planes and bit depth.
+struct PixelPlanes
+{
+	PixelPlanes(int width = 0, int height = 0)
+		: numPlanes(4)
+		, bits(16)
+		, yuv(false)
+	{
+		resize(width, height);
+	}
+
+	void resize(int width, int height)
+	{
+		this->width = width;
+		this->height = height;
+		for (int c = 0; c < 4; ++c)
+			planes[c].resize((size_t)width * height);
+	}
+
+	uint16_t& at(int c, int x, int y)
+	{
+		return planes[c][(size_t)y * width + x];
+	}
+
+	uint16_t at(int c, int x, int y) const
+	{
+		return planes[c][(size_t)y * width + x];
+	}
+
+	/// Average of pixel (x, y) and its right neighbour (for 4:2:2), or of the 2x2 block (for 4:2:0)
+	uint16_t chroma422(int c, int x, int y) const
+	{
+		int x1 = std::min(x + 1, width - 1);
+		return (at(c, x, y) + at(c, x1, y) + 1) >> 1;
+	}
+
+	uint16_t chroma420(int c, int x, int y) const
+	{
+		int y1 = std::min(y + 1, height - 1);
+		return (chroma422(c, x, y) + chroma422(c, x, y1) + 1) >> 1;
+	}
+
+	int width, height;
+	int numPlanes;  // components that carry data: 1 (Y8), 3 or 4 (with alpha)
+	int bits;       // significant bits of the format's samples: 8, 10 or 16
+	bool yuv;
+	std::vector<uint16_t> planes[4];
+};
+
+static inline void StoreBE16(char* dst, uint16_t v)
+{
+	dst[0] = (char)(v >> 8);
+	dst[1] = (char)v;
+}
+
+static inline void StoreLE32(char* dst, uint32_t v)
+{
+	memcpy(dst, &v, 4);
+}
+
+void PackPixels(const PixelPlanes& src, const BITMAPINFOHEADER* format, char* dst)
+{
+	const int w = src.width, h = src.height;
+	const DWORD fcc = format->biCompression;
+	memset(dst, 0, format->biSizeImage);
+
+	if (fcc == BI_RGB || fcc == mmioFOURCC('B','G','R','A'))
+	{
+		// Bottom-up rows of B, G, R(, A)
+		int bytesPerPixel = format->biBitCount / 8;
+		size_t stride = bytesPerPixel == 3 ? align_to<4>(w * 3) : (size_t)w * 4;
+		for (int y = 0; y < h; ++y)
+		{
+			char* row = dst + (size_t)(format->biHeight > 0 ? h - 1 - y : y) * stride;
+			for (int x = 0; x < w; ++x)
+			{
+				char* p = row + x * bytesPerPixel;
+				p[0] = src.at(2, x, y) >> 8;
+				p[1] = src.at(1, x, y) >> 8;
+				p[2] = src.at(0, x, y) >> 8;
+				if (bytesPerPixel == 4)
+					p[3] = src.at(3, x, y) >> 8;
+			}
+		}
+	}
+	else if (fcc == mmioFOURCC('A','Y','U','V'))
+	{
+		for (int y = 0; y < h; ++y)
+		{
+			for (int x = 0; x < w; ++x)
+			{
+				char* p = dst + ((size_t)y * w + x) * 4;
+				p[0] = src.at(2, x, y) >> 8;
+				p[1] = src.at(1, x, y) >> 8;
+				p[2] = src.at(0, x, y) >> 8;
+				p[3] = src.at(3, x, y) >> 8;
+			}
+		}
+	}
+	else if (fcc == mmioFOURCC('Y','U','Y','2') || fcc == mmioFOURCC('U','Y','V','Y'))
+	{
+		// Byte order Y0 U Y1 V, or U Y0 V Y1
+		int yPos = fcc == mmioFOURCC('Y','U','Y','2') ? 0 : 1;
+		for (int y = 0; y < h; ++y)
+		{
+			for (int x = 0; x < w; x += 2)
+			{
+				char* p = dst + ((size_t)y * w + x) * 2;
+				p[yPos]     = src.at(0, x, y) >> 8;
+				p[1 - yPos] = src.chroma422(1, x, y) >> 8;
+				if (x + 1 < w)
+				{
+					p[2 + yPos] = src.at(0, x + 1, y) >> 8;
+					p[3 - yPos] = src.chroma422(2, x, y) >> 8;
+				}
+			}
+		}
+	}
+	else if (fcc == mmioFOURCC('Y','V','1','2') || fcc == mmioFOURCC('Y','V','2','4') || fcc == mmioFOURCC('Y','8',' ',' '))
+	{
+		// Y plane, then the V and U planes (half resolution in both directions for YV12)
+		for (int y = 0; y < h; ++y)
+			for (int x = 0; x < w; ++x)
+				dst[(size_t)y * w + x] = src.at(0, x, y) >> 8;
+		char* plane = dst + (size_t)w * h;
+		if (fcc == mmioFOURCC('Y','V','2','4'))
+		{
+			for (int c = 2; c >= 1; --c, plane += (size_t)w * h)
+				for (int y = 0; y < h; ++y)
+					for (int x = 0; x < w; ++x)
+						plane[(size_t)y * w + x] = src.at(c, x, y) >> 8;
+		}
+		else if (fcc == mmioFOURCC('Y','V','1','2'))
+		{
+			int cw = w / 2, ch = h / 2;
+			for (int c = 2; c >= 1; --c, plane += (size_t)cw * ch)
+				for (int y = 0; y < ch; ++y)
+					for (int x = 0; x < cw; ++x)
+						plane[(size_t)y * cw + x] = src.chroma420(c, x * 2, y * 2) >> 8;
+		}
+	}
+	else if (fcc == mmioFOURCC('b','6','4','a') || fcc == mmioFOURCC('b','4','8','r'))
+	{
+		// Big-endian 16-bit A, R, G, B or R, G, B
+		bool alpha = fcc == mmioFOURCC('b','6','4','a');
+		size_t pixelSize = alpha ? 8 : 6;
+		for (int y = 0; y < h; ++y)
+		{
+			for (int x = 0; x < w; ++x)
+			{
+				char* p = dst + ((size_t)y * w + x) * pixelSize;
+				if (alpha)
+				{
+					StoreBE16(p, src.at(3, x, y));
+					p += 2;
+				}
+				StoreBE16(p, src.at(0, x, y));
+				StoreBE16(p + 2, src.at(1, x, y));
+				StoreBE16(p + 4, src.at(2, x, y));
+			}
+		}
+	}
+	else if (fcc == mmioFOURCC('v','2','1','0'))
+	{
+		// 10-bit 4:2:2, 6 pixels in 4 little-endian words: Cb0 Y0 Cr0 | Y1 Cb1 Y2 | Cr1 Y3 Cb2 | Y4 Cr2 Y5
+		size_t stride = (size_t)(w + 47) / 48 * 128;
+		for (int y = 0; y < h; ++y)
+		{
+			char* row = dst + y * stride;
+			for (int x = 0; x < w; x += 6)
+			{
+				uint32_t s[12]; // Y0..Y5, Cb0..Cb2, Cr0..Cr2
+				for (int i = 0; i < 6; ++i)
+					s[i] = src.at(0, std::min(x + i, w - 1), y) >> 6;
+				for (int i = 0; i < 3; ++i)
+				{
+					int cx = std::min(x + i * 2, w - 1);
+					s[6 + i] = src.chroma422(1, cx, y) >> 6;
+					s[9 + i] = src.chroma422(2, cx, y) >> 6;
+				}
+				char* p = row + x / 6 * 16;
+				StoreLE32(p,      s[6]  | (s[0]  << 10) | (s[9]  << 20));
+				StoreLE32(p + 4,  s[1]  | (s[7]  << 10) | (s[2]  << 20));
+				StoreLE32(p + 8,  s[10] | (s[3]  << 10) | (s[8]  << 20));
+				StoreLE32(p + 12, s[4]  | (s[11] << 10) | (s[5]  << 20));
+			}
+		}
+	}
+	else if (fcc == mmioFOURCC('r','2','1','0'))
+	{
+		// Big-endian words of 2 padding bits and 10-bit R, G, B
+		size_t stride = (size_t)(w + 63) / 64 * 256;
+		for (int y = 0; y < h; ++y)
+		{
+			for (int x = 0; x < w; ++x)
+			{
+				uint32_t v = ((uint32_t)(src.at(0, x, y) >> 6) << 20) | ((uint32_t)(src.at(1, x, y) >> 6) << 10) | (src.at(2, x, y) >> 6);
+				char* p = dst + y * stride + x * 4;
+				p[0] = (char)(v >> 24);
+				p[1] = (char)(v >> 16);
+				p[2] = (char)(v >> 8);
+				p[3] = (char)v;
+			}
+		}
+	}
+	else
+	{
+		throw std::runtime_error("ERROR: Pixel packing is not supported for this format\n");
+	}
+}
+
+static inline uint16_t LoadBE16(const char* src)
+{
+	return (uint16_t)((uint8_t)src[0] << 8 | (uint8_t)src[1]);
+}
+
+static inline uint32_t LoadLE32(const char* src)
+{
+	uint32_t v;
+	memcpy(&v, src, 4);
+	return v;
+}
+
+void UnpackPixels(const BITMAPINFOHEADER* format, const char* src, PixelPlanes& dst)
+{
+	const int w = format->biWidth, h = abs(format->biHeight);
+	const DWORD fcc = format->biCompression;
+	dst.resize(w, h);
+	dst.numPlanes = 3;
+	dst.bits = 8;
+	dst.yuv = true;
+	std::fill(dst.planes[3].begin(), dst.planes[3].end(), 0xFFFF); // opaque unless the format has alpha
+
+	if (fcc == BI_RGB || fcc == mmioFOURCC('B','G','R','A'))
+	{
+		int bytesPerPixel = format->biBitCount / 8;
+		size_t stride = bytesPerPixel == 3 ? align_to<4>(w * 3) : (size_t)w * 4;
+		dst.numPlanes = fcc == BI_RGB ? 3 : 4;
+		dst.yuv = false;
+		for (int y = 0; y < h; ++y)
+		{
+			const char* row = src + (size_t)(format->biHeight > 0 ? h - 1 - y : y) * stride;
+			for (int x = 0; x < w; ++x)
+			{
+				const uint8_t* p = (const uint8_t*)row + x * bytesPerPixel;
+				dst.at(2, x, y) = p[0] << 8;
+				dst.at(1, x, y) = p[1] << 8;
+				dst.at(0, x, y) = p[2] << 8;
+				dst.at(3, x, y) = bytesPerPixel == 4 ? p[3] << 8 : 0xFF00;
+			}
+		}
+	}
+	else if (fcc == mmioFOURCC('A','Y','U','V'))
+	{
+		dst.numPlanes = 4;
+		for (int y = 0; y < h; ++y)
+		{
+			for (int x = 0; x < w; ++x)
+			{
+				const uint8_t* p = (const uint8_t*)src + ((size_t)y * w + x) * 4;
+				dst.at(2, x, y) = p[0] << 8;
+				dst.at(1, x, y) = p[1] << 8;
+				dst.at(0, x, y) = p[2] << 8;
+				dst.at(3, x, y) = p[3] << 8;
+			}
+		}
+	}
+	else if (fcc == mmioFOURCC('Y','U','Y','2') || fcc == mmioFOURCC('U','Y','V','Y'))
+	{
+		int yPos = fcc == mmioFOURCC('Y','U','Y','2') ? 0 : 1;
+		for (int y = 0; y < h; ++y)
+		{
+			for (int x = 0; x < w; ++x)
+			{
+				const uint8_t* p = (const uint8_t*)src + ((size_t)y * w + (x & ~1)) * 2;
+				dst.at(0, x, y) = p[x & 1 ? 2 + yPos : yPos] << 8;
+				dst.at(1, x, y) = p[1 - yPos] << 8;
+				dst.at(2, x, y) = (x | 1) < w ? p[3 - yPos] << 8 : 0x8000;
+			}
+		}
+	}
+	else if (fcc == mmioFOURCC('Y','V','1','2') || fcc == mmioFOURCC('Y','V','2','4') || fcc == mmioFOURCC('Y','8',' ',' '))
+	{
+		const uint8_t* luma = (const uint8_t*)src;
+		bool yv12 = fcc == mmioFOURCC('Y','V','1','2');
+		int cw = yv12 ? w / 2 : w, ch = yv12 ? h / 2 : h;
+		const uint8_t* planeV = luma + (size_t)w * h;
+		const uint8_t* planeU = planeV + (size_t)cw * ch;
+		dst.numPlanes = fcc == mmioFOURCC('Y','8',' ',' ') ? 1 : 3;
+		for (int y = 0; y < h; ++y)
+		{
+			for (int x = 0; x < w; ++x)
+			{
+				dst.at(0, x, y) = luma[(size_t)y * w + x] << 8;
+				if (dst.numPlanes == 1)
+				{
+					dst.at(1, x, y) = dst.at(2, x, y) = 0x8000;
+					continue;
+				}
+				int cx = std::min(yv12 ? x / 2 : x, cw - 1), cy = std::min(yv12 ? y / 2 : y, ch - 1);
+				bool inside = cx >= 0 && cy >= 0;
+				dst.at(1, x, y) = inside ? planeU[(size_t)cy * cw + cx] << 8 : 0x8000;
+				dst.at(2, x, y) = inside ? planeV[(size_t)cy * cw + cx] << 8 : 0x8000;
+			}
+		}
+	}
+	else if (fcc == mmioFOURCC('b','6','4','a') || fcc == mmioFOURCC('b','4','8','r'))
+	{
+		bool alpha = fcc == mmioFOURCC('b','6','4','a');
+		size_t pixelSize = alpha ? 8 : 6;
+		dst.numPlanes = alpha ? 4 : 3;
+		dst.bits = 16;
+		dst.yuv = false;
+		for (int y = 0; y < h; ++y)
+		{
+			for (int x = 0; x < w; ++x)
+			{
+				const char* p = src + ((size_t)y * w + x) * pixelSize;
+				dst.at(3, x, y) = alpha ? LoadBE16(p) : 0xFFFF;
+				if (alpha)
+					p += 2;
+				dst.at(0, x, y) = LoadBE16(p);
+				dst.at(1, x, y) = LoadBE16(p + 2);
+				dst.at(2, x, y) = LoadBE16(p + 4);
+			}
+		}
+	}
+	else if (fcc == mmioFOURCC('v','2','1','0'))
+	{
+		size_t stride = (size_t)(w + 47) / 48 * 128;
+		dst.bits = 10;
+		for (int y = 0; y < h; ++y)
+		{
+			const char* row = src + y * stride;
+			for (int x = 0; x < w; x += 6)
+			{
+				const char* p = row + x / 6 * 16;
+				uint32_t w0 = LoadLE32(p), w1 = LoadLE32(p + 4), w2 = LoadLE32(p + 8), w3 = LoadLE32(p + 12);
+				uint32_t s[12] = { // Y0..Y5, Cb0..Cb2, Cr0..Cr2
+					(w0 >> 10) & 0x3FF, w1 & 0x3FF, (w1 >> 20) & 0x3FF, (w2 >> 10) & 0x3FF, w3 & 0x3FF, (w3 >> 20) & 0x3FF,
+					w0 & 0x3FF, (w1 >> 10) & 0x3FF, (w2 >> 20) & 0x3FF,
+					(w0 >> 20) & 0x3FF, w2 & 0x3FF, (w3 >> 10) & 0x3FF };
+				for (int i = 0; i < 6 && x + i < w; ++i)
+				{
+					dst.at(0, x + i, y) = s[i] << 6;
+					dst.at(1, x + i, y) = s[6 + i / 2] << 6;
+					dst.at(2, x + i, y) = s[9 + i / 2] << 6;
+				}
+			}
+		}
+	}
+	else if (fcc == mmioFOURCC('r','2','1','0'))
+	{
+		size_t stride = (size_t)(w + 63) / 64 * 256;
+		dst.bits = 10;
+		dst.yuv = false;
+		for (int y = 0; y < h; ++y)
+		{
+			for (int x = 0; x < w; ++x)
+			{
+				const uint8_t* p = (const uint8_t*)src + y * stride + x * 4;
+				uint32_t v = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+				dst.at(0, x, y) = ((v >> 20) & 0x3FF) << 6;
+				dst.at(1, x, y) = ((v >> 10) & 0x3FF) << 6;
+				dst.at(2, x, y) = (v & 0x3FF) << 6;
+			}
+		}
+	}
+	else
+	{
+		throw std::runtime_error("ERROR: Pixel unpacking is not supported for this format\n");
+	}
+}
+
+/////////////////////////////////////
+/// Synthetic test pictures for -synthetic: noise, gradient, bars (both moving from frame to frame), or
+/// mix[:entropy], the moving gradient and bars with uniform noise blended in (entropy 0..1, default 0.1).
+/// The noise is a xorshift sequence seeded from the seed and the frame number, so frames are reproducible.
+class SyntheticPattern
+{
+public:
+	enum Type { NOISE, GRADIENT, BARS, MIX };
+
+	explicit SyntheticPattern(const char* spec, uint32_t seed = 1)
+		: m_seed(seed)
+		, m_entropy(0.1)
+	{
+		std::string name(spec);
+		size_t colon = name.find(':');
+		if (colon != std::string::npos)
+		{
+			m_entropy = atof(name.c_str() + colon + 1);
+			name.resize(colon);
+		}
+		if (name == "noise")
+			m_type = NOISE;
+		else if (name == "gradient")
+			m_type = GRADIENT;
+		else if (name == "bars")
+			m_type = BARS;
+		else if (name == "mix")
+			m_type = MIX;
+		else
+			throw std::runtime_error(std::string("ERROR: Invalid -synthetic pattern (expected noise, gradient, bars or mix[:entropy]): ") + spec);
+		if (m_entropy < 0 || m_entropy > 1 || (colon != std::string::npos && m_type != MIX))
+		{
+			throw std::runtime_error(std::string("ERROR: Invalid -synthetic entropy (mix:0..1): ") + spec);
+		}
+	}
+
+	void generate(int frameNum, PixelPlanes& out) const
+	{
+		// Bar colors (100% color bars) as R, G, B, the chroma of YUV formats gets the same ramps
+		static const uint16_t bars[8][3] = {
+			{ 0xFFFF, 0xFFFF, 0xFFFF }, { 0xFFFF, 0xFFFF, 0 }, { 0, 0xFFFF, 0xFFFF }, { 0, 0xFFFF, 0 },
+			{ 0xFFFF, 0, 0xFFFF }, { 0xFFFF, 0, 0 }, { 0, 0, 0xFFFF }, { 0, 0, 0 } };
+
+		uint64_t state = ((uint64_t)m_seed << 32 | (uint32_t)frameNum) * 0x9E3779B97F4A7C15ULL + 1;
+		uint32_t noise = (uint32_t)(m_entropy * 65536);
+		const int w = out.width, h = out.height;
+		for (int y = 0; y < h; ++y)
+		{
+			for (int x = 0; x < w; ++x)
+			{
+				uint32_t v[3];
+				if (m_type != NOISE)
+				{
+					int mx = x + frameNum * 4;
+					uint32_t gradient[3] = {
+						(uint32_t)(mx % w) * 65535 / std::max(w - 1, 1),
+						(uint32_t)y * 65535 / std::max(h - 1, 1),
+						(uint32_t)((mx + y) % (w + h)) * 65535 / (w + h) };
+					const uint16_t* bar = bars[(x + frameNum * 8) % w * 8 / w];
+					for (int c = 0; c < 3; ++c)
+					{
+						v[c] = m_type == GRADIENT ? gradient[c] : m_type == BARS ? bar[c] : (gradient[c] + bar[c]) / 2;
+					}
+				}
+				for (int c = 0; c < 3; ++c)
+				{
+					if (m_type == NOISE || m_type == MIX)
+					{
+						state ^= state << 13;
+						state ^= state >> 7;
+						state ^= state << 17;
+						uint32_t r = (uint32_t)(state >> 16) & 0xFFFF;
+						v[c] = m_type == NOISE ? r : (v[c] * (65536 - noise) + r * noise) >> 16;
+					}
+					out.at(c, x, y) = (uint16_t)v[c];
+				}
+				out.at(3, x, y) = 0xFFFF;
+			}
+		}
+	}
+
+	const char* name() const
+	{
+		static const char* names[] = { "noise", "gradient", "bars", "mix" };
+		return names[m_type];
+	}
+
+	double entropy() const
+	{
+		return m_type == MIX ? m_entropy : m_type == NOISE ? 1.0 : 0.0;
+	}
+
+private:
+	Type m_type;
+	uint32_t m_seed;
+	double m_entropy;
+};
+
+/////////////////////////////////////
+/// Comparison kernels for -verify on 16-bit planes, in C, SSE2 and AVX2 versions selected at runtime
+/// by CompareKernels::get(). SSIM uses non-overlapping 8x8 blocks, which is enough to rank encoders.
+struct CompareKernels
+{
+	/// Sum of squared differences of n samples
+	uint64_t (*sumSquaredDiff)(const uint16_t* a, const uint16_t* b, size_t n);
+
+	/// Sums of a, b, a*a, b*b and a*b over an 8x8 block (stride in samples)
+	void (*blockSums)(const uint16_t* a, const uint16_t* b, size_t stride, double sums[5]);
+
+	const char* name;
+
+	static const CompareKernels& get();
+};
+
+static uint64_t SumSquaredDiffC(const uint16_t* a, const uint16_t* b, size_t n)
+{
+	uint64_t sum = 0;
+	for (size_t i = 0; i < n; ++i)
+	{
+		int64_t d = (int)a[i] - (int)b[i];
+		sum += d * d;
+	}
+	return sum;
+}
+
+static void BlockSumsC(const uint16_t* a, const uint16_t* b, size_t stride, double sums[5])
+{
+	double sa = 0, sb = 0, saa = 0, sbb = 0, sab = 0;
+	for (int y = 0; y < 8; ++y, a += stride, b += stride)
+	{
+		for (int x = 0; x < 8; ++x)
+		{
+			double va = a[x], vb = b[x];
+			sa += va;
+			sb += vb;
+			saa += va * va;
+			sbb += vb * vb;
+			sab += va * vb;
+		}
+	}
+	sums[0] = sa; sums[1] = sb; sums[2] = saa; sums[3] = sbb; sums[4] = sab;
+}
+
+__attribute__((target("sse2")))
+static uint64_t SumSquaredDiffSSE2(const uint16_t* a, const uint16_t* b, size_t n)
+{
+	// |a - b| fits 16 bits unsigned, its square is formed in 64-bit lanes
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc = zero;
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8)
+	{
+		__m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+		__m128i d = _mm_or_si128(_mm_subs_epu16(va, vb), _mm_subs_epu16(vb, va));
+		__m128i lo = _mm_unpacklo_epi16(d, zero), hi = _mm_unpackhi_epi16(d, zero);
+		acc = _mm_add_epi64(acc, _mm_mul_epu32(lo, lo));
+		acc = _mm_add_epi64(acc, _mm_mul_epu32(_mm_srli_epi64(lo, 32), _mm_srli_epi64(lo, 32)));
+		acc = _mm_add_epi64(acc, _mm_mul_epu32(hi, hi));
+		acc = _mm_add_epi64(acc, _mm_mul_epu32(_mm_srli_epi64(hi, 32), _mm_srli_epi64(hi, 32)));
+	}
+	uint64_t lanes[2];
+	_mm_storeu_si128((__m128i*)lanes, acc);
+	return lanes[0] + lanes[1] + SumSquaredDiffC(a + i, b + i, n - i);
+}
+
+/// Adds the 32-bit unsigned lanes of p to the two 64-bit lanes of acc
+__attribute__((target("sse2")))
+static inline __m128i AddEpu32ToEpi64(__m128i acc, __m128i p)
+{
+	const __m128i zero = _mm_setzero_si128();
+	return _mm_add_epi64(_mm_add_epi64(acc, _mm_unpacklo_epi32(p, zero)), _mm_unpackhi_epi32(p, zero));
+}
+
+__attribute__((target("sse2")))
+static void BlockSumsSSE2(const uint16_t* a, const uint16_t* b, size_t stride, double sums[5])
+{
+	// Exact integer sums like BlockSumsC: the 16x16-bit products are formed from their low and high halves and
+	// summed in 64-bit lanes (saa reaches 2.7e11 for 16-bit planes), sa and sb fit 32 bits
+	const __m128i zero = _mm_setzero_si128();
+	__m128i sa = zero, sb = zero, saa = zero, sbb = zero, sab = zero;
+	for (int y = 0; y < 8; ++y, a += stride, b += stride)
+	{
+		__m128i va = _mm_loadu_si128((const __m128i*)a), vb = _mm_loadu_si128((const __m128i*)b);
+		sa = _mm_add_epi32(sa, _mm_add_epi32(_mm_unpacklo_epi16(va, zero), _mm_unpackhi_epi16(va, zero)));
+		sb = _mm_add_epi32(sb, _mm_add_epi32(_mm_unpacklo_epi16(vb, zero), _mm_unpackhi_epi16(vb, zero)));
+		__m128i lo = _mm_mullo_epi16(va, va), hi = _mm_mulhi_epu16(va, va);
+		saa = AddEpu32ToEpi64(AddEpu32ToEpi64(saa, _mm_unpacklo_epi16(lo, hi)), _mm_unpackhi_epi16(lo, hi));
+		lo = _mm_mullo_epi16(vb, vb);
+		hi = _mm_mulhi_epu16(vb, vb);
+		sbb = AddEpu32ToEpi64(AddEpu32ToEpi64(sbb, _mm_unpacklo_epi16(lo, hi)), _mm_unpackhi_epi16(lo, hi));
+		lo = _mm_mullo_epi16(va, vb);
+		hi = _mm_mulhi_epu16(va, vb);
+		sab = AddEpu32ToEpi64(AddEpu32ToEpi64(sab, _mm_unpacklo_epi16(lo, hi)), _mm_unpackhi_epi16(lo, hi));
+	}
+	uint32_t lanes32[8];
+	_mm_storeu_si128((__m128i*)lanes32, sa);
+	_mm_storeu_si128((__m128i*)(lanes32 + 4), sb);
+	sums[0] = (double)lanes32[0] + lanes32[1] + lanes32[2] + lanes32[3];
+	sums[1] = (double)lanes32[4] + lanes32[5] + lanes32[6] + lanes32[7];
+	__m128i v[3] = { saa, sbb, sab };
+	for (int k = 0; k < 3; ++k)
+	{
+		uint64_t lanes[2];
+		_mm_storeu_si128((__m128i*)lanes, v[k]);
+		sums[2 + k] = (double)(lanes[0] + lanes[1]);
+	}
+}
+
+__attribute__((target("avx2")))
+static uint64_t SumSquaredDiffAVX2(const uint16_t* a, const uint16_t* b, size_t n)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i acc = zero;
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16)
+	{
+		__m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+		__m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+		__m256i d = _mm256_or_si256(_mm256_subs_epu16(va, vb), _mm256_subs_epu16(vb, va));
+		__m256i lo = _mm256_unpacklo_epi16(d, zero), hi = _mm256_unpackhi_epi16(d, zero);
+		acc = _mm256_add_epi64(acc, _mm256_mul_epu32(lo, lo));
+		acc = _mm256_add_epi64(acc, _mm256_mul_epu32(_mm256_srli_epi64(lo, 32), _mm256_srli_epi64(lo, 32)));
+		acc = _mm256_add_epi64(acc, _mm256_mul_epu32(hi, hi));
+		acc = _mm256_add_epi64(acc, _mm256_mul_epu32(_mm256_srli_epi64(hi, 32), _mm256_srli_epi64(hi, 32)));
+	}
+	uint64_t lanes[4];
+	_mm256_storeu_si256((__m256i*)lanes, acc);
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] + SumSquaredDiffC(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void BlockSumsAVX2(const uint16_t* a, const uint16_t* b, size_t stride, double sums[5])
+{
+	// Exact integer sums as in BlockSumsSSE2, the products fit 32 bits unsigned
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i sa = zero, sb = zero, saa = zero, sbb = zero, sab = zero;
+	for (int y = 0; y < 8; ++y, a += stride, b += stride)
+	{
+		__m256i va = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)a));
+		__m256i vb = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)b));
+		sa = _mm256_add_epi32(sa, va);
+		sb = _mm256_add_epi32(sb, vb);
+		__m256i p[3] = { _mm256_mullo_epi32(va, va), _mm256_mullo_epi32(vb, vb), _mm256_mullo_epi32(va, vb) };
+		__m256i* acc[3] = { &saa, &sbb, &sab };
+		for (int k = 0; k < 3; ++k)
+		{
+			*acc[k] = _mm256_add_epi64(*acc[k], _mm256_unpacklo_epi32(p[k], zero));
+			*acc[k] = _mm256_add_epi64(*acc[k], _mm256_unpackhi_epi32(p[k], zero));
+		}
+	}
+	uint32_t lanes32[16];
+	_mm256_storeu_si256((__m256i*)lanes32, sa);
+	_mm256_storeu_si256((__m256i*)(lanes32 + 8), sb);
+	uint32_t suma = 0, sumb = 0;
+	for (int i = 0; i < 8; ++i)
+	{
+		suma += lanes32[i];
+		sumb += lanes32[8 + i];
+	}
+	sums[0] = suma;
+	sums[1] = sumb;
+	__m256i v[3] = { saa, sbb, sab };
+	for (int k = 0; k < 3; ++k)
+	{
+		uint64_t lanes[4];
+		_mm256_storeu_si256((__m256i*)lanes, v[k]);
+		sums[2 + k] = (double)(lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+	}
+}
+
+const CompareKernels& CompareKernels::get()
+{
+	static const CompareKernels c    = { SumSquaredDiffC, BlockSumsC, "c" };
+	static const CompareKernels sse2 = { SumSquaredDiffSSE2, BlockSumsSSE2, "sse2" };
+	static const CompareKernels avx2 = { SumSquaredDiffAVX2, BlockSumsAVX2, "avx2" };
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return sse2;
+	return c;
+}
+
+/////////////////////////////////////
+/// Whether the GetDecompFormat() format stores Y, U, V (else R, G, B)
+bool IsYuvFormat(const BITMAPINFOHEADER* format)
+{
+	DWORD fcc = format->biCompression;
+	return fcc == mmioFOURCC('A','Y','U','V') || fcc == mmioFOURCC('Y','U','Y','2') || fcc == mmioFOURCC('U','Y','V','Y') ||
+		fcc == mmioFOURCC('Y','V','1','2') || fcc == mmioFOURCC('Y','V','2','4') || fcc == mmioFOURCC('Y','8',' ',' ') ||
+		fcc == mmioFOURCC('v','2','1','0');
+}
+
+/// Converts the planes between R, G, B and limited range BT.601 Y, U, V
+void ConvertColors(PixelPlanes& planes, bool toYuv)
+{
+	size_t n = (size_t)planes.width * planes.height;
+	uint16_t* p0 = &planes.planes[0][0];
+	uint16_t* p1 = &planes.planes[1][0];
+	uint16_t* p2 = &planes.planes[2][0];
+	for (size_t i = 0; i < n; ++i)
+	{
+		double a = p0[i] / 65535.0, b = p1[i] / 65535.0, c = p2[i] / 65535.0;
+		double o[3];
+		if (toYuv)
+		{
+			o[0] = (16.0 + 65.481 * a + 128.553 * b + 24.966 * c) / 255.0;
+			o[1] = (128.0 - 37.797 * a - 74.203 * b + 112.0 * c) / 255.0;
+			o[2] = (128.0 + 112.0 * a - 93.786 * b - 18.214 * c) / 255.0;
+		}
+		else
+		{
+			double y = (a * 255.0 - 16.0) * 1.164383, u = b * 255.0 - 128.0, v = c * 255.0 - 128.0;
+			o[0] = (y + 1.596027 * v) / 255.0;
+			o[1] = (y - 0.391762 * u - 0.812968 * v) / 255.0;
+			o[2] = (y + 2.017232 * u) / 255.0;
+		}
+		p0[i] = (uint16_t)(std::min(std::max(o[0], 0.0), 1.0) * 65535.0 + 0.5);
+		p1[i] = (uint16_t)(std::min(std::max(o[1], 0.0), 1.0) * 65535.0 + 0.5);
+		p2[i] = (uint16_t)(std::min(std::max(o[2], 0.0), 1.0) * 65535.0 + 0.5);
+	}
+	planes.yuv = toYuv;
+}
+
+/// YUY2 <-> UYVY: swaps the bytes of every 16-bit word
+__attribute__((target("sse2")))
+static void ConvertSwap422SSE2(const char* src, char* dst, int width, int height)
+{
+	size_t size = (size_t)width * 2 * height, i = 0;
+	for (; i + 16 <= size; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+	}
+	for (; i + 1 < size; i += 2)
+	{
+		dst[i] = src[i + 1];
+		dst[i + 1] = src[i];
+	}
+}
+
+/// YUY2 (Y_POS 0) or UYVY (Y_POS 1) -> YV12, the chroma of each pair of rows is averaged
+template <int Y_POS>
+__attribute__((target("sse2")))
+static void ConvertPacked422ToYV12SSE2(const char* src, char* dst, int width, int height)
+{
+	const int cw = width / 2, ch = height / 2;
+	uint8_t* lumaOut = (uint8_t*)dst;
+	uint8_t* vOut = lumaOut + (size_t)width * height;
+	uint8_t* uOut = vOut + (size_t)cw * ch;
+	const __m128i mask = _mm_set1_epi16(0x00FF), zero = _mm_setzero_si128();
+	for (int y = 0; y < height; y += 2)
+	{
+		const uint8_t* row0 = (const uint8_t*)src + (size_t)y * width * 2;
+		const uint8_t* row1 = y + 1 < height ? row0 + (size_t)width * 2 : row0;
+		uint8_t* luma0 = lumaOut + (size_t)y * width;
+		uint8_t* luma1 = y + 1 < height ? luma0 + width : NULL;
+		bool chroma = y / 2 < ch;
+		int x = 0;
+		for (; x + 16 <= width; x += 16)
+		{
+			__m128i a0 = _mm_loadu_si128((const __m128i*)(row0 + x * 2)), a1 = _mm_loadu_si128((const __m128i*)(row0 + x * 2 + 16));
+			__m128i b0 = _mm_loadu_si128((const __m128i*)(row1 + x * 2)), b1 = _mm_loadu_si128((const __m128i*)(row1 + x * 2 + 16));
+			__m128i ya, yb, ca, cb;
+			if (Y_POS == 0)
+			{
+				ya = _mm_packus_epi16(_mm_and_si128(a0, mask), _mm_and_si128(a1, mask));
+				yb = _mm_packus_epi16(_mm_and_si128(b0, mask), _mm_and_si128(b1, mask));
+				ca = _mm_packus_epi16(_mm_srli_epi16(a0, 8), _mm_srli_epi16(a1, 8));
+				cb = _mm_packus_epi16(_mm_srli_epi16(b0, 8), _mm_srli_epi16(b1, 8));
+			}
+			else
+			{
+				ya = _mm_packus_epi16(_mm_srli_epi16(a0, 8), _mm_srli_epi16(a1, 8));
+				yb = _mm_packus_epi16(_mm_srli_epi16(b0, 8), _mm_srli_epi16(b1, 8));
+				ca = _mm_packus_epi16(_mm_and_si128(a0, mask), _mm_and_si128(a1, mask));
+				cb = _mm_packus_epi16(_mm_and_si128(b0, mask), _mm_and_si128(b1, mask));
+			}
+			_mm_storeu_si128((__m128i*)(luma0 + x), ya);
+			if (luma1)
+				_mm_storeu_si128((__m128i*)(luma1 + x), yb);
+			if (chroma)
+			{
+				__m128i uv = _mm_avg_epu8(ca, cb); // U0 V0 U1 V1 ...
+				_mm_storel_epi64((__m128i*)(uOut + (size_t)(y / 2) * cw + x / 2), _mm_packus_epi16(_mm_and_si128(uv, mask), zero));
+				_mm_storel_epi64((__m128i*)(vOut + (size_t)(y / 2) * cw + x / 2), _mm_packus_epi16(_mm_srli_epi16(uv, 8), zero));
+			}
+		}
+		for (; x < width; ++x)
+		{
+			luma0[x] = row0[x * 2 + Y_POS];
+			if (luma1)
+				luma1[x] = row1[x * 2 + Y_POS];
+			if (chroma && !(x & 1) && x / 2 < cw)
+			{
+				const uint8_t* c0 = row0 + x * 2 + 1 - Y_POS;
+				const uint8_t* c1 = row1 + x * 2 + 1 - Y_POS;
+				uOut[(size_t)(y / 2) * cw + x / 2] = (c0[0] + c1[0] + 1) >> 1;
+				vOut[(size_t)(y / 2) * cw + x / 2] = (c0[2] + c1[2] + 1) >> 1;
+			}
+		}
+	}
+}
+
+/// YV12 -> YUY2 (Y_POS 0) or UYVY (Y_POS 1), each chroma row is used for two rows
+template <int Y_POS>
+__attribute__((target("sse2")))
+static void ConvertYV12ToPacked422SSE2(const char* src, char* dst, int width, int height)
+{
+	const int cw = width / 2, ch = height / 2;
+	const uint8_t* lumaIn = (const uint8_t*)src;
+	const uint8_t* vIn = lumaIn + (size_t)width * height;
+	const uint8_t* uIn = vIn + (size_t)cw * ch;
+	for (int y = 0; y < height; ++y)
+	{
+		const uint8_t* luma = lumaIn + (size_t)y * width;
+		int cy = std::min(y / 2, ch - 1);
+		const uint8_t* u = uIn + (size_t)cy * cw;
+		const uint8_t* v = vIn + (size_t)cy * cw;
+		uint8_t* out = (uint8_t*)dst + (size_t)y * width * 2;
+		int x = 0;
+		for (; cy >= 0 && x + 16 <= width && x / 2 + 8 <= cw; x += 16)
+		{
+			__m128i yv = _mm_loadu_si128((const __m128i*)(luma + x));
+			__m128i uv = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(u + x / 2)), _mm_loadl_epi64((const __m128i*)(v + x / 2)));
+			if (Y_POS == 0)
+			{
+				_mm_storeu_si128((__m128i*)(out + x * 2), _mm_unpacklo_epi8(yv, uv));
+				_mm_storeu_si128((__m128i*)(out + x * 2 + 16), _mm_unpackhi_epi8(yv, uv));
+			}
+			else
+			{
+				_mm_storeu_si128((__m128i*)(out + x * 2), _mm_unpacklo_epi8(uv, yv));
+				_mm_storeu_si128((__m128i*)(out + x * 2 + 16), _mm_unpackhi_epi8(uv, yv));
+			}
+		}
+		for (; x < width; ++x)
+		{
+			int cx = std::min(x / 2, cw - 1);
+			bool inside = cx >= 0 && cy >= 0;
+			out[x * 2 + Y_POS] = luma[x];
+			out[x * 2 + 1 - Y_POS] = !inside ? 0x80 : (x & 1) ? v[cx] : u[cx];
+		}
+	}
+}
+
+/// YUY2 (Y_POS 0) or UYVY (Y_POS 1) -> YV16 (planar 4:2:2: Y, then V and U of (width + 1) / 2 samples per row)
+template <int Y_POS>
+__attribute__((target("sse2")))
+static void ConvertPacked422ToYV16SSE2(const char* src, char* dst, int width, int height)
+{
+	const int cw = (width + 1) / 2;
+	uint8_t* lumaOut = (uint8_t*)dst;
+	uint8_t* vOut = lumaOut + (size_t)width * height;
+	uint8_t* uOut = vOut + (size_t)cw * height;
+	const __m128i mask = _mm_set1_epi16(0x00FF), zero = _mm_setzero_si128();
+	for (int y = 0; y < height; ++y)
+	{
+		const uint8_t* row = (const uint8_t*)src + (size_t)y * width * 2;
+		uint8_t* luma = lumaOut + (size_t)y * width;
+		uint8_t* u = uOut + (size_t)y * cw;
+		uint8_t* v = vOut + (size_t)y * cw;
+		int x = 0;
+		for (; x + 16 <= width; x += 16)
+		{
+			__m128i a0 = _mm_loadu_si128((const __m128i*)(row + x * 2)), a1 = _mm_loadu_si128((const __m128i*)(row + x * 2 + 16));
+			__m128i ya, uv; // uv: U0 V0 U1 V1 ...
+			if (Y_POS == 0)
+			{
+				ya = _mm_packus_epi16(_mm_and_si128(a0, mask), _mm_and_si128(a1, mask));
+				uv = _mm_packus_epi16(_mm_srli_epi16(a0, 8), _mm_srli_epi16(a1, 8));
+			}
+			else
+			{
+				ya = _mm_packus_epi16(_mm_srli_epi16(a0, 8), _mm_srli_epi16(a1, 8));
+				uv = _mm_packus_epi16(_mm_and_si128(a0, mask), _mm_and_si128(a1, mask));
+			}
+			_mm_storeu_si128((__m128i*)(luma + x), ya);
+			_mm_storel_epi64((__m128i*)(u + x / 2), _mm_packus_epi16(_mm_and_si128(uv, mask), zero));
+			_mm_storel_epi64((__m128i*)(v + x / 2), _mm_packus_epi16(_mm_srli_epi16(uv, 8), zero));
+		}
+		for (; x < width; ++x)
+		{
+			luma[x] = row[x * 2 + Y_POS];
+			if (!(x & 1))
+			{
+				u[x / 2] = row[x * 2 + 1 - Y_POS];
+				v[x / 2] = x + 1 < width ? row[x * 2 + 3 - Y_POS] : 0x80;
+			}
+		}
+	}
+}
+
+/// YV16 -> YUY2 (Y_POS 0) or UYVY (Y_POS 1), the reverse of ConvertPacked422ToYV16SSE2()
+template <int Y_POS>
+__attribute__((target("sse2")))
+static void ConvertYV16ToPacked422SSE2(const char* src, char* dst, int width, int height)
+{
+	const int cw = (width + 1) / 2;
+	const uint8_t* lumaIn = (const uint8_t*)src;
+	const uint8_t* vIn = lumaIn + (size_t)width * height;
+	const uint8_t* uIn = vIn + (size_t)cw * height;
+	for (int y = 0; y < height; ++y)
+	{
+		const uint8_t* luma = lumaIn + (size_t)y * width;
+		const uint8_t* u = uIn + (size_t)y * cw;
+		const uint8_t* v = vIn + (size_t)y * cw;
+		uint8_t* out = (uint8_t*)dst + (size_t)y * width * 2;
+		int x = 0;
+		for (; x + 16 <= width; x += 16)
+		{
+			__m128i yv = _mm_loadu_si128((const __m128i*)(luma + x));
+			__m128i uv = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(u + x / 2)), _mm_loadl_epi64((const __m128i*)(v + x / 2)));
+			if (Y_POS == 0)
+			{
+				_mm_storeu_si128((__m128i*)(out + x * 2), _mm_unpacklo_epi8(yv, uv));
+				_mm_storeu_si128((__m128i*)(out + x * 2 + 16), _mm_unpackhi_epi8(yv, uv));
+			}
+			else
+			{
+				_mm_storeu_si128((__m128i*)(out + x * 2), _mm_unpacklo_epi8(uv, yv));
+				_mm_storeu_si128((__m128i*)(out + x * 2 + 16), _mm_unpackhi_epi8(uv, yv));
+			}
+		}
+		for (; x < width; ++x)
+		{
+			out[x * 2 + Y_POS] = luma[x];
+			out[x * 2 + 1 - Y_POS] = (x & 1) ? v[x / 2] : u[x / 2];
+		}
+	}
+}
+
+/// YUY2 (Y_POS 0) or UYVY (Y_POS 1) -> v210, 8 to 10 bits per sample. A v210 block stores its 12 samples in
+/// UYVY order, 3 per 32-bit word: SSE2 spreads 12 UYVY bytes over the 4 words, partial blocks at the end are scalar.
+template <int Y_POS>
+__attribute__((target("sse2")))
+static void ConvertPacked422ToV210SSE2(const char* src, char* dst, int width, int height)
+{
+	size_t stride = (size_t)(width + 47) / 48 * 128;
+	const __m128i byte0 = _mm_set1_epi32(0xFF), low24 = _mm_set_epi32(0, 0xFFFFFF, 0, 0xFFFFFF);
+	const __m128i high24 = _mm_set_epi32(0xFFFFFF, 0, 0xFFFFFF, 0);
+	for (int y = 0; y < height; ++y)
+	{
+		const uint8_t* row = (const uint8_t*)src + (size_t)y * width * 2;
+		char* out = dst + y * stride;
+		int x = 0;
+		for (; x + 6 <= width; x += 6)
+		{
+			// 12 bytes: 6 into each 64-bit lane, 3 into each 32-bit word
+			__m128i t = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)(row + x * 2)), _mm_cvtsi32_si128(LoadLE32((const char*)row + x * 2 + 8)));
+			if (Y_POS == 0)
+				t = _mm_or_si128(_mm_slli_epi16(t, 8), _mm_srli_epi16(t, 8));
+			__m128i q = _mm_unpacklo_epi64(t, _mm_srli_si128(t, 6));
+			__m128i d = _mm_or_si128(_mm_and_si128(q, low24), _mm_and_si128(_mm_slli_epi64(q, 8), high24));
+			__m128i w = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(d, byte0), 2),
+				_mm_or_si128(_mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(d, 8), byte0), 12), _mm_slli_epi32(_mm_srli_epi32(d, 16), 22)));
+			_mm_storeu_si128((__m128i*)(out + x / 6 * 16), w);
+		}
+		for (; x < width; x += 6)
+		{
+			uint32_t s[12]; // Y0..Y5, Cb0..Cb2, Cr0..Cr2
+			for (int i = 0; i < 6; ++i)
+				s[i] = row[std::min(x + i, width - 1) * 2 + Y_POS] << 2;
+			for (int i = 0; i < 3; ++i)
+			{
+				int px = std::min(x + i * 2, (width - 1) & ~1);
+				s[6 + i] = row[px * 2 + 1 - Y_POS] << 2;
+				s[9 + i] = (px + 1 < width ? row[px * 2 + 3 - Y_POS] : 0x80) << 2;
+			}
+			char* p = out + x / 6 * 16;
+			StoreLE32(p,      s[6]  | (s[0]  << 10) | (s[9]  << 20));
+			StoreLE32(p + 4,  s[1]  | (s[7]  << 10) | (s[2]  << 20));
+			StoreLE32(p + 8,  s[10] | (s[3]  << 10) | (s[8]  << 20));
+			StoreLE32(p + 12, s[4]  | (s[11] << 10) | (s[5]  << 20));
+		}
+		size_t used = (size_t)(width + 5) / 6 * 16;
+		memset(out + used, 0, stride - used);
+	}
+}
+
+/// v210 -> YUY2 (Y_POS 0) or UYVY (Y_POS 1), 10 to 8 bits per sample with rounding. The reverse of
+/// ConvertPacked422ToV210SSE2(): the 4 words of a block are rounded and packed into 12 UYVY bytes.
+template <int Y_POS>
+__attribute__((target("sse2")))
+static void ConvertV210ToPacked422SSE2(const char* src, char* dst, int width, int height)
+{
+	size_t stride = (size_t)(width + 47) / 48 * 128;
+	const __m128i mask10 = _mm_set1_epi32(0x3FF), round = _mm_set1_epi32(2), max8 = _mm_set1_epi32(255);
+	const __m128i low24 = _mm_set_epi32(0, 0xFFFFFF, 0, 0xFFFFFF), low48 = _mm_set_epi32(0, 0, 0xFFFF, (int)0xFFFFFFFF);
+	for (int y = 0; y < height; ++y)
+	{
+		const char* row = src + y * stride;
+		uint8_t* out = (uint8_t*)dst + (size_t)y * width * 2;
+		int x = 0;
+		for (; x + 6 <= width; x += 6)
+		{
+			__m128i w = _mm_loadu_si128((const __m128i*)(row + x / 6 * 16));
+			// (s + 2) >> 2 of the 3 samples, at most 256 before the clamp (the high 16 bits stay 0 for min_epi16)
+			__m128i s0 = _mm_min_epi16(_mm_srli_epi32(_mm_add_epi32(_mm_and_si128(w, mask10), round), 2), max8);
+			__m128i s1 = _mm_min_epi16(_mm_srli_epi32(_mm_add_epi32(_mm_and_si128(_mm_srli_epi32(w, 10), mask10), round), 2), max8);
+			__m128i s2 = _mm_min_epi16(_mm_srli_epi32(_mm_add_epi32(_mm_and_si128(_mm_srli_epi32(w, 20), mask10), round), 2), max8);
+			__m128i d = _mm_or_si128(s0, _mm_or_si128(_mm_slli_epi32(s1, 8), _mm_slli_epi32(s2, 16)));
+			// 3 bytes of each word back to back: 6 per 64-bit lane, then the lanes
+			__m128i q = _mm_or_si128(_mm_and_si128(d, low24), _mm_srli_epi64(_mm_andnot_si128(low24, d), 8));
+			__m128i t = _mm_or_si128(_mm_and_si128(q, low48), _mm_slli_si128(_mm_srli_si128(q, 8), 6));
+			if (Y_POS == 0)
+				t = _mm_or_si128(_mm_slli_epi16(t, 8), _mm_srli_epi16(t, 8));
+			_mm_storel_epi64((__m128i*)(out + x * 2), t);
+			StoreLE32((char*)out + x * 2 + 8, (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(t, 8)));
+		}
+		for (; x < width; x += 6)
+		{
+			const char* p = row + x / 6 * 16;
+			uint32_t w0 = LoadLE32(p), w1 = LoadLE32(p + 4), w2 = LoadLE32(p + 8), w3 = LoadLE32(p + 12);
+			uint32_t s[12] = { // Y0..Y5, Cb0..Cb2, Cr0..Cr2
+				(w0 >> 10) & 0x3FF, w1 & 0x3FF, (w1 >> 20) & 0x3FF, (w2 >> 10) & 0x3FF, w3 & 0x3FF, (w3 >> 20) & 0x3FF,
+				w0 & 0x3FF, (w1 >> 10) & 0x3FF, (w2 >> 20) & 0x3FF,
+				(w0 >> 20) & 0x3FF, w2 & 0x3FF, (w3 >> 10) & 0x3FF };
+			for (int i = 0; i < 6 && x + i < width; ++i)
+			{
+				out[(x + i) * 2 + Y_POS] = (uint8_t)std::min<uint32_t>((s[i] + 2) >> 2, 255);
+				out[(x + i) * 2 + 1 - Y_POS] = (uint8_t)std::min<uint32_t>((s[(i & 1) ? 9 + i / 2 : 6 + i / 2] + 2) >> 2, 255);
+			}
+		}
+	}
+}
+
+/// 8-bit RGB (BPP 3 or 4 bytes per pixel, B G R (A)) -> b48r or b64a (ALPHA), widened as v << 8 like UnpackPixels(),
+/// alpha 0xFF00 for RGB24. Rows are taken in memory order, FormatConverter flips the bottom-up DIBs row by row.
+/// SSE2 gathers 4 pixels as B G R A words, reverses them to A R G B and drops A for b48r with overlapping 8-byte stores.
+template <int BPP, bool ALPHA>
+__attribute__((target("sse2")))
+static void ConvertRGBToBE16SSE2(const char* src, char* dst, int width, int height)
+{
+	const size_t stride = BPP == 3 ? align_to<4>(width * 3) : (size_t)width * 4;
+	const int outSize = ALPHA ? 8 : 6;
+	// Pixels past the 4 of a step that the loads (RGB24) or the b48r stores touch
+	const int margin = BPP == 3 ? 2 : (ALPHA ? 0 : 1);
+	const __m128i zero = _mm_setzero_si128(), opaque = _mm_set1_epi32((int)0xFF000000);
+	for (int y = 0; y < height; ++y)
+	{
+		const uint8_t* row = (const uint8_t*)src + y * stride;
+		uint8_t* out = (uint8_t*)dst + (size_t)y * width * outSize;
+		int x = 0;
+		for (; x + 4 + margin <= width; x += 4)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i*)(row + x * BPP));
+			if (BPP == 3)
+			{
+				// B G R of pixel i at byte 3 * i, one pixel per dword
+				__m128i p01 = _mm_unpacklo_epi32(v, _mm_srli_si128(v, 3)), p23 = _mm_unpacklo_epi32(_mm_srli_si128(v, 6), _mm_srli_si128(v, 9));
+				v = _mm_or_si128(_mm_unpacklo_epi64(p01, p23), opaque);
+			}
+			__m128i lo = _mm_unpacklo_epi8(v, zero), hi = _mm_unpackhi_epi8(v, zero);
+			lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, _MM_SHUFFLE(0, 1, 2, 3)), _MM_SHUFFLE(0, 1, 2, 3));
+			hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, _MM_SHUFFLE(0, 1, 2, 3)), _MM_SHUFFLE(0, 1, 2, 3));
+			if (ALPHA)
+			{
+				_mm_storeu_si128((__m128i*)(out + x * 8), lo);
+				_mm_storeu_si128((__m128i*)(out + x * 8 + 16), hi);
+			}
+			else
+			{
+				lo = _mm_srli_epi64(lo, 16);
+				hi = _mm_srli_epi64(hi, 16);
+				_mm_storel_epi64((__m128i*)(out + x * 6), lo);
+				_mm_storel_epi64((__m128i*)(out + x * 6 + 6), _mm_unpackhi_epi64(lo, lo));
+				_mm_storel_epi64((__m128i*)(out + x * 6 + 12), hi);
+				_mm_storel_epi64((__m128i*)(out + x * 6 + 18), _mm_unpackhi_epi64(hi, hi));
+			}
+		}
+		for (; x < width; ++x)
+		{
+			const uint8_t* p = row + x * BPP;
+			uint8_t* o = out + x * outSize;
+			if (ALPHA)
+			{
+				*o++ = BPP == 4 ? p[3] : 0xFF;
+				*o++ = 0;
+			}
+			o[0] = p[2];
+			o[2] = p[1];
+			o[4] = p[0];
+			o[1] = o[3] = o[5] = 0;
+		}
+	}
+}
+
+/// AYUV (V U Y A bytes) -> YV24, alpha dropped
+__attribute__((target("sse2")))
+static void ConvertAYUVToYV24SSE2(const char* src, char* dst, int width, int height)
+{
+	const size_t size = (size_t)width * height;
+	const uint8_t* in = (const uint8_t*)src;
+	uint8_t* luma = (uint8_t*)dst;
+	uint8_t* v = luma + size;
+	uint8_t* u = v + size;
+	const __m128i mask = _mm_set1_epi32(0xFF);
+	size_t i = 0;
+	for (; i + 16 <= size; i += 16)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i*)(in + i * 4)), b = _mm_loadu_si128((const __m128i*)(in + i * 4 + 16));
+		__m128i c = _mm_loadu_si128((const __m128i*)(in + i * 4 + 32)), d = _mm_loadu_si128((const __m128i*)(in + i * 4 + 48));
+		_mm_storeu_si128((__m128i*)(v + i), _mm_packus_epi16(
+			_mm_packs_epi32(_mm_and_si128(a, mask), _mm_and_si128(b, mask)), _mm_packs_epi32(_mm_and_si128(c, mask), _mm_and_si128(d, mask))));
+		_mm_storeu_si128((__m128i*)(u + i), _mm_packus_epi16(
+			_mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(a, 8), mask), _mm_and_si128(_mm_srli_epi32(b, 8), mask)),
+			_mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(c, 8), mask), _mm_and_si128(_mm_srli_epi32(d, 8), mask))));
+		_mm_storeu_si128((__m128i*)(luma + i), _mm_packus_epi16(
+			_mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(a, 16), mask), _mm_and_si128(_mm_srli_epi32(b, 16), mask)),
+			_mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(c, 16), mask), _mm_and_si128(_mm_srli_epi32(d, 16), mask))));
+	}
+	for (; i < size; ++i)
+	{
+		v[i] = in[i * 4];
+		u[i] = in[i * 4 + 1];
+		luma[i] = in[i * 4 + 2];
+	}
+}
+
+/// YV24 -> AYUV, opaque alpha
+__attribute__((target("sse2")))
+static void ConvertYV24ToAYUVSSE2(const char* src, char* dst, int width, int height)
+{
+	const size_t size = (size_t)width * height;
+	const uint8_t* luma = (const uint8_t*)src;
+	const uint8_t* v = luma + size;
+	const uint8_t* u = v + size;
+	uint8_t* out = (uint8_t*)dst;
+	const __m128i opaque = _mm_set1_epi8((char)0xFF);
+	size_t i = 0;
+	for (; i + 16 <= size; i += 16)
+	{
+		__m128i yv = _mm_loadu_si128((const __m128i*)(luma + i));
+		__m128i vu = _mm_unpacklo_epi8(_mm_loadu_si128((const __m128i*)(v + i)), _mm_loadu_si128((const __m128i*)(u + i)));
+		__m128i vuHi = _mm_unpackhi_epi8(_mm_loadu_si128((const __m128i*)(v + i)), _mm_loadu_si128((const __m128i*)(u + i)));
+		__m128i ya = _mm_unpacklo_epi8(yv, opaque), yaHi = _mm_unpackhi_epi8(yv, opaque);
+		_mm_storeu_si128((__m128i*)(out + i * 4), _mm_unpacklo_epi16(vu, ya));
+		_mm_storeu_si128((__m128i*)(out + i * 4 + 16), _mm_unpackhi_epi16(vu, ya));
+		_mm_storeu_si128((__m128i*)(out + i * 4 + 32), _mm_unpacklo_epi16(vuHi, yaHi));
+		_mm_storeu_si128((__m128i*)(out + i * 4 + 48), _mm_unpackhi_epi16(vuHi, yaHi));
+	}
+	for (; i < size; ++i)
+	{
+		out[i * 4] = v[i];
+		out[i * 4 + 1] = u[i];
+		out[i * 4 + 2] = luma[i];
+		out[i * 4 + 3] = 0xFF;
+	}
+}
+
+/////////////////////////////////////
+template <typename T>
+T readVar(std::istream& input)
+{
+	T var;
+	input.read((char*) &var, sizeof(var));
+	return var;
+}
+
+template <typename T>
+void writeVar(std::ostream& output, T var)
+{
+	output.write((char*) &var, sizeof(var));
+}
+
+std::vector<char> LoadFile(const char* filename)
+{
+	std::ifstream file(filename, std::ios::binary);
+	if (!file)
+	{
+		throw std::runtime_error(std::string("ERROR: Failed to open file: ") + filename);
+	}
+	return std::vector<char>((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+}
+
+void SaveFile(const char* filename, const std::vector<char>& data)
+{
+	std::ofstream file(filename, std::ios::binary);
+	if (!file || !file.write(data.empty() ? NULL : &data[0], data.size()))
+	{
+		throw std::runtime_error(std::string("ERROR: Failed to write file: ") + filename);
+	}
+}
+
+/// Up to 4 characters, padded with spaces (e.g. "Y8" -> 'Y8  ')
+DWORD ParseFourCC(const char* str)
+{
+	size_t len = strlen(str);
+	if (len == 0 || len > 4)
+	{
+		throw std::runtime_error(std::string("ERROR: Invalid FOURCC: ") + str);
+	}
+	char fcc[4] = { ' ', ' ', ' ', ' ' };
+	memcpy(fcc, str, len);
+	return mmioFOURCC(fcc[0], fcc[1], fcc[2], fcc[3]);
+}
+
+/// FOURCCs are compared case-insensitively, codecs are often installed as e.g. 'xvid' and report 'XVID'
+bool SameFourCC(DWORD a, DWORD b)
+{
+	for (int i = 0; i < 4; ++i, a >>= 8, b >>= 8)
+	{
+		if (toupper(a & 0xFF) != toupper(b & 0xFF))
+			return false;
+	}
+	return true;
+}
+
+/// Parses a rectangle given as 'x,y,w,h'
+RECT ParseRect(const char* str)
+{
+	int x, y, w, h;
+	char end;
+	if (sscanf(str, "%d,%d,%d,%d%c", &x, &y, &w, &h, &end) != 4 || w <= 0 || h <= 0)
+	{
+		throw std::runtime_error(std::string("ERROR: Invalid rectangle (expected x,y,w,h): ") + str);
+	}
+	RECT rect = { x, y, x + w, y + h };
+	return rect;
+}
+
+/////////////////////////////////////
+class BitmapInfoHeader
+{
+public:
+	BitmapInfoHeader()
+	{
+		resize(sizeof(BITMAPINFOHEADER));
+	}
+
+	BitmapInfoHeader& operator=(const BITMAPINFOHEADER* bih)
+	{
+		if (!bih)
+			return *this;
+
+		resize(bih->biSize);
+		memcpy(&buf[0], bih, bih->biSize);
+		return *this;
+	}
+
+	operator BITMAPINFOHEADER*()
+	{
+		return (BITMAPINFOHEADER*)&buf[0];
+	}
+
+	void resize(size_t size)
+	{
+		buf.resize(size);
+	}
+
+private:
+	std::vector<char> buf;
+};
+
+/////////////////////////////////////
+/// Converts frames between two GetDecompFormat() formats for the -convert stage. The 8-bit packed/planar YUV,
+/// AYUV <-> YV24, the v210 and the 8-bit RGB -> b48r/b64a pairs have direct SSE2 routines, all other pairs go
+/// through UnpackPixels(), ConvertColors() and PackPixels() per pixel (double precision colors) and are reported
+/// as unoptimised.
+class FormatConverter
+{
+public:
+	FormatConverter()
+		: m_func(NULL)
+		, m_pathName("none")
+		, m_flipRows(false)
+		, m_srcStride(0)
+		, m_dstStride(0)
+	{}
+
+	void init(BITMAPINFOHEADER* biFormatIn, BITMAPINFOHEADER* biFormatOut);
+
+	/// Converts into outBuf, or into the converter's own buffer if NULL. Returns the converted frame.
+	char* convert(const char* src, char* outBuf = NULL);
+
+	BITMAPINFOHEADER* getOutputFormat()
+	{
+		return (BITMAPINFOHEADER*)m_biFormatOut;
+	}
+
+	/// "generic" or the name of the direct routine
+	const char* pathName() const
+	{
+		return m_pathName;
+	}
+
+	/// False for the generic path, its time is not representative of a real converter
+	bool optimised() const
+	{
+		return m_func || strcmp(m_pathName, "copy") == 0;
+	}
+
+private:
+	typedef void (*ConvertFunc)(const char* src, char* dst, int width, int height);
+
+	ConvertFunc m_func;
+	const char* m_pathName;
+	bool m_flipRows; // bottom-up DIB input of a direct routine, converted one row at a time
+	size_t m_srcStride, m_dstStride;
+	BitmapInfoHeader m_biFormatIn;
+	BitmapInfoHeader m_biFormatOut;
+	PixelPlanes m_planes;
+	BufferRing m_frameBufs;
+};
+
+void FormatConverter::init(BITMAPINFOHEADER* biFormatIn, BITMAPINFOHEADER* biFormatOut)
+{
+	m_biFormatIn = biFormatIn;
+	m_biFormatOut = biFormatOut;
+	if (biFormatIn->biWidth != biFormatOut->biWidth || abs(biFormatIn->biHeight) != abs(biFormatOut->biHeight))
+	{
+		throw std::runtime_error("ERROR: -convert does not scale, the formats must have the same size\n");
+	}
+
+	struct Path
+	{
+		DWORD in;
+		WORD inBits; // 0 for any, BI_RGB is 24 or 32-bit
+		DWORD out;
+		ConvertFunc func;
+		const char* name;
+	};
+	static const Path paths[] = {
+		{ mmioFOURCC('Y','U','Y','2'), 0, mmioFOURCC('U','Y','V','Y'), ConvertSwap422SSE2, "yuy2-uyvy sse2" },
+		{ mmioFOURCC('U','Y','V','Y'), 0, mmioFOURCC('Y','U','Y','2'), ConvertSwap422SSE2, "uyvy-yuy2 sse2" },
+		{ mmioFOURCC('Y','U','Y','2'), 0, mmioFOURCC('Y','V','1','2'), ConvertPacked422ToYV12SSE2<0>, "yuy2-yv12 sse2" },
+		{ mmioFOURCC('U','Y','V','Y'), 0, mmioFOURCC('Y','V','1','2'), ConvertPacked422ToYV12SSE2<1>, "uyvy-yv12 sse2" },
+		{ mmioFOURCC('Y','V','1','2'), 0, mmioFOURCC('Y','U','Y','2'), ConvertYV12ToPacked422SSE2<0>, "yv12-yuy2 sse2" },
+		{ mmioFOURCC('Y','V','1','2'), 0, mmioFOURCC('U','Y','V','Y'), ConvertYV12ToPacked422SSE2<1>, "yv12-uyvy sse2" },
+		{ mmioFOURCC('Y','U','Y','2'), 0, mmioFOURCC('v','2','1','0'), ConvertPacked422ToV210SSE2<0>, "yuy2-v210 sse2" },
+		{ mmioFOURCC('U','Y','V','Y'), 0, mmioFOURCC('v','2','1','0'), ConvertPacked422ToV210SSE2<1>, "uyvy-v210 sse2" },
+		{ mmioFOURCC('v','2','1','0'), 0, mmioFOURCC('Y','U','Y','2'), ConvertV210ToPacked422SSE2<0>, "v210-yuy2 sse2" },
+		{ mmioFOURCC('v','2','1','0'), 0, mmioFOURCC('U','Y','V','Y'), ConvertV210ToPacked422SSE2<1>, "v210-uyvy sse2" },
+		{ mmioFOURCC('A','Y','U','V'), 0, mmioFOURCC('Y','V','2','4'), ConvertAYUVToYV24SSE2, "ayuv-yv24 sse2" },
+		{ mmioFOURCC('Y','V','2','4'), 0, mmioFOURCC('A','Y','U','V'), ConvertYV24ToAYUVSSE2, "yv24-ayuv sse2" },
+		{ BI_RGB, 24, mmioFOURCC('b','4','8','r'), ConvertRGBToBE16SSE2<3, false>, "rgb24-b48r sse2" },
+		{ BI_RGB, 24, mmioFOURCC('b','6','4','a'), ConvertRGBToBE16SSE2<3, true>, "rgb24-b64a sse2" },
+		{ BI_RGB, 32, mmioFOURCC('b','4','8','r'), ConvertRGBToBE16SSE2<4, false>, "rgb32-b48r sse2" },
+		{ BI_RGB, 32, mmioFOURCC('b','6','4','a'), ConvertRGBToBE16SSE2<4, true>, "rgb32-b64a sse2" },
+		{ mmioFOURCC('B','G','R','A'), 0, mmioFOURCC('b','4','8','r'), ConvertRGBToBE16SSE2<4, false>, "bgra-b48r sse2" },
+		{ mmioFOURCC('B','G','R','A'), 0, mmioFOURCC('b','6','4','a'), ConvertRGBToBE16SSE2<4, true>, "bgra-b64a sse2" },
+	};
+	m_func = NULL;
+	m_pathName = "generic";
+	for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); ++i)
+	{
+		if (paths[i].in == biFormatIn->biCompression && (!paths[i].inBits || paths[i].inBits == biFormatIn->biBitCount)
+			&& paths[i].out == biFormatOut->biCompression)
+		{
+			m_func = paths[i].func;
+			m_pathName = paths[i].name;
+		}
+	}
+	if (biFormatIn->biCompression == biFormatOut->biCompression && biFormatIn->biBitCount == biFormatOut->biBitCount)
+	{
+		m_pathName = "copy";
+	}
+
+	// The direct routines take top-down rows, UnpackPixels() flips bottom-up DIBs for the generic path
+	int height = abs(biFormatIn->biHeight);
+	m_flipRows = m_func && (biFormatIn->biCompression == BI_RGB || biFormatIn->biCompression == mmioFOURCC('B','G','R','A'))
+		&& biFormatIn->biHeight > 0;
+	m_srcStride = biFormatIn->biBitCount == 24 ? align_to<4>(biFormatIn->biWidth * 3) : (size_t)biFormatIn->biWidth * 4;
+	m_dstStride = biFormatOut->biSizeImage / height;
+
+	// Allocated here instead of in the timed convert()
+	m_planes.resize(biFormatIn->biWidth, abs(biFormatIn->biHeight));
+	m_frameBufs.allocate(biFormatOut->biSizeImage);
+}
+
+char* FormatConverter::convert(const char* src, char* outBuf)
+{
+	BITMAPINFOHEADER* biIn = m_biFormatIn;
+	BITMAPINFOHEADER* biOut = m_biFormatOut;
+	char* dst = outBuf ? outBuf : m_frameBufs.next();
+	if (m_flipRows)
+	{
+		int height = abs(biIn->biHeight);
+		for (int y = 0; y < height; ++y)
+			m_func(src + (size_t)(height - 1 - y) * m_srcStride, dst + (size_t)y * m_dstStride, biIn->biWidth, 1);
+	}
+	else if (m_func)
+	{
+		m_func(src, dst, biIn->biWidth, abs(biIn->biHeight));
+	}
+	else if (strcmp(m_pathName, "copy") == 0)
+	{
+		memcpy(dst, src, biOut->biSizeImage);
+	}
+	else
+	{
+		UnpackPixels(biIn, src, m_planes);
+		bool yuv = IsYuvFormat(biOut);
+		if (yuv != m_planes.yuv)
+			ConvertColors(m_planes, yuv);
+		PackPixels(m_planes, biOut, dst);
+	}
+	return dst;
+}
+
+/////////////////////////////////////
+/// Resizes frames of a GetDecompFormat() format for -postscale. Separable filter, widened by the ratio when
+/// downscaling so every input pixel contributes, with 14-bit fixed point weights. The 8-bit formats are scaled
+/// in place (vertical pass with SSE2, horizontal pass with SSE2 for 4 byte pixels), YUY2 and UYVY the same way
+/// after splitting them into Y, V and U planes. The 10/16-bit formats go through PixelPlanes, with an SSE2
+/// single precision vertical pass.
+class FrameScaler
+{
+public:
+	enum Filter
+	{
+		FILTER_BILINEAR,
+		FILTER_BICUBIC
+	};
+
+	FrameScaler()
+		: m_filter(FILTER_BILINEAR)
+		, m_fast(false)
+		, m_split(NULL)
+		, m_merge(NULL)
+	{}
+
+	void init(BITMAPINFOHEADER* biFormatIn, BITMAPINFOHEADER* biFormatOut, Filter filter);
+
+	/// Scales into outBuf, or into the scaler's own buffer if NULL. Returns the scaled frame.
+	char* scale(const char* src, char* outBuf = NULL);
+
+	BITMAPINFOHEADER* getOutputFormat()
+	{
+		return (BITMAPINFOHEADER*)m_biFormatOut;
+	}
+
+	static const char* filterName(Filter filter)
+	{
+		return filter == FILTER_BICUBIC ? "bicubic" : "bilinear";
+	}
+
+	/// "sse2" for the 8-bit formats (YUY2 and UYVY through planes), "sse2 16-bit" for the others
+	const char* pathName() const
+	{
+		return m_fast ? (m_split ? "sse2 planar" : "sse2") : "sse2 16-bit";
+	}
+
+private:
+	/// Input positions and weights (sum: 1 << WEIGHT_BITS) of every output position, numTaps per position
+	struct Taps
+	{
+		int numTaps;
+		std::vector<int> index;
+		std::vector<int16_t> weight;
+	};
+
+	/// An image plane of 8-bit samples, channels interleaved samples per pixel
+	struct Plane
+	{
+		size_t offset;
+		int width, height, stride, channels;
+	};
+
+	static const int WEIGHT_BITS = 14;
+
+	static void buildTaps(int inSize, int outSize, Filter filter, Taps& taps);
+
+	/// Planes of the 8-bit formats, false for the others
+	static bool getPlanes(const BITMAPINFOHEADER* format, std::vector<Plane>& planes);
+
+	void scalePlane(const uint8_t* src, const Plane& in, uint8_t* dst, const Plane& out, const Taps& hTaps, const Taps& vTaps);
+
+	void scalePlanes16(const PixelPlanes& in, PixelPlanes& out);
+
+	typedef void (*ConvertFunc)(const char* src, char* dst, int width, int height);
+
+	Filter m_filter;
+	bool m_fast;
+	ConvertFunc m_split, m_merge;        // YUY2/UYVY <-> the planes in m_packedIn/m_packedOut
+	BitmapInfoHeader m_biFormatIn;
+	BitmapInfoHeader m_biFormatOut;
+	std::vector<Plane> m_planesIn, m_planesOut;
+	std::vector<Taps> m_hTaps, m_vTaps; // per plane
+	AlignedBuffer m_rowBuf;             // vertically filtered input row
+	AlignedBuffer m_packedIn, m_packedOut;
+	PixelPlanes m_pixelsIn, m_pixelsOut;
+	std::vector<float> m_rowFloat;      // vertically filtered row of scalePlanes16()
+	BufferRing m_frameBufs;
+};
+
+static double ScalerKernel(double x, FrameScaler::Filter filter)
+{
+	x = fabs(x);
+	if (filter == FrameScaler::FILTER_BILINEAR)
+		return x < 1.0 ? 1.0 - x : 0.0;
+
+	// Keys cubic, a = -0.5 (Catmull-Rom)
+	const double a = -0.5;
+	if (x < 1.0)
+		return ((a + 2.0) * x - (a + 3.0)) * x * x + 1.0;
+	if (x < 2.0)
+		return ((a * x - 5.0 * a) * x + 8.0 * a) * x - 4.0 * a;
+	return 0.0;
+}
+
+void FrameScaler::buildTaps(int inSize, int outSize, Filter filter, Taps& taps)
+{
+	double ratio = (double)inSize / outSize;
+	double stretch = std::max(ratio, 1.0);
+	double radius = (filter == FILTER_BICUBIC ? 2.0 : 1.0) * stretch;
+	taps.numTaps = (int)ceil(radius) * 2 + 1;
+	taps.index.assign((size_t)outSize * taps.numTaps, 0);
+	taps.weight.assign((size_t)outSize * taps.numTaps, 0);
+
+	std::vector<double> weights(taps.numTaps);
+	for (int x = 0; x < outSize; ++x)
+	{
+		double center = (x + 0.5) * ratio - 0.5;
+		int first = (int)floor(center - radius) + 1;
+		double sum = 0.0;
+		for (int t = 0; t < taps.numTaps; ++t)
+		{
+			weights[t] = ScalerKernel((first + t - center) / stretch, filter);
+			sum += weights[t];
+		}
+
+		// Normalized, positions outside of the input repeat the edge
+		int total = 0, largest = 0;
+		int* index = &taps.index[(size_t)x * taps.numTaps];
+		int16_t* weight = &taps.weight[(size_t)x * taps.numTaps];
+		for (int t = 0; t < taps.numTaps; ++t)
+		{
+			index[t] = std::min(std::max(first + t, 0), inSize - 1);
+			weight[t] = (int16_t)floor(weights[t] / sum * (1 << WEIGHT_BITS) + 0.5);
+			total += weight[t];
+			if (weight[t] > weight[largest])
+				largest = t;
+		}
+		weight[largest] += (1 << WEIGHT_BITS) - total;
+	}
+}
+
+bool FrameScaler::getPlanes(const BITMAPINFOHEADER* format, std::vector<Plane>& planes)
+{
+	int w = format->biWidth, h = abs(format->biHeight);
+	DWORD fcc = format->biCompression;
+	planes.clear();
+	if (fcc == BI_RGB && format->biBitCount == 24)
+	{
+		Plane plane = { 0, w, h, (int)align_to<4>(w * 3), 3 };
+		planes.push_back(plane);
+	}
+	else if ((fcc == BI_RGB && format->biBitCount == 32) || fcc == mmioFOURCC('B','G','R','A') || fcc == mmioFOURCC('A','Y','U','V'))
+	{
+		Plane plane = { 0, w, h, w * 4, 4 };
+		planes.push_back(plane);
+	}
+	else if (fcc == mmioFOURCC('Y','V','1','2'))
+	{
+		// Y, V, U
+		Plane luma = { 0, w, h, w, 1 };
+		Plane v = { (size_t)w * h, w / 2, h / 2, w / 2, 1 };
+		Plane u = { (size_t)w * h + (size_t)(w / 2) * (h / 2), w / 2, h / 2, w / 2, 1 };
+		planes.push_back(luma);
+		planes.push_back(v);
+		planes.push_back(u);
+	}
+	else if (fcc == mmioFOURCC('Y','U','Y','2') || fcc == mmioFOURCC('U','Y','V','Y'))
+	{
+		// Y, V, U planes of ConvertPacked422ToYV16SSE2(), not the packed frame
+		int cw = (w + 1) / 2;
+		Plane luma = { 0, w, h, w, 1 };
+		Plane v = { (size_t)w * h, cw, h, cw, 1 };
+		Plane u = { (size_t)w * h + (size_t)cw * h, cw, h, cw, 1 };
+		planes.push_back(luma);
+		planes.push_back(v);
+		planes.push_back(u);
+	}
+	else if (fcc == mmioFOURCC('Y','V','2','4') || fcc == mmioFOURCC('Y','8',' ',' '))
+	{
+		int numPlanes = fcc == mmioFOURCC('Y','8',' ',' ') ? 1 : 3;
+		for (int i = 0; i < numPlanes; ++i)
+		{
+			Plane plane = { (size_t)i * w * h, w, h, w, 1 };
+			planes.push_back(plane);
+		}
+	}
+	return !planes.empty();
+}
+
+void FrameScaler::init(BITMAPINFOHEADER* biFormatIn, BITMAPINFOHEADER* biFormatOut, Filter filter)
+{
+	m_biFormatIn = biFormatIn;
+	m_biFormatOut = biFormatOut;
+	m_filter = filter;
+	if (biFormatIn->biCompression != biFormatOut->biCompression || biFormatIn->biBitCount != biFormatOut->biBitCount ||
+		(biFormatIn->biHeight < 0) != (biFormatOut->biHeight < 0))
+	{
+		throw std::runtime_error("ERROR: -postscale does not convert, the formats must only differ in size\n");
+	}
+
+	m_fast = getPlanes(biFormatIn, m_planesIn) && getPlanes(biFormatOut, m_planesOut);
+	m_split = m_merge = NULL;
+	if (biFormatIn->biCompression == mmioFOURCC('Y','U','Y','2'))
+	{
+		m_split = ConvertPacked422ToYV16SSE2<0>;
+		m_merge = ConvertYV16ToPacked422SSE2<0>;
+	}
+	else if (biFormatIn->biCompression == mmioFOURCC('U','Y','V','Y'))
+	{
+		m_split = ConvertPacked422ToYV16SSE2<1>;
+		m_merge = ConvertYV16ToPacked422SSE2<1>;
+	}
+	if (m_split)
+	{
+		// Allocated here instead of in the timed scale()
+		const Plane& inLast = m_planesIn.back();
+		const Plane& outLast = m_planesOut.back();
+		m_packedIn.resize(inLast.offset + (size_t)inLast.stride * inLast.height);
+		m_packedOut.resize(outLast.offset + (size_t)outLast.stride * outLast.height);
+	}
+	m_hTaps.clear();
+	m_vTaps.clear();
+	size_t rowSize = 0;
+	if (m_fast)
+	{
+		m_hTaps.resize(m_planesIn.size());
+		m_vTaps.resize(m_planesIn.size());
+		for (size_t i = 0; i < m_planesIn.size(); ++i)
+		{
+			if (m_planesOut[i].width < 1 || m_planesOut[i].height < 1)
+				throw std::runtime_error("ERROR: -postscale output size is too small\n");
+			buildTaps(m_planesIn[i].width, m_planesOut[i].width, filter, m_hTaps[i]);
+			buildTaps(m_planesIn[i].height, m_planesOut[i].height, filter, m_vTaps[i]);
+			rowSize = std::max(rowSize, (size_t)m_planesIn[i].width * m_planesIn[i].channels);
+		}
+	}
+	else
+	{
+		m_hTaps.resize(1);
+		m_vTaps.resize(1);
+		buildTaps(biFormatIn->biWidth, biFormatOut->biWidth, filter, m_hTaps[0]);
+		buildTaps(abs(biFormatIn->biHeight), abs(biFormatOut->biHeight), filter, m_vTaps[0]);
+		m_pixelsIn.resize(biFormatIn->biWidth, abs(biFormatIn->biHeight));
+		m_pixelsOut.resize(biFormatOut->biWidth, abs(biFormatOut->biHeight));
+		m_rowFloat.resize(biFormatIn->biWidth);
+	}
+	m_rowBuf.resize(rowSize + 16);
+	m_frameBufs.allocate(biFormatOut->biSizeImage);
+}
+
+char* FrameScaler::scale(const char* src, char* outBuf)
+{
+	char* dst = outBuf ? outBuf : m_frameBufs.next();
+	if (m_fast)
+	{
+		const char* in = src;
+		char* out = dst;
+		if (m_split)
+		{
+			const BITMAPINFOHEADER* biIn = m_biFormatIn;
+			m_split(src, m_packedIn.data(), biIn->biWidth, abs(biIn->biHeight));
+			in = m_packedIn.data();
+			out = m_packedOut.data();
+		}
+		for (size_t i = 0; i < m_planesIn.size(); ++i)
+		{
+			scalePlane((const uint8_t*)in + m_planesIn[i].offset, m_planesIn[i], (uint8_t*)out + m_planesOut[i].offset, m_planesOut[i],
+				m_hTaps[i], m_vTaps[i]);
+		}
+		if (m_merge)
+		{
+			const BITMAPINFOHEADER* biOut = m_biFormatOut;
+			m_merge(out, dst, biOut->biWidth, abs(biOut->biHeight));
+		}
+	}
+	else
+	{
+		UnpackPixels(m_biFormatIn, src, m_pixelsIn);
+		scalePlanes16(m_pixelsIn, m_pixelsOut);
+		PackPixels(m_pixelsOut, m_biFormatOut, dst);
+	}
+	return dst;
+}
+
+static inline uint8_t ScalerClamp8(int sum)
+{
+	return (uint8_t)std::min(std::max((sum + 8192) >> 14, 0), 255);
+}
+
+__attribute__((target("sse2")))
+void FrameScaler::scalePlane(const uint8_t* src, const Plane& in, uint8_t* dst, const Plane& out, const Taps& hTaps, const Taps& vTaps)
+{
+	const int rowBytes = in.width * in.channels;
+	const int ch = in.channels;
+	uint8_t* row = (uint8_t*)m_rowBuf.data();
+	const __m128i zero = _mm_setzero_si128(), round = _mm_set1_epi32(1 << (WEIGHT_BITS - 1));
+	for (int y = 0; y < out.height; ++y)
+	{
+		// Vertical: the taps' input rows into row, two taps per madd
+		const int* vIndex = &vTaps.index[(size_t)y * vTaps.numTaps];
+		const int16_t* vWeight = &vTaps.weight[(size_t)y * vTaps.numTaps];
+		int x = 0;
+		for (; x + 16 <= rowBytes; x += 16)
+		{
+			__m128i acc[4] = { round, round, round, round };
+			for (int t = 0; t < vTaps.numTaps; t += 2)
+			{
+				bool pair = t + 1 < vTaps.numTaps;
+				__m128i a = _mm_loadu_si128((const __m128i*)(src + (size_t)vIndex[t] * in.stride + x));
+				__m128i b = pair ? _mm_loadu_si128((const __m128i*)(src + (size_t)vIndex[t + 1] * in.stride + x)) : zero;
+				__m128i w = _mm_set1_epi32((uint16_t)vWeight[t] | ((pair ? (uint32_t)(uint16_t)vWeight[t + 1] : 0) << 16));
+				__m128i a0 = _mm_unpacklo_epi8(a, zero), a1 = _mm_unpackhi_epi8(a, zero);
+				__m128i b0 = _mm_unpacklo_epi8(b, zero), b1 = _mm_unpackhi_epi8(b, zero);
+				acc[0] = _mm_add_epi32(acc[0], _mm_madd_epi16(_mm_unpacklo_epi16(a0, b0), w));
+				acc[1] = _mm_add_epi32(acc[1], _mm_madd_epi16(_mm_unpackhi_epi16(a0, b0), w));
+				acc[2] = _mm_add_epi32(acc[2], _mm_madd_epi16(_mm_unpacklo_epi16(a1, b1), w));
+				acc[3] = _mm_add_epi32(acc[3], _mm_madd_epi16(_mm_unpackhi_epi16(a1, b1), w));
+			}
+			__m128i lo = _mm_packs_epi32(_mm_srai_epi32(acc[0], WEIGHT_BITS), _mm_srai_epi32(acc[1], WEIGHT_BITS));
+			__m128i hi = _mm_packs_epi32(_mm_srai_epi32(acc[2], WEIGHT_BITS), _mm_srai_epi32(acc[3], WEIGHT_BITS));
+			_mm_storeu_si128((__m128i*)(row + x), _mm_packus_epi16(lo, hi));
+		}
+		for (; x < rowBytes; ++x)
+		{
+			int sum = 0;
+			for (int t = 0; t < vTaps.numTaps; ++t)
+				sum += vWeight[t] * src[(size_t)vIndex[t] * in.stride + x];
+			row[x] = ScalerClamp8(sum);
+		}
+
+		// Horizontal: row into the output row
+		uint8_t* outRow = dst + (size_t)y * out.stride;
+		for (int ox = 0; ox < out.width; ++ox)
+		{
+			const int* hIndex = &hTaps.index[(size_t)ox * hTaps.numTaps];
+			const int16_t* hWeight = &hTaps.weight[(size_t)ox * hTaps.numTaps];
+			if (ch == 4)
+			{
+				// 4 channels of a pixel pair per madd
+				__m128i acc = round;
+				for (int t = 0; t < hTaps.numTaps; t += 2)
+				{
+					bool pair = t + 1 < hTaps.numTaps;
+					__m128i a = _mm_unpacklo_epi8(_mm_cvtsi32_si128(*(const int*)(row + hIndex[t] * 4)), zero);
+					__m128i b = pair ? _mm_unpacklo_epi8(_mm_cvtsi32_si128(*(const int*)(row + hIndex[t + 1] * 4)), zero) : zero;
+					__m128i w = _mm_set1_epi32((uint16_t)hWeight[t] | ((pair ? (uint32_t)(uint16_t)hWeight[t + 1] : 0) << 16));
+					acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+				}
+				__m128i v = _mm_packs_epi32(_mm_srai_epi32(acc, WEIGHT_BITS), zero);
+				*(int*)(outRow + ox * 4) = _mm_cvtsi128_si32(_mm_packus_epi16(v, zero));
+				continue;
+			}
+			for (int c = 0; c < ch; ++c)
+			{
+				int sum = 0;
+				for (int t = 0; t < hTaps.numTaps; ++t)
+					sum += hWeight[t] * row[hIndex[t] * ch + c];
+				outRow[ox * ch + c] = ScalerClamp8(sum);
+			}
+		}
+	}
+}
+
+__attribute__((target("sse2")))
+void FrameScaler::scalePlanes16(const PixelPlanes& in, PixelPlanes& out)
+{
+	const Taps& hTaps = m_hTaps[0];
+	const Taps& vTaps = m_vTaps[0];
+	out.numPlanes = in.numPlanes;
+	out.bits = in.bits;
+	out.yuv = in.yuv;
+	const float toWeight = 1.0f / (1 << WEIGHT_BITS);
+	const __m128i zero = _mm_setzero_si128();
+	float* row = &m_rowFloat[0];
+	for (int c = 0; c < in.numPlanes; ++c)
+	{
+		const uint16_t* plane = &in.planes[c][0];
+		for (int y = 0; y < out.height; ++y)
+		{
+			// Vertical: 8 samples per step, single precision is exact enough for 16-bit samples and 14-bit weights
+			const int* vIndex = &vTaps.index[(size_t)y * vTaps.numTaps];
+			const int16_t* vWeight = &vTaps.weight[(size_t)y * vTaps.numTaps];
+			int x = 0;
+			for (; x + 8 <= in.width; x += 8)
+			{
+				__m128 lo = _mm_setzero_ps(), hi = _mm_setzero_ps();
+				for (int t = 0; t < vTaps.numTaps; ++t)
+				{
+					__m128i v = _mm_loadu_si128((const __m128i*)(plane + (size_t)vIndex[t] * in.width + x));
+					__m128 w = _mm_set1_ps(vWeight[t] * toWeight);
+					lo = _mm_add_ps(lo, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero)), w));
+					hi = _mm_add_ps(hi, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zero)), w));
+				}
+				_mm_storeu_ps(row + x, lo);
+				_mm_storeu_ps(row + x + 4, hi);
+			}
+			for (; x < in.width; ++x)
+			{
+				float sum = 0.0f;
+				for (int t = 0; t < vTaps.numTaps; ++t)
+					sum += vWeight[t] * toWeight * plane[(size_t)vIndex[t] * in.width + x];
+				row[x] = sum;
+			}
+
+			// Horizontal
+			for (int x = 0; x < out.width; ++x)
+			{
+				const int* hIndex = &hTaps.index[(size_t)x * hTaps.numTaps];
+				const int16_t* hWeight = &hTaps.weight[(size_t)x * hTaps.numTaps];
+				float sum = 0.5f;
+				for (int t = 0; t < hTaps.numTaps; ++t)
+					sum += hWeight[t] * toWeight * row[hIndex[t]];
+				out.at(c, x, y) = (uint16_t)std::min(std::max(sum, 0.0f), 65535.0f);
+			}
+		}
+	}
+}
+
+/////////////////////////////////////
+/// File container. v1: magic, format size, format, then [uint32 size][payload] records.
+/// v2 adds random access: the header is padded to CONTAINER_V2_ALIGNMENT and every payload starts
+/// at a CONTAINER_V2_ALIGNMENT offset. The payloads are followed by the frame index and a footer:
+///   index entry: uint64 offset, uint32 size, uint32 flags (CONTAINER_V2_KEYFRAME), uint64 encode time (ns)
+///   footer:      uint64 index offset, uint32 number of frames, uint32 magic
+const uint32_t CONTAINER_V1_MAGIC     = 0xABCDEF01;
+const uint32_t CONTAINER_V2_MAGIC     = 0xABCDEF02;
+const uint32_t CONTAINER_V2_ALIGNMENT = 4096;
+const uint32_t CONTAINER_V2_KEYFRAME  = 1;
+
+/// A frame of the v2 frame index
+struct ContainerIndexEntry
+{
+	uint64_t offset;
+	uint32_t size;
+	uint32_t flags;
+	uint64_t encodeTimeNs;
+};
+
+/// Input/output file types
+enum ContainerType
+{
+	CONTAINER_RAW,
+	CONTAINER_V1,
+	CONTAINER_V2,
+	CONTAINER_AVI
+};
+
+const char* ContainerName(ContainerType container)
+{
+	switch (container)
+	{
+	case CONTAINER_RAW: return "raw";
+	case CONTAINER_V1:  return "v1";
+	case CONTAINER_V2:  return "v2";
+	case CONTAINER_AVI: return "avi";
+	}
+	return "unknown";
+}
+
+/////////////////////////////////////
+/// AVI input is parsed directly from the RIFF structure: the format is the first video stream's 'strf' chunk,
+/// the frame index comes from the stream's OpenDML 'indx' (super or standard index) or from the legacy 'idx1'.
+/// Both are turned into absolute payload offsets, so AVI input gets the same random access as v2 files.
+const uint32_t AVI_RIFF = mmioFOURCC('R','I','F','F');
+const uint32_t AVI_LIST = mmioFOURCC('L','I','S','T');
+const uint32_t AVI_AVI  = mmioFOURCC('A','V','I',' ');
+const uint32_t AVI_MOVI = mmioFOURCC('m','o','v','i');
+const uint32_t AVI_STRH = mmioFOURCC('s','t','r','h');
+const uint32_t AVI_STRF = mmioFOURCC('s','t','r','f');
+const uint32_t AVI_INDX = mmioFOURCC('i','n','d','x');
+const uint32_t AVI_IDX1 = mmioFOURCC('i','d','x','1');
+const uint32_t AVI_VIDS = mmioFOURCC('v','i','d','s');
+const uint32_t AVI_IDX1_KEYFRAME   = 0x10;       // AVIIF_KEYFRAME
+const uint32_t AVI_INDEX_OF_INDEXES = 0;         // bIndexType of an OpenDML super index
+const uint32_t AVI_INDEX_OF_CHUNKS  = 1;         // bIndexType of an OpenDML standard index
+const uint32_t AVI_INDEX_DELTAFRAME = 0x80000000; // Standard index entry size flag: not a keyframe
+
+/////////////////////////////////////
+class VideoReader
+{
+public:
+	VideoReader()
+		: m_indexed(false)
+		, m_hFile(INVALID_HANDLE_VALUE)
+		, m_hMapping(NULL)
+		, m_mappedView(NULL)
+		, m_container(CONTAINER_RAW)
+		, m_fileSize(0)
+		, m_rate(0)
+		, m_scale(0)
+		, m_droppedFrames(0)
+	{}
+
+	~VideoReader()
+	{
+		unmap();
+	}
+
+	void openRaw(const char* infile, const char* format, int width, int height);
+
+	void open(const char* infile);
+
+	/// Generates numFrames frames of the pattern in the given raw format into memory, as if preloaded
+	void openSynthetic(const SyntheticPattern& pattern, const char* format, int width, int height, int numFrames);
+
+	/// Replaces the in-memory frames by frames of another format, stored in frames at the offsets of index
+	/// (e.g. the -synthetic frames compressed for -gopthreads). They are then indexed like a v2 file, with keyframe flags.
+	void replaceIndexed(const BITMAPINFOHEADER* format, const std::vector<char>& frames, const std::vector<ContainerIndexEntry>& index);
+
+	bool readFrame();
+
+	/// Reads the whole input (or the first maxFrames frames, 0: all) into memory.
+	/// Afterwards readFrame() and rewind() only walk the in-memory frame index.
+	void preload(int maxFrames = 0);
+
+	/// Maps the whole input file into memory and indexes the first maxFrames frames (0: all).
+	/// Afterwards frameData() points directly into the mapping, no frame data is copied.
+	void map(int maxFrames = 0);
+
+	void rewind()
+	{
+		if (m_indexed)
+		{
+			m_currentFrame = 0;
+			return;
+		}
+		m_inFile.clear();
+		m_inFile.seekg(m_headerSize, m_inFile.beg);
+		m_fileFrame = 0;
+	}
+
+	char* frameData()
+	{
+		return m_frameData;
+	}
+
+	uint32_t frameSize()
+	{
+		return m_frameSize;
+	}
+
+	BITMAPINFOHEADER* getFormat()
+	{
+		return (BITMAPINFOHEADER*)m_biFormat;
+	}
+
+	bool isIndexed() const
+	{
+		return m_indexed;
+	}
+
+	ContainerType container() const
+	{
+		return m_container;
+	}
+
+	/// Whether the file has a frame index with keyframe flags (v2 and AVI), v2 also stores the encode times
+	bool hasFileIndex() const
+	{
+		return m_container == CONTAINER_V2 || m_container == CONTAINER_AVI;
+	}
+
+	/// Frame rate as rate / scale, from the AVI stream header (0 / 0 for the other containers)
+	uint32_t frameRate() const
+	{
+		return m_rate;
+	}
+
+	uint32_t frameRateScale() const
+	{
+		return m_scale;
+	}
+
+	/// Frames with an empty payload, which the AVI index lists but which are not returned by readFrame()
+	uint32_t droppedFrames() const
+	{
+		return m_droppedFrames;
+	}
+
+	/// Keyframe flag of the frameNum-th frame of the file, true without a file index
+	bool isKeyFrame(size_t frameNum) const
+	{
+		return !hasFileIndex() || frameNum >= m_fileIndex.size() || (m_fileIndex[frameNum].flags & CONTAINER_V2_KEYFRAME);
+	}
+
+	const std::vector<ContainerIndexEntry>& fileIndex() const
+	{
+		return m_fileIndex;
+	}
+
+	size_t numIndexedFrames() const
+	{
+		return m_frameIndex.size();
+	}
+
+	/// Random access to indexed frames, does not touch the readFrame() position (thread safe)
+	const char* indexedFrameData(size_t frameNum) const
+	{
+		return m_indexBase + m_frameIndex[frameNum].offset;
+	}
+
+	uint32_t indexedFrameSize(size_t frameNum) const
+	{
+		return m_frameIndex[frameNum].size;
+	}
+
+	/// Size of the memory backing the frame index (preload arena or file mapping)
+	uint64_t indexedSize() const
+	{
+		return m_indexedSize;
+	}
+
+private:
+	struct FrameEntry
+	{
+		uint64_t offset;
+		uint32_t size;
+	};
+
+	void unmap();
+
+	/// Reads the v2 frame index from the end of the file
+	void readFileIndex();
+
+	/// Reads the format and the frame index of an AVI file, the stream is positioned after the 'RIFF' fourcc
+	void openAvi();
+
+	/// Appends the entries of an OpenDML standard index (chunk data at pos) to the file index
+	void readAviStdIndex(uint64_t pos, uint32_t chunkSize);
+
+	/// Appends a frame to the file index, dropped (empty) frames are only counted
+	void addAviFrame(uint64_t offset, uint32_t size, bool keyFrame);
+
+	BufferRing m_frameBufs;
+	char* m_frameData;
+	uint32_t m_frameSize;
+	std::string m_fileName;
+	AlignedBuffer m_arena;
+	std::vector<FrameEntry> m_frameIndex;
+	char* m_indexBase;
+	uint64_t m_indexedSize;
+	size_t m_currentFrame;
+	bool m_indexed;
+	HANDLE m_hFile;
+	HANDLE m_hMapping;
+	LPVOID m_mappedView;
+	std::ifstream m_inFile;
+	BitmapInfoHeader m_biFormat;
+	uint32_t m_headerSize;
+	bool m_raw;
+	ContainerType m_container;
+	std::vector<ContainerIndexEntry> m_fileIndex;
+	size_t m_fileFrame;
+	uint64_t m_fileSize;
+	uint32_t m_rate, m_scale;
+	uint32_t m_droppedFrames;
+};
+
+void VideoReader::openRaw(const char* infile, const char* format, int width, int height)
+{
+	GetDecompFormat(format, width, height, (BITMAPINFOHEADER*)m_biFormat);
+
+	m_inFile.open(infile, std::ios::binary);
+	if (!m_inFile)
+	{
+		throw std::runtime_error(std::string("ERROR: Failed to open file: ") + infile);
+	}
+	m_raw = true;
+	m_container = CONTAINER_RAW;
+	m_headerSize = 0;
+	m_indexed = false;
+	m_fileName = infile;
+}
+
+void VideoReader::open(const char* infile)
+{
+	m_inFile.open(infile, std::ios::binary);
+	if (!m_inFile)
+	{
+		throw std::runtime_error(std::string("ERROR: Failed to open file: ") + infile);
+	}
+	m_raw = false;
+	m_indexed = false;
+	m_fileName = infile;
+
+	// Read magic
+	uint32_t magic = readVar<uint32_t>(m_inFile);
+	if (magic == CONTAINER_V1_MAGIC)
+	{
+		m_container = CONTAINER_V1;
+	}
+	else if (magic == CONTAINER_V2_MAGIC)
+	{
+		m_container = CONTAINER_V2;
+	}
+	else if (magic == AVI_RIFF)
+	{
+		m_container = CONTAINER_AVI;
+		openAvi();
+		return;
+	}
+	else
+	{
+		throw std::runtime_error("ERROR: Invalid file magic");
+	}
+
+	// Read format block
+	uint32_t formatSize = readVar<uint32_t>(m_inFile);
+	m_biFormat.resize(formatSize);
+	m_inFile.read((char*)(BITMAPINFOHEADER*)m_biFormat, formatSize);
+
+	m_headerSize = 8 + formatSize;
+	m_fileFrame = 0;
+	if (m_container == CONTAINER_V2)
+	{
+		m_headerSize = align_to<CONTAINER_V2_ALIGNMENT>(m_headerSize);
+		readFileIndex();
+		m_inFile.seekg(m_headerSize, m_inFile.beg);
+	}
+}
+
+void VideoReader::openSynthetic(const SyntheticPattern& pattern, const char* format, int width, int height, int numFrames)
+{
+	GetDecompFormat(format, width, height, (BITMAPINFOHEADER*)m_biFormat);
+	m_raw = true;
+	m_container = CONTAINER_RAW;
+	m_headerSize = 0;
+	m_fileName = std::string("synthetic:") + pattern.name();
+
+	// All frames are generated up front, so generating them is not part of the measurement
+	uint32_t frameSize = getFormat()->biSizeImage;
+	size_t stride = (frameSize + AlignedBuffer::alignment() - 1) / AlignedBuffer::alignment() * AlignedBuffer::alignment();
+	m_arena.resize(stride * numFrames);
+	PixelPlanes planes(width, abs(height));
+	m_frameIndex.clear();
+	for (int i = 0; i < numFrames; ++i)
+	{
+		FrameEntry entry;
+		entry.offset = stride * i;
+		entry.size = frameSize;
+		pattern.generate(i, planes);
+		PackPixels(planes, getFormat(), m_arena.data() + entry.offset);
+		m_frameIndex.push_back(entry);
+	}
+
+	m_indexBase = m_arena.data();
+	m_indexedSize = stride * numFrames;
+	m_indexed = true;
+	m_currentFrame = 0;
+}
+
+void VideoReader::replaceIndexed(const BITMAPINFOHEADER* format, const std::vector<char>& frames, const std::vector<ContainerIndexEntry>& index)
+{
+	m_biFormat = format;
+	m_raw = false;
+	m_container = CONTAINER_V2;
+	m_fileIndex = index;
+
+	m_arena.resize(frames.size());
+	if (!frames.empty())
+		memcpy(m_arena.data(), &frames[0], frames.size());
+	m_frameIndex.clear();
+	for (size_t i = 0; i < index.size(); ++i)
+	{
+		FrameEntry entry;
+		entry.offset = index[i].offset;
+		entry.size = index[i].size;
+		m_frameIndex.push_back(entry);
+	}
+
+	m_indexBase = m_arena.data();
+	m_indexedSize = frames.size();
+	m_indexed = true;
+	m_currentFrame = 0;
+}
+
+void VideoReader::readFileIndex()
+{
+	m_inFile.seekg(-16, m_inFile.end);
+	uint64_t indexOffset = readVar<uint64_t>(m_inFile);
+	uint32_t numFrames   = readVar<uint32_t>(m_inFile);
+	uint32_t magic       = readVar<uint32_t>(m_inFile);
+	if (!m_inFile || magic != CONTAINER_V2_MAGIC)
+	{
+		throw std::runtime_error("ERROR: The v2 file has no index (incomplete file?)\n");
+	}
+
+	m_inFile.seekg(indexOffset, m_inFile.beg);
+	m_fileIndex.resize(numFrames);
+	for (uint32_t i = 0; i < numFrames; ++i)
+	{
+		ContainerIndexEntry& entry = m_fileIndex[i];
+		entry.offset       = readVar<uint64_t>(m_inFile);
+		entry.size         = readVar<uint32_t>(m_inFile);
+		entry.flags        = readVar<uint32_t>(m_inFile);
+		entry.encodeTimeNs = readVar<uint64_t>(m_inFile);
+		if (entry.offset + entry.size > indexOffset)
+		{
+			throw std::runtime_error("ERROR: Invalid frame index in the v2 file\n");
+		}
+	}
+	if (!m_inFile)
+	{
+		throw std::runtime_error("ERROR: Failed to read the frame index of the v2 file\n");
+	}
+}
+
+void VideoReader::openAvi()
+{
+	m_inFile.seekg(0, m_inFile.end);
+	m_fileSize = m_inFile.tellg();
+	m_inFile.seekg(4, m_inFile.beg);
+	uint64_t riffEnd = std::min<uint64_t>(m_fileSize, 8 + (uint64_t)readVar<uint32_t>(m_inFile));
+	if (readVar<uint32_t>(m_inFile) != AVI_AVI)
+	{
+		throw std::runtime_error("ERROR: The RIFF file is not an AVI\n");
+	}
+
+	// Walk the chunks of the first RIFF, stepping into every LIST except 'movi'. The strl lists hold the
+	// strh, strf and indx of one stream each, so the stream a chunk belongs to is the last strh seen.
+	int stream = -1, videoStream = -1;
+	uint64_t moviPos = 0, idx1Pos = 0, indxPos = 0;
+	uint32_t idx1Size = 0, indxSize = 0;
+	uint64_t pos = 12;
+	while (pos + 8 <= riffEnd)
+	{
+		m_inFile.seekg(pos, m_inFile.beg);
+		uint32_t id   = readVar<uint32_t>(m_inFile);
+		uint32_t size = readVar<uint32_t>(m_inFile);
+		if (!m_inFile || pos + 8 + size > m_fileSize)
+		{
+			break;
+		}
+
+		if (id == AVI_LIST)
+		{
+			uint32_t listType = readVar<uint32_t>(m_inFile);
+			if (listType == AVI_MOVI)
+			{
+				moviPos = pos + 8;
+			}
+			else
+			{
+				pos += 12;
+				continue;
+			}
+		}
+		else if (id == AVI_STRH && size >= 28)
+		{
+			uint32_t fccType = readVar<uint32_t>(m_inFile);
+			++stream;
+			if (fccType == AVI_VIDS && videoStream < 0)
+			{
+				videoStream = stream;
+				m_inFile.seekg(pos + 8 + 20, m_inFile.beg);
+				m_scale = readVar<uint32_t>(m_inFile);
+				m_rate  = readVar<uint32_t>(m_inFile);
+			}
+		}
+		else if (id == AVI_STRF && stream == videoStream && stream >= 0)
+		{
+			if (size < sizeof(BITMAPINFOHEADER))
+			{
+				throw std::runtime_error("ERROR: Invalid video stream format in the AVI file\n");
+			}
+			m_biFormat.resize(size);
+			m_inFile.read((char*)(BITMAPINFOHEADER*)m_biFormat, size);
+		}
+		else if (id == AVI_INDX && stream == videoStream && stream >= 0)
+		{
+			indxPos = pos + 8;
+			indxSize = size;
+		}
+		else if (id == AVI_IDX1)
+		{
+			idx1Pos = pos + 8;
+			idx1Size = size;
+		}
+		pos += 8 + ((uint64_t)size + 1) / 2 * 2;
+	}
+
+	if (videoStream < 0 || !moviPos)
+	{
+		throw std::runtime_error("ERROR: The AVI file has no video stream\n");
+	}
+
+	m_fileIndex.clear();
+	m_droppedFrames = 0;
+	if (indxPos && indxSize >= 24)
+	{
+		// OpenDML: a super index points to standard indexes ('ix##' chunks), which can also be in later RIFF-AVIX parts
+		m_inFile.seekg(indxPos + 3, m_inFile.beg);
+		uint8_t indexType = readVar<uint8_t>(m_inFile);
+		uint32_t numEntries = readVar<uint32_t>(m_inFile);
+		if (indexType == AVI_INDEX_OF_INDEXES)
+		{
+			std::vector<std::pair<uint64_t, uint32_t> > indexes;
+			m_inFile.seekg(indxPos + 24, m_inFile.beg);
+			for (uint32_t i = 0; i < numEntries && 24 + (i + 1) * 16 <= indxSize; ++i)
+			{
+				uint64_t offset = readVar<uint64_t>(m_inFile);
+				uint32_t size   = readVar<uint32_t>(m_inFile);
+				readVar<uint32_t>(m_inFile); // duration
+				indexes.push_back(std::make_pair(offset, size));
+			}
+			for (size_t i = 0; i < indexes.size(); ++i)
+			{
+				if (indexes[i].first + indexes[i].second > m_fileSize || indexes[i].second < 8)
+				{
+					throw std::runtime_error("ERROR: Invalid OpenDML super index in the AVI file\n");
+				}
+				readAviStdIndex(indexes[i].first + 8, indexes[i].second - 8);
+			}
+		}
+		else if (indexType == AVI_INDEX_OF_CHUNKS)
+		{
+			readAviStdIndex(indxPos, indxSize);
+		}
+	}
+	if (m_fileIndex.empty() && !m_droppedFrames && idx1Pos)
+	{
+		// Legacy index: the chunk ids of the video stream are "##dc" or "##db", offsets point to the chunk header
+		// and are relative to the 'movi' fourcc, except in some files where they are absolute
+		uint32_t streamId = ('0' + videoStream / 10) | (('0' + videoStream % 10) << 8);
+		uint32_t numEntries = idx1Size / 16;
+		std::vector<uint32_t> entries(numEntries * 4 + 1);
+		m_inFile.seekg(idx1Pos, m_inFile.beg);
+		m_inFile.read((char*)&entries[0], numEntries * 16);
+		uint64_t base = moviPos;
+		bool first = true;
+		for (uint32_t i = 0; i < numEntries; ++i)
+		{
+			uint32_t ckid = entries[i * 4], flags = entries[i * 4 + 1], offset = entries[i * 4 + 2], size = entries[i * 4 + 3];
+			if ((ckid & 0xFFFF) != streamId || ((ckid >> 16) != ('d' | ('c' << 8)) && (ckid >> 16) != ('d' | ('b' << 8))))
+			{
+				continue;
+			}
+			if (first && offset >= moviPos)
+			{
+				base = 0;
+			}
+			first = false;
+			addAviFrame(base + offset + 8, size, (flags & AVI_IDX1_KEYFRAME) != 0);
+		}
+	}
+	if (!m_inFile)
+	{
+		throw std::runtime_error("ERROR: Failed to read the index of the AVI file\n");
+	}
+	if (m_fileIndex.empty())
+	{
+		throw std::runtime_error("ERROR: The AVI file has no index (idx1 or OpenDML indx), unindexed AVI files are not supported\n");
+	}
+
+	m_headerSize = moviPos + 4;
+	m_fileFrame = 0;
+	m_inFile.seekg(m_headerSize, m_inFile.beg);
+}
+
+void VideoReader::readAviStdIndex(uint64_t pos, uint32_t chunkSize)
+{
+	m_inFile.seekg(pos + 3, m_inFile.beg);
+	uint8_t indexType   = readVar<uint8_t>(m_inFile);
+	uint32_t numEntries = readVar<uint32_t>(m_inFile);
+	readVar<uint32_t>(m_inFile); // chunk id
+	uint64_t base       = readVar<uint64_t>(m_inFile);
+	if (!m_inFile || indexType != AVI_INDEX_OF_CHUNKS || 24 + (uint64_t)numEntries * 8 > chunkSize)
+	{
+		throw std::runtime_error("ERROR: Invalid OpenDML standard index in the AVI file\n");
+	}
+
+	std::vector<uint32_t> entries(numEntries * 2 + 1);
+	m_inFile.seekg(pos + 24, m_inFile.beg);
+	m_inFile.read((char*)&entries[0], numEntries * 8);
+	for (uint32_t i = 0; i < numEntries; ++i)
+	{
+		uint32_t size = entries[i * 2 + 1];
+		addAviFrame(base + entries[i * 2], size & ~AVI_INDEX_DELTAFRAME, !(size & AVI_INDEX_DELTAFRAME));
+	}
+}
+
+void VideoReader::addAviFrame(uint64_t offset, uint32_t size, bool keyFrame)
+{
+	if (!size)
+	{
+		++m_droppedFrames;
+		return;
+	}
+	if (offset + size > m_fileSize)
+	{
+		throw std::runtime_error("ERROR: Invalid frame index in the AVI file\n");
+	}
+	ContainerIndexEntry entry = { offset, size, keyFrame ? CONTAINER_V2_KEYFRAME : 0, 0 };
+	m_fileIndex.push_back(entry);
+}
+
+bool VideoReader::readFrame()
+{
+	if (m_indexed)
+	{
+		if (m_currentFrame >= m_frameIndex.size())
+		{
+			return false;
+		}
+		const FrameEntry& entry = m_frameIndex[m_currentFrame++];
+		m_frameData = m_indexBase + entry.offset;
+		m_frameSize = entry.size;
+		return true;
+	}
+
+	if (hasFileIndex())
+	{
+		if (m_fileFrame >= m_fileIndex.size())
+		{
+			return false;
+		}
+		const ContainerIndexEntry& entry = m_fileIndex[m_fileFrame++];
+		m_frameSize = entry.size;
+		m_frameData = m_frameBufs.nextResized(m_frameSize);
+		m_inFile.seekg(entry.offset, m_inFile.beg);
+		m_inFile.read(m_frameData, m_frameSize);
+		return (bool) m_inFile;
+	}
+
+	if (m_inFile.eof())
+	{
+		return false;
+	}
+
+	if (m_raw)
+	{
+		m_frameSize = getFormat()->biSizeImage;
+	}
+	else
+	{
+		m_frameSize = readVar<uint32_t>(m_inFile);
+		if (!m_inFile)
+		{
+			return false;
+		}
+	}
+
+	m_frameData = m_frameBufs.nextResized(m_frameSize);
+	m_inFile.read(m_frameData, m_frameSize);
+	return (bool) m_inFile;
+}
+
+void VideoReader::preload(int maxFrames)
+{
+	// Reserve the arena up front when its size is known, so it is not reallocated while reading.
+	// With -frames the frames of framed input have unknown sizes, the arena grows with the frames read.
+	std::streampos dataStart = m_inFile.tellg();
+	m_inFile.seekg(0, m_inFile.end);
+	uint64_t dataSize = (uint64_t)(m_inFile.tellg() - dataStart);
+	m_inFile.seekg(dataStart);
+	if (m_raw && maxFrames)
+	{
+		dataSize = std::min<uint64_t>(dataSize, (uint64_t)maxFrames * getFormat()->biSizeImage);
+	}
+	m_arena.resize(m_raw || !maxFrames ? dataSize : 0);
+
+	// Every frame starts at the buffer alignment, the padding only grows the arena if the file is full of small frames
+	size_t alignment = AlignedBuffer::alignment();
+	uint64_t used = 0;
+	m_frameIndex.clear();
+	while ((!maxFrames || (int)m_frameIndex.size() < maxFrames) && readFrame())
+	{
+		FrameEntry entry;
+		entry.offset = (used + alignment - 1) / alignment * alignment;
+		entry.size = m_frameSize;
+		if (entry.offset + entry.size > m_arena.size())
+		{
+			// Doubles, but never beyond what the rest of the file can need
+			uint64_t needed = entry.offset + entry.size;
+			m_arena.reallocate((size_t)std::max(needed, std::min<uint64_t>(2 * needed, dataSize + m_frameIndex.size() * alignment + alignment)));
+		}
+		memcpy(m_arena.data() + entry.offset, m_frameData, m_frameSize);
+		m_frameIndex.push_back(entry);
+		used = entry.offset + entry.size;
+	}
+
+	if (m_frameIndex.empty())
+	{
+		throw std::runtime_error("ERROR: No frames could be preloaded from the input file\n");
+	}
+
+	// Release the streaming buffer, from now on frames are served from the arena
+	m_frameBufs.clear();
+	m_indexBase = m_arena.data();
+	m_indexedSize = used;
+	m_indexed = true;
+	m_currentFrame = 0;
+}
+
+void VideoReader::map(int maxFrames)
+{
+	m_hFile = CreateFileA(m_fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (m_hFile == INVALID_HANDLE_VALUE)
+	{
+		throw std::runtime_error("ERROR: Failed to open file for mapping: " + m_fileName);
+	}
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(m_hFile, &fileSize) || (uint64_t)fileSize.QuadPart > (SIZE_T)-1)
+	{
+		throw std::runtime_error("ERROR: File is too large to be mapped in this process: " + m_fileName);
+	}
+
+	m_hMapping = CreateFileMappingA(m_hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+	m_mappedView = m_hMapping ? MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+	if (!m_mappedView)
+	{
+		throw std::runtime_error("ERROR: Failed to map file into memory: " + m_fileName);
+	}
+
+	// One-time scan to build the frame index, v2 files already have it
+	const char* base = (const char*)m_mappedView;
+	uint64_t size = fileSize.QuadPart, pos = m_headerSize;
+	m_frameIndex.clear();
+	for (size_t i = 0; i < m_fileIndex.size() && (!maxFrames || (int)i < maxFrames); ++i)
+	{
+		FrameEntry entry;
+		entry.offset = m_fileIndex[i].offset;
+		entry.size = m_fileIndex[i].size;
+		m_frameIndex.push_back(entry);
+		pos = std::max(pos, entry.offset + entry.size);
+	}
+	while (!hasFileIndex() && (!maxFrames || (int)m_frameIndex.size() < maxFrames))
+	{
+		FrameEntry entry;
+		if (m_raw)
+		{
+			entry.size = getFormat()->biSizeImage;
+		}
+		else
+		{
+			if (pos + sizeof(uint32_t) > size)
+				break;
+			memcpy(&entry.size, base + pos, sizeof(uint32_t));
+			pos += sizeof(uint32_t);
+		}
+		if (pos + entry.size > size)
+			break;
+		entry.offset = pos;
+		m_frameIndex.push_back(entry);
+		pos += entry.size;
+	}
+
+	if (m_frameIndex.empty())
+	{
+		throw std::runtime_error("ERROR: No frames found in the mapped input file\n");
+	}
+
+	// Touch every page once, so page faults are not part of the measurement
+	volatile char sink = 0;
+	for (uint64_t page = 0; page < pos; page += 4096)
+	{
+		sink += base[page];
+	}
+
+	m_inFile.close();
+	m_indexBase = (char*)m_mappedView;
+	m_indexedSize = pos;
+	m_indexed = true;
+	m_currentFrame = 0;
+}
+
+void VideoReader::unmap()
+{
+	if (m_mappedView)
+		UnmapViewOfFile(m_mappedView);
+	if (m_hMapping)
+		CloseHandle(m_hMapping);
+	if (m_hFile != INVALID_HANDLE_VALUE)
+		CloseHandle(m_hFile);
+	m_mappedView = NULL;
+	m_hMapping = NULL;
+	m_hFile = INVALID_HANDLE_VALUE;
+}
+
+/////////////////////////////////////
+/// Writes a byte stream on a background thread: the data is collected into large sector aligned blocks,
+/// which are written with overlapped, unbuffered WriteFile calls while the next blocks are being filled.
+class AsyncFileWriter : public Thread
+{
+public:
+	enum { BLOCK_SIZE = 4 * 1024 * 1024, NUM_BLOCKS = 3, SECTOR_SIZE = 4096 };
+
+	AsyncFileWriter()
+		: m_hFile(INVALID_HANDLE_VALUE)
+		, m_ring(NUM_BLOCKS, BLOCK_SIZE, SECTOR_SIZE)
+		, m_block(NULL)
+		, m_size(0)
+	{
+		m_events[0] = m_events[1] = NULL;
+	}
+
+	~AsyncFileWriter()
+	{
+		if (m_hFile != INVALID_HANDLE_VALUE)
+		{
+			m_ring.abort();
+			try
+			{
+				join();
+			}
+			catch (std::exception&)
+			{
+			}
+			closeHandles();
+		}
+	}
+
+	void open(const char* filename);
+
+	/// Copies the data into the current block, waits only if all blocks are still being written
+	void write(const void* data, size_t size);
+
+	/// Writes the last block, waits for all writes and cuts the file to the written size.
+	/// Throws the error the writer thread failed with.
+	void close();
+
+	uint64_t size() const
+	{
+		return m_size;
+	}
+
+	/// Time write() spent waiting for a free block
+	Timer& stallTimer()
+	{
+		return m_ring.producerStall();
+	}
+
+protected:
+	void threadMain();
+
+private:
+	void waitWrite(OVERLAPPED& overlapped, PipelineFrame* block);
+
+	void closeHandles();
+
+	std::string m_fileName;
+	HANDLE m_hFile;
+	HANDLE m_events[2];
+	FrameRing m_ring;
+	PipelineFrame* m_block;
+	uint64_t m_size;
+};
+
+void AsyncFileWriter::open(const char* filename)
+{
+	m_fileName = filename;
+	m_hFile = CreateFileA(filename, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED, NULL);
+	if (m_hFile == INVALID_HANDLE_VALUE)
+	{
+		throw std::runtime_error(std::string("ERROR: Failed to open file: ") + filename);
+	}
+	for (int i = 0; i < 2; ++i)
+	{
+		m_events[i] = CreateEventA(NULL, TRUE, FALSE, NULL);
+		if (!m_events[i])
+		{
+			throw std::runtime_error("ERROR: CreateEvent() failed\n");
+		}
+	}
+	start();
+}
+
+void AsyncFileWriter::write(const void* data, size_t size)
+{
+	const char* src = (const char*)data;
+	while (size)
+	{
+		if (!m_block)
+		{
+			m_block = m_ring.acquire();
+			if (!m_block)
+			{
+				throw std::runtime_error("ERROR: Writing the output file failed\n"); // the writer thread aborted, close() tells why
+			}
+			m_block->dataSize = 0;
+			m_block->last = false;
+		}
+
+		size_t n = std::min<size_t>(size, BLOCK_SIZE - m_block->dataSize);
+		memcpy(m_block->buf.data() + m_block->dataSize, src, n);
+		m_block->dataSize += n;
+		m_size += n;
+		src += n;
+		size -= n;
+
+		if (m_block->dataSize == BLOCK_SIZE)
+		{
+			m_ring.publish(m_block);
+			m_block = NULL;
+		}
+	}
+}
+
+void AsyncFileWriter::close()
+{
+	if (m_hFile == INVALID_HANDLE_VALUE)
+		return;
+
+	// Unbuffered writes must be whole sectors, the last block is padded and the padding cut off below
+	if (m_block && m_block->dataSize)
+	{
+		uint32_t padded = align_to<SECTOR_SIZE>(m_block->dataSize);
+		memset(m_block->buf.data() + m_block->dataSize, 0, padded - m_block->dataSize);
+		m_block->dataSize = padded;
+		m_ring.publish(m_block);
+	}
+	else if (m_block)
+	{
+		m_ring.release(m_block);
+	}
+	m_block = NULL;
+
+	PipelineFrame* end = m_ring.acquire();
+	if (end)
+	{
+		end->last = true;
+		m_ring.publish(end);
+	}
+
+	std::string error;
+	try
+	{
+		join();
+	}
+	catch (std::exception& e)
+	{
+		error = e.what();
+	}
+	closeHandles();
+	if (!error.empty())
+	{
+		throw std::runtime_error(error);
+	}
+
+	HANDLE hFile = CreateFileA(m_fileName.c_str(), GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	LARGE_INTEGER size;
+	size.QuadPart = m_size;
+	bool truncated = hFile != INVALID_HANDLE_VALUE && SetFilePointerEx(hFile, size, NULL, FILE_BEGIN) && SetEndOfFile(hFile);
+	if (hFile != INVALID_HANDLE_VALUE)
+		CloseHandle(hFile);
+	if (!truncated)
+	{
+		throw std::runtime_error("ERROR: Failed to set the size of the output file\n");
+	}
+}
+
+void AsyncFileWriter::threadMain()
+{
+	// Two writes are kept in flight, a block is released to write() once its write completed
+	OVERLAPPED overlapped[2];
+	PipelineFrame* inFlight[2] = { NULL, NULL };
+	uint64_t offset = 0;
+	try
+	{
+		for (int slot = 0;; slot ^= 1)
+		{
+			if (inFlight[slot])
+			{
+				waitWrite(overlapped[slot], inFlight[slot]);
+				m_ring.release(inFlight[slot]);
+				inFlight[slot] = NULL;
+			}
+
+			PipelineFrame* block = m_ring.consume();
+			if (!block)
+				break;
+			if (block->last)
+			{
+				m_ring.release(block);
+				break;
+			}
+
+			memset(&overlapped[slot], 0, sizeof(overlapped[slot]));
+			overlapped[slot].Offset = (DWORD)offset;
+			overlapped[slot].OffsetHigh = (DWORD)(offset >> 32);
+			overlapped[slot].hEvent = m_events[slot];
+			if (!WriteFile(m_hFile, block->buf.data(), block->dataSize, NULL, &overlapped[slot]) && GetLastError() != ERROR_IO_PENDING)
+			{
+				m_ring.release(block);
+				throw std::runtime_error("ERROR: WriteFile() failed on the output file\n");
+			}
+			inFlight[slot] = block;
+			offset += block->dataSize;
+		}
+
+		for (int slot = 0; slot < 2; ++slot)
+		{
+			if (inFlight[slot])
+			{
+				PipelineFrame* block = inFlight[slot];
+				inFlight[slot] = NULL;
+				waitWrite(overlapped[slot], block);
+				m_ring.release(block);
+			}
+		}
+	}
+	catch (std::exception&)
+	{
+		// Writes still in flight must not outlive their buffers
+		for (int slot = 0; slot < 2; ++slot)
+		{
+			DWORD written;
+			if (inFlight[slot])
+				GetOverlappedResult(m_hFile, &overlapped[slot], &written, TRUE);
+		}
+		m_ring.abort();
+		throw;
+	}
+}
+
+void AsyncFileWriter::waitWrite(OVERLAPPED& overlapped, PipelineFrame* block)
+{
+	DWORD written = 0;
+	if (!GetOverlappedResult(m_hFile, &overlapped, &written, TRUE) || written != block->dataSize)
+	{
+		throw std::runtime_error("ERROR: Writing the output file failed (disk full?)\n");
+	}
+}
+
+void AsyncFileWriter::closeHandles()
+{
+	for (int i = 0; i < 2; ++i)
+	{
+		if (m_events[i])
+			CloseHandle(m_events[i]);
+		m_events[i] = NULL;
+	}
+	CloseHandle(m_hFile);
+	m_hFile = INVALID_HANDLE_VALUE;
+}
+
+/////////////////////////////////////
+class VideoWriter
+{
+public:
+	VideoWriter()
+		: m_asyncFile(NULL)
+		, m_position(0)
+		, m_container(CONTAINER_V1)
+		, m_aviFile(NULL)
+		, m_aviStream(NULL)
+		, m_aviFrame(0)
+	{}
+
+	~VideoWriter()
+	{
+		delete m_asyncFile;
+		closeAvi();
+	}
+
+	/// If biFormat is NULL the file is written as raw, else in the given container (v1, v2 or AVI).
+	/// async: write through an AsyncFileWriter instead of std::ofstream (not for AVI, which is written by AVIFile).
+	/// rate / scale: frame rate of the AVI stream header.
+	void open(const char* outfile, BITMAPINFOHEADER* biFormat = NULL, bool async = false, ContainerType container = CONTAINER_V1,
+		uint32_t rate = 25, uint32_t scale = 1);
+
+	/// keyFrame is stored by v2 and AVI, encodeTimeNs only by v2
+	void writeFrame(const void* data, uint32_t frameSize, bool keyFrame = true, uint64_t encodeTimeNs = 0);
+
+	/// Finishes the file (writes the v2 frame index), reports the errors of asynchronous writes
+	void close();
+
+	/// Time the asynchronous writer made writeFrame() wait, NULL if not asynchronous
+	Timer* writeStallTimer()
+	{
+		return m_asyncFile ? &m_asyncFile->stallTimer() : NULL;
+	}
+
+private:
+	void write(const void* data, size_t size);
+
+	/// Writes zeros up to the next multiple of alignment
+	void pad(uint32_t alignment);
+
+	void openAvi(const char* outfile, BITMAPINFOHEADER* biFormat, uint32_t rate, uint32_t scale);
+
+	void closeAvi();
+
+	std::ofstream m_outFile;
+	AsyncFileWriter* m_asyncFile;
+	uint64_t m_position;
+	bool m_raw;
+	ContainerType m_container;
+	std::vector<ContainerIndexEntry> m_index;
+	PAVIFILE m_aviFile;
+	PAVISTREAM m_aviStream;
+	LONG m_aviFrame;
+};
+
+void VideoWriter::open(const char* outfile, BITMAPINFOHEADER* biFormat, bool async, ContainerType container, uint32_t rate, uint32_t scale)
+{
+	m_container = container;
+	m_position = 0;
+	m_index.clear();
+	if (m_container == CONTAINER_AVI && biFormat)
+	{
+		m_raw = false;
+		openAvi(outfile, biFormat, rate, scale);
+		return;
+	}
+	if (async)
+	{
+		m_asyncFile = new AsyncFileWriter();
+		m_asyncFile->open(outfile);
+	}
+	else
+	{
+		m_outFile.open(outfile, std::ios::binary);
+		if (!m_outFile)
+		{
+			throw std::runtime_error(std::string("ERROR: Failed to open file: ") + outfile);
+		}
+	}
+
+	if (!biFormat)
+	{
+		m_raw = true;
+	}
+	else
+	{
+		m_raw = false;
+
+		// Write magic
+		uint32_t magic = m_container == CONTAINER_V2 ? CONTAINER_V2_MAGIC : CONTAINER_V1_MAGIC;
+		write(&magic, sizeof(magic));
+
+		// Write format block
+		uint32_t formatSize = biFormat->biSize;
+		write(&formatSize, sizeof(formatSize));
+		write(biFormat, biFormat->biSize);
+	}
+}
+
+void VideoWriter::writeFrame(const void* data, uint32_t frameSize, bool keyFrame, uint64_t encodeTimeNs)
+{
+	if (m_aviStream)
+	{
+		HRESULT hr = AVIStreamWrite(m_aviStream, m_aviFrame++, 1, (LPVOID)data, frameSize, keyFrame ? AVIIF_KEYFRAME : 0, NULL, NULL);
+		if (hr != AVIERR_OK)
+		{
+			throw std::runtime_error("ERROR: AVIStreamWrite() failed (disk full or over the AVI size limit?)\n");
+		}
+		return;
+	}
+
+	if (!m_raw && m_container == CONTAINER_V2)
+	{
+		pad(CONTAINER_V2_ALIGNMENT);
+		ContainerIndexEntry entry = { m_position, frameSize, keyFrame ? CONTAINER_V2_KEYFRAME : 0, encodeTimeNs };
+		m_index.push_back(entry);
+	}
+	else if (!m_raw)
+	{
+		write(&frameSize, sizeof(frameSize));
+	}
+	write(data, frameSize);
+}
+
+void VideoWriter::close()
+{
+	if (m_aviFile)
+	{
+		closeAvi();
+		return;
+	}
+
+	if (!m_raw && m_container == CONTAINER_V2 && (m_asyncFile || m_outFile.is_open()))
+	{
+		uint64_t indexOffset = m_position;
+		for (size_t i = 0; i < m_index.size(); ++i)
+		{
+			const ContainerIndexEntry& entry = m_index[i];
+			write(&entry.offset, sizeof(entry.offset));
+			write(&entry.size, sizeof(entry.size));
+			write(&entry.flags, sizeof(entry.flags));
+			write(&entry.encodeTimeNs, sizeof(entry.encodeTimeNs));
+		}
+		uint32_t numFrames = m_index.size();
+		write(&indexOffset, sizeof(indexOffset));
+		write(&numFrames, sizeof(numFrames));
+		write(&CONTAINER_V2_MAGIC, sizeof(CONTAINER_V2_MAGIC));
+	}
+
+	if (m_asyncFile)
+	{
+		m_asyncFile->close();
+	}
+	else if (m_outFile.is_open())
+	{
+		m_outFile.close();
+	}
+}
+
+void VideoWriter::write(const void* data, size_t size)
+{
+	if (m_asyncFile)
+		m_asyncFile->write(data, size);
+	else
+		m_outFile.write((const char*)data, size);
+	m_position += size;
+}
+
+void VideoWriter::pad(uint32_t alignment)
+{
+	static const char zeros[CONTAINER_V2_ALIGNMENT] = {};
+	uint32_t padding = (alignment - m_position % alignment) % alignment;
+	write(zeros, padding);
+}
+
+void VideoWriter::openAvi(const char* outfile, BITMAPINFOHEADER* biFormat, uint32_t rate, uint32_t scale)
+{
+	AVIFileInit();
+	// Replace any existing file
+	DeleteFileA(outfile);
+	HRESULT hr = AVIFileOpenA(&m_aviFile, outfile, OF_CREATE | OF_WRITE, NULL);
+	if (hr != AVIERR_OK)
+	{
+		m_aviFile = NULL;
+		AVIFileExit();
+		throw std::runtime_error(std::string("ERROR: Failed to create AVI file: ") + outfile);
+	}
+
+	AVISTREAMINFOA info;
+	memset(&info, 0, sizeof(info));
+	info.fccType = streamtypeVIDEO;
+	info.fccHandler = biFormat->biCompression;
+	info.dwScale = scale;
+	info.dwRate = rate;
+	info.dwSuggestedBufferSize = biFormat->biSizeImage;
+	SetRect(&info.rcFrame, 0, 0, biFormat->biWidth, abs(biFormat->biHeight));
+	hr = AVIFileCreateStreamA(m_aviFile, &m_aviStream, &info);
+	if (hr != AVIERR_OK)
+	{
+		m_aviStream = NULL;
+		closeAvi();
+		throw std::runtime_error("ERROR: AVIFileCreateStream() failed\n");
+	}
+
+	hr = AVIStreamSetFormat(m_aviStream, 0, biFormat, biFormat->biSize);
+	if (hr != AVIERR_OK)
+	{
+		closeAvi();
+		throw std::runtime_error("ERROR: AVIStreamSetFormat() failed, the output format is not accepted by AVIFile\n");
+	}
+	m_aviFrame = 0;
+}
+
+void VideoWriter::closeAvi()
+{
+	if (m_aviStream)
+		AVIStreamRelease(m_aviStream);
+	if (m_aviFile)
+	{
+		AVIFileRelease(m_aviFile);
+		AVIFileExit();
+	}
+	m_aviStream = NULL;
+	m_aviFile = NULL;
+}
+
+/////////////////////////////////////
+/// Duration of the steps of opening a codec, in milliseconds (NAN: not measured)
+struct InitTimes
+{
+	InitTimes()
+		: open(NAN)
+		, format(NAN)
+		, begin(NAN)
+	{}
+
+	double open;   ///< ICLocate/ICOpen, includes loading the driver DLL if no instance has it loaded yet
+	double format; ///< ICGetInfo, ICSetState and the format queries
+	double begin;  ///< ICDecompressBegin/ICDecompressExBegin, ICSeqCompressFrameStart/ICCompressBegin
+};
+
+void PrintInitTimes(const InitTimes& times)
+{
+	const char* names[3] = { "open", "format", "begin" };
+	double ms[3] = { times.open, times.format, times.begin };
+	for (int i = 0; i < 3; ++i)
+	{
+		printf(i ? " | %s " : "%s ", names[i]);
+		if (isnan(ms[i]))
+			printf("-");
+		else
+			printf("%.3f", ms[i]);
+	}
+	printf(" ms\n");
+}
+
+/////////////////////////////////////
+/// How frames are passed to the decompressor
+struct DecompressParams
+{
+	DecompressParams()
+		: ex(false)
+		, hurryUp(false)
+	{
+		memset(&srcRect, 0, sizeof(srcRect));
+		memset(&dstRect, 0, sizeof(dstRect));
+	}
+
+	bool ex;      ///< Call ICDecompressEx instead of ICDecompress
+	bool hurryUp; ///< Pass ICDECOMPRESS_HURRYUP, the decompressor may skip the actual decoding
+	RECT srcRect, dstRect; ///< ICDecompressEx source/destination rectangles, empty: whole frame
+};
+
+/////////////////////////////////////
+class Decompressor
+{
+public:
+	Decompressor()
+		: m_hic(0)
+		, m_decompressing(false)
+		, m_fixedOutput(false)
+	{}
+
+	~Decompressor()
+	{
+		if (m_hic)
+		{
+			if (m_decompressing)
+			{
+				if (m_params.ex)
+					ICDecompressExEnd(m_hic);
+				else
+					ICDecompressEnd(m_hic);
+			}
+			ICClose(m_hic);
+		}
+		m_hic = 0;
+	}
+
+	void init(BITMAPINFOHEADER* biFormatIn, BITMAPINFOHEADER* biFormatOut = NULL, int width = 0, int height = 0,
+		const DecompressParams& params = DecompressParams());
+
+	/// Decompresses into outBuf, or into the decompressor's own buffer if NULL.
+	/// Returns the ICERR_* result: negative on errors, positive if the frame was not decoded (e.g. ICERR_DONTDRAW).
+	LRESULT decompressFrame(const void* data, uint32_t dataSize, void* outBuf = NULL, bool keyFrame = true);
+
+	/// Output of the last decompressFrame() into the decompressor's own buffers
+	char* frameData()
+	{
+		return m_frameBufs.current();
+	}
+
+	BITMAPINFOHEADER* getOutputFormat()
+	{
+		return (BITMAPINFOHEADER*)m_biFormatOut;
+	}
+
+	const ICINFO& getInfo() const
+	{
+		return m_icinfo;
+	}
+
+	const DecompressParams& getParams() const
+	{
+		return m_params;
+	}
+
+	/// Duration of the init() steps
+	const InitTimes& initTimes() const
+	{
+		return m_initTimes;
+	}
+
+	/// Whether frameData() is always the same buffer (temporal decoders, -ring does not apply)
+	bool fixedOutput() const
+	{
+		return m_fixedOutput;
+	}
+
+private:
+	/// Starts ICDecompressEx decompression, resolving empty rectangles to the whole frame
+	void beginEx();
+
+	HIC m_hic;
+	ICINFO m_icinfo;
+	DecompressParams m_params;
+	InitTimes m_initTimes;
+	bool m_decompressing;
+	bool m_fixedOutput;
+	BufferRing m_frameBufs;
+	BitmapInfoHeader m_biFormatIn;
+	BitmapInfoHeader m_biFormatOut;
+};
+
+void Decompressor::init(BITMAPINFOHEADER* biFormatIn, BITMAPINFOHEADER* biFormatOut, int width, int height,
+	const DecompressParams& params)
+{
+	m_decompressing = false;
+	m_params = params;
+	m_initTimes = InitTimes();
+	Timer step;
+
+	// Locate decompressor
+	step.begin();
+	m_hic = ICLocate(ICTYPE_VIDEO, biFormatIn->biCompression, biFormatIn, NULL, ICMODE_DECOMPRESS);
+	step.end(false);
+	if (!m_hic)
+	{
+		throw std::runtime_error("ERROR: Could not find appropriate decompressor!\n");
+	}
+	m_initTimes.open = step.lastMs();
+
+	step.begin();
+	memset(&m_icinfo, 0, sizeof(m_icinfo));
+	m_icinfo.dwSize = sizeof(m_icinfo);
+	ICGetInfo(m_hic, &m_icinfo, sizeof(m_icinfo));
+
+	// Determine/request decompressed format
+	if (biFormatOut)
+	{
+		// Try to decompress to the requested format
+		LRESULT result = ICDecompressQuery(m_hic, biFormatIn, biFormatOut);
+		if (result != ICERR_OK)
+		{
+			throw std::runtime_error("ERROR: The decompressor cannot decompress to the requested format/size\n");
+		}
+		m_biFormatOut = biFormatOut;
+	}
+	else
+	{
+		// Ask the decompressor about decompressed format
+		DWORD decompFormatSize = ICDecompressGetFormatSize(m_hic, biFormatIn);
+		if (!decompFormatSize || (LONG)decompFormatSize < 0)
+		{
+			throw std::runtime_error("ICDecompressGetFormatSize() failed\n");
+		}
+		m_biFormatOut.resize(decompFormatSize);
+		LRESULT result = ICDecompressGetFormat(m_hic, biFormatIn, (BITMAPINFOHEADER*)m_biFormatOut);
+		if (result != ICERR_OK)
+		{
+			throw std::runtime_error("ICDecompressGetFormat() failed\n");
+		}
+	}
+
+	// Determine/request decompressed size
+	// Do separately, as it is for both the above cases
+	if (width || height )
+	{
+		BITMAPINFOHEADER* biOut = (BITMAPINFOHEADER*)m_biFormatOut;
+		if (width)  biOut->biWidth  = width;
+		if (height) biOut->biHeight = height;
+		// The format came at the input size, the frame buffers must hold the scaled frames
+		biOut->biSizeImage = GetImageSize(biOut);
+		LRESULT result = ICDecompressQuery(m_hic, biFormatIn, (BITMAPINFOHEADER*)m_biFormatOut);
+		if (result != ICERR_OK)
+		{
+			throw std::runtime_error("ERROR: The decompressor cannot decompress to the specified size\n");
+		}
+	}
+	step.end(false);
+	m_initTimes.format = step.lastMs();
+
+	// Initialize decompressor
+	m_biFormatIn = biFormatIn;
+	step.begin();
+	if (m_params.ex)
+	{
+		beginEx();
+	}
+	else
+	{
+		LRESULT result = ICDecompressBegin(m_hic, biFormatIn, (BITMAPINFOHEADER*)m_biFormatOut);
+		if (result != ICERR_OK)
+		{
+			throw std::runtime_error("ICDecompressBegin() failed\n");
+		}
+	}
+	step.end(false);
+	m_initTimes.begin = step.lastMs();
+	m_decompressing = true;
+
+	// Temporal decoders may update their previous output in place, so they always decode into the same buffer
+	m_fixedOutput = (m_icinfo.dwFlags & VIDCF_TEMPORAL) != 0;
+	m_frameBufs.allocate(((BITMAPINFOHEADER*)m_biFormatOut)->biSizeImage, m_fixedOutput ? 1 : 0);
+}
+
+void Decompressor::beginEx()
+{
+	BITMAPINFOHEADER* biIn = (BITMAPINFOHEADER*)m_biFormatIn;
+	BITMAPINFOHEADER* biOut = (BITMAPINFOHEADER*)m_biFormatOut;
+	RECT& src = m_params.srcRect;
+	RECT& dst = m_params.dstRect;
+	if (src.right <= src.left || src.bottom <= src.top)
+	{
+		src.left = src.top = 0;
+		src.right = biIn->biWidth;
+		src.bottom = abs(biIn->biHeight);
+	}
+	if (dst.right <= dst.left || dst.bottom <= dst.top)
+	{
+		dst.left = dst.top = 0;
+		dst.right = biOut->biWidth;
+		dst.bottom = abs(biOut->biHeight);
+	}
+	if (src.left < 0 || src.top < 0 || src.right > biIn->biWidth || src.bottom > abs(biIn->biHeight)
+		|| dst.left < 0 || dst.top < 0 || dst.right > biOut->biWidth || dst.bottom > abs(biOut->biHeight))
+	{
+		throw std::runtime_error("ERROR: Decompress rectangle is outside of the frame\n");
+	}
+
+	LRESULT result = ICDecompressExQuery(m_hic, 0,
+		biIn, NULL, src.left, src.top, src.right - src.left, src.bottom - src.top,
+		biOut, NULL, dst.left, dst.top, dst.right - dst.left, dst.bottom - dst.top);
+	if (result != ICERR_OK)
+	{
+		throw std::runtime_error("ERROR: The decompressor does not support ICDecompressEx with the given rectangles\n");
+	}
+	result = ICDecompressExBegin(m_hic, 0,
+		biIn, NULL, src.left, src.top, src.right - src.left, src.bottom - src.top,
+		biOut, NULL, dst.left, dst.top, dst.right - dst.left, dst.bottom - dst.top);
+	if (result != ICERR_OK)
+	{
+		throw std::runtime_error("ICDecompressExBegin() failed\n");
+	}
+}
+
+LRESULT Decompressor::decompressFrame(const void* data, uint32_t dataSize, void* outBuf, bool keyFrame)
+{
+	((BITMAPINFOHEADER*)m_biFormatIn)->biSizeImage = dataSize;
+	DWORD flags = 0;
+	if (m_params.hurryUp) flags |= ICDECOMPRESS_HURRYUP;
+	if (!keyFrame)        flags |= ICDECOMPRESS_NOTKEYFRAME;
+	void* out = outBuf ? outBuf : m_frameBufs.next();
+
+	if (!m_params.ex)
+	{
+		return (LONG)ICDecompress(m_hic, flags, (BITMAPINFOHEADER*)m_biFormatIn, (LPVOID) data, (BITMAPINFOHEADER*)m_biFormatOut, out);
+	}
+	const RECT& src = m_params.srcRect;
+	const RECT& dst = m_params.dstRect;
+	return ICDecompressEx(m_hic, flags,
+		(BITMAPINFOHEADER*)m_biFormatIn, (LPVOID) data, src.left, src.top, src.right - src.left, src.bottom - src.top,
+		(BITMAPINFOHEADER*)m_biFormatOut, out, dst.left, dst.top, dst.right - dst.left, dst.bottom - dst.top);
+}
+
+/////////////////////////////////////
+/// Generic compressor settings (COMPVARS), negative values keep the codec defaults
+struct CompressParams
+{
+	CompressParams()
+		: quality(-1)
+		, keyFrameRate(-1)
+		, dataRate(-1)
+		, direct(false)
+		, frameRate(0)
+	{}
+
+	LONG quality, keyFrameRate, dataRate;
+	bool direct; ///< Call ICCompress directly instead of going through ICSeqCompressFrame
+	double frameRate; ///< Frames per second for the -direct rate control (0: unknown, no frame size budget)
+};
+
+class Compressor
+{
+public:
+	Compressor()
+		: m_compvars()
+		, m_compressing(false)
+		, m_direct(false)
+		, m_frameRate(0)
+		, m_keepPrevious(false)
+	{}
+
+	~Compressor()
+	{
+		if (m_compvars.hic)
+		{
+			if (m_compressing)
+			{
+				if (m_direct)
+				{
+					if (m_keepPrevious)
+						ICDecompressEnd(m_compvars.hic);
+					ICCompressEnd(m_compvars.hic);
+				}
+				else
+					ICSeqCompressFrameEnd(&m_compvars);
+			}
+			ICClose(m_compvars.hic);
+		}
+	}
+
+	/// Return false means "no-compression" was selected
+	bool init(BITMAPINFOHEADER* biFormatIn, const CompressParams& params = CompressParams());
+
+	/// Opens the compressor with the given FOURCC without user interaction,
+	/// and applies the codec settings in state (see getState()) if not empty
+	void init(BITMAPINFOHEADER* biFormatIn, DWORD fccHandler, const std::vector<char>& state, const CompressParams& params = CompressParams());
+
+	/// Opens another instance of the codec selected for other, with the same settings
+	/// Return false means other is not compressing
+	bool init(BITMAPINFOHEADER* biFormatIn, const Compressor& other);
+
+	/// Codec specific settings (ICGetState)
+	std::vector<char> getState() const;
+
+	void compressFrame(const void* data);
+
+	char* frameData() const
+	{
+		return (char*) m_frameData;
+	}
+
+	uint32_t frameSize() const
+	{
+		return m_frameSize;
+	}
+
+	/// Whether the last frame was compressed into a keyframe
+	bool isKeyFrame() const
+	{
+		return m_keyFrame;
+	}
+
+	BITMAPINFOHEADER* getOutputFormat()
+	{
+		return (BITMAPINFOHEADER*)m_biFormatOut;
+	}
+
+	const ICINFO& getInfo() const
+	{
+		return m_icinfo;
+	}
+
+	/// "direct" (ICCompress) or "sequence" (ICSeqCompressFrame)
+	const char* engineName() const
+	{
+		return m_direct ? "direct" : "sequence";
+	}
+
+	/// FOURCC of the opened codec
+	DWORD getHandler() const
+	{
+		return m_compvars.fccHandler;
+	}
+
+	/// Settings in effect (also the ones chosen in the selection dialog), for opening another instance
+	CompressParams getParams() const;
+
+	/// Duration of the init() steps, the ICCompressorChoose dialog is not measured.
+	/// begin includes the output format queries of ICSeqCompressFrameStart/-direct.
+	const InitTimes& initTimes() const
+	{
+		return m_initTimes;
+	}
+
+private:
+	/// Opens the codec and loads its defaults, then applies params over them
+	void open(BITMAPINFOHEADER* biFormatIn, DWORD fccHandler, const std::vector<char>& state, const CompressParams& params);
+
+	/// Sets the non-negative params in COMPVARS and selects the engine
+	void applyParams(const CompressParams& params);
+
+	void start(BITMAPINFOHEADER* biFormatIn);
+
+	void startDirect(BITMAPINFOHEADER* biFormatIn);
+
+	void compressFrameDirect(const void* data);
+
+	COMPVARS m_compvars;
+	ICINFO m_icinfo;
+	InitTimes m_initTimes;
+	bool m_compressing;
+	bool m_direct;
+	LONG m_frameNum;
+	DWORD m_quality;
+	double m_frameRate;
+	DWORD m_frameBudget; // -direct: dwFrameSize of ICCompress, from lDataRate
+	bool m_keepPrevious;
+	BitmapInfoHeader m_biFormatIn;
+	BitmapInfoHeader m_biFormatDirectOut;
+	BufferRing m_directBufs;
+	DWORD m_directBufSize;
+	AlignedBuffer m_prevBuf;
+	LPVOID m_frameData;
+	LONG m_frameSize;
+	bool m_keyFrame;
+	BitmapInfoHeader m_biFormatOut;
+};
+
+bool Compressor::init(BITMAPINFOHEADER* biFormatIn, const CompressParams& params)
+{
+	m_compressing = false;
+	m_initTimes = InitTimes();
+	m_compvars.cbSize = sizeof(m_compvars);
+
+	// Choose compressor
+	if (!ICCompressorChoose(GetDesktopWindow(), 0, biFormatIn, NULL, &m_compvars, NULL))
+	{
+		throw std::runtime_error("Compressor selection was canceled!\n");
+	}
+
+	if (!m_compvars.hic)
+	{
+		return false;
+	}
+
+	applyParams(params);
+	start(biFormatIn);
+	return true;
+}
+
+void Compressor::init(BITMAPINFOHEADER* biFormatIn, DWORD fccHandler, const std::vector<char>& state, const CompressParams& params)
+{
+	m_compressing = false;
+	m_initTimes = InitTimes();
+	open(biFormatIn, fccHandler, state, params);
+	start(biFormatIn);
+}
+
+bool Compressor::init(BITMAPINFOHEADER* biFormatIn, const Compressor& other)
+{
+	m_compressing = false;
+	m_initTimes = InitTimes();
+	if (!other.m_compvars.hic)
+	{
+		return false;
+	}
+
+	open(biFormatIn, other.m_compvars.fccHandler, other.getState(), other.getParams());
+	start(biFormatIn);
+	return true;
+}
+
+CompressParams Compressor::getParams() const
+{
+	CompressParams params;
+	params.quality      = m_compvars.lQ;
+	params.keyFrameRate = m_compvars.lKey;
+	params.dataRate     = m_compvars.lDataRate;
+	params.direct       = m_direct;
+	params.frameRate    = m_frameRate;
+	return params;
+}
+
+std::vector<char> Compressor::getState() const
+{
+	std::vector<char> state;
+	DWORD stateSize = ICGetStateSize(m_compvars.hic);
+	if (stateSize && (LONG)stateSize > 0)
+	{
+		state.resize(stateSize);
+		ICGetState(m_compvars.hic, &state[0], stateSize);
+	}
+	return state;
+}
+
+void Compressor::open(BITMAPINFOHEADER* biFormatIn, DWORD fccHandler, const std::vector<char>& state, const CompressParams& params)
+{
+	m_compvars.cbSize     = sizeof(m_compvars);
+	m_compvars.dwFlags    = ICMF_COMPVARS_VALID;
+	m_compvars.fccType    = ICTYPE_VIDEO;
+	m_compvars.fccHandler = fccHandler;
+	Timer step;
+	step.begin();
+	m_compvars.hic        = ICOpen(ICTYPE_VIDEO, fccHandler, ICMODE_COMPRESS);
+	bool located = !m_compvars.hic;
+	if (located)
+	{
+		// Not installed under this exact FOURCC, ask the codecs which one can handle it
+		m_compvars.hic = ICLocate(ICTYPE_VIDEO, fccHandler, biFormatIn, NULL, ICMODE_COMPRESS);
+	}
+	step.end(false);
+	if (!m_compvars.hic)
+	{
+		char fccstr[32];
+		printfcc(fccstr, fccHandler, 0);
+		throw std::runtime_error(std::string("ERROR: Could not open compressor '") + fccstr + "'!\n");
+	}
+	m_initTimes.open = step.lastMs();
+
+	step.begin();
+	// ICLocate falls back to any codec that accepts the input, which must not silently replace the requested one
+	ICINFO info = {};
+	info.dwSize = sizeof(info);
+	if (located)
+		ICGetInfo(m_compvars.hic, &info, sizeof(info));
+	if (located && !SameFourCC(info.fccHandler, fccHandler))
+	{
+		char fccstr[32], openedstr[32];
+		printfcc(fccstr, fccHandler, 0);
+		printfcc(openedstr, info.fccHandler, 0);
+		ICClose(m_compvars.hic);
+		m_compvars.hic = 0;
+		throw std::runtime_error(std::string("ERROR: Compressor '") + fccstr + "' is not installed (found '" + openedstr + "' instead)\n");
+	}
+
+	if (!state.empty())
+	{
+		ICSetState(m_compvars.hic, (LPVOID)&state[0], state.size());
+	}
+
+	if (ICCompressQuery(m_compvars.hic, biFormatIn, NULL) != ICERR_OK)
+	{
+		throw std::runtime_error("ERROR: The compressor cannot compress the input format\n");
+	}
+
+	DWORD keyFrameRate = 0;
+	ICSendMessage(m_compvars.hic, ICM_GETDEFAULTKEYFRAMERATE, (DWORD_PTR)&keyFrameRate, 0);
+	m_compvars.lQ        = ICQUALITY_DEFAULT;
+	m_compvars.lKey      = keyFrameRate;
+	m_compvars.lDataRate = 0;
+	applyParams(params);
+	step.end(false);
+	m_initTimes.format = step.lastMs();
+}
+
+void Compressor::applyParams(const CompressParams& params)
+{
+	if (params.quality >= 0)      m_compvars.lQ        = params.quality;
+	if (params.keyFrameRate >= 0) m_compvars.lKey      = params.keyFrameRate;
+	if (params.dataRate >= 0)     m_compvars.lDataRate = params.dataRate;
+	m_direct = params.direct;
+	m_frameRate = params.frameRate;
+}
+
+void Compressor::start(BITMAPINFOHEADER* biFormatIn)
+{
+	Timer step;
+	step.begin();
+	memset(&m_icinfo, 0, sizeof(m_icinfo));
+	m_icinfo.dwSize = sizeof(m_icinfo);
+	ICGetInfo(m_compvars.hic, &m_icinfo, sizeof(m_icinfo));
+	step.end(false);
+	m_initTimes.format = (isnan(m_initTimes.format) ? 0.0 : m_initTimes.format) + step.lastMs();
+
+	step.begin();
+	if (m_direct)
+	{
+		startDirect(biFormatIn);
+	}
+	else
+	{
+		// Initialize compressor
+		BOOL res = ICSeqCompressFrameStart(&m_compvars, (LPBITMAPINFO) biFormatIn);
+		if (!res)
+		{
+			throw std::runtime_error("ERROR: ICSeqCompressFrameStart() failed\n");
+		}
+
+		m_compressing = true;
+		m_biFormatOut = (BITMAPINFOHEADER*) m_compvars.lpbiOut;
+	}
+	step.end(false);
+	m_initTimes.begin = step.lastMs();
+}
+
+void Compressor::startDirect(BITMAPINFOHEADER* biFormatIn)
+{
+	HIC hic = m_compvars.hic;
+	m_biFormatIn = biFormatIn;
+
+	// Ask the compressor about the compressed format
+	DWORD formatSize = ICCompressGetFormatSize(hic, biFormatIn);
+	if (!formatSize || (LONG)formatSize < 0)
+	{
+		throw std::runtime_error("ERROR: ICCompressGetFormatSize() failed\n");
+	}
+	m_biFormatOut.resize(formatSize);
+	if (ICCompressGetFormat(hic, biFormatIn, (BITMAPINFOHEADER*)m_biFormatOut) != ICERR_OK)
+	{
+		throw std::runtime_error("ERROR: ICCompressGetFormat() failed\n");
+	}
+	m_biFormatDirectOut = (BITMAPINFOHEADER*)m_biFormatOut;
+
+	if (ICCompressBegin(hic, biFormatIn, (BITMAPINFOHEADER*)m_biFormatOut) != ICERR_OK)
+	{
+		throw std::runtime_error("ERROR: ICCompressBegin() failed\n");
+	}
+	m_compressing = true;
+
+	// Rate control settings, as ICSeqCompressFrameStart sends them, and the per-frame budget for ICCompress
+	m_frameBudget = m_compvars.lDataRate > 0 && m_frameRate > 0 ? (DWORD)(m_compvars.lDataRate * 1024.0 / m_frameRate) : 0;
+	ICCOMPRESSFRAMES framesInfo = {};
+	framesInfo.lpbiOutput = (BITMAPINFOHEADER*)m_biFormatOut;
+	framesInfo.lpbiInput  = biFormatIn;
+	framesInfo.lQuality   = m_compvars.lQ;
+	framesInfo.lDataRate  = m_compvars.lDataRate * 1024;
+	framesInfo.lKeyRate   = m_compvars.lKey;
+	framesInfo.dwRate     = m_frameRate > 0 ? (DWORD)(m_frameRate * 1000.0 + 0.5) : 1000000;
+	framesInfo.dwScale    = m_frameRate > 0 ? 1000 : 66667;
+	ICSendMessage(hic, ICM_COMPRESS_FRAMES_INFO, (DWORD_PTR)&framesInfo, sizeof(framesInfo));
+
+	// Caller owned output buffer for the worst case frame size
+	DWORD maxSize = ICCompressGetSize(hic, biFormatIn, (BITMAPINFOHEADER*)m_biFormatOut);
+	if (!maxSize || (LONG)maxSize < 0)
+	{
+		maxSize = ((BITMAPINFOHEADER*)m_biFormatOut)->biSizeImage;
+	}
+	m_directBufSize = maxSize;
+	m_directBufs.allocate(m_directBufSize);
+
+	// Temporal codecs that cannot track the previous frame themselves get it passed in.
+	// Like ICSeqCompressFrame, it is their previous output decoded again by the same instance.
+	m_keepPrevious = (m_icinfo.dwFlags & VIDCF_TEMPORAL) && !(m_icinfo.dwFlags & VIDCF_FASTTEMPORALC);
+	if (m_keepPrevious)
+	{
+		if (ICDecompressBegin(hic, (BITMAPINFOHEADER*)m_biFormatOut, biFormatIn) != ICERR_OK)
+		{
+			m_keepPrevious = false;
+			throw std::runtime_error("ERROR: The temporal compressor cannot decompress its previous frame for -direct\n");
+		}
+		m_prevBuf.resize(biFormatIn->biSizeImage);
+		memset(m_prevBuf.data(), 0, biFormatIn->biSizeImage);
+	}
+
+	if (m_compvars.lQ == ICQUALITY_DEFAULT)
+	{
+		ICSendMessage(hic, ICM_GETDEFAULTQUALITY, (DWORD_PTR)&m_quality, 0);
+	}
+	else
+	{
+		m_quality = m_compvars.lQ;
+	}
+	m_frameNum = 0;
+}
+
+void Compressor::compressFrame(const void* data)
+{
+	if (m_direct)
+	{
+		compressFrameDirect(data);
+		return;
+	}
+
+	BOOL fKey = 1;
+	m_frameSize = ((BITMAPINFOHEADER*) m_compvars.lpbiIn)->biSizeImage;
+	m_frameData = ICSeqCompressFrame(&m_compvars, 0, (LPVOID) data, &fKey, &m_frameSize);
+	m_keyFrame = fKey != 0;
+	//printf("Key: %2d, Size: %ld, Size Out: %ld\n", fKey, m_frameSize, ((BITMAPINFOHEADER*) m_compvars.lpbiOut)->biSizeImage);
+}
+
+void Compressor::compressFrameDirect(const void* data)
+{
+	// Keyframes are placed explicitly: first frame, then every lKey frames
+	bool forceKey = m_frameNum == 0 || (m_compvars.lKey > 0 && m_frameNum % m_compvars.lKey == 0);
+	BITMAPINFOHEADER* biFormatIn = (BITMAPINFOHEADER*)m_biFormatIn;
+	BITMAPINFOHEADER* biFormatOut = (BITMAPINFOHEADER*)m_biFormatDirectOut;
+	biFormatOut->biSizeImage = m_directBufSize;
+	char* out = m_directBufs.next();
+
+	DWORD ckid = 0, aviFlags = 0;
+	DWORD result = ICCompress(m_compvars.hic, forceKey ? ICCOMPRESS_KEYFRAME : 0,
+		biFormatOut, out, biFormatIn, (LPVOID)data,
+		&ckid, &aviFlags, m_frameNum, m_frameBudget, m_quality,
+		m_keepPrevious && !forceKey ? biFormatIn : NULL, m_keepPrevious && !forceKey ? m_prevBuf.data() : NULL);
+	if (result != ICERR_OK)
+	{
+		throw std::runtime_error("ERROR: ICCompress() failed\n");
+	}
+
+	if (m_keepPrevious)
+	{
+		// The reference of the next frame is what a decoder sees, not the input
+		if (ICDecompress(m_compvars.hic, 0, biFormatOut, out, biFormatIn, m_prevBuf.data()) != ICERR_OK)
+		{
+			throw std::runtime_error("ERROR: ICDecompress() of the previous frame failed\n");
+		}
+	}
+
+	m_frameData = out;
+	m_frameSize = biFormatOut->biSizeImage;
+	m_keyFrame = (aviFlags & AVIIF_KEYFRAME) != 0;
+	++m_frameNum;
+}
+
+/////////////////////////////////////
+/// Source of counters read right before and after each timed codec call, on the calling thread.
+/// Counters of the codecs' own worker threads are not included.
+class CounterBackend
+{
+public:
+	enum { MAX_COUNTERS = 16 };
+
+	virtual ~CounterBackend() {}
+
+	virtual const char* name() const = 0;
+
+	/// Names of the counters, read() fills the values in this order
+	const std::vector<std::string>& counterNames() const
+	{
+		return m_names;
+	}
+
+	/// Called from every stream/stage thread, must not keep state
+	virtual void read(uint64_t* values) = 0;
+
+	/// Difference of two read() values of counter i
+	virtual uint64_t delta(size_t i, uint64_t start, uint64_t end) const
+	{
+		return end - start;
+	}
+
+	/// Creates the backend for a -pmc spec: 'cycles' or 'rdpmc[:name,...]'
+	static CounterBackend* create(const std::string& spec);
+
+protected:
+	std::vector<std::string> m_names;
+};
+
+/// Cycles of the calling thread (QueryThreadCycleTime) and the time stamp counter, always available
+class CycleCounterBackend : public CounterBackend
+{
+public:
+	CycleCounterBackend()
+	{
+		m_names.push_back("thread_cycles");
+		m_names.push_back("tsc");
+	}
+
+	const char* name() const
+	{
+		return "cycles";
+	}
+
+	void read(uint64_t* values)
+	{
+		ULONG64 cycles = 0;
+		QueryThreadCycleTime(GetCurrentThread(), &cycles);
+		values[0] = cycles;
+		values[1] = __rdtsc();
+	}
+};
+
+/// Reads the fixed-function PMCs (instructions, core cycles, reference cycles) and the first
+/// general purpose PMCs with rdpmc. Windows does not allow rdpmc in user mode by itself: a driver
+/// (e.g. the one of Intel PCM) has to enable it and program the general purpose counters, whose
+/// events are named on the command line. The counters are per CPU, pin the run with -affinity.
+class RdpmcCounterBackend : public CounterBackend
+{
+public:
+	explicit RdpmcCounterBackend(const std::vector<std::string>& programmable)
+	{
+		m_names.push_back("instructions");
+		m_names.push_back("core_cycles");
+		m_names.push_back("ref_cycles");
+		m_names.insert(m_names.end(), programmable.begin(), programmable.end());
+		if (m_names.size() > MAX_COUNTERS)
+		{
+			throw std::runtime_error("ERROR: Too many rdpmc counters\n");
+		}
+		if (!probe(programmable.size()))
+		{
+			throw std::runtime_error("ERROR: rdpmc is not enabled for user mode, a driver (e.g. Intel PCM) must enable and program the PMCs\n");
+		}
+	}
+
+	const char* name() const
+	{
+		return "rdpmc";
+	}
+
+	void read(uint64_t* values)
+	{
+		values[0] = __rdpmc(FIXED_COUNTERS | 0);
+		values[1] = __rdpmc(FIXED_COUNTERS | 1);
+		values[2] = __rdpmc(FIXED_COUNTERS | 2);
+		for (size_t i = 3; i < m_names.size(); ++i)
+		{
+			values[i] = __rdpmc((int)i - 3);
+		}
+	}
+
+	/// The counters are 48 bits wide and may wrap around
+	uint64_t delta(size_t i, uint64_t start, uint64_t end) const
+	{
+		return (end - start) & (((uint64_t)1 << 48) - 1);
+	}
+
+private:
+	enum { FIXED_COUNTERS = 1 << 30 };
+
+	/// Executes every rdpmc once, a vectored exception handler skips it if it faults
+	static bool probe(size_t numProgrammable)
+	{
+		s_faulted = false;
+		PVOID handler = AddVectoredExceptionHandler(1, probeHandler);
+		__rdpmc(FIXED_COUNTERS | 0);
+		__rdpmc(FIXED_COUNTERS | 1);
+		__rdpmc(FIXED_COUNTERS | 2);
+		for (size_t i = 0; i < numProgrammable && !s_faulted; ++i)
+		{
+			__rdpmc((int)i);
+		}
+		RemoveVectoredExceptionHandler(handler);
+		return !s_faulted;
+	}
+
+	static LONG CALLBACK probeHandler(EXCEPTION_POINTERS* info)
+	{
+		DWORD code = info->ExceptionRecord->ExceptionCode;
+		if (code != EXCEPTION_PRIV_INSTRUCTION && code != EXCEPTION_ILLEGAL_INSTRUCTION)
+			return EXCEPTION_CONTINUE_SEARCH;
+		s_faulted = true;
+#ifdef _WIN64
+		info->ContextRecord->Rip += 2; // rdpmc is 0F 33
+#else
+		info->ContextRecord->Eip += 2;
+#endif
+		return EXCEPTION_CONTINUE_EXECUTION;
+	}
+
+	static volatile bool s_faulted;
+};
+
+volatile bool RdpmcCounterBackend::s_faulted = false;
+
+CounterBackend* CounterBackend::create(const std::string& spec)
+{
+	size_t colon = spec.find(':');
+	std::string backend = spec.substr(0, colon);
+	if (backend == "cycles" && colon == std::string::npos)
+	{
+		return new CycleCounterBackend();
+	}
+	if (backend == "rdpmc")
+	{
+		std::vector<std::string> programmable;
+		while (colon != std::string::npos)
+		{
+			size_t next = spec.find(',', colon + 1);
+			programmable.push_back(spec.substr(colon + 1, next == std::string::npos ? std::string::npos : next - colon - 1));
+			colon = next;
+		}
+		return new RdpmcCounterBackend(programmable);
+	}
+	throw std::runtime_error("ERROR: Invalid -pmc backend (expected cycles or rdpmc[:name,...]): " + spec);
+}
+
+/////////////////////////////////////
+/// -verify results: bit-exact frames, and per plane the squared error and SSIM sums for PSNR/SSIM
+struct VerifyStats
+{
+	VerifyStats()
+		: frames(0)
+		, exactFrames(0)
+		, decodeErrors(0)
+		, numPlanes(0)
+		, bits(8)
+		, yuv(false)
+		, minPsnr(INFINITY)
+	{
+		for (int c = 0; c < 4; ++c)
+		{
+			sumSquaredDiff[c] = 0;
+			samples[c] = 0;
+			sumSsim[c] = 0;
+		}
+	}
+
+	void merge(const VerifyStats& other)
+	{
+		frames += other.frames;
+		exactFrames += other.exactFrames;
+		decodeErrors += other.decodeErrors;
+		if (other.numPlanes)
+		{
+			numPlanes = other.numPlanes;
+			bits = other.bits;
+			yuv = other.yuv;
+		}
+		minPsnr = std::min(minPsnr, other.minPsnr);
+		for (int c = 0; c < 4; ++c)
+		{
+			sumSquaredDiff[c] += other.sumSquaredDiff[c];
+			samples[c] += other.samples[c];
+			sumSsim[c] += other.sumSsim[c];
+		}
+	}
+
+	/// Largest sample value, at the 16-bit scale of PixelPlanes
+	double peak() const
+	{
+		return (double)((1 << bits) - 1) * (1 << (16 - bits));
+	}
+
+	/// PSNR of plane c over all decoded frames (infinite if they are all identical, NAN if none was decoded)
+	double psnr(int c) const
+	{
+		return samples[c] ? PsnrFromMse(sumSquaredDiff[c] / (double)samples[c], peak()) : NAN;
+	}
+
+	/// Mean SSIM of plane c over the decoded frames (NAN if none was decoded)
+	double ssim(int c) const
+	{
+		return frames > decodeErrors ? sumSsim[c] / (frames - decodeErrors) : NAN;
+	}
+
+	const char* planeName(int c) const
+	{
+		static const char* names[2][4] = { { "R", "G", "B", "A" }, { "Y", "U", "V", "A" } };
+		return names[yuv][c];
+	}
+
+	static double PsnrFromMse(double mse, double peak)
+	{
+		return mse > 0 ? 10.0 * log10(peak * peak / mse) : INFINITY;
+	}
+
+	int frames, exactFrames, decodeErrors;
+	int numPlanes, bits;
+	bool yuv;
+	double minPsnr; // of the worst frame, over all planes
+	uint64_t sumSquaredDiff[4], samples[4];
+	double sumSsim[4];
+};
+
+/// Decodes the compressor output with a second decompressor and compares it with the compressor input (-verify).
+/// Identical frames are found with memcmp, the others are unpacked to PixelPlanes for PSNR and SSIM.
+class FrameVerifier
+{
+public:
+	FrameVerifier()
+		: m_kernels(CompareKernels::get())
+	{}
+
+	/// biSource: format of the compressor input, the decoder is asked for the same format
+	void init(BITMAPINFOHEADER* biCompressed, BITMAPINFOHEADER* biSource)
+	{
+		m_decompressor.init(biCompressed, biSource);
+		m_format = biSource;
+	}
+
+	/// Call for every compressed frame in order, the decoder depends on the previous frames. Adds the result to stats,
+	/// or only decodes the frame if stats is NULL (warm-up frames).
+	void verify(const char* compressed, uint32_t compressedSize, bool keyFrame, const char* source, VerifyStats* stats);
+
+	const char* kernelName() const
+	{
+		return m_kernels.name;
+	}
+
+private:
+	/// Mean SSIM of plane c over its 8x8 blocks
+	double planeSsim(int c) const;
+
+	const CompareKernels& m_kernels;
+	Decompressor m_decompressor;
+	BitmapInfoHeader m_format;
+	PixelPlanes m_source, m_decoded;
+};
+
+void FrameVerifier::verify(const char* compressed, uint32_t compressedSize, bool keyFrame, const char* source, VerifyStats* statsOut)
+{
+	bool decoded = m_decompressor.decompressFrame(compressed, compressedSize, NULL, keyFrame) == ICERR_OK;
+	if (!statsOut)
+		return;
+	VerifyStats& stats = *statsOut;
+	++stats.frames;
+	if (!decoded)
+	{
+		++stats.decodeErrors;
+		return;
+	}
+
+	BITMAPINFOHEADER* format = m_format;
+	size_t numSamples = (size_t)format->biWidth * abs(format->biHeight);
+	const char* frame = m_decompressor.frameData();
+	bool exact = memcmp(frame, source, format->biSizeImage) == 0;
+	double frameSquaredDiff = 0;
+	if (!exact)
+	{
+		// Row padding may differ while the pixels do not, so a zero error also counts as exact
+		UnpackPixels(format, source, m_source);
+		UnpackPixels(format, frame, m_decoded);
+		uint64_t squaredDiff[4];
+		for (int c = 0; c < m_source.numPlanes; ++c)
+		{
+			squaredDiff[c] = m_kernels.sumSquaredDiff(&m_source.planes[c][0], &m_decoded.planes[c][0], numSamples);
+			frameSquaredDiff += squaredDiff[c];
+		}
+		exact = frameSquaredDiff == 0;
+		for (int c = 0; !exact && c < m_source.numPlanes; ++c)
+		{
+			stats.sumSquaredDiff[c] += squaredDiff[c];
+			stats.sumSsim[c] += planeSsim(c);
+		}
+		stats.numPlanes = m_source.numPlanes;
+		stats.bits = m_source.bits;
+		stats.yuv = m_source.yuv;
+	}
+	else if (!stats.numPlanes)
+	{
+		// Plane layout of the format, taken from the first frame
+		UnpackPixels(format, source, m_source);
+		stats.numPlanes = m_source.numPlanes;
+		stats.bits = m_source.bits;
+		stats.yuv = m_source.yuv;
+	}
+
+	for (int c = 0; c < stats.numPlanes; ++c)
+	{
+		stats.samples[c] += numSamples;
+		if (exact)
+			stats.sumSsim[c] += 1.0;
+	}
+	if (exact)
+	{
+		++stats.exactFrames;
+	}
+	else
+	{
+		double psnr = VerifyStats::PsnrFromMse(frameSquaredDiff / (numSamples * stats.numPlanes), stats.peak());
+		stats.minPsnr = std::min(stats.minPsnr, psnr);
+	}
+}
+
+double FrameVerifier::planeSsim(int c) const
+{
+	const double peak = (double)((1 << m_source.bits) - 1) * (1 << (16 - m_source.bits));
+	const double c1 = (0.01 * peak) * (0.01 * peak), c2 = (0.03 * peak) * (0.03 * peak);
+	const int w = m_source.width, h = m_source.height;
+	double sum = 0;
+	int blocks = 0;
+	for (int y = 0; y + 8 <= h; y += 8)
+	{
+		for (int x = 0; x + 8 <= w; x += 8)
+		{
+			double s[5];
+			m_kernels.blockSums(&m_source.planes[c][(size_t)y * w + x], &m_decoded.planes[c][(size_t)y * w + x], w, s);
+			double ma = s[0] / 64, mb = s[1] / 64;
+			double va = s[2] / 64 - ma * ma, vb = s[3] / 64 - mb * mb, cov = s[4] / 64 - ma * mb;
+			sum += (2 * ma * mb + c1) * (2 * cov + c2) / ((ma * ma + mb * mb + c1) * (va + vb + c2));
+			++blocks;
+		}
+	}
+	return blocks ? sum / blocks : 1.0;
+}
+
+/////////////////////////////////////
+/// Sizes of a processed frame
+struct FrameRecord
+{
+	uint32_t inputSize, rawSize, outputSize;
+	bool keyFrame;
+};
+
+/// Timed work of one -loop iteration
+struct LoopRecord
+{
+	int frames;
+	int64_t decompSamples, decompCounts, compSamples, compCounts;
+};
+
+/// Accumulated measurements of a stream
+struct BenchStats
+{
+	BenchStats()
+		: numFrames(0)
+		, decompErrors(0)
+		, decompSkipped(0)
+		, sumInputSize(0)
+		, sumRawSize(0)
+		, sumOutputSize(0)
+		, sumDecodedSize(0)
+		, sumConvertedSize(0)
+	{}
+
+	void addFrame(uint32_t inputSize, uint32_t rawSize, uint32_t outputSize, bool keyFrame)
+	{
+		++numFrames;
+		sumInputSize += inputSize;
+		sumRawSize += rawSize;
+		sumOutputSize += outputSize;
+
+		FrameRecord record = { inputSize, rawSize, outputSize, keyFrame };
+		frames.push_back(record);
+	}
+
+	/// Adds the frames and times of other, for totals over several streams
+	void merge(const BenchStats& other)
+	{
+		numFrames += other.numFrames;
+		decompErrors += other.decompErrors;
+		decompSkipped += other.decompSkipped;
+		sumInputSize += other.sumInputSize;
+		sumRawSize += other.sumRawSize;
+		sumOutputSize += other.sumOutputSize;
+		sumDecodedSize += other.sumDecodedSize;
+		sumConvertedSize += other.sumConvertedSize;
+		frames.insert(frames.end(), other.frames.begin(), other.frames.end());
+		mergeTimer(decompTimer, other.decompTimer);
+		mergeTimer(compTimer, other.compTimer);
+		mergeTimer(convTimer, other.convTimer);
+		mergeCounters(decompCounters, other.decompCounters);
+		mergeCounters(compCounters, other.compCounters);
+		verify.merge(other.verify);
+
+		// Loop i of every stream adds up to loop i of the total, like the frames and times above
+		if (loops.size() < other.loops.size())
+		{
+			LoopRecord empty = {};
+			loops.resize(other.loops.size(), empty);
+		}
+		for (size_t i = 0; i < other.loops.size(); ++i)
+		{
+			loops[i].frames        += other.loops[i].frames;
+			loops[i].decompSamples += other.loops[i].decompSamples;
+			loops[i].decompCounts  += other.loops[i].decompCounts;
+			loops[i].compSamples   += other.loops[i].compSamples;
+			loops[i].compCounts    += other.loops[i].compCounts;
+		}
+	}
+
+	/// decompFPS() (compress false) or compFPS() of every loop
+	std::vector<double> loopFPS(bool compress) const
+	{
+		std::vector<double> fps;
+		const Timer& timer = compress ? compTimer : decompTimer;
+		for (size_t i = 0; i < loops.size(); ++i)
+		{
+			int64_t samples = compress ? loops[i].compSamples : loops[i].decompSamples;
+			int64_t counts = compress ? loops[i].compCounts : loops[i].decompCounts;
+			if (samples && counts)
+				fps.push_back((double)samples * timer.freq.QuadPart / counts);
+		}
+		return fps;
+	}
+
+	double decompFPS() const   { return 1000000.0 * decompTimer.numSamples / decompTimer.sumTimeUs(); } // decoded frames only
+	double decompMiBps() const { return 1000000.0 * sumDecodedSize / 1024.0 / 1024.0 / decompTimer.sumTimeUs(); } // decoded frames only
+	double decompRatio() const { return (double) sumRawSize / sumInputSize; }
+	double compFPS() const     { return 1000000.0 * numFrames / compTimer.sumTimeUs(); }
+	double compMiBps() const   { return 1000000.0 * sumConvertedSize / 1024.0 / 1024.0 / compTimer.sumTimeUs(); } // compressor input size
+	double compRatio() const   { return (double) sumConvertedSize / sumOutputSize; }
+	double convFPS() const     { return 1000000.0 * convTimer.numSamples / convTimer.sumTimeUs(); }
+	double convMiBps() const   { return 1000000.0 * sumRawSize / 1024.0 / 1024.0 / convTimer.sumTimeUs(); }
+
+	Timer decompTimer, compTimer, convTimer;
+	int numFrames;
+	int decompErrors, decompSkipped; // frames the decompressor failed on / did not decode, left out of decompTimer
+	std::vector<uint64_t> decompCounters, compCounters; // CounterBackend sums over the timed calls
+	VerifyStats verify;
+	uint64_t sumInputSize, sumRawSize, sumOutputSize;
+	uint64_t sumDecodedSize; // raw size of the frames in decompTimer
+	uint64_t sumConvertedSize; // size of the frames in compTimer as the compressor got them (after -convert)
+	std::vector<FrameRecord> frames;
+	std::vector<LoopRecord> loops; // loops with timed frames, through BenchStream::endLoop()
+
+private:
+	static void mergeTimer(Timer& timer, const Timer& other)
+	{
+		timer.sumCounts += other.sumCounts;
+		timer.numSamples += other.numSamples;
+		timer.samples.insert(timer.samples.end(), other.samples.begin(), other.samples.end());
+	}
+
+	static void mergeCounters(std::vector<uint64_t>& counters, const std::vector<uint64_t>& other)
+	{
+		if (counters.size() < other.size())
+			counters.resize(other.size());
+		for (size_t i = 0; i < other.size(); ++i)
+			counters[i] += other[i];
+	}
+};
+
+/////////////////////////////////////
+/// Leaky bucket (VBV-style) model of the compressed stream: every frame adds its size to the bucket, which drains
+/// at the channel rate, one frame interval per frame. Overflowing frames would be lost by a buffer of that size.
+struct VbvStats
+{
+	VbvStats()
+		: bufferBytes(0), bytesPerSecond(0), fps(0)
+		, peakFullness(0), overflowFrames(0), firstOverflow(-1)
+		, maxFrameSize(0), maxFrameNum(-1), maxFrameKey(false)
+		, peakFrameBitrate(0), peakWindowBitrate(0), avgBitrate(0)
+	{}
+
+	double bufferBytes, bytesPerSecond, fps;
+	double peakFullness;               // bytes, after adding a frame
+	int overflowFrames, firstOverflow; // frames that did not fit in bufferBytes, the first one (-1: none)
+	uint32_t maxFrameSize;
+	int maxFrameNum;
+	bool maxFrameKey;
+	double peakFrameBitrate;           // bits/s of the largest frame sent in one frame interval
+	double peakWindowBitrate;          // bits/s over the worst one second window
+	double avgBitrate;                 // bits/s
+	std::vector<double> fullness;      // bytes per frame, after adding the frame
+	std::vector<double> windowBitrate; // bits/s of the one second window ending at the frame
+};
+
+/// bytesPerSecond 0: drain at the average rate of the frames
+VbvStats SimulateVbv(const std::vector<FrameRecord>& frames, double bufferBytes, double bytesPerSecond, double fps)
+{
+	VbvStats vbv;
+	vbv.bufferBytes = bufferBytes;
+	vbv.fps = fps;
+	size_t n = frames.size();
+	if (!n || fps <= 0.0)
+		return vbv;
+
+	uint64_t sumSize = 0;
+	for (size_t i = 0; i < n; ++i)
+		sumSize += frames[i].outputSize;
+	vbv.avgBitrate = 8.0 * sumSize * fps / n;
+	vbv.bytesPerSecond = bytesPerSecond > 0.0 ? bytesPerSecond : vbv.avgBitrate / 8.0;
+
+	double drain = vbv.bytesPerSecond / fps, level = 0.0;
+	size_t window = std::max<size_t>(1, (size_t)(fps + 0.5));
+	uint64_t windowSize = 0;
+	vbv.fullness.reserve(n);
+	vbv.windowBitrate.reserve(n);
+	for (size_t i = 0; i < n; ++i)
+	{
+		uint32_t size = frames[i].outputSize;
+		if (size > vbv.maxFrameSize)
+		{
+			vbv.maxFrameSize = size;
+			vbv.maxFrameNum = (int)i;
+			vbv.maxFrameKey = frames[i].keyFrame;
+		}
+
+		level += size;
+		if (bufferBytes > 0.0 && level > bufferBytes)
+		{
+			if (vbv.firstOverflow < 0)
+				vbv.firstOverflow = (int)i;
+			++vbv.overflowFrames;
+		}
+		vbv.peakFullness = std::max(vbv.peakFullness, level);
+		vbv.fullness.push_back(level);
+		if (bufferBytes > 0.0)
+			level = std::min(level, bufferBytes); // the excess is lost, it does not count against later frames
+		level = std::max(0.0, level - drain);
+
+		windowSize += size;
+		if (i >= window)
+			windowSize -= frames[i - window].outputSize;
+		double bitrate = 8.0 * windowSize * fps / std::min(i + 1, window);
+		vbv.windowBitrate.push_back(bitrate);
+		if (i + 1 >= std::min(window, n))
+			vbv.peakWindowBitrate = std::max(vbv.peakWindowBitrate, bitrate);
+	}
+	vbv.peakFrameBitrate = 8.0 * vbv.maxFrameSize * fps;
+	return vbv;
+}
+
+/////////////////////////////////////
+/// A decompressor -> compressor chain with its own measurements
+class BenchStream
+{
+public:
+	BenchStream()
+		: m_decompress(false)
+		, m_compress(false)
+		, m_flushCache(false)
+		, m_counters(NULL)
+		, m_warmupFrames(0)
+		, m_decompCalls(0)
+		, m_compCalls(0)
+		, m_convCalls(0)
+		, m_countCalls(0)
+		, m_countRawSize(0)
+		, m_convert(false)
+		, m_verify(false)
+	{
+		LoopRecord start = {};
+		m_loopStart = start;
+	}
+
+	Decompressor& decompressor()
+	{
+		return m_decompressor;
+	}
+
+	Compressor& compressor()
+	{
+		return m_compressor;
+	}
+
+	BenchStats& stats()
+	{
+		return m_stats;
+	}
+
+	/// Enables the stages, their codecs must already be initialized
+	void setStages(bool decompress, bool compress)
+	{
+		m_decompress = decompress;
+		m_compress = compress;
+	}
+
+	/// Evict the input and output buffers of each stage from the caches after it ran (outside of the timed region)
+	void setFlushCache(bool flushCache)
+	{
+		m_flushCache = flushCache;
+	}
+
+	/// Decodes every compressed frame again (untimed) and compares it with the compressor input, which is in
+	/// biSource format. The compressor must already be initialized.
+	void enableVerify(BITMAPINFOHEADER* biSource)
+	{
+		m_verifier.init(m_compressor.getOutputFormat(), biSource);
+		m_verify = true;
+	}
+
+	const FrameVerifier& verifier() const
+	{
+		return m_verifier;
+	}
+
+	/// Converts the decompressed frames from biFormatIn to biFormatOut before they are compressed
+	void enableConvert(BITMAPINFOHEADER* biFormatIn, BITMAPINFOHEADER* biFormatOut)
+	{
+		m_converter.init(biFormatIn, biFormatOut);
+		m_convert = true;
+	}
+
+	const FormatConverter& converter() const
+	{
+		return m_converter;
+	}
+
+	bool converts() const
+	{
+		return m_convert;
+	}
+
+	/// Reads the counters of backend (not owned, NULL: none) around the timed codec calls
+	void setCounters(CounterBackend* backend)
+	{
+		m_counters = backend;
+		size_t numCounters = backend ? backend->counterNames().size() : 0;
+		m_stats.decompCounters.assign(numCounters, 0);
+		m_stats.compCounters.assign(numCounters, 0);
+	}
+
+	/// The first numFrames frames go through the codecs but are left out of the measurements
+	void setWarmup(int numFrames)
+	{
+		m_warmupFrames = numFrames;
+	}
+
+	/// Processes a frame through the enabled stages,
+	/// data, dataSize and keyFrame (the input's flag) are updated to the output of the last stage
+	void processFrame(char*& data, uint32_t& dataSize, bool& keyFrame);
+
+	/// Timed decompression only, into outBuf or the decompressor's own buffer if NULL.
+	/// Failed and not decoded frames are counted, but not timed.
+	void decompressFrame(char*& data, uint32_t& dataSize, char* outBuf = NULL, bool keyFrame = true);
+
+	/// Timed compression only
+	void compressFrame(char*& data, uint32_t& dataSize);
+
+	/// Timed format conversion only (if enabled), into outBuf or the converter's own buffer if NULL
+	void convertFrame(char*& data, uint32_t& dataSize, char* outBuf = NULL);
+
+	/// Duration of the last compressFrame() call (warm-up frames included)
+	uint64_t lastEncodeTimeNs() const
+	{
+		return (uint64_t)(m_stats.compTimer.lastCounts * 1000000000.0 / m_stats.compTimer.freq.QuadPart);
+	}
+
+	/// Adds a fully processed frame to the measurements (unless it is a warm-up frame)
+	void countFrame(uint32_t inputSize, uint32_t rawSize, uint32_t outputSize, bool keyFrame);
+
+	/// All frames through countFrame(), warm-up frames included
+	int processedFrames() const
+	{
+		return m_countCalls;
+	}
+
+	/// Raw size of all frames through countFrame(), warm-up frames included
+	uint64_t processedRawSize() const
+	{
+		return m_countRawSize;
+	}
+
+	/// Closes a -loop iteration: its frames and times become a LoopRecord, unless they were all warm-up frames.
+	/// Must be called on the thread that runs the stages.
+	void endLoop();
+
+private:
+	/// Adds the counter differences between start and end to sums
+	void addCounters(std::vector<uint64_t>& sums, const uint64_t* start, const uint64_t* end);
+
+	bool         m_decompress, m_compress, m_flushCache;
+	CounterBackend* m_counters;
+	int          m_warmupFrames;
+	int          m_decompCalls, m_compCalls, m_convCalls, m_countCalls; // per stage, as stages may run on different threads
+	uint64_t     m_countRawSize;
+	Decompressor m_decompressor;
+	Compressor   m_compressor;
+	bool         m_convert;
+	FormatConverter m_converter;
+	bool         m_verify;
+	FrameVerifier m_verifier;
+	BenchStats   m_stats;
+	LoopRecord   m_loopStart; // totals at the start of the current loop
+};
+
+void BenchStream::processFrame(char*& data, uint32_t& dataSize, bool& keyFrame)
+{
+	uint32_t inputSize = dataSize;
+
+	// Decompress if needed
+	if (m_decompress)
+	{
+		decompressFrame(data, dataSize, NULL, keyFrame);
+	}
+
+	uint32_t rawSize = dataSize;
+
+	// Convert if needed
+	convertFrame(data, dataSize);
+
+	// Compress if needed
+	if (m_compress)
+	{
+		compressFrame(data, dataSize);
+		keyFrame = m_compressor.isKeyFrame();
+	}
+
+	countFrame(inputSize, rawSize, dataSize, keyFrame);
+}
+
+void BenchStream::decompressFrame(char*& data, uint32_t& dataSize, char* outBuf, bool keyFrame)
+{
+	bool timed = m_decompCalls++ >= m_warmupFrames;
+	uint64_t countersStart[CounterBackend::MAX_COUNTERS], countersEnd[CounterBackend::MAX_COUNTERS];
+	if (timed)
+	{
+		// Counters are read outside of the timer, so reading them does not slow down the fps
+		if (m_counters)
+			m_counters->read(countersStart);
+		m_stats.decompTimer.begin();
+	}
+	LRESULT result = m_decompressor.decompressFrame(data, dataSize, outBuf, keyFrame);
+	if (timed)
+	{
+		if (result == ICERR_OK)
+		{
+			m_stats.decompTimer.end();
+			m_stats.sumDecodedSize += m_decompressor.getOutputFormat()->biSizeImage;
+			if (m_counters)
+			{
+				m_counters->read(countersEnd);
+				addCounters(m_stats.decompCounters, countersStart, countersEnd);
+			}
+		}
+		else if (result < 0)
+			++m_stats.decompErrors;
+		else
+			++m_stats.decompSkipped;
+	}
+	char* outData = outBuf ? outBuf : m_decompressor.frameData();
+	uint32_t outSize = m_decompressor.getOutputFormat()->biSizeImage;
+	if (m_flushCache)
+	{
+		FlushCache(data, dataSize);
+		FlushCache(outData, outSize);
+	}
+	data = outData;
+	dataSize = outSize;
+}
+
+void BenchStream::compressFrame(char*& data, uint32_t& dataSize)
+{
+	bool timed = m_compCalls++ >= m_warmupFrames;
+	uint64_t countersStart[CounterBackend::MAX_COUNTERS], countersEnd[CounterBackend::MAX_COUNTERS];
+	if (timed && m_counters)
+		m_counters->read(countersStart);
+	m_stats.compTimer.begin(); // warm-up frames too, for lastEncodeTimeNs()
+	m_compressor.compressFrame(data);
+	m_stats.compTimer.end(timed);
+	if (timed)
+	{
+		m_stats.sumConvertedSize += dataSize;
+		if (m_counters)
+		{
+			m_counters->read(countersEnd);
+			addCounters(m_stats.compCounters, countersStart, countersEnd);
+		}
+	}
+	if (m_verify)
+	{
+		// Warm-up frames are decoded too (the decoder needs the whole sequence) but not counted
+		m_verifier.verify(m_compressor.frameData(), m_compressor.frameSize(), m_compressor.isKeyFrame(), data, timed ? &m_stats.verify : NULL);
+	}
+	if (m_flushCache)
+	{
+		FlushCache(data, dataSize);
+		FlushCache(m_compressor.frameData(), m_compressor.frameSize());
+	}
+	data = m_compressor.frameData();
+	dataSize = m_compressor.frameSize();
+}
+
+void BenchStream::convertFrame(char*& data, uint32_t& dataSize, char* outBuf)
+{
+	if (!m_convert)
+	{
+		if (outBuf)
+		{
+			memcpy(outBuf, data, dataSize);
+			data = outBuf;
+		}
+		return;
+	}
+
+	bool timed = m_convCalls++ >= m_warmupFrames;
+	m_stats.convTimer.begin();
+	char* outData = m_converter.convert(data, outBuf);
+	m_stats.convTimer.end(timed);
+	uint32_t outSize = m_converter.getOutputFormat()->biSizeImage;
+	if (m_flushCache)
+	{
+		FlushCache(data, dataSize);
+		FlushCache(outData, outSize);
+	}
+	data = outData;
+	dataSize = outSize;
+}
+
+void BenchStream::endLoop()
+{
+	LoopRecord total = { m_stats.numFrames, m_stats.decompTimer.numSamples, m_stats.decompTimer.sumCounts,
+		m_stats.compTimer.numSamples, m_stats.compTimer.sumCounts };
+	LoopRecord loop = { total.frames - m_loopStart.frames,
+		total.decompSamples - m_loopStart.decompSamples, total.decompCounts - m_loopStart.decompCounts,
+		total.compSamples - m_loopStart.compSamples, total.compCounts - m_loopStart.compCounts };
+	if (loop.frames)
+		m_stats.loops.push_back(loop);
+	m_loopStart = total;
+}
+
+void BenchStream::addCounters(std::vector<uint64_t>& sums, const uint64_t* start, const uint64_t* end)
+{
+	for (size_t i = 0; i < sums.size(); ++i)
+	{
+		sums[i] += m_counters->delta(i, start[i], end[i]);
+	}
+}
+
+void BenchStream::countFrame(uint32_t inputSize, uint32_t rawSize, uint32_t outputSize, bool keyFrame)
+{
+	m_countRawSize += rawSize;
+	if (m_countCalls++ >= m_warmupFrames)
+	{
+		m_stats.addFrame(inputSize, rawSize, outputSize, keyFrame);
+	}
+}
+
+/////////////////////////////////////
+std::string ToUtf8(const WCHAR* str)
+{
+	int size = WideCharToMultiByte(CP_UTF8, 0, str, -1, NULL, 0, NULL, NULL);
+	if (size <= 1)
+		return std::string();
+	std::vector<char> buf(size);
+	WideCharToMultiByte(CP_UTF8, 0, str, -1, &buf[0], size, NULL, NULL);
+	return std::string(&buf[0]);
+}
+
+/// Ordered list of named results, written as a JSON document or as CSV.
+/// Keys are grouped with '.', e.g. "compress.fps"; keys of a group must be added together.
+class Report
+{
+public:
+	void addString(const std::string& key, const std::string& value)
+	{
+		Entry entry = { key, value, true };
+		m_entries.push_back(entry);
+	}
+
+	void addNumber(const std::string& key, double value)
+	{
+		Entry entry = { key, formatNumber(value), false };
+		m_entries.push_back(entry);
+	}
+
+	void addInt(const std::string& key, int64_t value)
+	{
+		char buf[32];
+		snprintf(buf, sizeof(buf), "%lld", (long long)value);
+		Entry entry = { key, buf, false };
+		m_entries.push_back(entry);
+	}
+
+	void addBool(const std::string& key, bool value)
+	{
+		Entry entry = { key, value ? "true" : "false", false };
+		m_entries.push_back(entry);
+	}
+
+	void addFormat(const std::string& key, BITMAPINFOHEADER* biFormat);
+
+	/// Starts a table, written as an array of objects (JSON) or a separate section (CSV).
+	/// The following addCell() calls fill it row by row.
+	void beginTable(const std::string& name, const std::vector<std::string>& columns)
+	{
+		Table table;
+		table.name = name;
+		table.columns = columns;
+		m_tables.push_back(table);
+	}
+
+	void addCell(double value)
+	{
+		Entry cell = { std::string(), formatNumber(value), false };
+		m_tables.back().cells.push_back(cell);
+	}
+
+	void addCell(const std::string& value)
+	{
+		Entry cell = { std::string(), value, true };
+		m_tables.back().cells.push_back(cell);
+	}
+
+	void writeJson(const char* filename) const;
+
+	void writeCsv(const char* filename) const;
+
+private:
+	struct Entry
+	{
+		std::string key, value;
+		bool quoted;
+	};
+
+	struct Table
+	{
+		std::string name;
+		std::vector<std::string> columns;
+		std::vector<Entry> cells;
+	};
+
+	static std::string formatNumber(double value)
+	{
+		char buf[64];
+		snprintf(buf, sizeof(buf), isfinite(value) ? "%.10g" : "null", value);
+		return buf;
+	}
+
+	static std::string jsonString(const std::string& str);
+
+	static std::string csvString(const std::string& str);
+
+	static std::vector<std::string> splitKey(const std::string& key);
+
+	std::vector<Entry> m_entries;
+	std::vector<Table> m_tables;
+};
+
+void Report::addFormat(const std::string& key, BITMAPINFOHEADER* biFormat)
+{
+	char fccstr[32];
+	printfcc(fccstr, biFormat->biCompression, biFormat->biBitCount);
+	addInt(key + ".width", biFormat->biWidth);
+	addInt(key + ".height", biFormat->biHeight);
+	addInt(key + ".planes", biFormat->biPlanes);
+	addInt(key + ".bitcount", biFormat->biBitCount);
+	addString(key + ".compression", fccstr);
+	addInt(key + ".size_image", biFormat->biSizeImage);
+}
+
+std::string Report::jsonString(const std::string& str)
+{
+	std::string result = "\"";
+	for (size_t i = 0; i < str.size(); ++i)
+	{
+		unsigned char c = str[i];
+		if (c == '"' || c == '\\')
+		{
+			result += '\\';
+			result += c;
+		}
+		else if (c < 0x20)
+		{
+			char buf[8];
+			snprintf(buf, sizeof(buf), "\\u%04x", c);
+			result += buf;
+		}
+		else
+		{
+			result += c;
+		}
+	}
+	return result + "\"";
+}
+
+std::string Report::csvString(const std::string& str)
+{
+	if (str.find_first_of(",\"\r\n") == std::string::npos)
+		return str;
+
+	std::string result = "\"";
+	for (size_t i = 0; i < str.size(); ++i)
+	{
+		if (str[i] == '"')
+			result += '"';
+		result += str[i];
+	}
+	return result + "\"";
+}
+
+std::vector<std::string> Report::splitKey(const std::string& key)
+{
+	std::vector<std::string> parts;
+	size_t start = 0, dot;
+	while ((dot = key.find('.', start)) != std::string::npos)
+	{
+		parts.push_back(key.substr(start, dot - start));
+		start = dot + 1;
+	}
+	parts.push_back(key.substr(start));
+	return parts;
+}
+
+void Report::writeJson(const char* filename) const
+{
+	FILE* f = fopen(filename, "w");
+	if (!f)
+	{
+		throw std::runtime_error(std::string("ERROR: Failed to open report file: ") + filename);
+	}
+
+	fprintf(f, "{");
+	std::vector<std::string> openGroups;
+	bool first = true;
+	for (size_t i = 0; i < m_entries.size(); ++i)
+	{
+		std::vector<std::string> parts = splitKey(m_entries[i].key);
+		std::string name = parts.back();
+		parts.pop_back();
+
+		// Close the groups not shared with this key, then open the new ones
+		size_t common = 0;
+		while (common < openGroups.size() && common < parts.size() && openGroups[common] == parts[common])
+			++common;
+		while (openGroups.size() > common)
+		{
+			openGroups.pop_back();
+			fprintf(f, "\n%*s}", (int)openGroups.size() * 2 + 2, "");
+			first = false;
+		}
+		while (openGroups.size() < parts.size())
+		{
+			fprintf(f, "%s\n%*s%s: {", first ? "" : ",", (int)openGroups.size() * 2 + 2, "", jsonString(parts[openGroups.size()]).c_str());
+			openGroups.push_back(parts[openGroups.size()]);
+			first = true;
+		}
+
+		const std::string& value = m_entries[i].quoted ? jsonString(m_entries[i].value) : m_entries[i].value;
+		fprintf(f, "%s\n%*s%s: %s", first ? "" : ",", (int)openGroups.size() * 2 + 2, "", jsonString(name).c_str(), value.c_str());
+		first = false;
+	}
+	while (!openGroups.empty())
+	{
+		openGroups.pop_back();
+		fprintf(f, "\n%*s}", (int)openGroups.size() * 2 + 2, "");
+		first = false;
+	}
+
+	for (size_t t = 0; t < m_tables.size(); ++t)
+	{
+		const Table& table = m_tables[t];
+		fprintf(f, "%s\n  %s: [", first ? "" : ",", jsonString(table.name).c_str());
+		for (size_t i = 0; i < table.cells.size(); ++i)
+		{
+			size_t col = i % table.columns.size();
+			const Entry& cell = table.cells[i];
+			if (col == 0)
+				fprintf(f, "%s\n    {", i ? "," : "");
+			else
+				fprintf(f, ", ");
+			std::string value = cell.quoted ? jsonString(cell.value) : cell.value;
+			fprintf(f, "%s: %s", jsonString(table.columns[col]).c_str(), value.c_str());
+			if (col + 1 == table.columns.size())
+				fprintf(f, "}");
+		}
+		fprintf(f, "\n  ]");
+		first = false;
+	}
+	fprintf(f, "\n}\n");
+	fclose(f);
+}
+
+void Report::writeCsv(const char* filename) const
+{
+	FILE* f = fopen(filename, "w");
+	if (!f)
+	{
+		throw std::runtime_error(std::string("ERROR: Failed to open report file: ") + filename);
+	}
+
+	fprintf(f, "key,value\n");
+	for (size_t i = 0; i < m_entries.size(); ++i)
+	{
+		fprintf(f, "%s,%s\n", csvString(m_entries[i].key).c_str(), csvString(m_entries[i].value).c_str());
+	}
+
+	for (size_t t = 0; t < m_tables.size(); ++t)
+	{
+		const Table& table = m_tables[t];
+		fprintf(f, "\n%s\n", csvString(table.name).c_str());
+		for (size_t col = 0; col < table.columns.size(); ++col)
+		{
+			fprintf(f, "%s%s", col ? "," : "", csvString(table.columns[col]).c_str());
+		}
+		for (size_t i = 0; i < table.cells.size(); ++i)
+		{
+			size_t col = i % table.columns.size();
+			fprintf(f, "%s%s", col ? "," : "\n", csvString(table.cells[i].value).c_str());
+		}
+		fprintf(f, "\n");
+	}
+	fclose(f);
+}
+
+/////////////////////////////////////
+/// One combination of a parameter sweep
+struct SweepPoint
+{
+	std::string format, codec, stateFile;
+	int width, height;
+	CompressParams params;
+};
+
+/////////////////////////////////////
+class CodecBench
+{
+public:
+	CodecBench()
+		: m_counterBackend(NULL)
+		, m_gopScheduler(NULL)
+		, m_channelScheduler(NULL)
+		, m_streamB(NULL)
+		, m_fullStream(NULL)
+		, m_scaleCalls(0)
+	{}
+
+	~CodecBench();
+
+	void init(int argc, char* argv[]);
+
+	void run();
+
+private:
+	class StreamThread : public Thread
+	{
+	public:
+		StreamThread(CodecBench& bench, BenchStream& stream)
+			: m_bench(bench)
+			, m_stream(stream)
+		{}
+
+	protected:
+		void threadMain()
+		{
+			m_bench.runStream(m_stream);
+		}
+
+	private:
+		CodecBench&  m_bench;
+		BenchStream& m_stream;
+	};
+
+	class GopThread : public Thread
+	{
+	public:
+		GopThread(CodecBench& bench, BenchStream& stream)
+			: m_bench(bench)
+			, m_stream(stream)
+		{}
+
+	protected:
+		void threadMain()
+		{
+			m_bench.runGopWorker(m_stream);
+		}
+
+	private:
+		CodecBench&  m_bench;
+		BenchStream& m_stream;
+	};
+
+	class ChannelThread : public Thread
+	{
+	public:
+		ChannelThread(CodecBench& bench, int worker)
+			: m_bench(bench)
+			, m_worker(worker)
+		{}
+
+	protected:
+		void threadMain()
+		{
+			m_bench.runChannelWorker(m_worker);
+		}
+
+	private:
+		CodecBench& m_bench;
+		int         m_worker;
+	};
+
+	/// -initbench measurements of one codec, the samples are in nanoseconds (for GetLatencyStats())
+	struct InitBenchStage
+	{
+		bool         enabled;
+		std::wstring driver;         // ICINFO::szDriver, pinned during the cycles
+		InitTimes    cold;           // the first open of the process, by init()
+		double       coldFirstFrame; // ms
+		std::vector<int64_t> dllLoad, open, format, begin, firstFrame, close, reopen;
+	};
+
+	/// A -channels live channel: m_streams[index] with its frame clock
+	struct LiveChannel
+	{
+		size_t  nextFrame, numFrames;
+		int64_t phaseCounts;            // offset of the channel's frame clock, so the channels do not all release at once
+		std::vector<int64_t> latency;   // release to done, per measured frame
+		std::vector<int64_t> service;   // start to done, per measured frame
+		int     misses;                 // frames done after the release of the next frame
+	};
+
+	enum PipelineStage
+	{
+		STAGE_READ,
+		STAGE_DECOMPRESS,
+		STAGE_COMPRESS,
+		STAGE_WRITE
+	};
+
+	class PipelineThread : public Thread
+	{
+	public:
+		PipelineThread(CodecBench& bench, size_t stageIndex)
+			: m_bench(bench)
+			, m_stageIndex(stageIndex)
+		{}
+
+	protected:
+		void threadMain()
+		{
+			m_bench.runPipelineStage(m_stageIndex);
+		}
+
+	private:
+		CodecBench& m_bench;
+		size_t      m_stageIndex;
+	};
+
+	static const char* stageName(PipelineStage stage);
+
+	void initArguments(int argc, char* argv[]);
+
+	/// Applies -priority, -affinity and -numa to the process and the main thread
+	void initProcess();
+
+	/// CPU of the threadIndex-th -threads instance, round-robin over the affinity mask (0: not pinned)
+	DWORD_PTR threadAffinity(size_t threadIndex) const;
+
+	void initInput();
+
+	void initDecompressor();
+
+	void initCompressor();
+
+	void initOutput();
+
+	void initStreams();
+
+	void destroyStreams();
+
+	/// Reads the -sweep configuration into m_sweepPoints
+	void initSweep(const char* sweepFile);
+
+	/// -gopthreads with -synthetic: compresses the generated frames with -codec (not measured), they become the input
+	void encodeSynthetic();
+
+	/// Whether input frame frameNum (counted from the start of the loop) is a keyframe, from the v2 or AVI index or -inkeyint
+	bool isInputKeyFrame(int frameNum) const
+	{
+		if (m_videoReader.hasFileIndex())
+			return m_videoReader.isKeyFrame(frameNum);
+		return m_inputKeyInt <= 0 || frameNum % m_inputKeyInt == 0;
+	}
+
+	/// Prints the measurements of the stream, returns the number of characters printed
+	int printStats(const BenchStats& stats);
+
+	/// Overwrites the status line (ncharsPrev long) with the stream's measurements, returns the new length
+	int printStatus(const BenchStats& stats, int ncharsPrev);
+
+	/// Measurements of all streams together
+	BenchStats totalStats();
+
+	/// Prints the per-frame latency distribution over all streams
+	void printLatency();
+
+	/// Frames through all streams, warm-up frames included (the CPU and wall times cover those too)
+	int processedFrames();
+
+	/// Raw size of the frames of processedFrames()
+	uint64_t processedRawSize();
+
+	/// Prints the process CPU time of the run against the wall time and the processed frames
+	void printCpu();
+
+	/// Prints the -pmc counters per timed frame of each stage
+	void printCounters();
+
+	/// -vbv simulation over the compressed frames of the first stream
+	VbvStats vbvStats()
+	{
+		return SimulateVbv(m_streams[0]->stats().frames, m_vbvBufferBytes, m_vbvBytesPerSecond, m_fps);
+	}
+
+	/// Prints the -vbv bucket fullness, overflows and peak bitrates
+	void printVbv();
+
+	void writeReport();
+
+	/// Writes the report to -report in -reportformat
+	void saveReport(const Report& report);
+
+	void runSingle();
+
+	/// Runs the A (m_streams[0]) and B (m_streamB) compressors on the same frames in ABBA order
+	void runAB();
+
+	/// -postscale path: decodes the input frame at full size with m_fullStream, then scales it (timed separately)
+	void postScaleFrame(const char* data, uint32_t dataSize, bool keyFrame, int frameIndex);
+
+	/// Codec-side scaled decode and full decode + scale times of the frames both paths measured, in frame order
+	void pairPostScale(std::vector<int64_t>& codec, std::vector<int64_t>& postScale) const;
+
+	/// Prints the codec-side scaled decode against the full size decode and post-scale
+	void printPostScale();
+
+	/// Prints the paired B/A encode time and frame size ratios of runAB()
+	void printAB();
+
+	/// Compressed size of every measured frame, for GetPairedRatio()
+	static std::vector<int64_t> abFrameSizes(const BenchStats& stats)
+	{
+		std::vector<int64_t> sizes;
+		for (size_t i = 0; i < stats.frames.size(); ++i)
+			sizes.push_back(stats.frames[i].outputSize);
+		return sizes;
+	}
+
+	/// Runs every m_sweepPoints combination on the preloaded input, prints a table of the results
+	void runSweep();
+
+	/// Opens and closes the codecs -initbench times, prints and reports the time of each step
+	void runInitBench();
+
+	void runThreads();
+
+	/// Runs all loops over the indexed input on the stream (called on a StreamThread)
+	void runStream(BenchStream& stream);
+
+	/// Splits the indexed input at its keyframes into m_gopSegments
+	void initGopSegments();
+
+	/// Decodes the input's segments on -gopthreads threads, writes the output in order on the calling thread
+	void runGop();
+
+	/// Decodes segments from m_gopScheduler with the stream's decompressor (called on a GopThread)
+	void runGopWorker(BenchStream& stream);
+
+	/// Runs -channels live channels at -fps on a pool of -pool threads
+	void runChannels();
+
+	/// Runs the frames of due channels from m_channelScheduler (called on a ChannelThread)
+	void runChannelWorker(int worker);
+
+	/// Release time of frame frameNum of the channel (QueryPerformanceCounter)
+	int64_t channelRelease(const LiveChannel& channel, size_t frameNum) const
+	{
+		return m_channelStart + channel.phaseCounts + (int64_t)(frameNum * m_channelPeriod);
+	}
+
+	/// Frames of all channels and the estimated number of channels the pool sustains (by mean and p99 service time)
+	void channelTotals(int& frames, int& misses, double& capacityMean, double& capacityP99, LatencyStats& latency, LatencyStats& service);
+
+	void runPipeline();
+
+	/// Runs a pipeline stage between m_rings[stageIndex - 1] and m_rings[stageIndex] (called on a PipelineThread)
+	void runPipelineStage(size_t stageIndex);
+
+	void pipelineRead(FrameRing& out);
+
+	void pipelineCodec(PipelineStage stage, FrameRing& in, FrameRing& out);
+
+	void pipelineWrite(FrameRing& in);
+
+	bool         m_rawin, m_rawout, m_decompress, m_compress, m_preload, m_mmap, m_pipeline;
+	const char  *m_synthetic;
+	uint32_t     m_seed;
+	const char  *m_infile, *m_outfile, *m_decompFormat, *m_convertFormat, *m_reportFile, *m_reportFormat;
+	bool         m_reportFrames, m_quiet, m_flushCache, m_asyncWrite, m_verify;
+	const char  *m_ringArg, *m_priority;
+	const char  *m_containerArg, *m_fpsArg;
+	ContainerType m_container;
+	uint32_t     m_fpsRate, m_fpsScale;
+	double       m_fps;      // -fps or the input AVI rate, for the output, -vbv and the -direct data rate
+	const char  *m_vbvArg;
+	double       m_vbvBufferBytes, m_vbvBytesPerSecond;
+	DWORD_PTR    m_affinityMask;
+	int          m_numaNode;
+	const char  *m_pmcArg;
+	CounterBackend* m_counterBackend;
+	int          m_refreshMs;
+	Timer        m_wallTimer;
+	CpuTimer     m_cpuTimer;
+	const char  *m_warmupArg, *m_codec, *m_codecStateFile, *m_saveCodecStateFile;
+	const char  *m_codec2, *m_codecStateFile2;
+	DecompressParams m_decompressParams;
+	CompressParams m_compressParams;
+	int          m_inputKeyInt;
+	int          m_decompWidth, m_decompHeight, m_framesToProcess, m_loopCount, m_threadCount, m_queueLength, m_warmupFrames;
+	int          m_gopThreads;
+	std::vector<size_t> m_gopSegments; // first frame of every segment
+	TaskScheduler* m_gopScheduler;
+	int          m_channelCount, m_poolThreads;
+	std::vector<LiveChannel> m_channels;
+	ChannelScheduler* m_channelScheduler;
+	int64_t      m_channelStart;
+	double       m_channelPeriod; // counts per frame at -fps
+	VideoReader  m_videoReader;
+	VideoWriter  m_videoWriter;
+	std::vector<BenchStream*> m_streams;
+	BenchStream* m_streamB; // -codec2 compressor, kept out of totalStats()
+	const char  *m_postScaleArg;
+	BenchStream* m_fullStream; // -postscale full size decompressor, kept out of totalStats()
+	FrameScaler  m_scaler;
+	Timer        m_scaleTimer;
+	int          m_scaleCalls;
+	std::vector<std::pair<int, int64_t> > m_codecScaledSamples, m_postScaleSamples; // frame index, counts
+	std::vector<PipelineStage> m_stages;
+	std::vector<FrameRing*> m_rings;
+	std::vector<SweepPoint> m_sweepPoints;
+	int          m_initBenchCount;
+	BitmapInfoHeader m_formatDecompressed;
+	BitmapInfoHeader m_formatConverted; // compressor input: m_formatDecompressed or the -convert format
+	BitmapInfoHeader m_formatCompressed;
+
+	// ---
+
+	static bool s_stop;
+
+	static void sighandler(int signo)
+	{
+		s_stop = true;
+	}
+};
+
+bool CodecBench::s_stop = false;
+
+CodecBench::~CodecBench()
+{
+	destroyStreams();
+	delete m_counterBackend;
+}
+
+void CodecBench::destroyStreams()
+{
+	for (size_t i = 0; i < m_streams.size(); ++i)
+	{
+		delete m_streams[i];
+	}
+	for (size_t i = 0; i < m_rings.size(); ++i)
+	{
+		delete m_rings[i];
+	}
+	delete m_streamB;
+	m_streamB = NULL;
+	delete m_fullStream;
+	m_fullStream = NULL;
+	m_streams.clear();
+	m_rings.clear();
+	m_stages.clear();
+}
+
+void CodecBench::init(int argc, char* argv[])
+{
+	signal(SIGINT, sighandler);
+
+	initArguments(argc, argv);
+	initProcess();
+	initInput();
+	if (!m_sweepPoints.empty())
+	{
+		return; // set up for each combination by runSweep()
+	}
+	initDecompressor();
+	initCompressor();
+	initOutput();
+	initStreams();
+}
+
+void CodecBench::initArguments(int argc, char* argv[])
+{
+	if (argc < 2)
+	{
+		printf("Usage: %s -i <infile> -o [outfile] [options]\n", argv[0]);
+		printf("Options:\n");
+		printf("  -i [infile]  Input file. Required.\n");
+		printf("  -o [outfile] Output file. Optional. If not given, the output is discarded.\n");
+		printf("  -container [v] Output container: 1 (size prefixed frames, default), 2 (4K aligned frames with a\n");
+		printf("               trailing index of offsets, keyframe flags and encode times) or avi (written by AVIFile,\n");
+		printf("               the default for .avi output names). AVI input (idx1 or OpenDML index) is detected automatically.\n");
+		printf("  -fps [r]     Frame rate of AVI output and -vbv as rate or rate/scale (e.g. 30000/1001). Default: input AVI rate or 25.\n");
+		printf("  -asyncwrite  Write the output on a background thread with large unbuffered, overlapped writes.\n");
+		printf("  -nd          Do not decompress input (send read input directly to compressor).\n");
+		printf("  -nc          Do not compress. Useful for benchmarking a decoder.\n");
+		printf("  -verify      Decode the compressed frames again (untimed) and compare them with the compressor input:\n");
+		printf("               bit-exact frames, else PSNR and SSIM per plane (SSE2/AVX2 kernels).\n");
+		printf("  -rawin       Input is raw. -nd is turned on automatically. -f, -w and -h must be specified.\n");
+		printf("  -synthetic [p] Generate the input instead of reading a file (no -i), in the -f, -w, -h raw format.\n");
+		printf("               [p]: noise, gradient, bars or mix[:entropy] (moving gradient and bars with 0..1 noise,\n");
+		printf("               default 0.1). -frames frames (default: 30) are generated into memory before the run.\n");
+		printf("  -seed [n]    Seed of the -synthetic noise (default: 1).\n");
+		printf("  -rawout      Output is raw. -nc is turned on automatically.\n");
+		printf("  -f [format]  Request the decompressor to decode <infile> as [format]. Valid formats are:\n");
+		printf("               RGB24 (bgr24), RGB32 (bgr32), BGRA, AYUV, YUY2, UYVY, YV12, YV24, Y8, b64a, b48r, v210, r210\n");
+		printf("               If not given, the decompressor specifies the format.\n");
+		printf("               For -rawin: specifies raw video format.\n");
+		printf("  -w [width]   Request the decompressor to decode <infile> to given width.\n");
+		printf("               If not given, the decompressor specifies the width.\n");
+		printf("               For -rawin: specifies raw video width.\n");
+		printf("  -h [height]  Request the decompressor to decode <infile> to given height.\n");
+		printf("               Negative value is possible, which will request top-to-bottom RGB (RGB only).\n");
+		printf("               If not given, the decompressor specifies the height.\n");
+		printf("               For -rawin: specifies raw video height.\n");
+		printf("  -convert [format] Convert the decompressed frames to [format] (a -f format) before compressing,\n");
+		printf("               timed as a separate stage. The YUY2, UYVY, YV12 pairs, YUY2/UYVY <-> v210, AYUV <-> YV24\n");
+		printf("               and RGB24/RGB32/BGRA -> b48r/b64a have SSE2 routines, the other pairs use a generic per\n");
+		printf("               pixel path and are reported as unoptimised.\n");
+		printf("  -postscale [filter] Also decode every frame at full size and scale it to -w/-h with the built-in\n");
+		printf("               bilinear or bicubic SSE2 scaler (8-bit integer, 10/16-bit single precision), timed against\n");
+		printf("               the codec-side scaled decode. Needs -f, -w and -h.\n");
+		printf("  -decompex    Decompress with ICDecompressEx instead of ICDecompress.\n");
+		printf("  -srcrect [x,y,w,h] -dstrect [x,y,w,h]\n");
+		printf("               Source/destination rectangles for -decompex (default: whole frame).\n");
+		printf("  -hurryup     Pass ICDECOMPRESS_HURRYUP, the decompressor may skip decoding frames.\n");
+		printf("  -inkeyint [n] Input keyframe interval: other frames are decompressed with ICDECOMPRESS_NOTKEYFRAME\n");
+		printf("               (default: 0, every input frame is a keyframe).\n");
+		printf("  -codec [fourcc]     Open the compressor with the given FOURCC instead of showing the selection dialog.\n");
+		printf("  -codecstate [file]  Apply the compressor settings saved in [file] (see -savecodecstate).\n");
+		printf("  -savecodecstate [file] Save the settings of the selected compressor to [file].\n");
+		printf("  -vbv [KiB][,KiB/s] Leaky bucket check of the compressed frames: a buffer of [KiB] drained at [KiB/s]\n");
+		printf("               (default: -datarate, else the average rate) per -fps frame interval. Prints the peak fullness,\n");
+		printf("               overflows and peak bitrates, -reportframes adds the fullness and 1 s bitrate per frame.\n");
+		printf("  -channels [m] Live ingest simulation: [m] channels, each with its own codec instances, get a frame every\n");
+		printf("               1/-fps s (staggered) and run on a work-stealing pool. A frame not done before the next one\n");
+		printf("               arrives is a deadline miss. Prints misses, latency jitter and the channels the pool sustains.\n");
+		printf("  -pool [k]    Threads of the -channels pool (default: number of logical processors).\n");
+		printf("  -codec2 [fourcc] -codecstate2 [file]\n");
+		printf("               A/B mode: compressor B gets the same frames as A, in ABBA order (A B, B A, ...).\n");
+		printf("               Prints the per-frame B/A encode time and size ratios with 95%% CIs. The output is A's.\n");
+		printf("  -quality [q] -keyint [n] -datarate [kBps]\n");
+		printf("               Compressor quality (0-10000), keyframe interval and data rate for -codec\n");
+		printf("               (default: codec defaults).\n");
+		printf("  -direct      Compress with ICCompressBegin/ICCompress into caller owned buffers, with explicit\n");
+		printf("               keyframes every -keyint frames and a -datarate frame size budget per -fps frame,\n");
+		printf("               instead of the ICSeqCompressFrame helper.\n");
+		printf("  -sweep [file] Run every combination of the parameter lists in [file] on the preloaded input\n");
+		printf("               and print one table of results. Lines have the form 'key = value, value, ...'\n");
+		printf("               with keys: format, size (WxH), codec (fourcc[:statefile]), quality, keyint, datarate,\n");
+		printf("               engine (sequence, direct)\n");
+		printf("  -initbench [n] Open, begin, code the first input frame, end and close the codecs [n] times and print\n");
+		printf("               the time of each step: driver DLL load, ICLocate/ICOpen, format queries, begin, first frame\n");
+		printf("               and end/close. The DLL is pinned with LoadLibrary around every cycle, so it is not part of\n");
+		printf("               the open time; the first open of the process (cold) is listed separately.\n");
+		printf("  -frames [n]  Process only the first [n] frames (0: all).\n");
+		printf("  -loop [n]    Loop the process [n] times (default: 1).\n");
+		printf("               Each loop is also a sample of its own: best, median and mean fps with a 95%% confidence\n");
+		printf("               interval and the outlier loops (not with -pipeline or -gopthreads).\n");
+		printf("  -warmup [n]  Run the first [n] frames through the codecs without measuring them (default: 0).\n");
+		printf("               'loop' excludes the whole first loop (needs -frames, -preload or -mmap).\n");
+		printf("  -preload     Load the input (or the first -frames [n] frames) into memory before processing,\n");
+		printf("               so file reads are not part of the measurement.\n");
+		printf("  -mmap        Memory-map the input and decode directly from the mapping (no frame copies).\n");
+		printf("  -align [n]   Alignment of the frame buffers and preloaded frames in bytes (default: 64).\n");
+		printf("  -largepages  Back the frame buffers with large pages (needs the 'Lock pages in memory' right).\n");
+		printf("  -ring [n]    Rotate through [n] input/output frame buffers instead of reusing one (default: 1).\n");
+		printf("               'auto' uses enough buffers to exceed twice the last level cache, so every frame is cold.\n");
+		printf("  -flushcache  Evict each frame's input and output buffers from the caches after every stage.\n");
+		printf("  -affinity [mask] Run on the CPUs in [mask] (e.g. 0xF0). The -threads instances are pinned to one\n");
+		printf("               CPU each, round-robin over the mask.\n");
+		printf("  -priority [class] Process priority class: high or realtime.\n");
+		printf("  -numa [node] Run on the CPUs of NUMA node [node] and allocate frame buffers and preloaded input there.\n");
+		printf("  -pmc [backend] Read counters around every timed codec call and report them per frame:\n");
+		printf("               cycles: thread cycles and TSC; rdpmc[:name,...]: fixed PMCs (instructions, cycles)\n");
+		printf("               and the named, externally programmed PMCs (needs a driver enabling user-mode rdpmc).\n");
+		printf("  -threads [n] Run [n] independent decompressor/compressor instances in parallel on the\n");
+		printf("               preloaded input (default: 1). Per-thread and aggregate throughput is reported.\n");
+		printf("  -pipeline    Run reading, decompression, compression and writing on separate threads.\n");
+		printf("               End-to-end throughput and the stall time of each queue is reported.\n");
+		printf("  -queue [n]   Number of frame buffers between pipeline stages (default: 4).\n");
+		printf("  -gopthreads [n] Decode a single input on [n] threads: the preloaded input is split at its keyframes\n");
+		printf("               (v2 or AVI index, -inkeyint, else every frame) and the segments are decoded by separate\n");
+		printf("               decompressor instances. The output is written in input order. Decompression only (-nc).\n");
+		printf("               With -synthetic the generated frames are first compressed with -codec, outside the measurement.\n");
+		printf("  -quiet       Do not show progress while running, only the final results.\n");
+		printf("  -refresh [ms] Minimum time between progress updates (default: 250, 0: every frame).\n");
+		printf("  -report [file]      Write the results to [file] for automated processing.\n");
+		printf("  -reportformat [fmt] Report format: json or csv (default: from the file extension, else json).\n");
+		printf("  -reportframes       Include per-frame sizes, keyframe flags and latencies in the report.\n");
+		throw std::runtime_error("");
+	}
+
+	// Parse command line
+	ArgvParser parser(argc, argv);
+	m_synthetic       = parser.getArg("-synthetic", NULL);
+	m_seed            = strtoul(parser.getArg("-seed", "1"), NULL, 0);
+	m_rawin           = parser.hasArg("-rawin") || m_synthetic; // generated frames are raw frames in memory
+	m_rawout          = parser.hasArg("-rawout");
+	m_decompress      = m_rawin  ? false : !parser.hasArg("-nd");
+	m_compress        = m_rawout ? false : !parser.hasArg("-nc");
+	m_decompFormat    = parser.getArg("-f", NULL);
+	m_convertFormat   = parser.getArg("-convert", NULL);
+	m_decompWidth     = atoi(parser.getArg("-w", "0"));
+	m_decompHeight    = atoi(parser.getArg("-h", "0"));
+	m_framesToProcess = atoi(parser.getArg("-frames", "0"));
+	m_loopCount       = atoi(parser.getArg("-loop", "1"));
+	m_warmupArg       = parser.getArg("-warmup", "0");
+	m_preload         = parser.hasArg("-preload");
+	m_mmap            = parser.hasArg("-mmap");
+	int alignment     = atoi(parser.getArg("-align", "64"));
+	bool largePages   = parser.hasArg("-largepages");
+	m_ringArg         = parser.getArg("-ring", "1");
+	const char* affinity = parser.getArg("-affinity", NULL);
+	m_affinityMask    = affinity ? (DWORD_PTR)strtoull(affinity, NULL, 0) : 0;
+	m_priority        = parser.getArg("-priority", NULL);
+	m_pmcArg          = parser.getArg("-pmc", NULL);
+	const char* numaNode = parser.getArg("-numa", NULL);
+	m_numaNode        = numaNode ? atoi(numaNode) : -1;
+	m_flushCache      = parser.hasArg("-flushcache");
+	m_threadCount     = atoi(parser.getArg("-threads", "1"));
+	m_pipeline        = parser.hasArg("-pipeline");
+	m_verify          = parser.hasArg("-verify");
+	m_gopThreads      = atoi(parser.getArg("-gopthreads", "0"));
+	m_channelCount    = atoi(parser.getArg("-channels", "0"));
+	const char* pool  = parser.getArg("-pool", NULL);
+	m_queueLength     = atoi(parser.getArg("-queue", "4"));
+	m_infile          = parser.getArg("-i", NULL);
+	m_outfile         = parser.getArg("-o", NULL);
+	m_asyncWrite      = parser.hasArg("-asyncwrite");
+	m_containerArg    = parser.getArg("-container", NULL);
+	m_fpsArg          = parser.getArg("-fps", NULL);
+	m_vbvArg          = parser.getArg("-vbv", NULL);
+	m_decompressParams.ex      = parser.hasArg("-decompex");
+	m_decompressParams.hurryUp = parser.hasArg("-hurryup");
+	m_postScaleArg    = parser.getArg("-postscale", NULL);
+	const char* srcRect = parser.getArg("-srcrect", NULL);
+	const char* dstRect = parser.getArg("-dstrect", NULL);
+	m_inputKeyInt     = atoi(parser.getArg("-inkeyint", "0"));
+	m_codec           = parser.getArg("-codec", NULL);
+	m_codecStateFile  = parser.getArg("-codecstate", NULL);
+	m_saveCodecStateFile = parser.getArg("-savecodecstate", NULL);
+	m_codec2          = parser.getArg("-codec2", NULL);
+	m_codecStateFile2 = parser.getArg("-codecstate2", NULL);
+	m_compressParams.quality      = atoi(parser.getArg("-quality", "-1"));
+	m_compressParams.keyFrameRate = atoi(parser.getArg("-keyint", "-1"));
+	m_compressParams.dataRate     = atoi(parser.getArg("-datarate", "-1"));
+	m_compressParams.direct       = parser.hasArg("-direct");
+	const char* sweepFile = parser.getArg("-sweep", NULL);
+	m_initBenchCount  = atoi(parser.getArg("-initbench", "0"));
+	m_reportFile      = parser.getArg("-report", NULL);
+	m_reportFormat    = parser.getArg("-reportformat", NULL);
+	m_reportFrames    = parser.hasArg("-reportframes");
+	m_quiet           = parser.hasArg("-quiet");
+	m_refreshMs       = atoi(parser.getArg("-refresh", "250"));
+
+	// Verify arguments
+	if (m_synthetic)
+	{
+		if (m_infile)
+		{
+			throw std::runtime_error("ERROR: -i cannot be used with -synthetic\n");
+		}
+		m_infile = m_synthetic;
+	}
+	if (!m_infile)
+	{
+		throw std::runtime_error("ERROR: No input file given (-i)!\n");
+	}
+
+	if (srcRect || dstRect)
+	{
+		if (!m_decompressParams.ex)
+		{
+			throw std::runtime_error("ERROR: -srcrect and -dstrect need -decompex\n");
+		}
+		if (srcRect) m_decompressParams.srcRect = ParseRect(srcRect);
+		if (dstRect) m_decompressParams.dstRect = ParseRect(dstRect);
+	}
+
+	if (m_codecStateFile && !m_codec)
+	{
+		throw std::runtime_error("ERROR: -codecstate needs -codec\n");
+	}
+	if (m_codecStateFile2 && !m_codec2)
+	{
+		throw std::runtime_error("ERROR: -codecstate2 needs -codec2\n");
+	}
+	if (m_codec2)
+	{
+		if (!m_compress)
+		{
+			throw std::runtime_error("ERROR: -codec2 needs the compress stage (cannot be used with -nc or -rawout)\n");
+		}
+		if (m_threadCount > 1 || m_pipeline || m_gopThreads || sweepFile)
+		{
+			throw std::runtime_error("ERROR: -codec2 cannot be used with -threads, -pipeline, -gopthreads or -sweep\n");
+		}
+	}
+
+	if (m_convertFormat && m_gopThreads)
+	{
+		throw std::runtime_error("ERROR: -convert cannot be used with -gopthreads\n");
+	}
+	if (m_convertFormat && m_pipeline && !m_decompress)
+	{
+		throw std::runtime_error("ERROR: -convert with -pipeline needs the decompress stage (cannot be used with -rawin)\n");
+	}
+
+	m_vbvBufferBytes = m_vbvBytesPerSecond = 0.0;
+	if (m_vbvArg)
+	{
+		// KiB, KiB/s like -datarate, which is the default drain rate
+		double bufferKiB = 0.0, rateKiBps = 0.0;
+		if (!m_compress || sscanf(m_vbvArg, "%lf,%lf", &bufferKiB, &rateKiBps) < 1 || bufferKiB <= 0.0 || rateKiBps < 0.0)
+		{
+			throw std::runtime_error(std::string("ERROR: Invalid -vbv (expected buffer KiB[,rate KiB/s], needs the compress stage): ") + m_vbvArg);
+		}
+		if (rateKiBps == 0.0 && m_compressParams.dataRate > 0)
+			rateKiBps = m_compressParams.dataRate;
+		m_vbvBufferBytes = bufferKiB * 1024.0;
+		m_vbvBytesPerSecond = rateKiBps * 1024.0;
+	}
+
+	if (m_verify && !m_compress)
+	{
+		throw std::runtime_error("ERROR: -verify needs the compress stage (cannot be used with -nc or -rawout)\n");
+	}
+
+	if (sweepFile)
+	{
+		if (m_outfile || m_threadCount > 1 || m_pipeline || m_verify)
+		{
+			throw std::runtime_error("ERROR: -sweep cannot be used with -o, -threads, -pipeline or -verify\n");
+		}
+		if (!m_mmap)
+		{
+			m_preload = true; // every combination runs on the same in-memory frames
+		}
+		initSweep(sweepFile);
+	}
+
+	if (m_reportFile && !m_reportFormat)
+	{
+		const char* ext = strrchr(m_reportFile, '.');
+		m_reportFormat = ext && strcmp(ext, ".csv") == 0 ? "csv" : "json";
+	}
+	else if (m_reportFormat && strcmp(m_reportFormat, "json") != 0 && strcmp(m_reportFormat, "csv") != 0)
+	{
+		throw std::runtime_error(std::string("ERROR: Invalid report format: ") + m_reportFormat);
+	}
+
+	if (alignment < 8 || alignment > 65536 || (alignment & (alignment - 1)))
+	{
+		throw std::runtime_error("ERROR: -align must be a power of 2 between 8 and 65536\n");
+	}
+	if (affinity && !m_affinityMask)
+	{
+		throw std::runtime_error(std::string("ERROR: Invalid -affinity mask: ") + affinity);
+	}
+	if (m_priority && strcmp(m_priority, "high") != 0 && strcmp(m_priority, "realtime") != 0)
+	{
+		throw std::runtime_error(std::string("ERROR: Invalid -priority (expected high or realtime): ") + m_priority);
+	}
+	ULONG highestNode = 0;
+	if (numaNode && (m_numaNode < 0 || !GetNumaHighestNodeNumber(&highestNode) || (ULONG)m_numaNode > highestNode))
+	{
+		throw std::runtime_error(std::string("ERROR: Invalid -numa node: ") + numaNode);
+	}
+
+	if (!AlignedBuffer::configure(alignment, largePages, m_numaNode))
+	{
+		printf("WARNING: large pages are not available (SeLockMemoryPrivilege), using regular pages\n");
+	}
+
+	int ringCount = strcmp(m_ringArg, "auto") == 0 ? 0 : atoi(m_ringArg);
+	if (ringCount < 0 || (ringCount == 0 && strcmp(m_ringArg, "auto") != 0))
+	{
+		throw std::runtime_error(std::string("ERROR: Invalid -ring value (expected a count or auto): ") + m_ringArg);
+	}
+	BufferRing::configure(ringCount);
+
+	// Without -container an .avi output file name selects AVI
+	const char* ext = m_outfile ? strrchr(m_outfile, '.') : NULL;
+	const char* container = m_containerArg ? m_containerArg : (ext && stricmp(ext, ".avi") == 0 ? "avi" : "1");
+	if (strcmp(container, "1") == 0)
+		m_container = CONTAINER_V1;
+	else if (strcmp(container, "2") == 0)
+		m_container = CONTAINER_V2;
+	else if (stricmp(container, "avi") == 0)
+		m_container = CONTAINER_AVI;
+	else
+		throw std::runtime_error("ERROR: -container must be 1, 2 or avi\n");
+
+	if (m_container == CONTAINER_AVI && m_asyncWrite)
+	{
+		printf("WARNING: ignoring -asyncwrite option because AVI output is written by AVIFile\n");
+		m_asyncWrite = false;
+	}
+
+	if (m_mmap && m_preload)
+	{
+		printf("WARNING: ignoring -preload option because -mmap option was given\n");
+		m_preload = false;
+	}
+
+	if (m_threadCount < 1)
+	{
+		throw std::runtime_error("ERROR: -threads must be at least 1\n");
+	}
+	else if (m_threadCount > 1)
+	{
+		if (m_pipeline)
+		{
+			throw std::runtime_error("ERROR: -pipeline cannot be used with -threads\n");
+		}
+		if (m_outfile)
+		{
+			throw std::runtime_error("ERROR: -o cannot be used with -threads\n");
+		}
+		if (!m_mmap)
+		{
+			m_preload = true; // all threads are fed from the same in-memory frames
+		}
+	}
+
+	if (m_gopThreads < 0)
+	{
+		throw std::runtime_error("ERROR: -gopthreads must be at least 1\n");
+	}
+	else if (m_gopThreads)
+	{
+		if (m_threadCount > 1 || m_pipeline || sweepFile)
+		{
+			throw std::runtime_error("ERROR: -gopthreads cannot be used with -threads, -pipeline or -sweep\n");
+		}
+		if (m_synthetic)
+		{
+			// The generated frames are compressed with -codec before the run, then only decoded
+			if (!m_codec)
+			{
+				throw std::runtime_error("ERROR: -gopthreads with -synthetic needs -codec to compress the frames before the run\n");
+			}
+			m_decompress = true;
+			m_compress = false;
+		}
+		else if (!m_decompress || m_compress)
+		{
+			throw std::runtime_error("ERROR: -gopthreads only decompresses, it needs -nc and cannot be used with -nd or -rawin\n");
+		}
+		if (!m_mmap)
+		{
+			m_preload = true; // segments are decoded in random order from the in-memory frames
+		}
+	}
+
+	if (m_channelCount < 0)
+	{
+		throw std::runtime_error("ERROR: -channels must be at least 1\n");
+	}
+	else if (m_channelCount)
+	{
+		if (m_threadCount > 1 || m_pipeline || m_gopThreads || sweepFile || m_codec2 || m_outfile)
+		{
+			throw std::runtime_error("ERROR: -channels cannot be used with -threads, -pipeline, -gopthreads, -sweep, -codec2 or -o\n");
+		}
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		m_poolThreads = pool ? atoi(pool) : (int)info.dwNumberOfProcessors;
+		if (m_poolThreads < 1)
+		{
+			throw std::runtime_error("ERROR: -pool must be at least 1\n");
+		}
+		if (!m_mmap)
+		{
+			m_preload = true; // every channel reads the same in-memory frames
+		}
+	}
+	else if (pool)
+	{
+		throw std::runtime_error("ERROR: -pool needs -channels\n");
+	}
+
+	if (m_postScaleArg)
+	{
+		if (strcmp(m_postScaleArg, "bilinear") != 0 && strcmp(m_postScaleArg, "bicubic") != 0)
+		{
+			throw std::runtime_error(std::string("ERROR: Invalid -postscale filter (expected bilinear or bicubic): ") + m_postScaleArg);
+		}
+		if (!m_decompress || !m_decompFormat || !m_decompWidth || !m_decompHeight)
+		{
+			throw std::runtime_error("ERROR: -postscale needs the decompress stage with -f, -w and -h\n");
+		}
+		if (m_threadCount > 1 || m_pipeline || m_gopThreads || m_channelCount || sweepFile || m_codec2)
+		{
+			throw std::runtime_error("ERROR: -postscale cannot be used with -threads, -pipeline, -gopthreads, -channels, -sweep or -codec2\n");
+		}
+	}
+
+	if (m_initBenchCount < 0)
+	{
+		throw std::runtime_error("ERROR: -initbench must be at least 1\n");
+	}
+	else if (m_initBenchCount)
+	{
+		// Other codec instances would keep the driver loaded
+		if (m_threadCount > 1 || m_pipeline || m_gopThreads || m_channelCount || sweepFile || m_codec2 || m_postScaleArg || m_verify || m_outfile)
+		{
+			throw std::runtime_error("ERROR: -initbench cannot be used with -threads, -pipeline, -gopthreads, -channels, -sweep, -codec2, -postscale, -verify or -o\n");
+		}
+		if (!m_decompress && !m_compress)
+		{
+			throw std::runtime_error("ERROR: -initbench needs the decompress or the compress stage\n");
+		}
+	}
+
+	if (m_rawin) // raw input: format must be given
+	{
+		if (!m_decompFormat || !m_decompWidth || !m_decompHeight)
+		{
+			throw std::runtime_error("ERROR: -f, -w, -h must be given for raw inputs\n");
+		}
+	}
+	else if (!m_decompress) // non-raw no-decompress: take format from file
+	{
+		if (m_decompFormat)
+		{
+			printf("WARNING: ignoring -f option because -nd option was given\n");
+			m_decompFormat = NULL;
+		}
+		if (m_decompWidth)
+		{
+			printf("WARNING: ignoring -w option because -nd option was given\n");
+			m_decompWidth = 0;
+		}
+		if (m_decompHeight)
+		{
+			printf("WARNING: ignoring -h option because -nd option was given\n");
+			m_decompHeight = 0;
+		}
+	}
+}
+
+void CodecBench::initProcess()
+{
+	if (m_priority)
+	{
+		DWORD priorityClass = strcmp(m_priority, "realtime") == 0 ? REALTIME_PRIORITY_CLASS : HIGH_PRIORITY_CLASS;
+		if (!SetPriorityClass(GetCurrentProcess(), priorityClass))
+		{
+			printf("WARNING: Failed to set the priority class\n");
+		}
+		else if (GetPriorityClass(GetCurrentProcess()) != priorityClass)
+		{
+			// Without SeIncreaseBasePriorityPrivilege Windows silently gives high instead of realtime
+			printf("WARNING: Realtime priority was not granted, running at high priority\n");
+		}
+	}
+
+	if (m_numaNode >= 0)
+	{
+		ULONGLONG nodeMask = 0;
+		if (!GetNumaNodeProcessorMask((UCHAR)m_numaNode, &nodeMask) || !nodeMask)
+		{
+			throw std::runtime_error("ERROR: Could not get the processors of the NUMA node\n");
+		}
+		m_affinityMask = m_affinityMask ? m_affinityMask & (DWORD_PTR)nodeMask : (DWORD_PTR)nodeMask;
+		if (!m_affinityMask)
+		{
+			throw std::runtime_error("ERROR: -affinity has no processors on the -numa node\n");
+		}
+	}
+
+	if (m_affinityMask)
+	{
+		// Codec worker threads inherit the process affinity
+		if (!SetProcessAffinityMask(GetCurrentProcess(), m_affinityMask))
+		{
+			throw std::runtime_error("ERROR: Failed to set the process affinity (are the CPUs in the mask present?)\n");
+		}
+		SetThreadAffinityMask(GetCurrentThread(), m_affinityMask);
+	}
+
+	// After pinning, per-CPU counters are probed where the measurement runs
+	if (m_pmcArg)
+	{
+		m_counterBackend = CounterBackend::create(m_pmcArg);
+		printf("INFO: Counters            : %s\n", m_counterBackend->name());
+	}
+
+	if (m_priority || m_affinityMask)
+	{
+		printf("INFO: Process             : priority %s, affinity 0x%llx", m_priority ? m_priority : "normal", (unsigned long long)m_affinityMask);
+		if (m_numaNode >= 0)
+			printf(", NUMA node %d", m_numaNode);
+		printf("\n");
+	}
+}
+
+DWORD_PTR CodecBench::threadAffinity(size_t threadIndex) const
+{
+	int numCpus = 0;
+	for (int cpu = 0; cpu < (int)sizeof(DWORD_PTR) * 8; ++cpu)
+	{
+		if (m_affinityMask & ((DWORD_PTR)1 << cpu))
+			++numCpus;
+	}
+	if (!numCpus)
+		return 0;
+
+	int n = (int)(threadIndex % numCpus);
+	for (int cpu = 0; cpu < (int)sizeof(DWORD_PTR) * 8; ++cpu)
+	{
+		if ((m_affinityMask & ((DWORD_PTR)1 << cpu)) && n-- == 0)
+			return (DWORD_PTR)1 << cpu;
+	}
+	return 0;
+}
+
+void CodecBench::initInput()
+{
+	// Open input video stream
+	if (m_synthetic)
+	{
+		SyntheticPattern pattern(m_synthetic, m_seed);
+		int numFrames = m_framesToProcess ? m_framesToProcess : 30;
+		m_videoReader.openSynthetic(pattern, m_decompFormat, m_decompWidth, m_decompHeight, numFrames);
+		printf("INFO: Input file          : [SYNTHETIC] %s (seed %u, %d frames, %.1f MiB)\n", m_synthetic, m_seed,
+			numFrames, m_videoReader.indexedSize() / 1024.0 / 1024.0);
+	}
+	else if (m_rawin)
+	{
+		m_videoReader.openRaw(m_infile, m_decompFormat, m_decompWidth, m_decompHeight);
+	}
+	else
+	{
+		m_videoReader.open(m_infile);
+	}
+	if (!m_synthetic)
+		printf("INFO: Input file          : %s%s\n", m_rawin ? "[RAW] " : "", m_infile);
+	if (m_videoReader.hasFileIndex())
+	{
+		printf("INFO: Input container     : %s, %d indexed frames", ContainerName(m_videoReader.container()), (int)m_videoReader.fileIndex().size());
+		if (m_videoReader.droppedFrames())
+			printf(" (%u dropped frames skipped)", m_videoReader.droppedFrames());
+		if (m_videoReader.frameRate())
+			printf(", %u/%u fps", m_videoReader.frameRate(), m_videoReader.frameRateScale());
+		printf("\n");
+	}
+	printf("INFO: Frame buffers       : %d byte aligned", (int)AlignedBuffer::alignment());
+	if (AlignedBuffer::largePageSize())
+		printf(", large pages (%d KiB)", (int)(AlignedBuffer::largePageSize() / 1024));
+	if (BufferRing::cacheSize())
+		printf(", ring of 2x %.1f MiB (last level cache)", BufferRing::cacheSize() / 1024.0 / 1024.0);
+	else if (strcmp(m_ringArg, "1") != 0)
+		printf(", ring of %s", m_ringArg);
+	if (m_flushCache)
+		printf(", flushed after each stage");
+	printf("\n");
+
+	// The frame rate of the output (AVI, -vbv) and the -direct data rate defaults to the one of the input AVI,
+	// before encodeSynthetic() runs the encoder with it
+	m_fpsRate  = m_videoReader.frameRate() ? m_videoReader.frameRate() : 25;
+	m_fpsScale = m_videoReader.frameRate() ? m_videoReader.frameRateScale() : 1;
+	if (m_fpsArg)
+	{
+		m_fpsScale = 1;
+		if (sscanf(m_fpsArg, "%u/%u", &m_fpsRate, &m_fpsScale) < 1 || !m_fpsRate || !m_fpsScale)
+		{
+			throw std::runtime_error(std::string("ERROR: Invalid -fps value (expected rate or rate/scale): ") + m_fpsArg);
+		}
+	}
+	m_fps = (double)m_fpsRate / m_fpsScale;
+
+	if (m_synthetic)
+	{
+		// Already in memory
+		if (m_gopThreads)
+			encodeSynthetic();
+	}
+	else if (m_preload)
+	{
+		m_videoReader.preload(m_framesToProcess);
+		printf("INFO: Preloaded           : %d frames (%.1f MiB)\n", (int)m_videoReader.numIndexedFrames(), m_videoReader.indexedSize() / 1024.0 / 1024.0);
+	}
+	else if (m_mmap)
+	{
+		m_videoReader.map(m_framesToProcess);
+		printf("INFO: Memory-mapped       : %d frames (%.1f MiB)\n", (int)m_videoReader.numIndexedFrames(), m_videoReader.indexedSize() / 1024.0 / 1024.0);
+	}
+
+	printf("INFO: Input format        : ");
+	PrintBitmapInfo(m_videoReader.getFormat());
+	printf("\n");
+}
+
+void CodecBench::encodeSynthetic()
+{
+	std::vector<char> state;
+	if (m_codecStateFile)
+		state = LoadFile(m_codecStateFile);
+	Compressor compressor;
+	m_compressParams.frameRate = m_fps;
+	compressor.init(m_videoReader.getFormat(), ParseFourCC(m_codec), state, m_compressParams);
+
+	// Frames back to back at aligned offsets, like the -preload arena
+	size_t alignment = AlignedBuffer::alignment();
+	size_t numFrames = m_videoReader.numIndexedFrames();
+	std::vector<char> frames;
+	std::vector<ContainerIndexEntry> index(numFrames);
+	Timer timer;
+	int keyFrames = 0;
+	for (size_t i = 0; i < numFrames; ++i)
+	{
+		timer.begin();
+		compressor.compressFrame(m_videoReader.indexedFrameData(i));
+		timer.end();
+		ContainerIndexEntry& entry = index[i];
+		entry.offset = frames.size();
+		entry.size = compressor.frameSize();
+		entry.flags = compressor.isKeyFrame() ? CONTAINER_V2_KEYFRAME : 0;
+		entry.encodeTimeNs = (uint64_t)(timer.lastMs() * 1000000.0);
+		keyFrames += compressor.isKeyFrame();
+		frames.insert(frames.end(), compressor.frameData(), compressor.frameData() + entry.size);
+		frames.resize((frames.size() + alignment - 1) / alignment * alignment);
+	}
+	m_videoReader.replaceIndexed(compressor.getOutputFormat(), frames, index);
+
+	wprintf(L"INFO: Synthetic encoder   : '%ls' - '%ls'\n", compressor.getInfo().szName, compressor.getInfo().szDescription);
+	printf("INFO: Synthetic encoded   : %d frames (%.1f MiB, %d keyframes)\n", (int)numFrames,
+		m_videoReader.indexedSize() / 1024.0 / 1024.0, keyFrames);
+}
+
+void CodecBench::initDecompressor()
+{
+	// Prepare decompressor if needed
+	m_streams.push_back(new BenchStream());
+	if (m_decompress)
+	{
+		BITMAPINFOHEADER biFormatDecomp = {};
+		if (m_decompFormat)
+		{
+			// At the -w/-h size, so biSizeImage matches the scaled frames
+			GetDecompFormat(m_decompFormat, m_decompWidth ? m_decompWidth : m_videoReader.getFormat()->biWidth,
+				m_decompHeight ? m_decompHeight : m_videoReader.getFormat()->biHeight, &biFormatDecomp);
+		}
+		Decompressor& decompressor = m_streams[0]->decompressor();
+		decompressor.init(m_videoReader.getFormat(), m_decompFormat ? &biFormatDecomp : NULL, m_decompWidth, m_decompHeight, m_decompressParams);
+		m_formatDecompressed = decompressor.getOutputFormat();
+		wprintf(L"INFO: Decompressor        : '%ls' - '%ls'\n", decompressor.getInfo().szName, decompressor.getInfo().szDescription);
+		printf("INFO: Decompressor init   : ");
+		PrintInitTimes(decompressor.initTimes());
+		if (decompressor.fixedOutput() && strcmp(m_ringArg, "1") != 0)
+		{
+			printf("WARNING: The decompressor is temporal and decodes into one fixed buffer, -ring does not apply to it\n");
+		}
+
+		printf("INFO: Decompressed format : ");
+		PrintBitmapInfo((BITMAPINFOHEADER*)m_formatDecompressed);
+		printf("\n");
+		if (m_decompressParams.ex)
+		{
+			const RECT& src = decompressor.getParams().srcRect;
+			const RECT& dst = decompressor.getParams().dstRect;
+			printf("INFO: ICDecompressEx      : src %ld,%ld %ldx%ld -> dst %ld,%ld %ldx%ld%s\n",
+				src.left, src.top, src.right - src.left, src.bottom - src.top,
+				dst.left, dst.top, dst.right - dst.left, dst.bottom - dst.top, m_decompressParams.hurryUp ? " (hurry up)" : "");
+		}
+		else if (m_decompressParams.hurryUp)
+		{
+			printf("INFO: ICDecompress        : hurry up\n");
+		}
+
+		if (m_postScaleArg)
+		{
+			// The same frames decoded at full size, then scaled to the -w/-h size by FrameScaler
+			const BITMAPINFOHEADER* biInput = m_videoReader.getFormat();
+			BITMAPINFOHEADER biFormatFull = {};
+			GetDecompFormat(m_decompFormat, biInput->biWidth, m_decompHeight < 0 ? -abs(biInput->biHeight) : abs(biInput->biHeight), &biFormatFull);
+			m_fullStream = new BenchStream();
+			m_fullStream->decompressor().init(m_videoReader.getFormat(), &biFormatFull, 0, 0, m_decompressParams);
+			m_fullStream->setStages(true, false);
+			m_scaler.init(m_fullStream->decompressor().getOutputFormat(), m_formatDecompressed,
+				strcmp(m_postScaleArg, "bicubic") == 0 ? FrameScaler::FILTER_BICUBIC : FrameScaler::FILTER_BILINEAR);
+			printf("INFO: Post-scale          : ");
+			PrintBitmapInfo(m_fullStream->decompressor().getOutputFormat());
+			printf(" -> ");
+			PrintBitmapInfo((BITMAPINFOHEADER*)m_formatDecompressed);
+			printf(" (%s, %s)\n", m_postScaleArg, m_scaler.pathName());
+		}
+	}
+	else
+	{
+		printf("INFO: Decompressor        : -\n");
+		m_formatDecompressed = m_videoReader.getFormat();
+	}
+
+	// The compressor gets the frames in the -convert format
+	m_formatConverted = m_formatDecompressed;
+	if (m_convertFormat)
+	{
+		BITMAPINFOHEADER* biDecompressed = m_formatDecompressed;
+		BITMAPINFOHEADER biFormatConverted = {};
+		GetDecompFormat(m_convertFormat, biDecompressed->biWidth, abs(biDecompressed->biHeight), &biFormatConverted);
+		m_formatConverted = &biFormatConverted;
+	}
+}
+
+void CodecBench::initCompressor()
+{
+	// Prepare compressor if needed
+	if (m_compress)
+	{
+		m_compressParams.frameRate = m_fps; // -sweep points replace m_compressParams
+		Compressor& compressor = m_streams[0]->compressor();
+		if (m_codec)
+		{
+			std::vector<char> state;
+			if (m_codecStateFile)
+				state = LoadFile(m_codecStateFile);
+			compressor.init(m_formatConverted, ParseFourCC(m_codec), state, m_compressParams);
+		}
+		else
+		{
+			m_compress = compressor.init(m_formatConverted, m_compressParams);
+		}
+		if (m_compress)
+		{
+			m_formatCompressed = compressor.getOutputFormat();
+			wprintf(L"INFO: Compressor          : '%ls' - '%ls'\n", compressor.getInfo().szName, compressor.getInfo().szDescription);
+			printf("INFO: Compress engine     : %s\n", compressor.engineName());
+			printf("INFO: Compressor init     : ");
+			PrintInitTimes(compressor.initTimes());
+			if (m_codecStateFile)
+				printf("INFO: Compressor settings : %s\n", m_codecStateFile);
+			if (m_saveCodecStateFile)
+			{
+				SaveFile(m_saveCodecStateFile, compressor.getState());
+				printf("INFO: Settings saved to   : %s\n", m_saveCodecStateFile);
+			}
+		}
+	}
+
+	if (!m_compress)
+	{
+		printf("INFO: Compressor          : -\n");
+		m_formatCompressed = m_formatConverted;
+	}
+	else if (m_codec2)
+	{
+		// Same input format and parameters, only the codec and its state differ
+		std::vector<char> state;
+		if (m_codecStateFile2)
+			state = LoadFile(m_codecStateFile2);
+		m_streamB = new BenchStream();
+		m_streamB->compressor().init(m_formatConverted, ParseFourCC(m_codec2), state, m_compressParams);
+		m_streamB->setStages(false, true);
+		const ICINFO& info = m_streamB->compressor().getInfo();
+		wprintf(L"INFO: Compressor B        : '%ls' - '%ls'\n", info.szName, info.szDescription);
+		if (m_codecStateFile2)
+			printf("INFO: Compressor B state  : %s\n", m_codecStateFile2);
+	}
+}
+
+void CodecBench::initOutput()
+{
+	printf("INFO: Output format       : ");
+	PrintBitmapInfo((BITMAPINFOHEADER*)m_formatCompressed);
+	printf("\n");
+
+	uint32_t rate = m_fpsRate, scale = m_fpsScale;
+
+	// Initialize output file if needed
+	if (m_outfile)
+	{
+		// Open file
+		// The AVI stream needs a format even for -rawout
+		bool avi = m_container == CONTAINER_AVI;
+		m_videoWriter.open(m_outfile, m_rawout && !avi ? NULL : (BITMAPINFOHEADER*)m_formatCompressed, m_asyncWrite, m_container, rate, scale);
+		if (avi)
+			printf("INFO: Output container    : avi, %u/%u fps\n", rate, scale);
+	}
+	printf("INFO: Output file         : %s%s%s\n", m_outfile && m_rawout ? "[RAW] " : "", m_outfile ? m_outfile : "-",
+		m_outfile && m_asyncWrite ? " (asynchronous)" : "");
+}
+
+void CodecBench::initStreams()
+{
+	m_streams[0]->setStages(m_decompress, m_compress);
+
+	// Room for the per-frame times, so recording them does not allocate in the loop
+	size_t expectedFrames = 65536;
+	if (m_videoReader.isIndexed())
+		expectedFrames = m_videoReader.numIndexedFrames();
+	else if (m_framesToProcess)
+		expectedFrames = m_framesToProcess;
+	expectedFrames *= m_loopCount;
+
+	// Additional instances for -threads, -gopthreads and -channels
+	for (int i = 1; i < std::max(std::max(m_threadCount, m_gopThreads), m_channelCount); ++i)
+	{
+		BenchStream* stream = new BenchStream();
+		m_streams.push_back(stream);
+		if (m_decompress)
+		{
+			// Same request as for the first instance, the resulting format is already known to work
+			stream->decompressor().init(m_videoReader.getFormat(), m_formatDecompressed, 0, 0, m_decompressParams);
+		}
+		if (m_compress)
+		{
+			stream->compressor().init(m_formatConverted, m_streams[0]->compressor());
+		}
+		stream->setStages(m_decompress, m_compress);
+	}
+	// Warm-up frames
+	m_warmupFrames = atoi(m_warmupArg);
+	if (strcmp(m_warmupArg, "loop") == 0)
+	{
+		if (m_videoReader.isIndexed())
+			m_warmupFrames = (int)m_videoReader.numIndexedFrames();
+		else if (m_framesToProcess)
+			m_warmupFrames = m_framesToProcess;
+		else
+			throw std::runtime_error("ERROR: -warmup loop needs -frames, -preload or -mmap to know the loop length\n");
+	}
+	if (m_warmupFrames < 0)
+	{
+		throw std::runtime_error("ERROR: -warmup must not be negative\n");
+	}
+	if (m_warmupFrames)
+	{
+		printf("INFO: Warm-up frames      : %d\n", m_warmupFrames);
+	}
+
+	for (size_t i = 0; i < m_streams.size(); ++i)
+	{
+		m_streams[i]->setWarmup(m_warmupFrames);
+		m_streams[i]->setFlushCache(m_flushCache);
+		m_streams[i]->setCounters(m_counterBackend);
+		m_streams[i]->stats().decompTimer.enableSamples(m_decompress ? expectedFrames : 0);
+		m_streams[i]->stats().compTimer.enableSamples(m_compress ? expectedFrames : 0);
+		m_streams[i]->stats().convTimer.enableSamples(m_convertFormat ? expectedFrames : 0);
+		m_streams[i]->stats().frames.reserve(expectedFrames);
+		if (m_convertFormat)
+			m_streams[i]->enableConvert(m_formatDecompressed, m_formatConverted);
+	}
+	if (m_fullStream)
+	{
+		m_fullStream->setWarmup(m_warmupFrames);
+		m_fullStream->setFlushCache(m_flushCache);
+		m_fullStream->stats().decompTimer.enableSamples(expectedFrames);
+		m_fullStream->stats().frames.reserve(expectedFrames);
+		m_scaleTimer.enableSamples(expectedFrames);
+		m_codecScaledSamples.reserve(expectedFrames);
+		m_postScaleSamples.reserve(expectedFrames);
+	}
+	if (m_streamB)
+	{
+		m_streamB->setWarmup(m_warmupFrames);
+		m_streamB->setFlushCache(m_flushCache);
+		m_streamB->setCounters(m_counterBackend);
+		m_streamB->stats().compTimer.enableSamples(expectedFrames);
+		m_streamB->stats().frames.reserve(expectedFrames);
+	}
+
+	if (m_convertFormat)
+	{
+		printf("INFO: Converter           : ");
+		PrintBitmapInfo((BITMAPINFOHEADER*)m_formatDecompressed);
+		printf(" -> ");
+		PrintBitmapInfo((BITMAPINFOHEADER*)m_formatConverted);
+		const FormatConverter& converter = m_streams[0]->converter();
+		printf(" (%s%s)\n", converter.pathName(), converter.optimised() ? "" : ", unoptimised");
+		if (!converter.optimised())
+		{
+			printf("WARNING: No SIMD path for this -convert pair, the generic per pixel conversion is timed\n");
+		}
+	}
+
+	if (m_threadCount > 1)
+	{
+		printf("INFO: Threads             : %d\n", m_threadCount);
+	}
+
+	if (m_gopThreads)
+	{
+		initGopSegments();
+	}
+
+	if (m_channelCount)
+	{
+		printf("INFO: Channels            : %d at %.3f fps (deadline %.2f ms) on %d pool threads\n", m_channelCount, m_fps,
+			1000.0 / m_fps, m_poolThreads);
+	}
+
+	if (m_verify)
+	{
+		for (size_t i = 0; i < m_streams.size(); ++i)
+		{
+			m_streams[i]->enableVerify(m_formatConverted);
+		}
+		printf("INFO: Verify              : decoding the output again, %s compare kernels\n", m_streams[0]->verifier().kernelName());
+	}
+
+	if (m_pipeline)
+	{
+		if (m_queueLength < 1)
+		{
+			throw std::runtime_error("ERROR: -queue must be at least 1\n");
+		}
+
+		// Stages, with a ring of frames between each neighbouring pair
+		m_stages.push_back(STAGE_READ);
+		if (m_decompress)
+			m_stages.push_back(STAGE_DECOMPRESS);
+		if (m_compress)
+			m_stages.push_back(STAGE_COMPRESS);
+		m_stages.push_back(STAGE_WRITE);
+
+		for (size_t i = 0; i + 1 < m_stages.size(); ++i)
+		{
+			// Decompressed frames have a fixed size, other buffers grow on demand
+			size_t bufferSize = m_stages[i] == STAGE_DECOMPRESS ? ((BITMAPINFOHEADER*)m_formatConverted)->biSizeImage : 0;
+			m_rings.push_back(new FrameRing(m_queueLength, bufferSize));
+		}
+
+		printf("INFO: Pipeline            : ");
+		for (size_t i = 0; i < m_stages.size(); ++i)
+		{
+			printf("%s%s", i ? " -> " : "", stageName(m_stages[i]));
+		}
+		printf(" (%d frames per queue)\n", m_queueLength);
+	}
+}
+
+const char* CodecBench::stageName(PipelineStage stage)
+{
+	switch (stage)
+	{
+	case STAGE_READ:       return "read";
+	case STAGE_DECOMPRESS: return "decompress";
+	case STAGE_COMPRESS:   return "compress";
+	case STAGE_WRITE:      return "write";
+	}
+	return "?";
+}
+
+int CodecBench::printStats(const BenchStats& stats)
+{
+	int nchars = 0;
+	nchars += printf("F: %d", stats.numFrames);
+	if (!stats.numFrames)
+	{
+		return nchars + printf(" (warm-up)");
+	}
+	if (m_decompress)
+	{
+		nchars += printf(" | Decompress: %.1f fps (%.1f MiB/s) (ratio: %.2f)", stats.decompFPS(), stats.decompMiBps(), stats.decompRatio());
+		if (stats.decompErrors || stats.decompSkipped)
+			nchars += printf(" (errors: %d, skipped: %d)", stats.decompErrors, stats.decompSkipped);
+	}
+	if (m_convertFormat)
+	{
+		nchars += printf(" | Convert: %.1f fps (%.1f MiB/s)", stats.convFPS(), stats.convMiBps());
+	}
+	if (m_compress)
+	{
+		nchars += printf(" | Compress: %.1f fps (%.1f MiB/s) (ratio: %.2f)", stats.compFPS(), stats.compMiBps(), stats.compRatio());
+	}
+	const VerifyStats& verify = stats.verify;
+	if (m_verify && verify.frames)
+	{
+		if (verify.exactFrames == verify.frames)
+		{
+			nchars += printf(" | Verify: lossless");
+		}
+		else if (verify.decodeErrors == verify.frames)
+		{
+			nchars += printf(" | Verify: no frame decoded");
+		}
+		else
+		{
+			nchars += printf(" | Verify: %d/%d exact, PSNR", verify.exactFrames, verify.frames);
+			for (int c = 0; c < verify.numPlanes; ++c)
+				nchars += printf(" %s %.2f", verify.planeName(c), verify.psnr(c));
+			nchars += printf(" dB, SSIM");
+			for (int c = 0; c < verify.numPlanes; ++c)
+				nchars += printf(" %s %.4f", verify.planeName(c), verify.ssim(c));
+		}
+		if (verify.decodeErrors)
+			nchars += printf(" (decode errors: %d)", verify.decodeErrors);
+	}
+	return nchars;
+}
+
+int CodecBench::printStatus(const BenchStats& stats, int ncharsPrev)
+{
+	int nchars = printf("\r");
+	nchars += printStats(stats);
+	int padding = ncharsPrev - nchars;
+	if (padding > 0) printf("%*s", padding, "");
+	fflush(stdout);
+	return nchars;
+}
+
+BenchStats CodecBench::totalStats()
+{
+	BenchStats total;
+	for (size_t i = 0; i < m_streams.size(); ++i)
+	{
+		total.merge(m_streams[i]->stats());
+	}
+	return total;
+}
+
+void CodecBench::printLatency()
+{
+	BenchStats total = totalStats();
+	if (m_decompress)
+		PrintLatencyStats("Decompress", GetLatencyStats(total.decompTimer.samples, total.decompTimer.freq.QuadPart));
+	if (m_convertFormat)
+		PrintLatencyStats("Convert   ", GetLatencyStats(total.convTimer.samples, total.convTimer.freq.QuadPart));
+	if (m_compress)
+		PrintLatencyStats("Compress  ", GetLatencyStats(total.compTimer.samples, total.compTimer.freq.QuadPart));
+
+	// Per-loop spread, -pipeline and -gopthreads overlap the loops and have none
+	if (total.loops.size() >= 2)
+	{
+		if (m_decompress)
+			PrintRepeatStats("Decompress", GetRepeatStats(total.loopFPS(false)));
+		if (m_compress)
+			PrintRepeatStats("Compress  ", GetRepeatStats(total.loopFPS(true)));
+	}
+}
+
+int CodecBench::processedFrames()
+{
+	int frames = 0;
+	for (size_t i = 0; i < m_streams.size(); ++i)
+	{
+		frames += m_streams[i]->processedFrames();
+	}
+	return frames;
+}
+
+uint64_t CodecBench::processedRawSize()
+{
+	uint64_t size = 0;
+	for (size_t i = 0; i < m_streams.size(); ++i)
+	{
+		size += m_streams[i]->processedRawSize();
+	}
+	return size;
+}
+
+void CodecBench::printCpu()
+{
+	int frames = processedFrames();
+	double cpuSec = m_cpuTimer.seconds();
+	double wallSec = m_wallTimer.sumTimeUs() / 1000000.0;
+	if (!frames || cpuSec <= 0.0)
+		return;
+	printf("CPU: %.2f s (user: %.2f s, kernel: %.2f s) | %.3f ms/frame, %.1f Mcycles/frame | parallelism: %.2f | %.1f frames per core-second\n",
+		cpuSec, m_cpuTimer.userSeconds(), m_cpuTimer.kernelSeconds(), 1000.0 * cpuSec / frames, m_cpuTimer.cycles / 1000000.0 / frames,
+		cpuSec / wallSec, frames / cpuSec);
+}
+
+/// Instructions per core cycle, if the counters have both, else NAN
+static double CounterIPC(const std::vector<std::string>& names, const std::vector<uint64_t>& sums)
+{
+	std::vector<std::string>::const_iterator instructions = std::find(names.begin(), names.end(), "instructions");
+	std::vector<std::string>::const_iterator cycles = std::find(names.begin(), names.end(), "core_cycles");
+	if (instructions == names.end() || cycles == names.end() || !sums[cycles - names.begin()])
+		return NAN;
+	return (double)sums[instructions - names.begin()] / sums[cycles - names.begin()];
+}
+
+void CodecBench::printCounters()
+{
+	if (!m_counterBackend)
+		return;
+
+	BenchStats total = totalStats();
+	const std::vector<std::string>& names = m_counterBackend->counterNames();
+	for (int stage = 0; stage < 2; ++stage)
+	{
+		bool enabled = stage == 0 ? m_decompress : m_compress;
+		const Timer& timer = stage == 0 ? total.decompTimer : total.compTimer;
+		const std::vector<uint64_t>& sums = stage == 0 ? total.decompCounters : total.compCounters;
+		if (!enabled || !timer.numSamples)
+			continue;
+
+		printf("%s counters per frame:", stage == 0 ? "Decompress" : "Compress  ");
+		for (size_t i = 0; i < names.size(); ++i)
+		{
+			printf(" %s: %.3f M%s", names[i].c_str(), sums[i] / 1000000.0 / timer.numSamples, i + 1 < names.size() ? "," : "");
+		}
+		double ipc = CounterIPC(names, sums);
+		if (!isnan(ipc))
+			printf(" | IPC: %.2f", ipc);
+		printf("\n");
+	}
+}
+
+void CodecBench::writeReport()
+{
+	Report report;
+	report.addString("tool", "codecbench");
+
+	report.addString("input.file", m_infile);
+	report.addBool("input.raw", m_rawin);
+	if (m_synthetic)
+	{
+		report.addString("input.synthetic", m_synthetic);
+		report.addInt("input.seed", m_seed);
+	}
+	report.addString("input.container", ContainerName(m_videoReader.container()));
+	report.addFormat("input.format", m_videoReader.getFormat());
+
+	if (m_decompress)
+	{
+		const ICINFO& info = m_streams[0]->decompressor().getInfo();
+		report.addString("decompressor.name", ToUtf8(info.szName));
+		report.addString("decompressor.description", ToUtf8(info.szDescription));
+		report.addBool("decompressor.ex", m_decompressParams.ex);
+		report.addBool("decompressor.hurryup", m_decompressParams.hurryUp);
+		report.addInt("decompressor.input_keyint", m_inputKeyInt);
+		const InitTimes& init = m_streams[0]->decompressor().initTimes();
+		report.addNumber("decompressor.init_ms.open", init.open);
+		report.addNumber("decompressor.init_ms.format", init.format);
+		report.addNumber("decompressor.init_ms.begin", init.begin);
+	}
+	report.addFormat("decompressed.format", m_formatDecompressed);
+	if (m_fullStream)
+	{
+		const Timer& codecTimer = m_streams[0]->stats().decompTimer;
+		const Timer& fullTimer = m_fullStream->stats().decompTimer;
+		std::vector<int64_t> codec, postScale;
+		pairPostScale(codec, postScale);
+		PairedRatio ratio = GetPairedRatio(codec, postScale);
+		report.addString("postscale.filter", m_postScaleArg);
+		report.addString("postscale.path", m_scaler.pathName());
+		report.addFormat("postscale.full_format", m_fullStream->decompressor().getOutputFormat());
+		report.addNumber("postscale.codec_scaled_fps", 1000000.0 * codecTimer.numSamples / codecTimer.sumTimeUs());
+		report.addNumber("postscale.full_decode_fps", 1000000.0 * fullTimer.numSamples / fullTimer.sumTimeUs());
+		report.addNumber("postscale.scale_fps", 1000000.0 * m_scaleTimer.numSamples / m_scaleTimer.sumTimeUs());
+		report.addNumber("postscale.time_ratio", ratio.ratio);
+		report.addNumber("postscale.time_ratio_ci95_low", ratio.ciLow);
+		report.addNumber("postscale.time_ratio_ci95_high", ratio.ciHigh);
+		report.addBool("postscale.time_significant", ratio.significant());
+	}
+	if (m_convertFormat)
+	{
+		report.addFormat("convert.format", m_formatConverted);
+		report.addString("convert.path", m_streams[0]->converter().pathName());
+		report.addBool("convert.optimised", m_streams[0]->converter().optimised());
+	}
+
+	if (m_compress)
+	{
+		const ICINFO& info = m_streams[0]->compressor().getInfo();
+		report.addString("compressor.name", ToUtf8(info.szName));
+		report.addString("compressor.description", ToUtf8(info.szDescription));
+		report.addString("compressor.engine", m_streams[0]->compressor().engineName());
+		const InitTimes& init = m_streams[0]->compressor().initTimes();
+		report.addNumber("compressor.init_ms.open", init.open);
+		report.addNumber("compressor.init_ms.format", init.format);
+		report.addNumber("compressor.init_ms.begin", init.begin);
+	}
+	if (m_streamB)
+	{
+		const ICINFO& info = m_streamB->compressor().getInfo();
+		const BenchStats& statsB = m_streamB->stats();
+		report.addString("ab.compressor_b.name", ToUtf8(info.szName));
+		report.addString("ab.compressor_b.description", ToUtf8(info.szDescription));
+		report.addString("ab.compressor_b.codec", m_codec2);
+		report.addString("ab.compressor_b.state", m_codecStateFile2 ? m_codecStateFile2 : "");
+		report.addNumber("ab.compress_b.fps", statsB.compFPS());
+		report.addNumber("ab.compress_b.mibps", statsB.compMiBps());
+		report.addNumber("ab.compress_b.ratio", statsB.compRatio());
+
+		PairedRatio time = GetPairedRatio(m_streams[0]->stats().compTimer.samples, statsB.compTimer.samples);
+		PairedRatio size = GetPairedRatio(abFrameSizes(m_streams[0]->stats()), abFrameSizes(statsB));
+		report.addInt("ab.frames", time.n);
+		report.addNumber("ab.time_ratio", time.ratio);
+		report.addNumber("ab.time_ratio_ci95_low", time.ciLow);
+		report.addNumber("ab.time_ratio_ci95_high", time.ciHigh);
+		report.addBool("ab.time_significant", time.significant());
+		report.addInt("ab.b_faster_frames", time.smaller);
+		report.addNumber("ab.size_ratio", size.ratio);
+		report.addNumber("ab.size_ratio_ci95_low", size.ciLow);
+		report.addNumber("ab.size_ratio_ci95_high", size.ciHigh);
+		report.addBool("ab.size_significant", size.significant());
+		report.addInt("ab.b_smaller_frames", size.smaller);
+	}
+	report.addFormat("output.format", m_formatCompressed);
+	if (m_outfile)
+	{
+		report.addString("output.file", m_outfile);
+		report.addBool("output.async", m_asyncWrite);
+		report.addString("output.container", ContainerName(m_rawout && m_container != CONTAINER_AVI ? CONTAINER_RAW : m_container));
+		Timer* stall = m_videoWriter.writeStallTimer();
+		if (stall)
+			report.addNumber("output.write_stall_ms", stall->sumTimeUs() / 1000.0);
+	}
+
+	BenchStats total = totalStats();
+	double wallSec = m_wallTimer.sumTimeUs() / 1000000.0;
+	report.addString("memory.allocator", AlignedBuffer::allocatorName());
+	report.addInt("memory.alignment", AlignedBuffer::alignment());
+	report.addInt("memory.large_page_size", AlignedBuffer::largePageSize());
+	report.addInt("memory.large_page_fallbacks", AlignedBuffer::largePageFallbacks());
+	report.addInt("memory.numa_node", AlignedBuffer::numaNode());
+	report.addString("memory.ring", m_ringArg);
+	report.addInt("memory.last_level_cache", BufferRing::cacheSize());
+	report.addBool("memory.flush_cache", m_flushCache);
+
+	report.addString("run.mode", m_threadCount > 1 ? "threads" : m_gopThreads ? "gop" : m_channelCount ? "channels" : m_pipeline ? "pipeline" :
+		m_streamB ? "ab" : "single");
+	report.addInt("run.threads", m_gopThreads ? m_gopThreads : m_channelCount ? m_poolThreads : m_threadCount);
+	if (m_gopThreads)
+		report.addInt("run.gop_segments", m_gopSegments.size());
+	report.addString("run.priority", m_priority ? m_priority : "normal");
+	report.addInt("run.affinity_mask", (int64_t)m_affinityMask);
+	report.addString("run.counters", m_counterBackend ? m_counterBackend->name() : "none");
+	report.addInt("run.loops", m_loopCount);
+	report.addInt("run.warmup_frames", m_warmupFrames);
+	report.addInt("run.frames", total.numFrames);
+	report.addNumber("run.wall_seconds", wallSec);
+	report.addNumber("run.fps", processedFrames() / wallSec); // the wall time covers the warm-up frames too
+	report.addInt("run.input_bytes", total.sumInputSize);
+	report.addInt("run.raw_bytes", total.sumRawSize);
+	report.addInt("run.output_bytes", total.sumOutputSize);
+
+	int frames = processedFrames();
+	double cpuSec = m_cpuTimer.seconds();
+	report.addInt("cpu.frames", frames);
+	report.addNumber("cpu.user_seconds", m_cpuTimer.userSeconds());
+	report.addNumber("cpu.kernel_seconds", m_cpuTimer.kernelSeconds());
+	report.addInt("cpu.cycles", m_cpuTimer.cycles);
+	report.addNumber("cpu.seconds_per_frame", cpuSec / frames);
+	report.addNumber("cpu.cycles_per_frame", (double)m_cpuTimer.cycles / frames);
+	report.addNumber("cpu.parallelism", cpuSec / wallSec);
+	report.addNumber("cpu.frames_per_core_second", frames / cpuSec);
+
+	for (int stage = 0; stage < 2; ++stage)
+	{
+		bool enabled = stage == 0 ? m_decompress : m_compress;
+		if (!enabled)
+			continue;
+
+		std::string key = stage == 0 ? "decompress" : "compress";
+		const Timer& timer = stage == 0 ? total.decompTimer : total.compTimer;
+		report.addNumber(key + ".fps",   stage == 0 ? total.decompFPS()   : total.compFPS());
+		report.addNumber(key + ".mibps", stage == 0 ? total.decompMiBps() : total.compMiBps());
+		report.addNumber(key + ".ratio", stage == 0 ? total.decompRatio() : total.compRatio());
+		if (stage == 0)
+		{
+			report.addInt(key + ".decoded_frames", timer.numSamples);
+			report.addInt(key + ".errors", total.decompErrors);
+			report.addInt(key + ".skipped", total.decompSkipped);
+		}
+
+		if (m_counterBackend && timer.numSamples)
+		{
+			const std::vector<std::string>& names = m_counterBackend->counterNames();
+			const std::vector<uint64_t>& sums = stage == 0 ? total.decompCounters : total.compCounters;
+			for (size_t i = 0; i < names.size(); ++i)
+			{
+				report.addNumber(key + ".counters_per_frame." + names[i], (double)sums[i] / timer.numSamples);
+			}
+			report.addNumber(key + ".counters_per_frame.ipc", CounterIPC(names, sums));
+		}
+
+		if (total.loops.size() >= 2)
+		{
+			RepeatStats loops = GetRepeatStats(total.loopFPS(stage == 1));
+			report.addInt(key + ".loops.count",           loops.n);
+			report.addNumber(key + ".loops.fps.best",     loops.best);
+			report.addNumber(key + ".loops.fps.median",   loops.median);
+			report.addNumber(key + ".loops.fps.mean",     loops.mean);
+			report.addNumber(key + ".loops.fps.stddev",   loops.stddev);
+			report.addNumber(key + ".loops.fps.ci95_low",  loops.ciLow);
+			report.addNumber(key + ".loops.fps.ci95_high", loops.ciHigh);
+			report.addInt(key + ".loops.outliers",        loops.outliers.size());
+			report.addString(key + ".loops.outlier_loops", RepeatOutlierList(loops));
+		}
+
+		LatencyStats latency = GetLatencyStats(timer.samples, timer.freq.QuadPart);
+		report.addNumber(key + ".latency_ms.min",    latency.min);
+		report.addNumber(key + ".latency_ms.p50",    latency.p50);
+		report.addNumber(key + ".latency_ms.p90",    latency.p90);
+		report.addNumber(key + ".latency_ms.p99",    latency.p99);
+		report.addNumber(key + ".latency_ms.p99_9",  latency.p999);
+		report.addNumber(key + ".latency_ms.max",    latency.max);
+		report.addNumber(key + ".latency_ms.mean",   latency.mean);
+		report.addNumber(key + ".latency_ms.stddev", latency.stddev);
+	}
+
+	if (m_convertFormat)
+	{
+		report.addNumber("convert.fps", total.convFPS());
+		report.addNumber("convert.mibps", total.convMiBps());
+		LatencyStats latency = GetLatencyStats(total.convTimer.samples, total.convTimer.freq.QuadPart);
+		report.addNumber("convert.latency_ms.min",  latency.min);
+		report.addNumber("convert.latency_ms.p50",  latency.p50);
+		report.addNumber("convert.latency_ms.p99",  latency.p99);
+		report.addNumber("convert.latency_ms.max",  latency.max);
+		report.addNumber("convert.latency_ms.mean", latency.mean);
+	}
+
+	if (m_verify)
+	{
+		const VerifyStats& verify = total.verify;
+		report.addString("verify.kernels", m_streams[0]->verifier().kernelName());
+		report.addInt("verify.frames", verify.frames);
+		report.addInt("verify.exact_frames", verify.exactFrames);
+		report.addInt("verify.decode_errors", verify.decodeErrors);
+		report.addBool("verify.lossless", verify.frames && verify.exactFrames == verify.frames);
+		report.addNumber("verify.min_psnr", verify.minPsnr);
+		for (int c = 0; c < verify.numPlanes; ++c)
+		{
+			report.addNumber(std::string("verify.psnr.") + verify.planeName(c), verify.psnr(c));
+			report.addNumber(std::string("verify.ssim.") + verify.planeName(c), verify.ssim(c));
+		}
+	}
+
+	if (m_channelCount)
+	{
+		int frames, misses;
+		double capacityMean, capacityP99;
+		LatencyStats latency, service;
+		channelTotals(frames, misses, capacityMean, capacityP99, latency, service);
+		report.addInt("channels.count", m_channelCount);
+		report.addInt("channels.pool_threads", m_poolThreads);
+		report.addNumber("channels.fps", m_fps);
+		report.addNumber("channels.deadline_ms", 1000.0 / m_fps);
+		report.addInt("channels.frames", frames);
+		report.addInt("channels.deadline_misses", misses);
+		report.addNumber("channels.miss_rate", frames ? (double)misses / frames : 0.0);
+		report.addNumber("channels.latency_ms.p50", latency.p50);
+		report.addNumber("channels.latency_ms.p99", latency.p99);
+		report.addNumber("channels.latency_ms.max", latency.max);
+		report.addNumber("channels.service_ms.mean", service.mean);
+		report.addNumber("channels.service_ms.p99", service.p99);
+		report.addNumber("channels.capacity_mean", capacityMean);
+		report.addNumber("channels.capacity_p99", capacityP99);
+
+		std::vector<std::string> columns;
+		columns.push_back("channel");
+		columns.push_back("frames");
+		columns.push_back("misses");
+		columns.push_back("latency_p50_ms");
+		columns.push_back("latency_p99_ms");
+		columns.push_back("latency_max_ms");
+		columns.push_back("jitter_ms");
+		report.beginTable("channel_data", columns);
+		for (size_t i = 0; i < m_channels.size(); ++i)
+		{
+			const LiveChannel& channel = m_channels[i];
+			LatencyStats stats = GetLatencyStats(channel.latency, m_wallTimer.freq.QuadPart);
+			report.addCell((double)i);
+			report.addCell((double)channel.latency.size());
+			report.addCell(channel.misses);
+			report.addCell(stats.p50);
+			report.addCell(stats.p99);
+			report.addCell(stats.max);
+			report.addCell(stats.stddev);
+		}
+	}
+
+	VbvStats vbv;
+	if (m_vbvArg)
+	{
+		vbv = vbvStats();
+		report.addNumber("vbv.buffer_bytes", vbv.bufferBytes);
+		report.addNumber("vbv.drain_bytes_per_second", vbv.bytesPerSecond);
+		report.addNumber("vbv.fps", vbv.fps);
+		report.addNumber("vbv.peak_fullness_bytes", vbv.peakFullness);
+		report.addInt("vbv.overflow_frames", vbv.overflowFrames);
+		report.addInt("vbv.first_overflow", vbv.firstOverflow);
+		report.addNumber("vbv.avg_bitrate", vbv.avgBitrate);
+		report.addNumber("vbv.peak_window_bitrate", vbv.peakWindowBitrate);
+		report.addNumber("vbv.peak_frame_bitrate", vbv.peakFrameBitrate);
+		report.addInt("vbv.max_frame_size", vbv.maxFrameSize);
+		report.addInt("vbv.max_frame", vbv.maxFrameNum);
+		report.addBool("vbv.max_frame_key", vbv.maxFrameKey);
+	}
+
+	if (m_reportFrames)
+	{
+		std::vector<std::string> columns;
+		columns.push_back("stream");
+		columns.push_back("frame");
+		columns.push_back("input_size");
+		columns.push_back("raw_size");
+		columns.push_back("output_size");
+		columns.push_back("key");
+		columns.push_back("decompress_ms");
+		columns.push_back("compress_ms");
+		if (m_vbvArg)
+		{
+			// Bitrate timeline of the first stream
+			columns.push_back("vbv_fullness");
+			columns.push_back("bitrate_1s");
+		}
+
+		report.beginTable("frame_data", columns);
+		for (size_t s = 0; s < m_streams.size(); ++s)
+		{
+			const BenchStats& stats = m_streams[s]->stats();
+			double toMs = 1000.0 / stats.decompTimer.freq.QuadPart;
+			for (size_t i = 0; i < stats.frames.size(); ++i)
+			{
+				const FrameRecord& frame = stats.frames[i];
+				report.addCell((double)s);
+				report.addCell((double)i);
+				report.addCell(frame.inputSize);
+				report.addCell(frame.rawSize);
+				report.addCell(frame.outputSize);
+				report.addCell(frame.keyFrame ? 1 : 0);
+				report.addCell(i < stats.decompTimer.samples.size() ? stats.decompTimer.samples[i] * toMs : 0.0);
+				report.addCell(i < stats.compTimer.samples.size() ? stats.compTimer.samples[i] * toMs : 0.0);
+				if (m_vbvArg)
+				{
+					report.addCell(s == 0 && i < vbv.fullness.size() ? vbv.fullness[i] : 0.0);
+					report.addCell(s == 0 && i < vbv.windowBitrate.size() ? vbv.windowBitrate[i] : 0.0);
+				}
+			}
+		}
+	}
+
+	saveReport(report);
+}
+
+void CodecBench::printVbv()
+{
+	VbvStats vbv = vbvStats();
+	printf("VBV: %.0f KiB buffer, drained at %.1f KiB/s (%.3f fps): peak fullness %.1f KiB (%.0f%%)", vbv.bufferBytes / 1024.0,
+		vbv.bytesPerSecond / 1024.0, vbv.fps, vbv.peakFullness / 1024.0, 100.0 * vbv.peakFullness / vbv.bufferBytes);
+	if (vbv.overflowFrames)
+		printf(" | overflows: %d frames (first: %d)\n", vbv.overflowFrames, vbv.firstOverflow);
+	else
+		printf(" | no overflows\n");
+	printf("Bitrate (Mbit/s): avg %.3f | peak 1 s window %.3f | peak frame %.3f (frame %d, %u bytes%s)\n",
+		vbv.avgBitrate / 1000000.0, vbv.peakWindowBitrate / 1000000.0, vbv.peakFrameBitrate / 1000000.0,
+		vbv.maxFrameNum, vbv.maxFrameSize, vbv.maxFrameKey ? ", keyframe" : "");
+}
+
+void CodecBench::saveReport(const Report& report)
+{
+	if (strcmp(m_reportFormat, "csv") == 0)
+		report.writeCsv(m_reportFile);
+	else
+		report.writeJson(m_reportFile);
+	printf("INFO: Report written      : %s (%s)\n", m_reportFile, m_reportFormat);
+}
+
+void CodecBench::run()
+{
+	if (!m_sweepPoints.empty())
+	{
+		runSweep();
+		return;
+	}
+
+	if (m_initBenchCount)
+	{
+		runInitBench();
+		return;
+	}
+
+	if (m_threadCount > 1)
+	{
+		runThreads();
+	}
+	else if (m_gopThreads)
+	{
+		runGop();
+	}
+	else if (m_channelCount)
+	{
+		runChannels();
+	}
+	else if (m_pipeline)
+	{
+		runPipeline();
+	}
+	else if (m_streamB)
+	{
+		runAB();
+	}
+	else
+	{
+		runSingle();
+	}
+
+	if (m_outfile)
+	{
+		m_videoWriter.close();
+		Timer* stall = m_videoWriter.writeStallTimer();
+		if (stall)
+			printf("Output writer stalled for %.1f ms\n", stall->sumTimeUs() / 1000.0);
+	}
+
+	printCpu();
+	printCounters();
+	if (m_vbvArg)
+	{
+		printVbv();
+	}
+	if (m_fullStream)
+	{
+		printPostScale();
+	}
+
+	BenchStats total = totalStats();
+	if (total.decompErrors || total.decompSkipped)
+	{
+		printf("WARNING: %d frames failed to decompress, %d frames were not decoded (left out of the decompress times)\n",
+			total.decompErrors, total.decompSkipped);
+	}
+	if (AlignedBuffer::largePageFallbacks())
+	{
+		printf("WARNING: %d frame buffers could not get large pages and use regular pages\n", (int)AlignedBuffer::largePageFallbacks());
+	}
+
+	if (m_reportFile)
+	{
+		writeReport();
+	}
+}
+
+void CodecBench::runSingle()
+{
+	BenchStream& stream = *m_streams[0];
+	int currentFrameNum = 0, frameNum = 0;
+
+	printf("\n");
+	int loop = 0, ncharsPrev = 0;
+	IntervalTimer statusTimer(m_refreshMs);
+	m_wallTimer.begin();
+	m_cpuTimer.begin();
+	while (!s_stop && loop < m_loopCount)
+	{
+		if (!m_videoReader.readFrame() || (m_framesToProcess && currentFrameNum >= m_framesToProcess))
+		{
+			currentFrameNum = 0;
+			++loop;
+			stream.endLoop();
+			if (loop < m_loopCount)
+				m_videoReader.rewind();
+			continue;
+		}
+
+		bool keyFrame = isInputKeyFrame(currentFrameNum++);
+		char* currData = m_videoReader.frameData();
+		uint32_t currDataSize = m_videoReader.frameSize();
+
+		// The -postscale path runs first on every other frame, like -codec2
+		int frameIndex = frameNum++;
+		bool postScaleFirst = m_fullStream && (frameIndex & 1);
+		if (postScaleFirst)
+			postScaleFrame(currData, currDataSize, keyFrame, frameIndex);
+		char* inputData = currData;
+		uint32_t inputSize = currDataSize;
+		bool inputKeyFrame = keyFrame;
+
+		const Timer& decompTimer = stream.stats().decompTimer;
+		size_t decompSamples = decompTimer.samples.size();
+		stream.processFrame(currData, currDataSize, keyFrame);
+		if (m_fullStream && decompTimer.samples.size() > decompSamples)
+			m_codecScaledSamples.push_back(std::make_pair(frameIndex, decompTimer.samples.back()));
+
+		if (m_fullStream && !postScaleFirst)
+			postScaleFrame(inputData, inputSize, inputKeyFrame, frameIndex);
+
+		// Write output if needed
+		if (m_outfile)
+		{
+			m_videoWriter.writeFrame(currData, currDataSize, keyFrame, m_compress ? stream.lastEncodeTimeNs() : 0);
+		}
+
+		// Console output is slow, only refresh the status periodically
+		if (!m_quiet && statusTimer.due())
+		{
+			ncharsPrev = printStatus(stream.stats(), ncharsPrev);
+		}
+	}
+	m_cpuTimer.end();
+	m_wallTimer.end();
+	printStatus(stream.stats(), ncharsPrev);
+	printf("\n");
+	printLatency();
+}
+
+void CodecBench::postScaleFrame(const char* data, uint32_t dataSize, bool keyFrame, int frameIndex)
+{
+	BenchStream& stream = *m_fullStream;
+	char* frame = (char*)data;
+	uint32_t frameSize = dataSize;
+	const Timer& fullTimer = stream.stats().decompTimer;
+	size_t fullSamples = fullTimer.samples.size();
+	stream.decompressFrame(frame, frameSize, NULL, keyFrame);
+
+	bool timed = m_scaleCalls++ >= m_warmupFrames;
+	m_scaleTimer.begin();
+	char* scaled = m_scaler.scale(frame);
+	m_scaleTimer.end(timed);
+	if (timed && fullTimer.samples.size() > fullSamples)
+		m_postScaleSamples.push_back(std::make_pair(frameIndex, fullTimer.samples.back() + m_scaleTimer.lastCounts));
+	uint32_t scaledSize = m_scaler.getOutputFormat()->biSizeImage;
+	if (m_flushCache)
+	{
+		FlushCache(frame, frameSize);
+		FlushCache(scaled, scaledSize);
+	}
+	stream.countFrame(dataSize, frameSize, scaledSize, keyFrame);
+}
+
+void CodecBench::pairPostScale(std::vector<int64_t>& codec, std::vector<int64_t>& postScale) const
+{
+	// Both lists are in frame order, a frame that failed, was skipped or was a warm-up frame on one path is left out
+	codec.clear();
+	postScale.clear();
+	size_t a = 0, b = 0;
+	while (a < m_codecScaledSamples.size() && b < m_postScaleSamples.size())
+	{
+		int frameA = m_codecScaledSamples[a].first, frameB = m_postScaleSamples[b].first;
+		if (frameA == frameB)
+		{
+			codec.push_back(m_codecScaledSamples[a++].second);
+			postScale.push_back(m_postScaleSamples[b++].second);
+		}
+		else if (frameA < frameB)
+			++a;
+		else
+			++b;
+	}
+}
+
+void CodecBench::printPostScale()
+{
+	const Timer& codecTimer = m_streams[0]->stats().decompTimer;
+	const Timer& fullTimer = m_fullStream->stats().decompTimer;
+	double codecMs = codecTimer.sumTimeUs() / 1000.0 / std::max<int64_t>(codecTimer.numSamples, 1);
+	double fullMs = fullTimer.sumTimeUs() / 1000.0 / std::max<int64_t>(fullTimer.numSamples, 1);
+	double scaleMs = m_scaleTimer.sumTimeUs() / 1000.0 / std::max<int64_t>(m_scaleTimer.numSamples, 1);
+
+	// Per frame: full decode + scale against the scaled decode
+	std::vector<int64_t> codec, postScale;
+	pairPostScale(codec, postScale);
+	PairedRatio ratio = GetPairedRatio(codec, postScale);
+
+	printf("Codec-side scaled decode : %.1f fps (%.3f ms/frame)\n", 1000.0 / codecMs, codecMs);
+	printf("Full decode + %-10s : %.1f fps (decode %.3f ms + scale %.3f ms = %.3f ms/frame, %s)\n", m_postScaleArg,
+		1000.0 / (fullMs + scaleMs), fullMs, scaleMs, fullMs + scaleMs, m_scaler.pathName());
+	printf("Post-scale/codec-side time: %.4f (95%% CI %.4f..%.4f) %s | post-scale faster on %d of %d frames\n", ratio.ratio,
+		ratio.ciLow, ratio.ciHigh, ratio.significant() ? "significant" : "not significant", ratio.smaller, ratio.n);
+	PrintLatencyStats("Full decode", GetLatencyStats(fullTimer.samples, fullTimer.freq.QuadPart));
+	PrintLatencyStats("Post-scale ", GetLatencyStats(m_scaleTimer.samples, m_scaleTimer.freq.QuadPart));
+}
+
+void CodecBench::runAB()
+{
+	BenchStream& streamA = *m_streams[0];
+	BenchStream& streamB = *m_streamB;
+	int currentFrameNum = 0, pairNum = 0;
+
+	printf("\nComparing compressors A and B in ABBA order...\n");
+	int loop = 0, ncharsPrev = 0;
+	IntervalTimer statusTimer(m_refreshMs);
+	m_wallTimer.begin();
+	m_cpuTimer.begin();
+	while (!s_stop && loop < m_loopCount)
+	{
+		if (!m_videoReader.readFrame() || (m_framesToProcess && currentFrameNum >= m_framesToProcess))
+		{
+			currentFrameNum = 0;
+			++loop;
+			streamA.endLoop();
+			streamB.endLoop();
+			if (loop < m_loopCount)
+				m_videoReader.rewind();
+			continue;
+		}
+
+		bool keyFrame = isInputKeyFrame(currentFrameNum++);
+		char* currData = m_videoReader.frameData();
+		uint32_t currDataSize = m_videoReader.frameSize();
+		uint32_t inputSize = currDataSize;
+		if (m_decompress)
+		{
+			streamA.decompressFrame(currData, currDataSize, NULL, keyFrame);
+		}
+		uint32_t rawSize = currDataSize;
+		streamA.convertFrame(currData, currDataSize);
+
+		// A B, B A, A B, ...: each compressor runs first on every other frame, so neither of them
+		// systematically gets the warmer caches or the later clock state
+		BenchStream* order[2] = { &streamA, &streamB };
+		if (pairNum++ & 1)
+			std::swap(order[0], order[1]);
+		for (int i = 0; i < 2; ++i)
+		{
+			char* data = currData;
+			uint32_t dataSize = currDataSize;
+			order[i]->compressFrame(data, dataSize);
+		}
+		Compressor& compA = streamA.compressor();
+		Compressor& compB = streamB.compressor();
+		streamA.countFrame(inputSize, rawSize, compA.frameSize(), compA.isKeyFrame());
+		streamB.countFrame(inputSize, rawSize, compB.frameSize(), compB.isKeyFrame());
+
+		// The output is A's
+		if (m_outfile)
+		{
+			m_videoWriter.writeFrame(compA.frameData(), compA.frameSize(), compA.isKeyFrame(), streamA.lastEncodeTimeNs());
+		}
+
+		if (!m_quiet && statusTimer.due())
+		{
+			ncharsPrev = printStatus(streamA.stats(), ncharsPrev);
+		}
+	}
+	m_cpuTimer.end();
+	m_wallTimer.end();
+	printStatus(streamA.stats(), ncharsPrev);
+	printf("\n");
+	printLatency();
+	printAB();
+}
+
+void CodecBench::printAB()
+{
+	const BenchStats& statsA = m_streams[0]->stats();
+	const BenchStats& statsB = m_streamB->stats();
+	printf("A: F: %d | Compress: %.1f fps (%.1f MiB/s) (ratio: %.2f)\n", statsA.numFrames, statsA.compFPS(), statsA.compMiBps(), statsA.compRatio());
+	printf("B: F: %d | Compress: %.1f fps (%.1f MiB/s) (ratio: %.2f)\n", statsB.numFrames, statsB.compFPS(), statsB.compMiBps(), statsB.compRatio());
+	PrintLatencyStats("Compress B", GetLatencyStats(statsB.compTimer.samples, statsB.compTimer.freq.QuadPart));
+
+	PairedRatio time = GetPairedRatio(statsA.compTimer.samples, statsB.compTimer.samples);
+	PairedRatio size = GetPairedRatio(abFrameSizes(statsA), abFrameSizes(statsB));
+	printf("B/A encode time: %.4f (95%% CI %.4f..%.4f) %s | B faster on %d of %d frames\n", time.ratio, time.ciLow, time.ciHigh,
+		time.significant() ? "significant" : "not significant", time.smaller, time.n);
+	printf("B/A frame size : %.4f (95%% CI %.4f..%.4f) %s | B smaller on %d of %d frames\n", size.ratio, size.ciLow, size.ciHigh,
+		size.significant() ? "significant" : "not significant", size.smaller, size.n);
+}
+
+void CodecBench::runThreads()
+{
+	printf("\nRunning %d threads...\n", m_threadCount);
+
+	std::vector<StreamThread*> threads;
+	for (size_t i = 0; i < m_streams.size(); ++i)
+	{
+		threads.push_back(new StreamThread(*this, *m_streams[i]));
+	}
+
+	m_wallTimer.begin();
+	m_cpuTimer.begin();
+	for (size_t i = 0; i < threads.size(); ++i)
+	{
+		threads[i]->start(threadAffinity(i));
+	}
+
+	std::string error;
+	for (size_t i = 0; i < threads.size(); ++i)
+	{
+		try
+		{
+			threads[i]->join();
+		}
+		catch (std::exception& e)
+		{
+			if (error.empty())
+				error = e.what();
+		}
+	}
+	m_cpuTimer.end();
+	m_wallTimer.end();
+
+	for (size_t i = 0; i < threads.size(); ++i)
+	{
+		delete threads[i];
+	}
+	if (!error.empty())
+	{
+		throw std::runtime_error(error);
+	}
+
+	// Per-thread and aggregate results
+	for (size_t i = 0; i < m_streams.size(); ++i)
+	{
+		BenchStats& stats = m_streams[i]->stats();
+		printf("T%-2d ", (int)i);
+		printStats(stats);
+		printf("\n");
+	}
+
+	// The wall time covers the warm-up frames too
+	int totalFrames = processedFrames();
+	uint64_t totalRawSize = processedRawSize();
+	double wallSec = m_wallTimer.sumTimeUs() / 1000000.0;
+	printf("Aggregate: %d frames in %.2f s | %.1f fps (%.1f MiB/s)\n", totalFrames, wallSec,
+		totalFrames / wallSec, totalRawSize / 1024.0 / 1024.0 / wallSec);
+	printLatency();
+}
+
+void CodecBench::runStream(BenchStream& stream)
+{
+	size_t numFrames = m_videoReader.numIndexedFrames();
+	for (int loop = 0; !s_stop && loop < m_loopCount; ++loop)
+	{
+		for (size_t i = 0; !s_stop && i < numFrames; ++i)
+		{
+			char* currData = (char*)m_videoReader.indexedFrameData(i);
+			uint32_t currDataSize = m_videoReader.indexedFrameSize(i);
+			bool keyFrame = isInputKeyFrame((int)i);
+			stream.processFrame(currData, currDataSize, keyFrame);
+		}
+		if (!s_stop)
+			stream.endLoop();
+	}
+}
+
+void CodecBench::initGopSegments()
+{
+	size_t numFrames = m_videoReader.numIndexedFrames();
+	if (!m_videoReader.hasFileIndex() && m_inputKeyInt <= 0)
+	{
+		printf("WARNING: the input has no keyframe flags (v2 or AVI index) and no -inkeyint, every frame is decoded on its own\n");
+	}
+	if (!isInputKeyFrame(0))
+	{
+		printf("WARNING: the input does not start with a keyframe, the first segment is decoded from a non-keyframe\n");
+	}
+
+	m_gopSegments.clear();
+	m_gopSegments.push_back(0);
+	for (size_t i = 1; i < numFrames; ++i)
+	{
+		if (isInputKeyFrame((int)i))
+			m_gopSegments.push_back(i);
+	}
+	printf("INFO: GOP threads         : %d, %d segments (%.1f frames per segment)\n", m_gopThreads,
+		(int)m_gopSegments.size(), (double)numFrames / m_gopSegments.size());
+	if ((int)m_gopSegments.size() < m_gopThreads)
+	{
+		printf("WARNING: fewer segments than -gopthreads, some threads will be idle\n");
+	}
+}
+
+void CodecBench::runGop()
+{
+	printf("\nDecoding %d segments on %d threads...\n", (int)m_gopSegments.size(), m_gopThreads);
+
+	// Every loop is a pass over all segments. With an output, each thread can be two segments ahead of the writer.
+	size_t stride = align_to<CONTAINER_V2_ALIGNMENT>(((BITMAPINFOHEADER*)m_formatDecompressed)->biSizeImage);
+	size_t maxSegment = 0;
+	for (size_t i = 0; i < m_gopSegments.size(); ++i)
+	{
+		size_t end = i + 1 < m_gopSegments.size() ? m_gopSegments[i + 1] : m_videoReader.numIndexedFrames();
+		maxSegment = std::max(maxSegment, end - m_gopSegments[i]);
+	}
+	TaskScheduler scheduler(m_gopSegments.size() * m_loopCount, m_outfile ? 2 * m_gopThreads : 0, m_outfile ? maxSegment * stride : 0);
+	m_gopScheduler = &scheduler;
+
+	std::vector<GopThread*> threads;
+	for (int i = 0; i < m_gopThreads; ++i)
+	{
+		threads.push_back(new GopThread(*this, *m_streams[i]));
+	}
+
+	m_wallTimer.begin();
+	m_cpuTimer.begin();
+	std::string error;
+	try
+	{
+		for (size_t i = 0; i < threads.size(); ++i)
+		{
+			threads[i]->start(threadAffinity(i));
+		}
+
+		// Decoded frames are written here, in input order
+		while (TaskScheduler::Slot* slot = m_outfile ? scheduler.consume() : NULL)
+		{
+			for (size_t i = 0; i < slot->frameSizes.size(); ++i)
+			{
+				m_videoWriter.writeFrame(slot->buf.data() + i * stride, slot->frameSizes[i]);
+			}
+			scheduler.release();
+		}
+	}
+	catch (std::exception& e)
+	{
+		error = e.what();
+		scheduler.abort();
+	}
+
+	for (size_t i = 0; i < threads.size(); ++i)
+	{
+		try
+		{
+			threads[i]->join();
+		}
+		catch (std::exception& e)
+		{
+			if (error.empty())
+				error = e.what();
+		}
+	}
+	m_cpuTimer.end();
+	m_wallTimer.end();
+	m_gopScheduler = NULL;
+
+	for (size_t i = 0; i < threads.size(); ++i)
+	{
+		delete threads[i];
+	}
+	if (!error.empty())
+	{
+		throw std::runtime_error(error);
+	}
+
+	for (int i = 0; i < m_gopThreads; ++i)
+	{
+		BenchStats& stats = m_streams[i]->stats();
+		printf("T%-2d ", i);
+		printStats(stats);
+		printf("\n");
+	}
+
+	// The wall time covers the warm-up frames too
+	int totalFrames = processedFrames();
+	uint64_t totalRawSize = processedRawSize();
+	double wallSec = m_wallTimer.sumTimeUs() / 1000000.0;
+	printf("Aggregate: %d frames in %.2f s | %.1f fps (%.1f MiB/s) single stream decode\n", totalFrames, wallSec,
+		totalFrames / wallSec, totalRawSize / 1024.0 / 1024.0 / wallSec);
+	printLatency();
+}
+
+void CodecBench::runGopWorker(BenchStream& stream)
+{
+	size_t numFrames = m_videoReader.numIndexedFrames();
+	size_t numSegments = m_gopSegments.size();
+	size_t stride = align_to<CONTAINER_V2_ALIGNMENT>(((BITMAPINFOHEADER*)m_formatDecompressed)->biSizeImage);
+	try
+	{
+		size_t task;
+		TaskScheduler::Slot* slot;
+		while (!s_stop && m_gopScheduler->acquire(task, slot))
+		{
+			size_t segment = task % numSegments;
+			size_t first = m_gopSegments[segment];
+			size_t end = segment + 1 < numSegments ? m_gopSegments[segment + 1] : numFrames;
+			if (slot)
+				slot->frameSizes.clear();
+
+			for (size_t i = first; i < end; ++i)
+			{
+				char* data = (char*)m_videoReader.indexedFrameData(i);
+				uint32_t dataSize = m_videoReader.indexedFrameSize(i);
+				uint32_t inputSize = dataSize;
+				// Temporal decoders update their previous output in place, so they keep their own buffer and
+				// the frame is copied into the slot
+				stream.decompressFrame(data, dataSize, NULL, isInputKeyFrame((int)i));
+				stream.countFrame(inputSize, dataSize, dataSize, true);
+				if (slot)
+				{
+					memcpy(slot->buf.data() + (i - first) * stride, data, std::min<size_t>(dataSize, stride));
+					slot->frameSizes.push_back(dataSize);
+				}
+			}
+			m_gopScheduler->publish(task);
+		}
+		if (s_stop)
+			m_gopScheduler->abort();
+	}
+	catch (...)
+	{
+		// Do not leave the writer and the other workers waiting for this segment
+		m_gopScheduler->abort();
+		throw;
+	}
+}
+
+void CodecBench::runChannels()
+{
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+	m_channelPeriod = freq.QuadPart / m_fps;
+	size_t numFrames = m_framesToProcess ? std::min((size_t)m_framesToProcess, m_videoReader.numIndexedFrames()) : m_videoReader.numIndexedFrames();
+	numFrames *= m_loopCount;
+
+	m_channels.assign(m_channelCount, LiveChannel());
+	for (int i = 0; i < m_channelCount; ++i)
+	{
+		LiveChannel& channel = m_channels[i];
+		channel.nextFrame = 0;
+		channel.numFrames = numFrames;
+		channel.phaseCounts = (int64_t)(m_channelPeriod * i / m_channelCount);
+		channel.latency.reserve(numFrames);
+		channel.service.reserve(numFrames);
+		channel.misses = 0;
+	}
+
+	printf("\nRunning %d channels at %.3f fps on %d threads...\n", m_channelCount, m_fps, m_poolThreads);
+
+	ChannelScheduler scheduler(m_poolThreads, m_channels.size());
+	m_channelScheduler = &scheduler;
+
+	// 1 ms sleeps between the releases
+	timeBeginPeriod(1);
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	m_channelStart = now.QuadPart + freq.QuadPart / 50; // the threads start in the meantime
+	for (size_t i = 0; i < m_channels.size(); ++i)
+	{
+		scheduler.schedule((int)(i % m_poolThreads), i, channelRelease(m_channels[i], 0), now.QuadPart);
+	}
+
+	std::vector<ChannelThread*> threads;
+	for (int i = 0; i < m_poolThreads; ++i)
+	{
+		threads.push_back(new ChannelThread(*this, i));
+	}
+
+	m_wallTimer.begin();
+	m_cpuTimer.begin();
+	std::string error;
+	try
+	{
+		for (size_t i = 0; i < threads.size(); ++i)
+		{
+			threads[i]->start(threadAffinity(i));
+		}
+	}
+	catch (std::exception& e)
+	{
+		error = e.what();
+		scheduler.abort();
+	}
+	for (size_t i = 0; i < threads.size(); ++i)
+	{
+		try
+		{
+			threads[i]->join();
+		}
+		catch (std::exception& e)
+		{
+			if (error.empty())
+				error = e.what();
+		}
+	}
+	m_cpuTimer.end();
+	m_wallTimer.end();
+	timeEndPeriod(1);
+	LONG steals = scheduler.steals();
+	m_channelScheduler = NULL;
+
+	for (size_t i = 0; i < threads.size(); ++i)
+	{
+		delete threads[i];
+	}
+	if (!error.empty())
+	{
+		throw std::runtime_error(error);
+	}
+
+	// Per-channel and aggregate results
+	double toMs = 1000.0 / freq.QuadPart;
+	for (size_t i = 0; i < m_channels.size(); ++i)
+	{
+		const LiveChannel& channel = m_channels[i];
+		LatencyStats latency = GetLatencyStats(channel.latency, freq.QuadPart);
+		printf("C%-2d F: %d | misses: %d | latency (ms): p50 %.3f | p99 %.3f | max %.3f | jitter %.3f\n", (int)i,
+			(int)channel.latency.size(), channel.misses, latency.p50, latency.p99, latency.max, latency.stddev);
+	}
+
+	int frames, misses;
+	double capacityMean, capacityP99;
+	LatencyStats latency, service;
+	channelTotals(frames, misses, capacityMean, capacityP99, latency, service);
+	printf("Channels: %d frames, %d deadline misses (%.2f%%) of %.3f ms | %ld steals\n", frames, misses,
+		frames ? 100.0 * misses / frames : 0.0, m_channelPeriod * toMs, (long)steals);
+	PrintLatencyStats("Channel   ", latency);
+	PrintLatencyStats("Service   ", service);
+	printf("Capacity estimate: %.1f channels by the mean service time, %.1f by the p99 (%d threads at %.3f fps)\n",
+		capacityMean, capacityP99, m_poolThreads, m_fps);
+	printLatency();
+}
+
+void CodecBench::runChannelWorker(int worker)
+{
+	ChannelScheduler& scheduler = *m_channelScheduler;
+	size_t numIndexed = m_videoReader.numIndexedFrames();
+	size_t loopFrames = m_framesToProcess ? std::min((size_t)m_framesToProcess, numIndexed) : numIndexed;
+	try
+	{
+		size_t index;
+		while (scheduler.next(worker, index))
+		{
+			if (s_stop)
+			{
+				scheduler.abort();
+				break;
+			}
+
+			LiveChannel& channel = m_channels[index];
+			BenchStream& stream = *m_streams[index];
+			size_t frameNum = channel.nextFrame % loopFrames;
+			char* data = (char*)m_videoReader.indexedFrameData(frameNum);
+			uint32_t dataSize = m_videoReader.indexedFrameSize(frameNum);
+			bool keyFrame = isInputKeyFrame((int)frameNum);
+
+			LARGE_INTEGER start, end;
+			QueryPerformanceCounter(&start);
+			stream.processFrame(data, dataSize, keyFrame);
+			QueryPerformanceCounter(&end);
 
-	static bool s_stop;
+			// A frame misses its deadline when it is not done before the next one arrives
+			int64_t release = channelRelease(channel, channel.nextFrame);
+			if ((int)channel.nextFrame >= m_warmupFrames)
+			{
+				channel.latency.push_back(end.QuadPart - release);
+				channel.service.push_back(end.QuadPart - start.QuadPart);
+				if (end.QuadPart > channelRelease(channel, channel.nextFrame + 1))
+					++channel.misses;
+			}
 
-	static void sighandler(int signo)
+			if (++channel.nextFrame >= channel.numFrames)
+				scheduler.finish();
+			else
+				scheduler.schedule(worker, index, channelRelease(channel, channel.nextFrame), end.QuadPart);
+		}
+	}
+	catch (...)
 	{
-		s_stop = true;
+		scheduler.abort();
+		throw;
 	}
-};
-
-bool CodecBench::s_stop = false;
+}
 
-void CodecBench::init(int argc, char* argv[])
+void CodecBench::channelTotals(int& frames, int& misses, double& capacityMean, double& capacityP99, LatencyStats& latency, LatencyStats& service)
 {
-	signal(SIGINT, sighandler);
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+	std::vector<int64_t> latencies, services;
+	misses = 0;
+	for (size_t i = 0; i < m_channels.size(); ++i)
+	{
+		latencies.insert(latencies.end(), m_channels[i].latency.begin(), m_channels[i].latency.end());
+		services.insert(services.end(), m_channels[i].service.begin(), m_channels[i].service.end());
+		misses += m_channels[i].misses;
+	}
+	frames = (int)latencies.size();
+	latency = GetLatencyStats(latencies, freq.QuadPart);
+	service = GetLatencyStats(services, freq.QuadPart);
 
-	initArguments(argc, argv);
-	initInput();
-	initOutput();
+	// Every pool thread has one frame interval per frame of each channel
+	double periodMs = 1000.0 / m_fps;
+	capacityMean = service.mean > 0.0 ? m_poolThreads * periodMs / service.mean : 0.0;
+	capacityP99 = service.p99 > 0.0 ? m_poolThreads * periodMs / service.p99 : 0.0;
 }
 
-void CodecBench::initArguments(int argc, char* argv[])
+void CodecBench::runPipeline()
 {
-	if (argc < 2)
+	printf("\n");
+
+	std::vector<PipelineThread*> threads;
+	for (size_t i = 0; i < m_stages.size(); ++i)
 	{
-		printf("Usage: %s -i <infile> -o [outfile] [options]\n", argv[0]);
-		printf("Options:\n");
-		printf("  -i [infile]  Input file. Required.\n");
-		printf("  -o [outfile] Output file. Optional. If not given, the output is discarded.\n");
-		printf("  -nd          Do not decompress input (send read input directly to compressor).\n");
-		printf("  -nc          Do not compress. Useful for benchmarking a decoder.\n");
-		printf("  -rawin       Input is raw. -nd is turned on automatically. -f, -w and -h must be specified.\n");
-		printf("  -rawout      Output is raw. -nc is turned on automatically.\n");
-		printf("  -f [format]  Request the decompressor to decode <infile> as [format]. Valid formats are:\n");
-		printf("               RGB24 (bgr24), RGB32 (bgr32), BGRA, AYUV, YUY2, UYVY, YV12, YV24, Y8, b64a, b48r, v210, r210\n");
-		printf("               If not given, the decompressor specifies the format.\n");
-		printf("               For -rawin: specifies raw video format.\n");
-		printf("  -w [width]   Request the decompressor to decode <infile> to given width.\n");
-		printf("               If not given, the decompressor specifies the width.\n");
-		printf("               For -rawin: specifies raw video width.\n");
-		printf("  -h [height]  Request the decompressor to decode <infile> to given height.\n");
-		printf("               Negative value is possible, which will request top-to-bottom RGB (RGB only).\n");
-		printf("               If not given, the decompressor specifies the height.\n");
-		printf("               For -rawin: specifies raw video height.\n");
-		printf("  -frames [n]  Process only the first [n] frames (0: all).\n");
-		printf("  -loop [n]    Loop the process [n] times (default: 1).\n");
-		throw std::runtime_error("");
+		threads.push_back(new PipelineThread(*this, i));
 	}
 
-	// Parse command line
-	ArgvParser parser(argc, argv);
-	m_rawin           = parser.hasArg("-rawin");
-	m_rawout          = parser.hasArg("-rawout");
-	m_decompress      = m_rawin  ? false : !parser.hasArg("-nd");
-	m_compress        = m_rawout ? false : !parser.hasArg("-nc");
-	m_decompFormat    = parser.getArg("-f", NULL);
-	m_decompWidth     = atoi(parser.getArg("-w", "0"));
-	m_decompHeight    = atoi(parser.getArg("-h", "0"));
-	m_framesToProcess = atoi(parser.getArg("-frames", "0"));
-	m_loopCount       = atoi(parser.getArg("-loop", "1"));
-	m_infile          = parser.getArg("-i", NULL);
-	m_outfile         = parser.getArg("-o", NULL);
-
-	// Verify arguments
-	if (!m_infile)
+	m_wallTimer.begin();
+	m_cpuTimer.begin();
+	for (size_t i = 0; i < threads.size(); ++i)
 	{
-		throw std::runtime_error("ERROR: No input file given (-i)!\n");
+		threads[i]->start();
 	}
 
-	if (m_rawin) // raw input: format must be given
+	std::string error;
+	for (size_t i = 0; i < threads.size(); ++i)
 	{
-		if (!m_decompFormat || !m_decompWidth || !m_decompHeight)
+		try
 		{
-			throw std::runtime_error("ERROR: -f, -w, -h must be given for raw inputs\n");
+			threads[i]->join();
 		}
-	}
-	else if (!m_decompress) // non-raw no-decompress: take format from file
-	{
-		if (m_decompFormat)
+		catch (std::exception& e)
 		{
-			printf("WARNING: ignoring -f option because -nd option was given\n");
-			m_decompFormat = NULL;
+			if (error.empty())
+				error = e.what();
 		}
-		if (m_decompWidth)
+	}
+	m_cpuTimer.end();
+	m_wallTimer.end();
+
+	for (size_t i = 0; i < threads.size(); ++i)
+	{
+		delete threads[i];
+	}
+	if (!error.empty())
+	{
+		throw std::runtime_error(error);
+	}
+
+	BenchStats& stats = m_streams[0]->stats();
+	printStats(stats);
+	printf("\n");
+
+	// The wall time covers the warm-up frames too
+	int totalFrames = processedFrames();
+	double wallSec = m_wallTimer.sumTimeUs() / 1000000.0;
+	printf("Pipeline: %d frames in %.2f s | %.1f fps end-to-end (%.1f MiB/s)\n", totalFrames, wallSec,
+		totalFrames / wallSec, processedRawSize() / 1024.0 / 1024.0 / wallSec);
+	for (size_t i = 0; i < m_rings.size(); ++i)
+	{
+		FrameRing& ring = *m_rings[i];
+		printf("  Queue %-10s -> %-10s : producer stalled %8.1f ms (%5d waits), consumer stalled %8.1f ms (%5d waits)\n",
+			stageName(m_stages[i]), stageName(m_stages[i + 1]),
+			ring.producerStall().sumTimeUs() / 1000.0, (int)ring.producerStall().numSamples,
+			ring.consumerStall().sumTimeUs() / 1000.0, (int)ring.consumerStall().numSamples);
+	}
+	printLatency();
+}
+
+void CodecBench::runPipelineStage(size_t stageIndex)
+{
+	try
+	{
+		switch (m_stages[stageIndex])
 		{
-			printf("WARNING: ignoring -w option because -nd option was given\n");
-			m_decompWidth = 0;
+		case STAGE_READ:
+			pipelineRead(*m_rings[stageIndex]);
+			break;
+		case STAGE_DECOMPRESS:
+		case STAGE_COMPRESS:
+			pipelineCodec(m_stages[stageIndex], *m_rings[stageIndex - 1], *m_rings[stageIndex]);
+			break;
+		case STAGE_WRITE:
+			pipelineWrite(*m_rings[stageIndex - 1]);
+			break;
 		}
-		if (m_decompHeight)
+	}
+	catch (...)
+	{
+		// Do not leave the other stages waiting for this one
+		for (size_t i = 0; i < m_rings.size(); ++i)
 		{
-			printf("WARNING: ignoring -h option because -nd option was given\n");
-			m_decompHeight = 0;
+			m_rings[i]->abort();
 		}
+		throw;
 	}
 }
 
-void CodecBench::initInput()
+void CodecBench::pipelineRead(FrameRing& out)
 {
-	// Open input video stream
-	if (m_rawin)
-	{
-		m_videoReader.openRaw(m_infile, m_decompFormat, m_decompWidth, m_decompHeight);
-	}
-	else
+	int loop = 0, currentFrameNum = 0;
+	while (!s_stop && loop < m_loopCount)
 	{
-		m_videoReader.open(m_infile);
+		if (!m_videoReader.readFrame() || (m_framesToProcess && currentFrameNum >= m_framesToProcess))
+		{
+			currentFrameNum = 0;
+			++loop;
+			if (loop < m_loopCount)
+				m_videoReader.rewind();
+			continue;
+		}
+		++currentFrameNum;
+
+		PipelineFrame* frame = out.acquire();
+		if (!frame)
+			return;
+
+		uint32_t frameSize = m_videoReader.frameSize();
+		if (m_videoReader.isIndexed())
+		{
+			// In-memory frames stay valid, pass them on without copying
+			frame->data = m_videoReader.frameData();
+		}
+		else
+		{
+			if (frame->buf.size() < frameSize)
+				frame->buf.resize(frameSize);
+			memcpy(frame->buf.data(), m_videoReader.frameData(), frameSize);
+			frame->data = frame->buf.data();
+		}
+		frame->dataSize = frame->inputSize = frame->rawSize = frameSize;
+		frame->keyFrame = isInputKeyFrame(currentFrameNum - 1);
+		frame->encodeTimeNs = 0;
+		frame->last = false;
+		out.publish(frame);
 	}
-	printf("INFO: Input file          : %s%s\n", m_rawin ? "[RAW] " : "", m_infile);
 
-	printf("INFO: Input format        : ");
-	PrintBitmapInfo(m_videoReader.getFormat());
-	printf("\n");
+	PipelineFrame* frame = out.acquire();
+	if (!frame)
+		return;
+	frame->last = true;
+	out.publish(frame);
+}
 
-	// Prepare decompressor if needed
-	if (m_decompress)
+void CodecBench::pipelineCodec(PipelineStage stage, FrameRing& in, FrameRing& out)
+{
+	BenchStream& stream = *m_streams[0];
+	for (;;)
 	{
-		BITMAPINFOHEADER biFormatDecomp = {};
-		if (m_decompFormat)
+		PipelineFrame* src = in.consume();
+		if (!src)
+			return;
+		PipelineFrame* dst = out.acquire();
+		if (!dst)
+			return;
+
+		dst->last = src->last;
+		if (!src->last)
 		{
-			GetDecompFormat(m_decompFormat, m_videoReader.getFormat()->biWidth, m_videoReader.getFormat()->biHeight, &biFormatDecomp);
+			char* data = src->data;
+			uint32_t dataSize = src->dataSize;
+			dst->inputSize = src->inputSize;
+			if (stage == STAGE_DECOMPRESS)
+			{
+				// The decompressor writes its own buffer, as temporal decoders update their previous output in place.
+				// The converter (-convert) writes the frame's, otherwise the output is copied there.
+				stream.decompressFrame(data, dataSize, NULL, src->keyFrame);
+				dst->rawSize = dataSize;
+				if (stream.converts())
+				{
+					stream.convertFrame(data, dataSize, dst->buf.data());
+				}
+				else
+				{
+					if (dst->buf.size() < dataSize)
+						dst->buf.resize(dataSize);
+					memcpy(dst->buf.data(), data, dataSize);
+				}
+				dst->keyFrame = src->keyFrame;
+				dst->encodeTimeNs = src->encodeTimeNs;
+			}
+			else
+			{
+				// The compressor reuses its output buffer, so the frame must be copied
+				stream.compressFrame(data, dataSize);
+				dst->keyFrame = stream.compressor().isKeyFrame();
+				dst->encodeTimeNs = stream.lastEncodeTimeNs();
+				if (dst->buf.size() < dataSize)
+					dst->buf.resize(dataSize);
+				memcpy(dst->buf.data(), data, dataSize);
+				dst->rawSize = src->rawSize;
+			}
+			dst->data = dst->buf.data();
+			dst->dataSize = dataSize;
 		}
-		m_decompressor.init(m_videoReader.getFormat(), m_decompFormat ? &biFormatDecomp : NULL, m_decompWidth, m_decompHeight);
-		m_formatDecompressed = m_decompressor.getOutputFormat();
 
-		printf("INFO: Decompressed format : ");
-		PrintBitmapInfo((BITMAPINFOHEADER*)m_formatDecompressed);
-		printf("\n");
+		bool last = src->last;
+		in.release(src);
+		out.publish(dst);
+		if (last)
+			return;
 	}
-	else
+}
+
+void CodecBench::pipelineWrite(FrameRing& in)
+{
+	BenchStream& stream = *m_streams[0];
+	for (;;)
 	{
-		printf("INFO: Decompressor        : -\n");
-		m_formatDecompressed = m_videoReader.getFormat();
+		PipelineFrame* frame = in.consume();
+		if (!frame || frame->last)
+			return;
+
+		stream.countFrame(frame->inputSize, frame->rawSize, frame->dataSize, frame->keyFrame);
+
+		if (m_outfile)
+		{
+			m_videoWriter.writeFrame(frame->data, frame->dataSize, frame->keyFrame, frame->encodeTimeNs);
+		}
+		in.release(frame);
 	}
 }
 
-void CodecBench::initOutput()
+static std::string Trim(const std::string& str)
 {
-	// Prepare compressor if needed
-	if (m_compress)
+	size_t start = str.find_first_not_of(" \t\r\n");
+	size_t end = str.find_last_not_of(" \t\r\n");
+	return start == std::string::npos ? std::string() : str.substr(start, end - start + 1);
+}
+
+void CodecBench::initSweep(const char* sweepFile)
+{
+	// Every key defaults to the single value given on the command line
+	std::vector<std::string> formats(1, m_decompFormat ? m_decompFormat : "");
+	std::vector<std::pair<int, int> > sizes(1, std::make_pair(m_decompWidth, m_decompHeight));
+	std::vector<std::string> codecs(1, m_codec ? std::string(m_codec) + (m_codecStateFile ? std::string(":") + m_codecStateFile : "") : "");
+	std::vector<LONG> qualities(1, m_compressParams.quality);
+	std::vector<LONG> keyints(1, m_compressParams.keyFrameRate);
+	std::vector<LONG> datarates(1, m_compressParams.dataRate);
+	std::vector<bool> engines(1, m_compressParams.direct);
+
+	std::ifstream file(sweepFile);
+	if (!file)
 	{
-		m_compress = m_compressor.init(m_formatDecompressed);
-		if (m_compress)
+		throw std::runtime_error(std::string("ERROR: Failed to open sweep file: ") + sweepFile);
+	}
+
+	std::string line;
+	while (std::getline(file, line))
+	{
+		line = Trim(line.substr(0, line.find('#')));
+		if (line.empty())
+			continue;
+
+		size_t eq = line.find('=');
+		if (eq == std::string::npos)
+		{
+			throw std::runtime_error("ERROR: Invalid line in sweep file: " + line);
+		}
+		std::string key = Trim(line.substr(0, eq));
+		std::vector<std::string> values;
+		std::string list = line.substr(eq + 1);
+		size_t start = 0, comma;
+		do
+		{
+			comma = list.find(',', start);
+			std::string value = Trim(list.substr(start, comma == std::string::npos ? std::string::npos : comma - start));
+			if (!value.empty())
+				values.push_back(value);
+			start = comma + 1;
+		} while (comma != std::string::npos);
+		if (values.empty())
 		{
-			m_formatCompressed = m_compressor.getOutputFormat();
+			throw std::runtime_error("ERROR: No values for sweep key: " + key);
+		}
+
+		if (key == "format")
+		{
+			formats = values;
+		}
+		else if (key == "size")
+		{
+			sizes.clear();
+			for (size_t i = 0; i < values.size(); ++i)
+			{
+				int width = 0, height = 0;
+				if (sscanf(values[i].c_str(), "%dx%d", &width, &height) != 2)
+				{
+					throw std::runtime_error("ERROR: Invalid size in sweep file (expected WxH): " + values[i]);
+				}
+				sizes.push_back(std::make_pair(width, height));
+			}
+		}
+		else if (key == "engine")
+		{
+			engines.clear();
+			for (size_t i = 0; i < values.size(); ++i)
+			{
+				if (values[i] != "sequence" && values[i] != "direct")
+				{
+					throw std::runtime_error("ERROR: Invalid engine in sweep file (expected sequence or direct): " + values[i]);
+				}
+				engines.push_back(values[i] == "direct");
+			}
+		}
+		else if (key == "codec" || key == "quality" || key == "keyint" || key == "datarate")
+		{
+			if (key == "codec")
+			{
+				codecs = values;
+			}
+			else
+			{
+				std::vector<LONG>& list = key == "quality" ? qualities : key == "keyint" ? keyints : datarates;
+				list.clear();
+				for (size_t i = 0; i < values.size(); ++i)
+					list.push_back(atoi(values[i].c_str()));
+			}
+		}
+		else
+		{
+			throw std::runtime_error("ERROR: Unknown sweep key: " + key);
 		}
 	}
 
-	if (!m_compress)
+	if ((formats.size() > 1 || sizes.size() > 1) && !m_decompress)
 	{
-		printf("INFO: Compressor          : -\n");
-		m_formatCompressed = m_formatDecompressed;
+		throw std::runtime_error("ERROR: Sweeping format or size needs a decompressor (not -nd or -rawin)\n");
+	}
+	if (m_compress && codecs[0].empty())
+	{
+		throw std::runtime_error("ERROR: -sweep needs the compressor given by -codec or the codec key (or -nc)\n");
 	}
 
-	printf("INFO: Output format       : ");
-	PrintBitmapInfo((BITMAPINFOHEADER*)m_formatCompressed);
-	printf("\n");
-
-	// Initialize output file if needed
-	if (m_outfile)
+	// Cartesian product, the last key varies fastest
+	for (size_t f = 0; f < formats.size(); ++f)
+	for (size_t z = 0; z < sizes.size(); ++z)
+	for (size_t c = 0; c < codecs.size(); ++c)
+	for (size_t q = 0; q < qualities.size(); ++q)
+	for (size_t k = 0; k < keyints.size(); ++k)
+	for (size_t d = 0; d < datarates.size(); ++d)
+	for (size_t e = 0; e < engines.size(); ++e)
 	{
-		// Open file
-		m_videoWriter.open(m_outfile, m_rawout ? NULL : (BITMAPINFOHEADER*)m_formatCompressed);
+		SweepPoint point;
+		point.format = formats[f];
+		point.width  = sizes[z].first;
+		point.height = sizes[z].second;
+		size_t colon = codecs[c].find(':');
+		point.codec     = codecs[c].substr(0, colon);
+		point.stateFile = colon == std::string::npos ? std::string() : codecs[c].substr(colon + 1);
+		point.params.quality      = qualities[q];
+		point.params.keyFrameRate = keyints[k];
+		point.params.dataRate     = datarates[d];
+		point.params.direct       = engines[e];
+		m_sweepPoints.push_back(point);
 	}
-	printf("INFO: Output file         : %s%s\n", m_outfile && m_rawout ? "[RAW] " : "", m_outfile ? m_outfile : "-");
+	printf("INFO: Sweep               : %d combinations from %s\n", (int)m_sweepPoints.size(), sweepFile);
 }
 
-void CodecBench::run()
+void CodecBench::runSweep()
 {
-	Timer decompTimer, compTimer;
-	int numFrames = 0, currentFrameNum = 0;
-	uint64_t sumInputSize = 0LL, sumOutputSize = 0LL, sumRawSize = 0LL;
+	bool compress = m_compress;
+	std::vector<BenchStats> results(m_sweepPoints.size());
+	std::vector<std::string> errors(m_sweepPoints.size());
+	std::vector<double> coreFps(m_sweepPoints.size(), NAN);
 
-	printf("\n");
-	int loop = 0, ncharsPrev = 0;
-	while (!s_stop && loop < m_loopCount)
+	for (size_t i = 0; i < m_sweepPoints.size() && !s_stop; ++i)
 	{
-		if (!m_videoReader.readFrame() || (m_framesToProcess && currentFrameNum >= m_framesToProcess))
+		const SweepPoint& point = m_sweepPoints[i];
+		printf("\n=== Sweep %d/%d ===\n", (int)i + 1, (int)m_sweepPoints.size());
+
+		m_decompFormat   = point.format.empty() ? NULL : point.format.c_str();
+		m_decompWidth    = point.width;
+		m_decompHeight   = point.height;
+		m_codec          = point.codec.empty() ? NULL : point.codec.c_str();
+		m_codecStateFile = point.stateFile.empty() ? NULL : point.stateFile.c_str();
+		m_compressParams = point.params;
+		m_compress       = compress;
+
+		try
 		{
-			currentFrameNum = 0;
-			++loop;
-			if (loop < m_loopCount)
-				m_videoReader.rewind();
-			continue;
+			initDecompressor();
+			initCompressor();
+			initStreams();
+			m_videoReader.rewind();
+			m_cpuTimer = CpuTimer();
+			runSingle();
+			results[i] = m_streams[0]->stats();
+			if (m_cpuTimer.seconds() > 0.0)
+				coreFps[i] = processedFrames() / m_cpuTimer.seconds();
+		}
+		catch (std::exception& e)
+		{
+			errors[i] = e.what();
+			printf("%s\n", e.what());
 		}
+		destroyStreams();
+	}
 
-		++currentFrameNum;
-		++numFrames;
-		char* currData = m_videoReader.frameData();
-		uint32_t currDataSize = m_videoReader.frameSize();
+	// Results table
+	printf("\nSweep results:\n");
+	printf("%4s %-6s %-11s %-6s %7s %6s %8s %-8s | %10s | %10s %10s %7s %9s | %9s\n",
+		"#", "format", "size", "codec", "quality", "keyint", "datarate", "engine", "decomp fps", "comp fps", "comp MiB/s", "ratio", "p99 ms",
+		"core fps");
 
-		sumInputSize += currDataSize;
+	std::vector<std::string> columns;
+	columns.push_back("index");
+	columns.push_back("format");
+	columns.push_back("width");
+	columns.push_back("height");
+	columns.push_back("codec");
+	columns.push_back("state");
+	columns.push_back("quality");
+	columns.push_back("keyint");
+	columns.push_back("datarate");
+	columns.push_back("engine");
+	columns.push_back("frames");
+	columns.push_back("decompress_fps");
+	columns.push_back("compress_fps");
+	columns.push_back("compress_mibps");
+	columns.push_back("compress_ratio");
+	columns.push_back("compress_p99_ms");
+	columns.push_back("frames_per_core_second");
+	columns.push_back("error");
+	Report report;
+	report.addString("tool", "codecbench");
+	report.addString("input.file", m_infile);
+	report.addFormat("input.format", m_videoReader.getFormat());
+	report.beginTable("sweep", columns);
 
-		// Decompress if needed
-		if (m_decompress)
+	for (size_t i = 0; i < m_sweepPoints.size(); ++i)
+	{
+		const SweepPoint& point = m_sweepPoints[i];
+		const BenchStats& stats = results[i];
+		char size[32];
+		snprintf(size, sizeof(size), "%dx%d", point.width, point.height);
+		const char* engine = point.params.direct ? "direct" : "sequence";
+		printf("%4d %-6s %-11s %-6s %7ld %6ld %8ld %-8s | ", (int)i + 1, point.format.empty() ? "-" : point.format.c_str(), size,
+			point.codec.empty() ? "-" : point.codec.c_str(), point.params.quality, point.params.keyFrameRate, point.params.dataRate, engine);
+
+		double decompFPS = NAN, compFPS = NAN, compMiBps = NAN, compRatio = NAN, compP99 = NAN;
+		if (!errors[i].empty() || !stats.numFrames)
 		{
-			decompTimer.begin();
-			m_decompressor.decompressFrame(currData, currDataSize);
-			decompTimer.end();
-			currData = m_decompressor.frameData();
-			currDataSize = m_decompressor.getOutputFormat()->biSizeImage;
+			printf("FAILED: %s\n", errors[i].empty() ? "no frames" : Trim(errors[i]).c_str());
+		}
+		else
+		{
+			if (m_decompress)
+				decompFPS = stats.decompFPS();
+			if (compress)
+			{
+				compFPS   = stats.compFPS();
+				compMiBps = stats.compMiBps();
+				compRatio = stats.compRatio();
+				compP99   = GetLatencyStats(stats.compTimer.samples, stats.compTimer.freq.QuadPart).p99;
+			}
+			printf("%10.1f | %10.1f %10.1f %7.2f %9.3f | %9.1f\n", decompFPS, compFPS, compMiBps, compRatio, compP99, coreFps[i]);
 		}
 
-		sumRawSize += currDataSize;
+		report.addCell((double)i + 1);
+		report.addCell(point.format);
+		report.addCell(point.width);
+		report.addCell(point.height);
+		report.addCell(point.codec);
+		report.addCell(point.stateFile);
+		report.addCell(point.params.quality);
+		report.addCell(point.params.keyFrameRate);
+		report.addCell(point.params.dataRate);
+		report.addCell(engine);
+		report.addCell(stats.numFrames);
+		report.addCell(decompFPS);
+		report.addCell(compFPS);
+		report.addCell(compMiBps);
+		report.addCell(compRatio);
+		report.addCell(compP99);
+		report.addCell(coreFps[i]);
+		report.addCell(Trim(errors[i]));
+	}
 
-		// Compress if needed
-		if (m_compress)
+	if (m_reportFile)
+	{
+		saveReport(report);
+	}
+}
+
+void CodecBench::runInitBench()
+{
+	// The first input frame is coded in every cycle
+	m_videoReader.rewind();
+	if (!m_videoReader.readFrame())
+	{
+		throw std::runtime_error("ERROR: -initbench needs at least one input frame\n");
+	}
+	char* inputData = m_videoReader.frameData();
+	uint32_t inputSize = m_videoReader.frameSize();
+	bool inputKeyFrame = isInputKeyFrame(0);
+
+	// Cold cycle: the codecs opened by init(), the first ones of the process
+	InitBenchStage stages[2];
+	BenchStream& stream = *m_streams[0];
+	char* data = inputData;
+	uint32_t dataSize = inputSize;
+	Timer step;
+	stages[0].enabled = m_decompress;
+	stages[1].enabled = m_compress;
+	if (m_decompress)
+	{
+		Decompressor& decompressor = stream.decompressor();
+		stages[0].driver = decompressor.getInfo().szDriver;
+		stages[0].cold = decompressor.initTimes();
+		step.begin();
+		LRESULT result = decompressor.decompressFrame(data, dataSize, NULL, inputKeyFrame);
+		step.end(false);
+		if (result != ICERR_OK)
 		{
-			compTimer.begin();
-			m_compressor.compressFrame(currData);
-			compTimer.end();
-			currData = m_compressor.frameData();
-			currDataSize = m_compressor.frameSize();
+			throw std::runtime_error("ERROR: The first input frame was not decompressed\n");
 		}
+		stages[0].coldFirstFrame = step.lastMs();
+		data = decompressor.frameData();
+		dataSize = decompressor.getOutputFormat()->biSizeImage;
+	}
+	stream.convertFrame(data, dataSize);
+	AlignedBuffer compressInput(dataSize);
+	memcpy(compressInput.data(), data, dataSize);
 
-		sumOutputSize += currDataSize;
+	// The pinned cycles reopen the codec selected by init(), also if it came from the selection dialog
+	DWORD fccHandler = 0;
+	std::vector<char> state;
+	CompressParams compressParams;
+	if (m_compress)
+	{
+		Compressor& compressor = stream.compressor();
+		stages[1].driver = compressor.getInfo().szDriver;
+		stages[1].cold = compressor.initTimes();
+		step.begin();
+		compressor.compressFrame(compressInput.data());
+		step.end(false);
+		stages[1].coldFirstFrame = step.lastMs();
+		fccHandler = compressor.getHandler();
+		state = compressor.getState();
+		compressParams = compressor.getParams();
+	}
+	destroyStreams(); // unloads the driver DLLs again
 
-		// Write output if needed
-		if (m_outfile)
+	printf("\nINFO: Init benchmark      : %d cycles\n", m_initBenchCount);
+	for (int cycle = 0; cycle < m_initBenchCount && !s_stop; ++cycle)
+	{
+		for (int s = 0; s < 2; ++s)
 		{
-			m_videoWriter.writeFrame(currData, currDataSize);
+			InitBenchStage& stage = stages[s];
+			if (!stage.enabled)
+				continue;
+
+			step.begin();
+			HMODULE dll = stage.driver.empty() ? NULL : LoadLibraryW(stage.driver.c_str());
+			step.end(false);
+			if (dll)
+				stage.dllLoad.push_back((int64_t)(step.lastMs() * 1000000.0));
+
+			InitTimes times;
+			double firstFrame;
+			if (s == 0)
+			{
+				{
+					Decompressor decompressor;
+					decompressor.init(m_videoReader.getFormat(), m_formatDecompressed, 0, 0, m_decompressParams);
+					times = decompressor.initTimes();
+					step.begin();
+					LRESULT result = decompressor.decompressFrame(inputData, inputSize, NULL, inputKeyFrame);
+					step.end(false);
+					if (result != ICERR_OK)
+					{
+						throw std::runtime_error("ERROR: The first input frame was not decompressed\n");
+					}
+					firstFrame = step.lastMs();
+					step.begin();
+				} // ends and closes the decompressor
+				step.end(false);
+			}
+			else
+			{
+				{
+					Compressor compressor;
+					compressor.init(m_formatConverted, fccHandler, state, compressParams);
+					times = compressor.initTimes();
+					step.begin();
+					compressor.compressFrame(compressInput.data());
+					step.end(false);
+					firstFrame = step.lastMs();
+					step.begin();
+				} // ends and closes the compressor
+				step.end(false);
+			}
+			double close = step.lastMs();
+
+			if (dll)
+				FreeLibrary(dll);
+
+			stage.open.push_back((int64_t)(times.open * 1000000.0));
+			stage.format.push_back((int64_t)(times.format * 1000000.0));
+			stage.begin.push_back((int64_t)(times.begin * 1000000.0));
+			stage.firstFrame.push_back((int64_t)(firstFrame * 1000000.0));
+			stage.close.push_back((int64_t)(close * 1000000.0));
+			stage.reopen.push_back((int64_t)((times.open + times.format + times.begin + close) * 1000000.0));
 		}
+	}
 
-		int nchars = 0;
-		nchars += printf("\rF: %d", numFrames);
-		if (m_decompress)
+	// Results table, reopen: what a pooled HIC saves per stream (everything but the first frame and the DLL load)
+	const char* stepNames[7] = { "dll load", "open", "format", "begin", "first frame", "end/close", "reopen" };
+	const char* stepKeys[7] = { "dll_load", "open", "format", "begin", "first_frame", "close", "reopen" };
+	printf("\nInit times (ms), cold: first open of the process (includes the DLL load)\n");
+	printf("%-10s %-11s | %9s | %9s %9s %9s %9s %9s\n", "stage", "step", "cold", "min", "p50", "p90", "max", "mean");
+
+	Report report;
+	report.addString("tool", "codecbench");
+	report.addString("input.file", m_infile);
+	report.addFormat("input.format", m_videoReader.getFormat());
+	report.addInt("initbench.cycles", m_initBenchCount);
+	for (int s = 0; s < 2; ++s)
+	{
+		const InitBenchStage& stage = stages[s];
+		if (!stage.enabled)
+			continue;
+
+		std::string key = std::string("initbench.") + (s == 0 ? "decompress" : "compress");
+		report.addString(key + ".driver", ToUtf8(stage.driver.c_str()));
+		report.addBool(key + ".dll_pinned", !stage.dllLoad.empty());
+		const std::vector<int64_t>* samples[7] = { &stage.dllLoad, &stage.open, &stage.format, &stage.begin, &stage.firstFrame,
+			&stage.close, &stage.reopen };
+		double cold[7] = { NAN, stage.cold.open, stage.cold.format, stage.cold.begin, stage.coldFirstFrame, NAN, NAN };
+		for (int i = 0; i < 7; ++i)
 		{
-			double decompFPS   = 1000000.0 * numFrames / decompTimer.sumTimeUs();
-			double decompMiBps = 1000000.0 * sumRawSize / 1024.0 / 1024.0 / decompTimer.sumTimeUs();
-			double decompRatio = (double) sumRawSize / sumInputSize;
-			nchars += printf(" | Decompress: %.1f fps (%.1f MiB/s) (ratio: %.2f)", decompFPS, decompMiBps, decompRatio);
+			LatencyStats stats = GetLatencyStats(*samples[i], 1000000000);
+			bool measured = !samples[i]->empty();
+			printf("%-10s %-11s | ", s == 0 ? "decompress" : "compress", stepNames[i]);
+			if (isnan(cold[i]))
+				printf("%9s | ", "-");
+			else
+				printf("%9.3f | ", cold[i]);
+			if (measured)
+				printf("%9.3f %9.3f %9.3f %9.3f %9.3f\n", stats.min, stats.p50, stats.p90, stats.max, stats.mean);
+			else
+				printf("%9s %9s %9s %9s %9s\n", "-", "-", "-", "-", "-");
+
+			std::string stepKey = key + "." + stepKeys[i];
+			report.addNumber(stepKey + ".cold_ms", cold[i]);
+			report.addNumber(stepKey + ".min_ms",  measured ? stats.min  : NAN);
+			report.addNumber(stepKey + ".p50_ms",  measured ? stats.p50  : NAN);
+			report.addNumber(stepKey + ".p90_ms",  measured ? stats.p90  : NAN);
+			report.addNumber(stepKey + ".max_ms",  measured ? stats.max  : NAN);
+			report.addNumber(stepKey + ".mean_ms", measured ? stats.mean : NAN);
 		}
-		if (m_compress)
+		if (stage.dllLoad.empty())
 		{
-			double compFPS     = 1000000.0 * numFrames / compTimer.sumTimeUs();
-			double compMiBps   = 1000000.0 * sumRawSize / 1024.0 / 1024.0 / compTimer.sumTimeUs();
-			double compRatio   = (double) sumRawSize / sumOutputSize;
-			nchars += printf(" | Compress: %.1f fps (%.1f MiB/s) (ratio: %.2f)", compFPS, compMiBps, compRatio);
+			printf("WARNING: The %s driver DLL could not be pinned, the open times include loading it\n", s == 0 ? "decompressor" : "compressor");
 		}
-		int padding = ncharsPrev - nchars;
-		if (padding > 0) printf("%*s", padding, "");
-		fflush(stdout);
-		ncharsPrev = nchars;
 	}
-	printf("\n");
+
+	if (m_reportFile)
+	{
+		saveReport(report);
+	}
 }
 
 /////////////////////////////////////